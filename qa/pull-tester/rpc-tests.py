@@ -130,7 +130,9 @@ testScripts = [
     'p2p-leaktests.py',
     'abc-transaction-ordering.py',
     'abc-checkdatasig-activation.py',
-    'ctor-mining.py'
+    'ctor-mining.py',
+    'utxosnapshot.py',
+    'reorg_mempool.py'
 ]
 
 testScriptsExt = [
@@ -27,17 +27,34 @@ class ReindexTest(BitcoinTestFramework):
     def reindex(self, justchainstate=False):
         self.nodes[0].generate(3)
         blockcount = self.nodes[0].getblockcount()
+        utxohash = self.nodes[0].gettxoutsetinfo()["hash_serialized_2"]
+        chaintips = [(tip["hash"], tip["height"]) for tip in self.nodes[0].getchaintips()]
         stop_nodes(self.nodes)
         extra_args = [["-debug", "-reindex-chainstate" if justchainstate else "-reindex", "-checkblockindex=1"]]
         self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, extra_args)
         while self.nodes[0].getblockcount() < blockcount:
             time.sleep(0.1)
         assert_equal(self.nodes[0].getblockcount(), blockcount)
+        assert_equal(self.nodes[0].gettxoutsetinfo()["hash_serialized_2"], utxohash)
+        # Stale blocks are stored, but not validated any further.
+        assert_equal([(tip["hash"], tip["height"]) for tip in self.nodes[0].getchaintips()], chaintips)
+        for tip in chaintips:
+            self.nodes[0].getblock(tip[0])
         print("Success")
 
+    def fork(self):
+        # A stale branch, stored in between the blocks of the active chain.
+        node = self.nodes[0]
+        tip = node.getbestblockhash()
+        node.invalidateblock(tip)
+        node.generate(1)
+        node.reconsiderblock(tip)
+        assert_equal(node.getbestblockhash(), tip)
+
     def run_test(self):
         self.reindex(False)
         self.reindex(True)
+        self.fork()
         self.reindex(False)
         self.reindex(True)
 
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin XT developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that transactions of blocks disconnected in a multi block reorg
+# return to the mempool once the new chain is connected, unless the new
+# chain confirms them, and that in-mempool children of those stay.
+#
+from test_framework.mininode import *
+from test_framework.script import CScript, OP_TRUE, hash160
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import hashlib
+
+B58_DIGITS = '123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz'
+
+def p2sh_address(script):
+    # Regtest P2SH address of script
+    data = bytes([196]) + hash160(script)
+    data += hashlib.sha256(hashlib.sha256(data).digest()).digest()[:4]
+    n = int.from_bytes(data, 'big')
+    address = ''
+    while n > 0:
+        n, r = divmod(n, 58)
+        address = B58_DIGITS[r] + address
+    return '1' * (len(data) - len(data.lstrip(b'\0'))) + address
+
+REDEEM_SCRIPT = CScript([OP_TRUE])
+ADDRESS = p2sh_address(REDEEM_SCRIPT)
+
+class ReorgMempoolTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, [["-checkmempool=1", "-checkblockindex=1"]])
+
+    def spend(self, txid, amount):
+        node = self.nodes[0]
+        # Padded to the minimum transaction size.
+        raw = node.createrawtransaction([{"txid": txid, "vout": 0}], {ADDRESS: amount, "data": "00" * 32})
+        tx = FromHex(CTransaction(), raw)
+        tx.vin[0].scriptSig = CScript([REDEEM_SCRIPT])
+        return node.sendrawtransaction(ToHex(tx))
+
+    def coinbase(self, height):
+        node = self.nodes[0]
+        return node.getblock(node.getblockhash(height))["tx"][0]
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generatetoaddress(110, ADDRESS)
+
+        # Chain B: t1 is confirmed in its first block.
+        t1 = self.spend(self.coinbase(1), 49.99)
+        chain_b = node.generatetoaddress(4, ADDRESS)
+        assert(t1 in node.getblock(chain_b[0])["tx"])
+
+        # Back to 110, t1 returns to the mempool.
+        node.invalidateblock(chain_b[0])
+        assert_equal(node.getblockcount(), 110)
+        assert_equal(node.getrawmempool(), [t1])
+
+        # Chain A: t1 and t2 confirmed in a chain of 3 blocks, with t1's
+        # child c in the mempool.
+        t2 = self.spend(self.coinbase(2), 49.99)
+        chain_a = node.generatetoaddress(3, ADDRESS)
+        assert_equal(set(node.getblock(chain_a[0])["tx"][1:]), set([t1, t2]))
+        c = self.spend(t1, 49.98)
+        assert_equal(node.getrawmempool(), [c])
+        utxo_a = node.gettxoutsetinfo()
+
+        # Reorg to the longer chain B. t1 stays confirmed, c stays in the
+        # mempool and t2 returns to it.
+        node.reconsiderblock(chain_b[0])
+        assert_equal(node.getbestblockhash(), chain_b[-1])
+        assert_equal(set(node.getrawmempool()), set([t2, c]))
+        assert_equal(node.getrawtransaction(t1, 1)["confirmations"], 4)
+
+        # And back again, to check the chain state went both ways intact.
+        node.invalidateblock(chain_b[0])
+        assert_equal(node.getbestblockhash(), chain_a[-1])
+        assert_equal(node.getrawmempool(), [c])
+        assert_equal(node.gettxoutsetinfo()["hash_serialized_2"], utxo_a["hash_serialized_2"])
+
+        stop_nodes(self.nodes)
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, [["-checkblocks=0", "-checklevel=4"]])
+        assert_equal(self.nodes[0].getbestblockhash(), chain_a[-1])
+
+if __name__ == '__main__':
+    ReorgMempoolTest().main()
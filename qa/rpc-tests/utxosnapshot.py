@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin XT developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test dumptxoutset and loadtxoutset: a node that only has the headers
+# bootstraps from another node's UTXO set, then follows the chain.
+#
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import os
+
+ADDRESS = 'mneYUmWYsuk7kySiURxCi3AGxrAqZxLgPZ'
+
+def assert_same_utxo_set(node0, node1):
+    info0, info1 = node0.gettxoutsetinfo(), node1.gettxoutsetinfo()
+    assert_equal(info0["bestblock"], info1["bestblock"])
+    assert_equal(info0["hash_serialized_2"], info1["hash_serialized_2"])
+
+class UTXOSnapshotTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def setup_network(self):
+        self.extra_args = [["-checkblockindex=1"], ["-checkblockindex=1", "-debug"]]
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, self.extra_args)
+
+    def run_test(self):
+        node0, node1 = self.nodes
+        node0.generatetoaddress(111, ADDRESS)
+
+        dump = node0.dumptxoutset("utxo.dat")
+        assert_equal(dump["base_height"], 111)
+        assert_equal(dump["base_hash"], node0.getbestblockhash())
+        assert_raises_jsonrpc(-8, "already exists", node0.dumptxoutset, "utxo.dat")
+        path = os.path.join(self.options.tmpdir, "node0", "regtest", "utxo.dat")
+
+        # node1 has no blocks, and can't load a snapshot it has no headers for.
+        assert_raises_jsonrpc(-1, "not known", node1.loadtxoutset, path, dump["commitment"])
+
+        # Give node1 the headers. Without services, it won't ask for the blocks.
+        test_node = SingleNodeConnCB()
+        connection = NodeConn('127.0.0.1', p2p_port(1), node1, test_node, services=0)
+        test_node.add_connection(connection)
+        NetworkThread().start()
+        test_node.wait_for_verack()
+        headers = msg_headers()
+        for height in range(1, 112):
+            header = node0.getblockheader(node0.getblockhash(height), False)
+            headers.headers.append(FromHex(CBlockHeader(), header))
+        test_node.send_and_ping(headers)
+        assert_equal(node1.getblockcount(), 0)
+
+        assert_raises_jsonrpc(-25, "not the expected one", node1.loadtxoutset, path, "00" * 32)
+        loaded = node1.loadtxoutset(path, dump["commitment"])
+        assert_equal(loaded["base_hash"], dump["base_hash"])
+        assert_equal(loaded["coins_loaded"], dump["coins_written"])
+        assert_equal(node1.getbestblockhash(), dump["base_hash"])
+        assert_same_utxo_set(node0, node1)
+        assert_raises_jsonrpc(-1, "before any blocks", node1.loadtxoutset, path, dump["commitment"])
+        assert_equal(node1.getblockchaininfo()["snapshot"]["height"], 111)
+        assert_equal(node1.getblockchaininfo()["snapshot"]["status"], "validating")
+
+        # From the snapshot on, node1 validates blocks as usual, also after a restart.
+        connect_nodes(node1, 0)
+        node0.generatetoaddress(5, ADDRESS)
+        sync_blocks(self.nodes)
+        assert_same_utxo_set(node0, node1)
+
+        # Meanwhile node1 downloads the blocks below the snapshot, and checks
+        # them against it.
+        assert wait_until(lambda: node1.getblockchaininfo()["snapshot"]["status"] == "valid", timeout=60)
+        assert "validatedheight" not in node1.getblockchaininfo()["snapshot"]
+        assert_equal(node1.getblockheader(node0.getblockhash(1))["confirmations"], 116)
+        node1.getblock(node0.getblockhash(1))
+
+        stop_node(node1, 1)
+        self.nodes[1] = node1 = start_node(1, self.options.tmpdir, self.extra_args[1])
+        assert_equal(node1.getblockcount(), 116)
+        assert_equal(node1.getblockchaininfo()["snapshot"]["status"], "valid")
+        connect_nodes(node1, 0)
+        node0.generatetoaddress(1, ADDRESS)
+        sync_blocks(self.nodes)
+        assert_same_utxo_set(node0, node1)
+
+if __name__ == '__main__':
+    UTXOSnapshotTest().main()
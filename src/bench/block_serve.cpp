@@ -0,0 +1,109 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+static const int SERVE_BLOCKS = 20;
+static const int SERVE_TXS_PER_BLOCK = 2000;
+
+namespace {
+
+struct StoredBlock {
+    uint256 hash;
+    CBlockIndex index;
+};
+
+// Historical blocks the way a syncing peer requests them: 600 kB or so of
+// pay to pubkey hash transactions each, read back from the block files.
+std::vector<StoredBlock> WriteBlocks()
+{
+    FastRandomContext rng(true);
+    std::vector<StoredBlock> blocks(SERVE_BLOCKS);
+    CDiskBlockPos pos(0, 0);
+    for (StoredBlock& stored : blocks) {
+        CBlock block;
+        block.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+        for (int i = 0; i < SERVE_TXS_PER_BLOCK; ++i) {
+            CMutableTransaction tx;
+            tx.vin.resize(1 + rng.randrange(2));
+            for (CTxIn& in : tx.vin) {
+                in.prevout = COutPoint(GetRandHash(), rng.randrange(3));
+                in.scriptSig.resize(107);
+            }
+            tx.vout.resize(2);
+            for (CTxOut& out : tx.vout) {
+                out.nValue = rng.randrange(100000) * 1000;
+                out.scriptPubKey.resize(25);
+            }
+            block.vtx.push_back(tx);
+        }
+        while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus()))
+            ++block.nNonce;
+
+        bool fOk = WriteBlockToDisk(block, pos, Params().DBMagic());
+        assert(fOk);
+        stored.hash = block.GetHash();
+        stored.index.phashBlock = &stored.hash;
+        stored.index.nFile = pos.nFile;
+        stored.index.nDataPos = pos.nPos;
+        stored.index.nStatus = BLOCK_HAVE_DATA;
+        pos.nPos += ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    }
+    return blocks;
+}
+
+void BlockServe(benchmark::State& state, bool fRaw)
+{
+    const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_serve_%%%%%%%%");
+    boost::filesystem::create_directories(path / "regtest" / "blocks");
+    SelectParams(CBaseChainParams::REGTEST);
+    mapArgs["-datadir"] = path.string();
+    ClearDatadirCache();
+
+    const std::vector<StoredBlock> blocks = WriteBlocks();
+    while (state.KeepRunning()) {
+        for (const StoredBlock& stored : blocks) {
+            // The payload of the block message.
+            std::vector<unsigned char> data;
+            if (fRaw) {
+                bool fOk = ReadRawBlockFromDisk(data, &stored.index, Params().DBMagic());
+                assert(fOk);
+            }
+            else {
+                CBlock block;
+                bool fOk = ReadBlockFromDisk(block, &stored.index, Params().GetConsensus());
+                assert(fOk);
+                CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, data, 0, block);
+            }
+        }
+    }
+    boost::filesystem::remove_all(path);
+}
+
+} // anon namespace
+
+static void BlockServeDeserialized(benchmark::State& state)
+{
+    BlockServe(state, false);
+}
+
+static void BlockServeRaw(benchmark::State& state)
+{
+    BlockServe(state, true);
+}
+
+BENCHMARK(BlockServeDeserialized);
+BENCHMARK(BlockServeRaw);
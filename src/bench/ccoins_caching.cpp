@@ -5,8 +5,10 @@
 #include "bench.h"
 #include "coins.h"
 #include "policy/policy.h"
+#include "random.h"
 #include "wallet/crypter.h"
 
+#include <iostream>
 #include <vector>
 
 // FIXME: Dedup with SetupDummyInputs in test/transaction_tests.cpp.
@@ -85,3 +87,93 @@ static void CCoinsCaching(benchmark::State& state)
 }
 
 BENCHMARK(CCoinsCaching);
+
+static const size_t COINS_BENCH_COINS = 100000;
+
+// A base view that accepts writes and has nothing to read, so the
+// benchmarks below measure the cache alone.
+class CCoinsViewSink : public CCoinsView
+{
+public:
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override
+    {
+        mapCoins.clear();
+        return true;
+    }
+};
+
+static std::vector<COutPoint> RandomOutPoints()
+{
+    std::vector<COutPoint> outpoints;
+    outpoints.reserve(COINS_BENCH_COINS);
+    const uint256 hash = GetRandHash();
+    for (size_t i = 0; i < COINS_BENCH_COINS; ++i) {
+        outpoints.push_back(COutPoint(hash, i));
+    }
+    return outpoints;
+}
+
+static Coin BenchCoin()
+{
+    CTxOut out(1 * CENT, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1)
+                                   << OP_EQUALVERIFY << OP_CHECKSIG);
+    return Coin(out, 1, false);
+}
+
+static void FillCache(CCoinsViewCache& cache, const std::vector<COutPoint>& outpoints)
+{
+    const Coin coin = BenchCoin();
+    for (const COutPoint& out : outpoints) {
+        cache.AddCoin(out, Coin(coin), false);
+    }
+}
+
+// Insert coins into an empty cache, and report the cache memory per coin.
+static void CCoinsCacheInsert(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = RandomOutPoints();
+    CCoinsViewSink sink;
+    bool fPrinted = false;
+    while (state.KeepRunning()) {
+        CCoinsViewCache cache(&sink);
+        FillCache(cache, outpoints);
+        if (!fPrinted) {
+            std::cout << "# CCoinsCacheInsert: " << cache.DynamicMemoryUsage() / outpoints.size()
+                      << " bytes per coin" << std::endl;
+            fPrinted = true;
+        }
+    }
+}
+
+static void CCoinsCacheLookup(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = RandomOutPoints();
+    CCoinsViewSink sink;
+    CCoinsViewCache cache(&sink);
+    FillCache(cache, outpoints);
+    while (state.KeepRunning()) {
+        CAmount nTotal = 0;
+        for (const COutPoint& out : outpoints) {
+            nTotal += cache.AccessCoin(out).out.nValue;
+        }
+        assert(nTotal == CAmount(outpoints.size() * CENT));
+    }
+}
+
+static void CCoinsCacheFlush(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = RandomOutPoints();
+    CCoinsViewSink sink;
+    CCoinsViewCache cache(&sink);
+    const uint256 hashBlock = GetRandHash();
+    while (state.KeepRunning()) {
+        FillCache(cache, outpoints);
+        cache.SetBestBlock(hashBlock);
+        bool success = cache.Flush();
+        assert(success);
+    }
+}
+
+BENCHMARK(CCoinsCacheInsert);
+BENCHMARK(CCoinsCacheLookup);
+BENCHMARK(CCoinsCacheFlush);
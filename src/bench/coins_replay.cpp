@@ -0,0 +1,87 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparamsbase.h"
+#include "coinsmapped.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <memory>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+static const int REPLAY_BLOCKS = 100;
+static const int REPLAY_OUTPUTS_PER_BLOCK = 2000;
+static const int REPLAY_SPENDS_PER_BLOCK = 1500;
+static const int REPLAY_FLUSH_INTERVAL = 10;
+
+// Connects blocks into a cache on top of the given coin store, the way IBD
+// does with a small -dbcache: every block spends older coins and creates
+// new ones, and the cache is flushed to the store every few blocks.
+static void ReplayBlocks(CCoinsView& store)
+{
+    FastRandomContext rng(true);
+    std::vector<COutPoint> unspent;
+    std::unique_ptr<CCoinsViewCache> cache(new CCoinsViewCache(&store));
+    for (int nHeight = 1; nHeight <= REPLAY_BLOCKS; ++nHeight) {
+        for (int i = 0; i < REPLAY_SPENDS_PER_BLOCK && !unspent.empty(); ++i) {
+            size_t n = rng.randrange(unspent.size());
+            bool fSpent = cache->SpendCoin(unspent[n]);
+            assert(fSpent);
+            unspent[n] = unspent.back();
+            unspent.pop_back();
+        }
+        const uint256 txid = GetRandHash();
+        for (int i = 0; i < REPLAY_OUTPUTS_PER_BLOCK; ++i) {
+            CTxOut out(1 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i & 0xff)
+                                           << OP_EQUALVERIFY << OP_CHECKSIG);
+            unspent.push_back(COutPoint(txid, i));
+            cache->AddCoin(unspent.back(), Coin(std::move(out), nHeight, false), false);
+        }
+        cache->SetBestBlock(GetRandHash());
+        if (nHeight % REPLAY_FLUSH_INTERVAL == 0) {
+            bool fOk = cache->Flush();
+            assert(fOk);
+        }
+    }
+    bool fOk = cache->Flush();
+    assert(fOk);
+}
+
+static boost::filesystem::path BenchDataDir()
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_coins_%%%%%%%%");
+    boost::filesystem::create_directories(path);
+    SelectBaseParams(CBaseChainParams::REGTEST);
+    mapArgs["-datadir"] = path.string();
+    ClearDatadirCache();
+    return path;
+}
+
+static void CoinsReplayLevelDB(benchmark::State& state)
+{
+    const boost::filesystem::path path = BenchDataDir();
+    while (state.KeepRunning()) {
+        bool fObfuscated;
+        CCoinsViewDB db(nMaxCoinsDBCache << 20, fObfuscated, false, true);
+        ReplayBlocks(db);
+    }
+    boost::filesystem::remove_all(path);
+}
+
+static void CoinsReplayMapped(benchmark::State& state)
+{
+    const boost::filesystem::path path = BenchDataDir();
+    while (state.KeepRunning()) {
+        CCoinsViewMapped store(path / "coinsmap", true);
+        ReplayBlocks(store);
+    }
+    boost::filesystem::remove_all(path);
+}
+
+BENCHMARK(CoinsReplayLevelDB);
+BENCHMARK(CoinsReplayMapped);
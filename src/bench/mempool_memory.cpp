@@ -0,0 +1,79 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <iostream>
+#include <vector>
+
+static const size_t MEMPOOL_BENCH_TXS = 2000;
+static const size_t MEMPOOL_BENCH_CHAIN = 10;
+
+// Chains of MEMPOOL_BENCH_CHAIN transactions. Chains are paired, every
+// transaction in the second chain of a pair also spends an output of the
+// first, so that entries have both multiple parents and multiple children.
+static std::vector<CTransaction> CreateChains()
+{
+    std::vector<CTransaction> txs;
+    for (size_t i = 0; i < MEMPOOL_BENCH_TXS; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        if (i % MEMPOOL_BENCH_CHAIN == 0) {
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        } else {
+            tx.vin[0].prevout = COutPoint(txs.back().GetHash(), 0);
+        }
+        if ((i / MEMPOOL_BENCH_CHAIN) % 2 == 1) {
+            tx.vin.resize(2);
+            tx.vin[1].prevout = COutPoint(txs[i - MEMPOOL_BENCH_CHAIN].GetHash(), 1);
+        }
+        for (auto& in : tx.vin) {
+            in.scriptSig = CScript() << OP_1;
+        }
+        tx.vout.resize(2);
+        for (auto& out : tx.vout) {
+            out.scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+            out.nValue = 10 * COIN;
+        }
+        txs.push_back(tx);
+    }
+    return txs;
+}
+
+// Fills a mempool and walks it in ancestor score order, the way
+// CreateNewBlock does. The memory used per transaction is printed once.
+static void MempoolMemoryPerTx(benchmark::State& state)
+{
+    const std::vector<CTransaction> txs = CreateChains();
+    CTxMemPool pool(CFeeRate(1000));
+    bool fPrinted = false;
+
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < txs.size(); ++i) {
+            pool.addUnchecked(txs[i].GetHash(), CTxMemPoolEntry(
+                txs[i], 1000 + i, 0, 1, false, false, LockPoints(), 1));
+        }
+
+        uint64_t nSize = 0;
+        LOCK(pool.cs);
+        auto& byAncestorScore = pool.mapTx.get<3>();
+        for (auto it = byAncestorScore.begin(); it != byAncestorScore.end(); ++it) {
+            nSize += it->GetTxSize();
+            nSize += pool.GetMemPoolParents(pool.mapTx.project<0>(it)).size();
+        }
+        assert(nSize > 0);
+
+        if (!fPrinted) {
+            std::cout << "# MempoolMemoryPerTx: " << pool.DynamicMemoryUsage() / txs.size()
+                      << " bytes per transaction" << std::endl;
+            fPrinted = true;
+        }
+        pool._clear();
+    }
+}
+
+BENCHMARK(MempoolMemoryPerTx);
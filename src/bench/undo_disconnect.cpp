@@ -0,0 +1,121 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "main.h"
+#include "random.h"
+#include "undo.h"
+#include "undowriter.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+enum class DisconnectResult;
+DisconnectResult ApplyTxInUndo(Coin undo, CCoinsViewCache& view, const COutPoint& out);
+
+static const int REORG_BLOCKS = 100;
+static const int REORG_TXS_PER_BLOCK = 1000;
+static const int REORG_INPUTS_PER_TX = 2;
+static const int REORG_ADDRESSES = 5000;
+
+namespace {
+
+struct UndoRecord {
+    CDiskBlockPos pos;
+    uint256 hashPrev;
+    std::vector<COutPoint> prevouts;
+};
+
+// Undo data the way a chain of full blocks has it: pay to pubkey hash coins,
+// some addresses being reused, created not long before they're spent.
+std::vector<UndoRecord> WriteReorgUndo(int nFile, bool fCompress)
+{
+    FastRandomContext rng(true);
+    std::vector<CScript> scripts;
+    for (int i = 0; i < REORG_ADDRESSES; ++i) {
+        std::vector<unsigned char> hash(20);
+        for (unsigned char& c : hash)
+            c = rng.rand32() & 0xff;
+        scripts.push_back(CScript() << OP_DUP << OP_HASH160 << hash << OP_EQUALVERIFY << OP_CHECKSIG);
+    }
+
+    std::vector<UndoRecord> records;
+    CDiskBlockPos pos(nFile, 0);
+    for (int nHeight = 500000; nHeight < 500000 + REORG_BLOCKS; ++nHeight) {
+        UndoRecord record;
+        record.hashPrev = GetRandHash();
+        CBlockUndo blockundo;
+        for (int i = 0; i < REORG_TXS_PER_BLOCK; ++i) {
+            CTxUndo txundo;
+            for (int j = 0; j < REORG_INPUTS_PER_TX; ++j) {
+                CTxOut out(rng.randrange(100000) * 1000, scripts[rng.randrange(REORG_ADDRESSES - 1)]);
+                txundo.vprevout.push_back(Coin(std::move(out), nHeight - 1 - rng.randrange(1000), false));
+                record.prevouts.push_back(COutPoint(GetRandHash(), rng.randrange(3)));
+            }
+            blockundo.vtxundo.push_back(txundo);
+        }
+
+        std::vector<unsigned char> vchCompressed;
+        if (fCompress)
+            CompressBlockUndo(blockundo, vchCompressed);
+        CDiskBlockPos posWritten = pos;
+        bool fOk = UndoWriteToDisk(blockundo, posWritten, record.hashPrev, Params().DBMagic(), vchCompressed);
+        assert(fOk);
+        record.pos = posWritten;
+        pos.nPos += (vchCompressed.empty() ? ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) : vchCompressed.size()) + 40;
+        records.push_back(record);
+    }
+    return records;
+}
+
+// Restores the spent coins of every block, tip first, as DisconnectBlock does.
+void Disconnect(const std::vector<UndoRecord>& records)
+{
+    CCoinsView base;
+    CCoinsViewCache view(&base);
+    for (auto record = records.rbegin(); record != records.rend(); ++record) {
+        CBlockUndo blockundo;
+        bool fOk = UndoReadFromDisk(blockundo, record->pos, record->hashPrev);
+        assert(fOk);
+        size_t n = 0;
+        for (const CTxUndo& txundo : blockundo.vtxundo) {
+            for (const Coin& coin : txundo.vprevout)
+                ApplyTxInUndo(coin, view, record->prevouts[n++]);
+        }
+    }
+}
+
+void UndoDisconnect(benchmark::State& state, bool fCompress)
+{
+    const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_undo_%%%%%%%%");
+    boost::filesystem::create_directories(path);
+    SelectParams(CBaseChainParams::REGTEST);
+    mapArgs["-datadir"] = path.string();
+    ClearDatadirCache();
+
+    const std::vector<UndoRecord> records = WriteReorgUndo(0, fCompress);
+    while (state.KeepRunning())
+        Disconnect(records);
+    boost::filesystem::remove_all(path);
+}
+
+} // anon namespace
+
+static void UndoDisconnectRaw(benchmark::State& state)
+{
+    UndoDisconnect(state, false);
+}
+
+static void UndoDisconnectCompressed(benchmark::State& state)
+{
+    UndoDisconnect(state, true);
+}
+
+BENCHMARK(UndoDisconnectRaw);
+BENCHMARK(UndoDisconnectCompressed);
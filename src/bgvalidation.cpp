@@ -0,0 +1,223 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bgvalidation.h"
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "script/script_error.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+#include "utxocommit.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+std::atomic<int> nValidatedHeight(-1);
+std::unique_ptr<boost::thread> validationThread;
+
+// The background chain state gets a quarter of the coins cache, on top of it.
+const int CACHE_SHARE = 4;
+const size_t DB_CACHE_SIZE = 8 << 20;
+
+boost::filesystem::path ChainStatePath()
+{
+    return GetDataDir() / "chainstate_bg";
+}
+
+void FlagInvalid(const std::string& strReason)
+{
+    LogPrintf("*** Background validation: %s\n", strReason);
+    const std::string strWarning = _("Warning: The UTXO snapshot the chain state was loaded from does not match the block chain, rebuild it with -reindex-chainstate!");
+    strMiscWarning = strWarning;
+    AlertNotify(strWarning, false);
+    pblocktree->WriteFlag("snapshotinvalid", true);
+}
+
+uint256 CommitmentOf(CCoinsView& view)
+{
+    CUtxoCommit commit;
+    std::unique_ptr<CCoinsViewCursor> cursor(view.Cursor());
+    for (; cursor->Valid(); cursor->Next()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (!cursor->GetKey(key) || !cursor->GetValue(coin))
+            throw std::runtime_error("unable to read coin");
+        commit.Add(key, coin);
+    }
+    return commit.GetHash();
+}
+
+void ValidateHistory(CBlockIndex* pindexBase, uint256 hashCommit)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    bool fObfuscated;
+    std::unique_ptr<CCoinsViewDB> db(new CCoinsViewDB(ChainStatePath(), DB_CACHE_SIZE, fObfuscated));
+
+    // Continue where the last run stopped, if that was on the way to the base.
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator it = mapBlockIndex.find(db->GetBestBlock());
+        if (it != mapBlockIndex.end() && pindexBase->GetAncestor(it->second->nHeight) == it->second) {
+            pindex = it->second;
+        } else {
+            db.reset();
+            db.reset(new CCoinsViewDB(ChainStatePath(), DB_CACHE_SIZE, fObfuscated, false, true));
+            pindex = chainActive.Genesis();
+        }
+    }
+    std::unique_ptr<CCoinsViewCache> view(new CCoinsViewCache(db.get()));
+    view->SetBestBlock(pindex->GetBlockHash());
+    nValidatedHeight = pindex->nHeight;
+    LogPrintf("Background validation of the UTXO snapshot at height %d, from height %d\n",
+              pindexBase->nHeight, pindex->nHeight);
+
+    try {
+        int64_t nLastLog = GetTime();
+        while (pindex != pindexBase) {
+            boost::this_thread::interruption_point();
+            CBlockIndex* pindexNext;
+            CDiskBlockPos pos;
+            {
+                LOCK(cs_main);
+                pindexNext = pindexBase->GetAncestor(pindex->nHeight + 1);
+                if (pindexNext->nStatus & BLOCK_HAVE_DATA)
+                    pos = pindexNext->GetBlockPos();
+            }
+            if (pos.IsNull()) {
+                // Not downloaded yet.
+                boost::this_thread::sleep_for(boost::chrono::seconds(1));
+                continue;
+            }
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pos, consensusParams) || block.GetHash() != pindexNext->GetBlockHash())
+                throw std::runtime_error("unable to read block " + pindexNext->GetBlockHash().ToString());
+
+            // This thread runs at low priority. Read the inputs, and check the
+            // scripts, without holding cs_main, so as not to hold up others.
+            for (const CTransaction& tx : block.vtx) {
+                if (tx.IsCoinBase())
+                    continue;
+                for (const CTxIn& txin : tx.vin)
+                    view->AccessCoin(txin.prevout);
+            }
+            std::vector<CScriptCheck> vChecks;
+            {
+                LOCK(cs_main);
+                CValidationState state;
+                if (!ConnectBlock(block, state, pindexNext, *view, true, &vChecks)) {
+                    if (state.IsInvalid()) {
+                        FlagInvalid(strprintf("block %s at height %d is invalid: %s", pindexNext->GetBlockHash().ToString(),
+                                              pindexNext->nHeight, FormatStateMessage(state)));
+                        break;
+                    }
+                    throw std::runtime_error("unable to connect block " + pindexNext->GetBlockHash().ToString());
+                }
+            }
+            std::vector<CScriptCheck>::iterator itFailed = std::find_if(vChecks.begin(), vChecks.end(),
+                    [](CScriptCheck& check) { return !check(); });
+            if (itFailed != vChecks.end()) {
+                FlagInvalid(strprintf("block %s at height %d is invalid: script verification failed (%s)",
+                                      pindexNext->GetBlockHash().ToString(), pindexNext->nHeight,
+                                      ScriptErrorString(itFailed->GetScriptError())));
+                break;
+            }
+            view->SetBestBlock(pindexNext->GetBlockHash());
+            pindex = pindexNext;
+            nValidatedHeight = pindex->nHeight;
+
+            if (view->DynamicMemoryUsage() > nCoinCacheUsage / CACHE_SHARE && !view->Flush())
+                throw std::runtime_error("unable to write coins");
+            if (GetTime() > nLastLog + 60) {
+                LogPrintf("Background validation: height %d of %d, cache=%.1fMiB(%utxo)\n", pindex->nHeight, pindexBase->nHeight,
+                          view->DynamicMemoryUsage() * (1.0 / (1<<20)), view->GetCacheSize());
+                nLastLog = GetTime();
+            }
+        }
+        if (pindex == pindexBase) {
+            if (!view->Flush())
+                throw std::runtime_error("unable to write coins");
+            LogPrintf("Background validation: reached the snapshot base, computing the UTXO commitment\n");
+            const uint256 hash = CommitmentOf(*db);
+            if (hash == hashCommit) {
+                LogPrintf("Background validation: the UTXO snapshot matches the block chain\n");
+                pblocktree->WriteFlag("snapshotvalidated", true);
+            } else {
+                FlagInvalid(strprintf("UTXO commitment %s at height %d, the snapshot has %s",
+                                      hash.GetHex(), pindex->nHeight, hashCommit.GetHex()));
+            }
+            view.reset();
+            db.reset();
+            boost::filesystem::remove_all(ChainStatePath());
+        }
+    } catch (const boost::thread_interrupted&) {
+        if (view && !view->Flush())
+            LogPrintf("Background validation: unable to save progress\n");
+        nValidatedHeight = -1;
+        throw;
+    } catch (const std::exception& e) {
+        LogPrintf("Background validation stopped: %s\n", e.what());
+    }
+    nValidatedHeight = -1;
+}
+
+} // anon namespace
+
+void StartBackgroundValidation()
+{
+    AssertLockHeld(cs_main);
+    if (!pindexSnapshotBase || validationThread)
+        return;
+
+    bool fValidated = false, fInvalid = false;
+    pblocktree->ReadFlag("snapshotvalidated", fValidated);
+    pblocktree->ReadFlag("snapshotinvalid", fInvalid);
+    if (fInvalid)
+        strMiscWarning = _("Warning: The UTXO snapshot the chain state was loaded from does not match the block chain, rebuild it with -reindex-chainstate!");
+    if (fValidated || fInvalid)
+        return;
+
+    uint256 hashBase, hashCommit;
+    uint64_t nChainTx;
+    if (!pblocktree->ReadSnapshotBase(hashBase, hashCommit, nChainTx)) {
+        LogPrintf("%s: UTXO snapshot base not found\n", __func__);
+        return;
+    }
+    CBlockIndex* pindexBase = pindexSnapshotBase;
+    nValidatedHeight = 0;
+    validationThread.reset(new boost::thread([pindexBase, hashCommit]() {
+        ScheduleBatchPriority();
+        TraceThread("bgvalidation", [pindexBase, hashCommit]() { ValidateHistory(pindexBase, hashCommit); });
+    }));
+}
+
+void StopBackgroundValidation()
+{
+    if (!validationThread)
+        return;
+    validationThread->interrupt();
+    validationThread->join();
+    validationThread.reset();
+}
+
+int BackgroundValidationHeight()
+{
+    return nValidatedHeight;
+}
+
+bool IsSnapshotValidated()
+{
+    bool fValidated = false;
+    return pblocktree->ReadFlag("snapshotvalidated", fValidated) && fValidated;
+}
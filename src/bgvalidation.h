@@ -0,0 +1,32 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BGVALIDATION_H
+#define BITCOIN_BGVALIDATION_H
+
+/**
+ * Background validation of a chain state loaded from a UTXO snapshot (see
+ * loadtxoutset).
+ *
+ * A low priority thread connects the blocks from genesis up to the base of
+ * the snapshot into a chain state of its own (chainstate_bg/), as they are
+ * downloaded, and compares its UTXO commitment with the snapshot's once it
+ * gets there. A mismatch, or an invalid block on the way, is flagged with a
+ * warning. The active chain state is not touched either way.
+ *
+ * Progress is kept across restarts. The outcome is recorded in the block
+ * tree database, the background chain state is deleted once done. Pruning
+ * keeps the blocks below the base until the snapshot is validated.
+ */
+
+/** Start validating the snapshot the chain state was loaded from, if it isn't yet. Requires cs_main. */
+void StartBackgroundValidation();
+/** Interrupt the validation, and wait for it to save its progress. */
+void StopBackgroundValidation();
+/** Height up to which the blocks below the snapshot base were validated, -1 if not validating. */
+int BackgroundValidationHeight();
+/** Whether the snapshot the chain state was loaded from was found to match the block chain. */
+bool IsSnapshotValidated();
+
+#endif // BITCOIN_BGVALIDATION_H
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcompression.h"
+
+#include "crypto/common.h"
+#include "lz4.h"
+#include "main.h"
+#include "utilstrencodings.h"
+
+namespace {
+
+/**
+ * What a block's transactions are mostly made of, apart from hashes, keys
+ * and signatures: the templates of the common scripts and the fields around
+ * them. Blocks repeat these anyway, this is for their first occurrences,
+ * which is what most of a small block is.
+ */
+const char* const DICTIONARY_HEX[] = {
+    // Coinbase input
+    "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff",
+    // Bare and P2SH multisig
+    "5121", "5221", "5321", "52ae", "53ae", "004830450221004c69522102", "004730440220",
+    // OP_RETURN outputs, SLP and memo among them
+    "00000000000000006a", "6a04534c500001", "6a026d02",
+    // P2SH outputs
+    "0000000017a914", "8700000000",
+    // Pay to pubkey hash inputs, with the BCH sighash type
+    "6b483045022100", "6a47304402200", "0220", "41210", "4121020", "4121030", "feffffff", "ffffffff",
+    // Versions and input counts
+    "0100000001", "0200000001", "0100000002", "0200000002",
+    // Pay to pubkey hash outputs, followed by the next or the lock time
+    "000000001976a914", "88ac00000000", "88ac", "ffffffff02", "ffffffff01",
+};
+
+const std::vector<unsigned char>& Dictionary()
+{
+    static const std::vector<unsigned char> dictionary = []() {
+        std::vector<unsigned char> dict;
+        for (const char* hex : DICTIONARY_HEX) {
+            const std::vector<unsigned char> bytes = ParseHex(hex);
+            dict.insert(dict.end(), bytes.begin(), bytes.end());
+        }
+        return dict;
+    }();
+    return dictionary;
+}
+
+} // anon namespace
+
+void CompressBlock(const unsigned char* pBlock, size_t nBlock, std::vector<unsigned char>& vchCompressed)
+{
+    assert(nBlock >= BLOCK_HEADER_SIZE);
+    const std::vector<unsigned char>& dict = Dictionary();
+    std::vector<unsigned char> vchLZ4;
+    LZ4Compress(pBlock + BLOCK_HEADER_SIZE, nBlock - BLOCK_HEADER_SIZE, vchLZ4, dict.data(), dict.size());
+
+    vchCompressed.resize(BLOCK_HEADER_SIZE + 4);
+    memcpy(vchCompressed.data(), pBlock, BLOCK_HEADER_SIZE);
+    WriteLE32(vchCompressed.data() + BLOCK_HEADER_SIZE, nBlock - BLOCK_HEADER_SIZE);
+    vchCompressed.insert(vchCompressed.end(), vchLZ4.begin(), vchLZ4.end());
+}
+
+bool DecompressBlock(const unsigned char* pCompressed, size_t nCompressed, std::vector<unsigned char>& vchBlock)
+{
+    if (nCompressed < BLOCK_HEADER_SIZE + 4)
+        return false;
+    const size_t nRest = ReadLE32(pCompressed + BLOCK_HEADER_SIZE);
+    const size_t nLZ4 = nCompressed - BLOCK_HEADER_SIZE - 4;
+    // LZ4 can't do better than 255:1
+    if (nRest > nLZ4 * 255)
+        return false;
+
+    const std::vector<unsigned char>& dict = Dictionary();
+    vchBlock.resize(BLOCK_HEADER_SIZE + nRest);
+    memcpy(vchBlock.data(), pCompressed, BLOCK_HEADER_SIZE);
+    return LZ4Decompress(pCompressed + BLOCK_HEADER_SIZE + 4, nLZ4, vchBlock.data() + BLOCK_HEADER_SIZE, nRest,
+                         dict.data(), dict.size());
+}
@@ -0,0 +1,28 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCOMPRESSION_H
+#define BITCOIN_BLOCKCOMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** Set in the size of compressed blocks in the block files. */
+static const uint32_t BLOCK_COMPRESSED_FLAG = 0x80000000;
+
+/**
+ * Compress the serialized block at pBlock for the block files.
+ *
+ * The header stays as it is, for the block files to be scanned without
+ * decompressing anything. It's followed by the size of the rest of the
+ * block and the rest, LZ4 compressed against a dictionary of the scripts
+ * and other byte sequences transactions are mostly made of.
+ */
+void CompressBlock(const unsigned char* pBlock, size_t nBlock, std::vector<unsigned char>& vchCompressed);
+
+/** Turn what CompressBlock made back into the serialized block. Returns false if it's corrupt. */
+bool DecompressBlock(const unsigned char* pCompressed, size_t nCompressed, std::vector<unsigned char>& vchBlock);
+
+#endif // BITCOIN_BLOCKCOMPRESSION_H
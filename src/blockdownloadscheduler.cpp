@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "blockdownloadscheduler.h"
+
+#include <algorithm>
+
+namespace {
+
+// Deliveries measured before a peer's share depends on them.
+const uint64_t MIN_MEASURED_DELIVERIES = 4;
+// Weight of the latest delivery in the averages is 1 / AVERAGE_WEIGHT.
+const int64_t AVERAGE_WEIGHT = 4;
+
+} // anon namespace
+
+void BlockDownloadScheduler::delivered(NodeId node, int64_t requestTime, int64_t now) {
+    std::unique_lock<std::mutex> lock(cs);
+    Peer& p = peers[node];
+    const int64_t latency = now - requestTime;
+    // What it took to deliver this one: the time since the previous
+    // delivery, unless it had nothing in flight in between.
+    const int64_t interval = now - std::max(p.lastDelivery, requestTime);
+    if (p.stats.delivered == 0) {
+        p.stats.latency = latency;
+        p.stats.interval = interval;
+    }
+    else {
+        p.stats.latency += (latency - p.stats.latency) / AVERAGE_WEIGHT;
+        p.stats.interval += (interval - p.stats.interval) / AVERAGE_WEIGHT;
+    }
+    p.lastDelivery = now;
+    p.stats.delivered++;
+}
+
+void BlockDownloadScheduler::rerequested(NodeId node) {
+    std::unique_lock<std::mutex> lock(cs);
+    peers[node].stats.rerequested++;
+}
+
+void BlockDownloadScheduler::remove(NodeId node) {
+    std::unique_lock<std::mutex> lock(cs);
+    peers.erase(node);
+}
+
+void BlockDownloadScheduler::clear() {
+    std::unique_lock<std::mutex> lock(cs);
+    peers.clear();
+}
+
+int BlockDownloadScheduler::share(NodeId node) const {
+    std::unique_lock<std::mutex> lock(cs);
+    const Peer* p = find(node);
+    if (p == nullptr || !isMeasured(*p))
+        return maxInFlight;
+
+    int64_t fastest = p->stats.interval;
+    for (auto& other : peers) {
+        if (isMeasured(other.second))
+            fastest = std::min(fastest, other.second.stats.interval);
+    }
+    const int64_t interval = std::max<int64_t>(p->stats.interval, 1);
+    const int64_t share = (maxInFlight * std::max<int64_t>(fastest, 1) + interval / 2) / interval;
+    return std::max<int64_t>(share, 1);
+}
+
+bool BlockDownloadScheduler::shouldRerequest(NodeId node, NodeId staller,
+                                             int64_t requestTime, int64_t now) const
+{
+    std::unique_lock<std::mutex> lock(cs);
+    const Peer* p = find(node);
+    if (node == staller || p == nullptr || !isMeasured(*p))
+        return false;
+
+    // Not late yet for what node would take.
+    const int64_t waited = now - requestTime;
+    if (waited < 2 * p->stats.latency)
+        return false;
+
+    const Peer* s = find(staller);
+    return s == nullptr || !isMeasured(*s)
+        || s->stats.interval > 2 * p->stats.interval
+        || waited > 2 * s->stats.latency;
+}
+
+BlockDownloadStats BlockDownloadScheduler::stats(NodeId node) const {
+    std::unique_lock<std::mutex> lock(cs);
+    const Peer* p = find(node);
+    return p == nullptr ? BlockDownloadStats() : p->stats;
+}
+
+bool BlockDownloadScheduler::isMeasured(const Peer& p) const {
+    return p.stats.delivered >= MIN_MEASURED_DELIVERIES;
+}
+
+const BlockDownloadScheduler::Peer* BlockDownloadScheduler::find(NodeId node) const {
+    auto it = peers.find(node);
+    return it == peers.end() ? nullptr : &it->second;
+}
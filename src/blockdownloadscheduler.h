@@ -0,0 +1,70 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKDOWNLOADSCHEDULER_H
+#define BITCOIN_BLOCKDOWNLOADSCHEDULER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+typedef int NodeId;
+
+/// What was measured of the blocks a peer delivered. Times in microseconds.
+struct BlockDownloadStats {
+    BlockDownloadStats() : delivered(0), latency(0), interval(0), rerequested(0) { }
+
+    //! Blocks delivered
+    uint64_t delivered;
+    //! Average time from requesting a block to its delivery
+    int64_t latency;
+    //! Average time between deliveries, while it has blocks in flight
+    int64_t interval;
+    //! Blocks it held back that were requested from a faster peer
+    uint64_t rerequested;
+};
+
+/// Balances block download over peers by how fast they deliver.
+///
+/// Peers get a share of the blocks in flight proportional to their delivery
+/// rate, the fastest one the full share. When a slow peer holds the download
+/// window back, the block it's late with is requested from a faster one as
+/// well. Peers are given the full share until enough of their deliveries
+/// were measured. Has its own lock, for the stats to be read without cs_main.
+class BlockDownloadScheduler {
+    public:
+        BlockDownloadScheduler(int maxInFlight) : maxInFlight(maxInFlight) { }
+
+        /// node delivered a block it was asked for at requestTime.
+        void delivered(NodeId node, int64_t requestTime, int64_t now);
+        /// A block node held back was requested from another peer.
+        void rerequested(NodeId node);
+        void remove(NodeId node);
+        void clear();
+
+        /// How many blocks node may have in flight.
+        int share(NodeId node) const;
+
+        /// Whether a block requested from staller at requestTime, that holds
+        /// the download window back, should be requested from node as well.
+        bool shouldRerequest(NodeId node, NodeId staller,
+                             int64_t requestTime, int64_t now) const;
+
+        BlockDownloadStats stats(NodeId node) const;
+
+    private:
+        struct Peer {
+            Peer() : lastDelivery(0) { }
+            BlockDownloadStats stats;
+            int64_t lastDelivery;
+        };
+
+        bool isMeasured(const Peer& p) const;
+        const Peer* find(NodeId node) const;
+
+        const int maxInFlight;
+        mutable std::mutex cs;
+        std::map<NodeId, Peer> peers;
+};
+
+#endif
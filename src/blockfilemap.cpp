@@ -0,0 +1,84 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "util.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileMaps::CBlockFileMaps(size_t nMaxMappedIn) : nMaxMapped(nMaxMappedIn) {}
+
+#ifndef WIN32
+
+CBlockFileMaps::Mapping::~Mapping()
+{
+    munmap(const_cast<char*>(pData), nSize);
+}
+
+std::shared_ptr<const CBlockFileMaps::Mapping> CBlockFileMaps::Get(const boost::filesystem::path& path, size_t nEnd)
+{
+    if (nMaxMapped == 0)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(cs);
+    auto it = mappings.begin();
+    while (it != mappings.end() && it->first != path)
+        ++it;
+    if (it != mappings.end() && it->second->nSize >= nEnd) {
+        mappings.splice(mappings.begin(), mappings, it);
+        return it->second;
+    }
+
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < nEnd || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping doesn't need the descriptor.
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrint(Log::BLOCK, "%s: Unable to map %s: %s\n", __func__, path.string(), strerror(errno));
+        return nullptr;
+    }
+
+    std::shared_ptr<const Mapping> mapping = std::make_shared<Mapping>(static_cast<const char*>(p), st.st_size);
+    if (it != mappings.end()) {
+        // The file has grown since it was mapped.
+        mappings.erase(it);
+    }
+    mappings.emplace_front(path, mapping);
+    if (mappings.size() > nMaxMapped)
+        mappings.pop_back();
+    return mapping;
+}
+
+#else // WIN32
+
+CBlockFileMaps::Mapping::~Mapping() {}
+
+std::shared_ptr<const CBlockFileMaps::Mapping> CBlockFileMaps::Get(const boost::filesystem::path& path, size_t nEnd)
+{
+    return nullptr;
+}
+
+#endif // WIN32
+
+void CBlockFileMaps::Invalidate(const boost::filesystem::path& path)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    mappings.remove_if([&path](const std::pair<boost::filesystem::path, std::shared_ptr<const Mapping>>& mapping) {
+        return mapping.first == path;
+    });
+}
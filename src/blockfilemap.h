@@ -0,0 +1,104 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "serialize.h"
+
+#include <cstring>
+#include <ios>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+/** A read-only stream over memory, to deserialize from a mapping in place. */
+class CMemoryReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const char* pBegin;
+    const char* pEnd;
+
+public:
+    CMemoryReader(int nTypeIn, int nVersionIn, const char* pData, size_t nSize)
+        : nType(nTypeIn), nVersion(nVersionIn), pBegin(pData), pEnd(pData + nSize) {}
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    size_t size() const { return pEnd - pBegin; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read: end of data");
+        memcpy(pch, pBegin, nSize);
+        pBegin += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore: end of data");
+        pBegin += nSize;
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
+/**
+ * Read-only memory mappings of block files, so that blocks are deserialized
+ * straight from the page cache instead of being copied through stdio
+ * buffers, and files aren't opened and closed for every block read. The
+ * mappings of the most recently read files are kept.
+ *
+ * Block files only grow while in use: a file is mapped again once a read
+ * goes past the end of its mapping. Files that are truncated or deleted
+ * have to be invalidated, as reading past the end of a file through a
+ * mapping is fatal.
+ */
+class CBlockFileMaps
+{
+public:
+    struct Mapping {
+        const char* pData;
+        size_t nSize;
+
+        Mapping(const char* pDataIn, size_t nSizeIn) : pData(pDataIn), nSize(nSizeIn) {}
+        ~Mapping();
+    };
+
+    //! Keep at most nMaxMapped files mapped. With none, nothing is mapped.
+    explicit CBlockFileMaps(size_t nMaxMapped);
+
+    /**
+     * The mapping of file path covering at least its first nEnd bytes, or
+     * nullptr if it can't be mapped. It stays valid while held, even if the
+     * file is invalidated.
+     */
+    std::shared_ptr<const Mapping> Get(const boost::filesystem::path& path, size_t nEnd);
+
+    //! Drop the mapping of path, after it was truncated or deleted.
+    void Invalidate(const boost::filesystem::path& path);
+
+private:
+    const size_t nMaxMapped;
+    std::mutex cs;
+    //! Most recently used first. Guarded by cs.
+    std::list<std::pair<boost::filesystem::path, std::shared_ptr<const Mapping>>> mappings;
+
+    CBlockFileMaps(const CBlockFileMaps&);
+    void operator=(const CBlockFileMaps&);
+};
+
+#endif // BITCOIN_BLOCKFILEMAP_H
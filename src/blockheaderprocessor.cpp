@@ -33,10 +33,22 @@ DefaultHeaderProcessor::DefaultHeaderProcessor(CConnman& connman, CNode* pfrom,
 {
 }
 
-// maybeAnnouncement: Header *might* have been received as a block announcement.
+CheckedHeaders::CheckedHeaders(const std::vector<CBlockHeader>& h) : headers(h)
+{
+    valid = CheckBlockHeaders(headers, hashes, state);
+}
+
 CBlockIndex* DefaultHeaderProcessor::operator()(const std::vector<CBlockHeader>& headers,
         bool peerSentMax,
         bool maybeAnnouncement)
+{
+    return (*this)(CheckedHeaders(headers), peerSentMax, maybeAnnouncement);
+}
+
+// maybeAnnouncement: Header *might* have been received as a block announcement.
+CBlockIndex* DefaultHeaderProcessor::operator()(const CheckedHeaders& headers,
+        bool peerSentMax,
+        bool maybeAnnouncement)
 {
     CBlockIndex* pindexLast = acceptHeaders(headers);
 
@@ -67,17 +79,22 @@ CBlockIndex* DefaultHeaderProcessor::operator()(const std::vector<CBlockHeader>&
     return pindexLast;
 }
 
-CBlockIndex* DefaultHeaderProcessor::acceptHeaders(
-        const std::vector<CBlockHeader>& headers) {
+CBlockIndex* DefaultHeaderProcessor::acceptHeaders(const CheckedHeaders& headers) {
 
-    CBlockIndex *pindexLast = nullptr;
-    for (const CBlockHeader& header : headers) {
-        CValidationState state;
-        if (pindexLast != nullptr && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+    // The hashes are known, check the sequence up front.
+    for (size_t i = 1; i < headers.headers.size(); ++i) {
+        if (headers.headers[i].hashPrevBlock != headers.hashes[i - 1]) {
             Misbehaving(pfrom->GetId(), 20, "non-continuous header sequence");
             throw BlockHeaderError("non-continuous headers sequence");
         }
-        if (!AcceptBlockHeader(header, state, &pindexLast)) {
+    }
+
+    // Headers before the first that failed the checks without context are
+    // still accepted.
+    CBlockIndex *pindexLast = nullptr;
+    for (size_t i = 0; i < headers.headers.size(); ++i) {
+        CValidationState state = i < headers.valid ? CValidationState() : headers.state;
+        if (i >= headers.valid || !AcceptCheckedBlockHeader(headers.headers[i], headers.hashes[i], state, &pindexLast)) {
             int nDoS;
             if (state.IsInvalid(nDoS)) {
                 if (nDoS > 0)
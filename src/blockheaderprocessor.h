@@ -1,5 +1,8 @@
 #ifndef BITCOIN_BLOCKHEDERPROCESSOR_H
 
+#include "consensus/validation.h"
+#include "uint256.h"
+
 #include <vector>
 #include <functional>
 #include <tuple>
@@ -30,6 +33,20 @@ class BlockHeaderProcessor {
 };
 inline BlockHeaderProcessor::~BlockHeaderProcessor() { }
 
+/// Headers hashed and checked without context by CheckBlockHeaders, which
+/// doesn't need cs_main. A full headers message is checked on more than one
+/// thread, so this is done before taking it.
+struct CheckedHeaders {
+    explicit CheckedHeaders(const std::vector<CBlockHeader>& headers);
+
+    const std::vector<CBlockHeader>& headers;
+    std::vector<uint256> hashes;
+    // Headers that passed, before the first that failed.
+    size_t valid;
+    // Why the first that failed did.
+    CValidationState state;
+};
+
 /// Process a block header received from another peer on the network.
 class DefaultHeaderProcessor : public BlockHeaderProcessor {
     public:
@@ -41,13 +58,16 @@ class DefaultHeaderProcessor : public BlockHeaderProcessor {
                 bool peerSentMax,
                 bool maybeAnnouncement) override;
 
+        CBlockIndex* operator()(const CheckedHeaders& headers,
+                bool peerSentMax,
+                bool maybeAnnouncement);
+
         bool requestConnectHeaders(const CBlockHeader& h,
                                    CConnman&, CNode& from,
                                    bool bumpUnconnecting) override;
 
     protected:
-         CBlockIndex* acceptHeaders(
-                const std::vector<CBlockHeader>& headers);
+         CBlockIndex* acceptHeaders(const CheckedHeaders& headers);
 
          // private, but protected for unittest
          virtual std::vector<CBlockIndex*> findMissingBlocks(CBlockIndex* last);
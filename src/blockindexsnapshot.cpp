@@ -0,0 +1,144 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexsnapshot.h"
+
+#include "blockfilemap.h"
+#include "chain.h"
+#include "clientversion.h"
+#include "crypto/sha256.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace {
+
+const uint32_t SNAPSHOT_VERSION = 1;
+//! Version, state and number of entries
+const size_t SNAPSHOT_HEADER_SIZE = 4 + 32 + 4;
+const size_t SNAPSHOT_ENTRY_SIZE = 128;
+
+template<typename Stream>
+void SerializeEntry(Stream& s, const CBlockIndex& index, int32_t nPrev)
+{
+    s << index.GetBlockHash() << nPrev << index.nHeight << index.nStatus << index.nTx
+      << index.nFile << index.nDataPos << index.nUndoPos
+      << index.nVersion << index.hashMerkleRoot << index.nTime << index.nBits << index.nNonce
+      << index.nSerialVersion << index.nMaxBlockSize << index.nMaxBlockSizeVote;
+}
+
+template<typename Stream>
+void UnserializeEntry(Stream& s, CBlockIndex& index)
+{
+    s >> index.nHeight >> index.nStatus >> index.nTx
+      >> index.nFile >> index.nDataPos >> index.nUndoPos
+      >> index.nVersion >> index.hashMerkleRoot >> index.nTime >> index.nBits >> index.nNonce
+      >> index.nSerialVersion >> index.nMaxBlockSize >> index.nMaxBlockSizeVote;
+}
+
+uint256 Checksum(const char* pData, size_t nSize)
+{
+    uint256 hash;
+    CSHA256().Write((const unsigned char*)pData, nSize).Finalize(hash.begin());
+    return hash;
+}
+
+} // anon namespace
+
+bool CBlockIndexSnapshot::Read(const boost::filesystem::path& path, const uint256& hashState)
+{
+    vData.clear();
+    nEntries = 0;
+
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("%s: Unable to open %s", __func__, path.string());
+    boost::system::error_code ec;
+    const uintmax_t nSize = boost::filesystem::file_size(path, ec);
+    if (ec || nSize < SNAPSHOT_HEADER_SIZE + sizeof(uint256)) {
+        fclose(file);
+        return error("%s: %s is truncated", __func__, path.string());
+    }
+    vData.resize(nSize);
+    const size_t nRead = fread(vData.data(), 1, nSize, file);
+    fclose(file);
+    if (nRead != nSize)
+        return error("%s: Unable to read %s", __func__, path.string());
+
+    const size_t nChecksummed = nSize - sizeof(uint256);
+    if (Checksum(vData.data(), nChecksummed) != uint256(std::vector<unsigned char>(vData.begin() + nChecksummed, vData.end())))
+        return error("%s: Checksum mismatch in %s", __func__, path.string());
+
+    CMemoryReader reader(SER_DISK, CLIENT_VERSION, vData.data(), SNAPSHOT_HEADER_SIZE);
+    uint32_t nVersion, nCount;
+    uint256 hashSnapshotState;
+    reader >> nVersion >> hashSnapshotState >> nCount;
+    if (nVersion != SNAPSHOT_VERSION)
+        return error("%s: Unknown version %u of %s", __func__, nVersion, path.string());
+    if (hashSnapshotState != hashState) {
+        LogPrintf("%s: %s is outdated\n", __func__, path.string());
+        return false;
+    }
+    if (SNAPSHOT_HEADER_SIZE + (uint64_t)nCount * SNAPSHOT_ENTRY_SIZE != nChecksummed)
+        return error("%s: Size mismatch in %s", __func__, path.string());
+    nEntries = nCount;
+    return true;
+}
+
+bool CBlockIndexSnapshot::Load(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, std::vector<CBlockIndex*>& vEntries) const
+{
+    const size_t nFirst = vEntries.size();
+    vEntries.reserve(nFirst + nEntries);
+    CMemoryReader reader(SER_DISK, CLIENT_VERSION, vData.data() + SNAPSHOT_HEADER_SIZE, nEntries * SNAPSHOT_ENTRY_SIZE);
+    for (size_t i = 0; i < nEntries; ++i) {
+        uint256 hash;
+        int32_t nPrev;
+        reader >> hash >> nPrev;
+        if (nPrev >= (int32_t)i)
+            return error("%s: Entry %u stored ahead of its parent", __func__, i);
+        CBlockIndex* pindex = insertBlockIndex(hash);
+        pindex->pprev = nPrev < 0 ? NULL : vEntries[nFirst + nPrev];
+        UnserializeEntry(reader, *pindex);
+        vEntries.push_back(pindex);
+    }
+    return true;
+}
+
+bool CBlockIndexSnapshot::Write(const boost::filesystem::path& path, const uint256& hashState, const std::vector<const CBlockIndex*>& vEntries)
+{
+    std::vector<unsigned char> vData;
+    vData.reserve(SNAPSHOT_HEADER_SIZE + vEntries.size() * SNAPSHOT_ENTRY_SIZE + sizeof(uint256));
+    CVectorWriter writer(SER_DISK, CLIENT_VERSION, vData, 0);
+    writer << SNAPSHOT_VERSION << hashState << (uint32_t)vEntries.size();
+
+    boost::unordered_map<const CBlockIndex*, int32_t> mapPosition;
+    for (const CBlockIndex* pindex : vEntries) {
+        int32_t nPrev = -1;
+        if (pindex->pprev) {
+            auto it = mapPosition.find(pindex->pprev);
+            if (it == mapPosition.end())
+                return error("%s: Block index entry %s ahead of its parent", __func__, pindex->GetBlockHash().ToString());
+            nPrev = it->second;
+        }
+        SerializeEntry(writer, *pindex, nPrev);
+        mapPosition.emplace(pindex, mapPosition.size());
+    }
+    writer << Checksum((const char*)vData.data(), vData.size());
+
+    const boost::filesystem::path pathTmp = path.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: Unable to create %s", __func__, pathTmp.string());
+    const bool fWritten = fwrite(vData.data(), 1, vData.size(), file) == vData.size();
+    if (fWritten)
+        FileCommit(file);
+    fclose(file);
+    if (!fWritten || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: Unable to write %s", __func__, path.string());
+    }
+    return true;
+}
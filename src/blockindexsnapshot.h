@@ -0,0 +1,49 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKINDEXSNAPSHOT_H
+#define BITCOIN_BLOCKINDEXSNAPSHOT_H
+
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
+
+class CBlockIndex;
+
+static const char* const BLOCK_INDEX_SNAPSHOT_FILENAME = "blockindex.snapshot";
+
+/**
+ * A flat copy of the block index, written on shutdown so that the next
+ * start loads the index in one pass, instead of reading every entry from the
+ * block tree database and sorting them all by height.
+ *
+ * Entries are fixed size records, stored parents first, that refer to their
+ * parent by position. The file is checksummed, and only valid for the state
+ * of the block tree database it was taken of, identified by hashState.
+ */
+class CBlockIndexSnapshot
+{
+public:
+    CBlockIndexSnapshot() : nEntries(0) {}
+
+    //! Read and verify the snapshot at path. Fails if it was taken of another state.
+    bool Read(const boost::filesystem::path& path, const uint256& hashState);
+
+    size_t size() const { return nEntries; }
+
+    //! Create the entries with insertBlockIndex, parents first, and add them to vEntries in that order.
+    bool Load(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, std::vector<CBlockIndex*>& vEntries) const;
+
+    //! Write vEntries, sorted parents first, as the snapshot of hashState.
+    static bool Write(const boost::filesystem::path& path, const uint256& hashState, const std::vector<const CBlockIndex*>& vEntries);
+
+private:
+    std::vector<char> vData;
+    size_t nEntries;
+};
+
+#endif // BITCOIN_BLOCKINDEXSNAPSHOT_H
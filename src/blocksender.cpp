@@ -93,20 +93,16 @@ static bool withinDepthLimits(int depth, int blockHeight, int activeChainHeight)
     return blockHeight >= activeChainHeight - depth;
 }
 
-void BlockSender::sendBlock(CConnman& connman, CNode& node,
-        const CBlockIndex& blockIndex, int invType, int activeChainHeight)
+// Would the request be answered with the full block?
+static bool sendsFullBlock(CNode& node, const CBlockIndex& blockIndex,
+        int invType, int activeChainHeight)
 {
-
-    // Send block from disk
-    CBlock block;
-    if (!readBlockFromDisk(block, &blockIndex) || block.IsNull())
-        throw std::runtime_error("cannot read block from disk");
-
-    // We only support MSG_XTHINBLOCK, if peer wants MSG_THINBLOCK,
-    // fallback to full one.
-    if (invType == MSG_BLOCK || (invType == MSG_THINBLOCK
-                && !NodeStatePtr(node.id)->supportsCompactBlocks))
-    {
+    if (invType == MSG_BLOCK)
+        return true;
+    if (invType == MSG_CMPCT_BLOCK) {
+        // We only support MSG_XTHINBLOCK, if peer wants MSG_THINBLOCK,
+        // fallback to full one.
+        //
         // Fun fact:
         // Responding to a BUIP010 MSG_THINBLOCK is actually a BIP152 violation.
         // MSG_CMPCT_BLOCK uses the same enum value as MSG_THINBLOCK.
@@ -114,11 +110,38 @@ void BlockSender::sendBlock(CConnman& connman, CNode& node,
         // BIP152 states:
         // "Nodes MUST NOT send a request for a MSG_CMPCT_BLOCK object to a
         // peer before having received a sendcmpct message from that peer."
+        if (!NodeStatePtr(node.id)->supportsCompactBlocks)
+            return true;
+        if (!withinDepthLimits(MAX_CMPCTBLOCK_DEPTH, blockIndex.nHeight, activeChainHeight)) {
+            LogPrint(Log::NET, "cmpctblock outside depth %d, %d peer=%d\n",
+                    blockIndex.nHeight, activeChainHeight, node.id);
+            return true;
+        }
+        return false;
+    }
+    if (invType == MSG_XTHINBLOCK)
+        return !withinDepthLimits(MAX_CMPCTBLOCK_DEPTH, blockIndex.nHeight, activeChainHeight);
+    return false;
+}
 
-        connman.PushMessage(&node, NetMsg(&node, NetMsgType::BLOCK, block));
+void BlockSender::sendBlock(CConnman& connman, CNode& node,
+        const CBlockIndex& blockIndex, int invType, int activeChainHeight)
+{
+    if (sendsFullBlock(node, blockIndex, invType, activeChainHeight)) {
+        // Send the block as stored, there's no need to deserialize it.
+        CSerializedNetMsg msg;
+        msg.command = NetMsgType::BLOCK;
+        if (!readRawBlockFromDisk(msg.data, &blockIndex))
+            throw std::runtime_error("cannot read block from disk");
+        connman.PushMessage(&node, std::move(msg));
         return;
     }
 
+    // Send block from disk
+    CBlock block;
+    if (!readBlockFromDisk(block, &blockIndex) || block.IsNull())
+        throw std::runtime_error("cannot read block from disk");
+
     if (invType == MSG_XTHINBLOCK) {
         CBloomFilter filter;
         {
@@ -127,15 +150,10 @@ void BlockSender::sendBlock(CConnman& connman, CNode& node,
         }
 
         try {
-            bool sent = false;
-            if (withinDepthLimits(MAX_CMPCTBLOCK_DEPTH, blockIndex.nHeight, activeChainHeight)) {
-                XThinBlock thinb(block, filter);
-                if (thinIsSmaller(block, thinb)) {
-                    connman.PushMessage(&node, NetMsg(&node, NetMsgType::XTHINBLOCK, thinb));
-                    sent = true;
-                }
-            }
-            if (!sent)
+            XThinBlock thinb(block, filter);
+            if (thinIsSmaller(block, thinb))
+                connman.PushMessage(&node, NetMsg(&node, NetMsgType::XTHINBLOCK, thinb));
+            else
                 connman.PushMessage(&node, NetMsg(&node, NetMsgType::BLOCK, block));
         }
         catch (const xthin_collision_error& e) {
@@ -148,16 +166,9 @@ void BlockSender::sendBlock(CConnman& connman, CNode& node,
         return;
     }
 
-    if (invType == MSG_CMPCT_BLOCK && NodeStatePtr(node.id)->supportsCompactBlocks) {
-        if (withinDepthLimits(MAX_CMPCTBLOCK_DEPTH, blockIndex.nHeight, activeChainHeight)) {
-            CompactBlock cmpct(block, *choosePrefiller(node));
-            connman.PushMessage(&node, NetMsg(&node, NetMsgType::CMPCTBLOCK, cmpct));
-        }
-        else {
-            LogPrint(Log::NET, "cmpctblock outside depth %d, %d peer=%d\n",
-                    blockIndex.nHeight, activeChainHeight, node.id);
-            connman.PushMessage(&node, NetMsg(&node, NetMsgType::BLOCK, block));
-        }
+    if (invType == MSG_CMPCT_BLOCK) {
+        CompactBlock cmpct(block, *choosePrefiller(node));
+        connman.PushMessage(&node, NetMsg(&node, NetMsgType::CMPCTBLOCK, cmpct));
         return;
     }
 
@@ -218,3 +229,7 @@ void BlockSender::sendReReqReponse(CConnman& connman, CNode& node, const CBlockI
 bool BlockSender::readBlockFromDisk(CBlock& block, const CBlockIndex* pindex) {
     return ::ReadBlockFromDisk(block, pindex, Params().GetConsensus());
 }
+
+bool BlockSender::readRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex) {
+    return ::ReadRawBlockFromDisk(block, pindex, Params().DBMagic());
+}
@@ -4,6 +4,8 @@
 #ifndef BITCOIN_BLOCKSENDER_H
 #define BITCOIN_BLOCKSENDER_H
 
+#include <vector>
+
 class CChain;
 class CConnman;
 class CBlockIndex;
@@ -44,6 +46,7 @@ class BlockSender {
     protected: // used in unit tests
         virtual void triggerNextRequest(const CChain& activeChain, const CInv& inv, CConnman&, CNode& node);
         virtual bool readBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+        virtual bool readRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex);
 };
 
 #endif
@@ -144,3 +144,23 @@ const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex*
     assert(pa == pb);
     return pa;
 }
+
+static_assert(std::is_trivially_destructible<CBlockIndex>::value, "CBlockIndexArena doesn't destroy its entries");
+
+void CBlockIndexArena::AddChunk(size_t nSize)
+{
+    chunks.emplace_back(std::unique_ptr<Slot[]>(new Slot[nSize]), nSize);
+    nUsed = 0;
+}
+
+void CBlockIndexArena::Reserve(size_t n)
+{
+    if (chunks.empty() || chunks.back().second - nUsed < n)
+        AddChunk(n > CHUNK_SIZE ? n : CHUNK_SIZE);
+}
+
+void CBlockIndexArena::Clear()
+{
+    chunks.clear();
+    nUsed = 0;
+}
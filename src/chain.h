@@ -15,6 +15,9 @@
 #include <vector>
 #include <functional>
 #include <atomic>
+#include <memory>
+#include <type_traits>
+#include <utility>
 
 static const int BIP100_DBI_VERSION = 0x08000000;
 static const int DISK_BLOCK_INDEX_VERSION = BIP100_DBI_VERSION;
@@ -356,6 +359,45 @@ public:
 /** Find the forking point between two chain tips. */
 const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb);
 
+/**
+ * Allocates block index entries in chunks, so that they're close together in
+ * memory and don't carry allocator overhead each. Entries are never freed on
+ * their own, they all go at once with Clear().
+ */
+class CBlockIndexArena
+{
+public:
+    CBlockIndexArena() : nUsed(0) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    template<typename... Args>
+    CBlockIndex* New(Args&&... args)
+    {
+        if (chunks.empty() || nUsed == chunks.back().second)
+            AddChunk(CHUNK_SIZE);
+        return new (&chunks.back().first[nUsed++]) CBlockIndex(std::forward<Args>(args)...);
+    }
+
+    //! Allocate the next n entries contiguously.
+    void Reserve(size_t n);
+
+    void Clear();
+
+private:
+    static const size_t CHUNK_SIZE = 4096;
+    typedef std::aligned_storage<sizeof(CBlockIndex), alignof(CBlockIndex)>::type Slot;
+
+    //! Chunks of storage and the number of entries they hold
+    std::vector<std::pair<std::unique_ptr<Slot[]>, size_t> > chunks;
+    //! Entries used in the last chunk
+    size_t nUsed;
+
+    void AddChunk(size_t nSize);
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    void operator=(const CBlockIndexArena&);
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -65,6 +65,12 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    friend class CCheckQueueControl<T>;
+
+    //! Held by the CCheckQueueControl using the queue, so masters that don't
+    //! share another lock take turns.
+    boost::mutex ControlMutex;
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
@@ -179,12 +185,14 @@ class CCheckQueueControl
 private:
     CCheckQueue<T>* pqueue;
     bool fDone;
+    boost::unique_lock<boost::mutex> lock;
 
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
+            lock = boost::unique_lock<boost::mutex>(pqueue->ControlMutex);
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
         }
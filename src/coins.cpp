@@ -8,6 +8,7 @@
 #include "memusage.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
 
 bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
@@ -34,20 +35,27 @@ size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0), nAccessClock(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
     return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
 }
 
+size_t CCoinsViewCache::PoolFreeMemoryUsage() const {
+    return cacheCoins.get_allocator().PoolFree();
+}
+
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
     CCoinsMap::iterator it = cacheCoins.find(outpoint);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.lastAccess = nAccessClock;
         return it;
+    }
     Coin tmp;
     if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
+    ret->second.lastAccess = nAccessClock;
     if (ret->second.coin.IsSpent()) {
         // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
@@ -84,6 +92,7 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
     }
     it->second.coin = std::move(coin);
     it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    it->second.lastAccess = nAccessClock;
     cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
 
@@ -143,6 +152,7 @@ uint256 CCoinsViewCache::GetBestBlock() const {
 
 void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
+    ++nAccessClock;
 }
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
@@ -159,6 +169,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     entry.coin = std::move(it->second.coin);
                     cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY;
+                    entry.lastAccess = nAccessClock;
                     // We can mark it FRESH in the parent if it was FRESH in the child
                     // Otherwise it might have just been flushed from the parent's cache
                     // and already exist in the grandparent
@@ -186,6 +197,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     itUs->second.coin = std::move(it->second.coin);
                     cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.lastAccess = nAccessClock;
                     // NOTE: It is possible the child has a FRESH flag here in
                     // the event the entry we found in the parent is pruned. But
                     // we must not copy that FRESH flag to the parent as that
@@ -198,6 +210,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
         mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
+    ++nAccessClock;
     return true;
 }
 
@@ -208,6 +221,73 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    CCoinsMap mapDirty;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            ++it;
+            continue;
+        }
+        if (it->second.coin.IsSpent()) {
+            // The base doesn't need to know about a spent coin it never had.
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                CCoinsCacheEntry& entry = mapDirty[it->first];
+                entry.flags = CCoinsCacheEntry::DIRTY;
+            }
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            it = cacheCoins.erase(it);
+            continue;
+        }
+        CCoinsCacheEntry& entry = mapDirty[it->first];
+        entry.coin = it->second.coin;
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        // Once written, the base has the same version of the coin.
+        it->second.flags = 0;
+        ++it;
+    }
+    return base->BatchWrite(mapDirty, hashBlock);
+}
+
+size_t CCoinsViewCache::Trim(size_t nMaxUsage) {
+    const size_t nPoolFree = PoolFreeMemoryUsage();
+    size_t nUsage = DynamicMemoryUsage() - nPoolFree;
+    if (nUsage <= nMaxUsage)
+        return 0;
+
+    // Sum up the memory held by unmodified entries, by how many blocks ago
+    // they were last used. Then evict from the oldest age down until enough
+    // memory is freed.
+    static const uint32_t MAX_AGE = 1024;
+    const size_t nEntryUsage = cacheCoins.empty() ? 0 :
+        (memusage::DynamicUsage(cacheCoins) - nPoolFree - memusage::MallocUsage(sizeof(void*) * cacheCoins.bucket_count())) / cacheCoins.size();
+    std::vector<size_t> vUsageByAge(MAX_AGE + 1, 0);
+    for (const CCoinsMap::value_type& it : cacheCoins) {
+        if (it.second.flags != 0)
+            continue;
+        const uint32_t nAge = std::min(nAccessClock - it.second.lastAccess, MAX_AGE);
+        vUsageByAge[nAge] += nEntryUsage + it.second.coin.DynamicMemoryUsage();
+    }
+    uint32_t nMinAge = MAX_AGE + 1;
+    size_t nFreed = 0;
+    while (nMinAge > 0 && nUsage - nFreed > nMaxUsage) {
+        --nMinAge;
+        nFreed += vUsageByAge[nMinAge];
+    }
+
+    size_t nEvicted = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags == 0 && std::min(nAccessClock - it->second.lastAccess, MAX_AGE) >= nMinAge) {
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            it = cacheCoins.erase(it);
+            ++nEvicted;
+        } else {
+            ++it;
+        }
+    }
+    cacheCoins.get_allocator().ReleaseUnused();
+    return nEvicted;
+}
+
 void CCoinsViewCache::Uncache(const COutPoint& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
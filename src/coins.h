@@ -11,6 +11,7 @@
 #include "hash.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
@@ -104,8 +105,11 @@ public:
      * This *must* return size_t. With Boost 1.46 on 32-bit systems the
      * unordered_map will behave unpredictably if the custom hasher returns a
      * uint64_t, resulting in failures when syncing the chain (#4634).
+     *
+     * Being noexcept, std::unordered_map doesn't store the hash in each
+     * node, which makes the coins cache nodes smaller.
      */
-    size_t operator()(const COutPoint& id) const {
+    size_t operator()(const COutPoint& id) const noexcept {
         return SipHashUint256Extra(k0, k1, id.hash, id.n);
     }
 };
@@ -114,6 +118,7 @@ struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
     unsigned char flags;
+    uint32_t lastAccess; // Access clock of the cache when this entry was last used.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -125,11 +130,16 @@ struct CCoinsCacheEntry
          */
     };
 
-    CCoinsCacheEntry() : flags(0) {}
-    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
+    CCoinsCacheEntry() : flags(0), lastAccess(0) {}
+    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0), lastAccess(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+/**
+ * The nodes of the map come from a pool, so the cache doesn't pay malloc
+ * overhead for each coin.
+ */
+typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher, std::equal_to<COutPoint>,
+    PoolAllocator<std::pair<const COutPoint, CCoinsCacheEntry> > > CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -221,6 +231,10 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Advanced for every block, used to find entries that have not been
+     * used recently. */
+    uint32_t nAccessClock;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -265,6 +279,23 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, but keep the
+     * cache. Entries that were written become clean, spent entries are
+     * dropped.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync();
+
+    /**
+     * Evict unmodified entries, least recently used first, until the cache
+     * uses no more than nMaxUsage bytes or only modified entries are left.
+     * Usage here excludes free pool blocks, which new entries fill before
+     * the pool grows. Chunks of the pool left empty are released.
+     * Returns the number of entries evicted.
+     */
+    size_t Trim(size_t nMaxUsage);
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -277,6 +308,9 @@ public:
     //! Calculate the size of the cache (in bytes)
     size_t DynamicMemoryUsage() const;
 
+    //! Memory included in DynamicMemoryUsage() that the map's node pool holds for reuse
+    size_t PoolFreeMemoryUsage() const;
+
     /**
      * Amount of bitcoins coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -0,0 +1,700 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsmapped.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "tinyformat.h"
+#include "util.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char MAPPED_MAGIC[8] = {'x', 't', 'c', 'o', 'i', 'n', 's', 0};
+const uint32_t MAPPED_VERSION = 1;
+//! The header takes the first page of the table file.
+const size_t HEADER_SIZE = 4096;
+//! Slots in a new table, must be a power of two.
+const uint64_t MIN_CAPACITY = 1 << 16;
+//! Size of a new value log.
+const size_t MIN_LOG_SIZE = 1 << 20;
+//! The log is compacted when more than half of it, and at least this much, is garbage.
+const uint64_t MIN_COMPACT_GARBAGE = 64 << 20;
+
+//! Offset of a slot whose coin was spent.
+const uint64_t TOMBSTONE = std::numeric_limits<uint64_t>::max();
+//! Returned by Find if there is no such coin.
+const uint64_t NO_SLOT = std::numeric_limits<uint64_t>::max();
+
+/** Deserializes from a range of memory, without copying it. */
+class CMemoryReader
+{
+public:
+    CMemoryReader(const char* pbeginIn, const char* pendIn) : pbegin(pbeginIn), pend(pendIn) {}
+
+    void read(char* pch, size_t nSize) {
+        if (nSize > size_t(pend - pbegin))
+            throw std::ios_base::failure("CMemoryReader::read(): end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+    }
+
+    void ignore(size_t nSize) {
+        if (nSize > size_t(pend - pbegin))
+            throw std::ios_base::failure("CMemoryReader::ignore(): end of data");
+        pbegin += nSize;
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj) {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+
+private:
+    const char* pbegin;
+    const char* pend;
+};
+
+boost::filesystem::path LogPath(const boost::filesystem::path& dir, uint32_t nGeneration) {
+    return dir / strprintf("values%05u.dat", nGeneration);
+}
+
+boost::filesystem::path JournalPath(const boost::filesystem::path& dir) {
+    return dir / "journal.dat";
+}
+
+} // anon namespace
+
+struct CCoinsViewMapped::Header {
+    char magic[8];
+    uint32_t nVersion;
+    //! Which value log the slots point into.
+    uint32_t nLogGeneration;
+    //! Hash salt
+    uint64_t k0, k1;
+    uint64_t nCapacity;
+    //! Unspent coins
+    uint64_t nCount;
+    //! Slots that are not empty, unspent coins and tombstones.
+    uint64_t nUsed;
+    uint64_t nLogSize;
+    //! Bytes in the log that no slot points to.
+    uint64_t nLogGarbage;
+    uint256 hashBest;
+    //! While the slots are being written, the block being written and the previous best block.
+    uint256 hashHeads[2];
+};
+
+struct CCoinsViewMapped::Slot {
+    uint256 txid;
+    uint32_t n;
+    //! Size of the serialized coin in the log, zero for empty slots and tombstones.
+    uint32_t nSize;
+    uint64_t nOffset;
+
+    bool IsEmpty() const { return nSize == 0 && nOffset == 0; }
+    bool IsLive() const { return nSize != 0; }
+};
+
+static_assert(sizeof(uint256) == 32, "slot layout");
+
+/** The slot writes of a BatchWrite, and the counters after it. */
+struct CCoinsViewMapped::Journal {
+    uint256 hashBlock;
+    uint256 hashPrev;
+    uint64_t nCount;
+    uint64_t nUsed;
+    uint64_t nLogSize;
+    uint64_t nLogGarbage;
+    //! Slot index and new contents
+    std::vector<std::pair<uint64_t, Slot> > vSlots;
+};
+
+MappedFile::MappedFile() : fd(-1), pData(nullptr), nSize(0) {}
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+#ifndef WIN32
+
+static size_t PageAlign(size_t n) {
+    const size_t nPage = sysconf(_SC_PAGESIZE);
+    return (n + nPage - 1) / nPage * nPage;
+}
+
+void MappedFile::Open(const boost::filesystem::path& pathIn, size_t nMinSize) {
+    Close();
+    path = pathIn;
+    fd = open(path.string().c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw std::runtime_error(strprintf("Unable to open %s: %s", path.string(), strerror(errno)));
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error(strprintf("Unable to stat %s: %s", path.string(), strerror(errno)));
+    nSize = size_t(st.st_size);
+    Resize(std::max(nSize, PageAlign(nMinSize)));
+}
+
+void MappedFile::Close() {
+    if (pData)
+        munmap(pData, nSize);
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    pData = nullptr;
+    nSize = 0;
+}
+
+void MappedFile::Resize(size_t nNewSize) {
+    assert(fd >= 0);
+    if (pData && nNewSize == nSize)
+        return;
+    if (nNewSize > nSize) {
+        // Allocate the space up front, running out of disk space while
+        // writing to a sparse mapping would be fatal.
+        int ret = EINVAL;
+#ifdef __linux__
+        ret = posix_fallocate(fd, 0, nNewSize);
+#endif
+        if (ret != 0 && ftruncate(fd, nNewSize) != 0)
+            throw std::runtime_error(strprintf("Unable to grow %s: %s", path.string(), strerror(errno)));
+    }
+    if (pData)
+        munmap(pData, nSize);
+    nSize = nNewSize;
+    void* p = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        pData = nullptr;
+        throw std::runtime_error(strprintf("Unable to map %s: %s", path.string(), strerror(errno)));
+    }
+    pData = static_cast<char*>(p);
+}
+
+//! Make a new directory entry in dir durable.
+static bool SyncDirectory(const boost::filesystem::path& dir) {
+    int fd = open(dir.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool fOk = fsync(fd) == 0;
+    close(fd);
+    return fOk;
+}
+
+bool MappedFile::Sync(size_t nOffset, size_t nLength) {
+    const size_t nPage = sysconf(_SC_PAGESIZE);
+    const size_t nBegin = nOffset / nPage * nPage;
+    const size_t nEnd = std::min(nOffset + nLength, nSize);
+    if (nEnd <= nBegin)
+        return true;
+    if (msync(pData + nBegin, nEnd - nBegin, MS_SYNC) != 0) {
+        LogPrintf("%s: msync of %s failed: %s\n", __func__, path.string(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#else // WIN32
+
+void MappedFile::Open(const boost::filesystem::path& pathIn, size_t nMinSize) {
+    throw std::runtime_error("The memory mapped coin store is not supported on this platform");
+}
+void MappedFile::Close() {}
+void MappedFile::Resize(size_t nNewSize) {}
+bool MappedFile::Sync(size_t nOffset, size_t nLength) { return false; }
+static bool SyncDirectory(const boost::filesystem::path& dir) { return false; }
+
+#endif // WIN32
+
+CCoinsViewMapped::CCoinsViewMapped(const boost::filesystem::path& dirIn, bool fWipe) : dir(dirIn), fInterruptWrite(false) {
+    if (fWipe) {
+        LogPrintf("Wiping coin store in %s\n", dir.string());
+        boost::filesystem::remove_all(dir);
+    }
+    TryCreateDirectory(dir);
+    // Left over from an interrupted Rebuild
+    boost::filesystem::remove(dir / "table.new");
+
+    table.Open(dir / "table.dat", HEADER_SIZE + MIN_CAPACITY * sizeof(Slot));
+    if (memcmp(GetHeader().magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0) {
+        if (!GetHeader().hashBest.IsNull() || GetHeader().nCapacity != 0)
+            throw std::runtime_error(strprintf("%s is not a coin store", (dir / "table.dat").string()));
+        CreateTable();
+    }
+    if (GetHeader().nVersion != MAPPED_VERSION)
+        throw std::runtime_error(strprintf("Unsupported coin store version %u", GetHeader().nVersion));
+    if (table.Size() < HEADER_SIZE + GetHeader().nCapacity * sizeof(Slot))
+        throw std::runtime_error(strprintf("%s is truncated", (dir / "table.dat").string()));
+    // Opening would create an empty log in its place, and the logs of other
+    // generations are removed below.
+    if (GetHeader().nLogSize > 0 && !boost::filesystem::exists(LogPath(dir, GetHeader().nLogGeneration)))
+        throw std::runtime_error(strprintf("%s is missing", LogPath(dir, GetHeader().nLogGeneration).string()));
+    OpenLog();
+
+    // Remove logs of other generations, left over from an interrupted compaction.
+    std::vector<boost::filesystem::path> vStale;
+    for (boost::filesystem::directory_iterator it(dir); it != boost::filesystem::directory_iterator(); ++it) {
+        const std::string name = it->path().filename().string();
+        if (name.compare(0, 6, "values") == 0 && it->path() != LogPath(dir, GetHeader().nLogGeneration))
+            vStale.push_back(it->path());
+    }
+    for (const boost::filesystem::path& path : vStale)
+        boost::filesystem::remove(path);
+    if (!GetHeader().hashHeads[0].IsNull())
+        Recover();
+    else
+        boost::filesystem::remove(JournalPath(dir)); // of a write that was interrupted before it started
+
+    LogPrintf("Opened coin store in %s, %u coins, %u/%u slots used, log %.1f MiB\n", dir.string(),
+              GetHeader().nCount, GetHeader().nUsed, GetHeader().nCapacity, GetHeader().nLogSize * (1.0 / 1048576.0));
+}
+
+CCoinsViewMapped::~CCoinsViewMapped() {}
+
+CCoinsViewMapped::Header& CCoinsViewMapped::GetHeader() const {
+    return *reinterpret_cast<Header*>(table.Data());
+}
+
+CCoinsViewMapped::Slot* CCoinsViewMapped::Slots() const {
+    return reinterpret_cast<Slot*>(table.Data() + HEADER_SIZE);
+}
+
+void CCoinsViewMapped::CreateTable() {
+    Header& header = GetHeader();
+    memset(table.Data(), 0, table.Size());
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+    header.nVersion = MAPPED_VERSION;
+    header.nLogGeneration = 0;
+    header.k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    header.k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    header.nCapacity = MIN_CAPACITY;
+    boost::filesystem::remove(LogPath(dir, 0));
+    if (!table.Sync(0, table.Size()))
+        throw std::runtime_error("Unable to write coin store");
+}
+
+void CCoinsViewMapped::OpenLog() {
+    const Header& header = GetHeader();
+    log.Open(LogPath(dir, header.nLogGeneration), std::max<size_t>(MIN_LOG_SIZE, header.nLogSize));
+}
+
+void CCoinsViewMapped::Recover() {
+    // A write was interrupted while updating the slots. Its journal was
+    // synced before it started, redoing the writes completes it.
+    const Header& header = GetHeader();
+    LogPrintf("Coin store was being written from %s to %s, recovering\n",
+              header.hashHeads[1].ToString(), header.hashHeads[0].ToString());
+    Journal journal;
+    if (!ReadJournal(journal) || journal.hashBlock != header.hashHeads[0] || journal.hashPrev != header.hashHeads[1])
+        throw std::runtime_error(strprintf("The journal of the coin store in %s is missing or corrupt", dir.string()));
+    if (!ApplyJournal(journal))
+        throw std::runtime_error("Unable to write coin store");
+    LogPrintf("Redid %u slot writes of the coin store\n", journal.vSlots.size());
+}
+
+bool CCoinsViewMapped::WriteJournal(const Journal& journal) const {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << journal.hashBlock << journal.hashPrev << journal.nCount << journal.nUsed
+       << journal.nLogSize << journal.nLogGarbage << uint64_t(journal.vSlots.size());
+    for (const std::pair<uint64_t, Slot>& entry : journal.vSlots) {
+        ss << entry.first;
+        ss.write(reinterpret_cast<const char*>(&entry.second), sizeof(Slot));
+    }
+    ss << Hash(ss.begin(), ss.end());
+
+    FILE* file = fopen(JournalPath(dir).string().c_str(), "wb");
+    if (!file)
+        return error("%s: Unable to open %s", __func__, JournalPath(dir).string());
+    const bool fWritten = fwrite(&ss[0], 1, ss.size(), file) == ss.size();
+    if (fWritten)
+        FileCommit(file);
+    fclose(file);
+    if (!fWritten)
+        return error("%s: Unable to write %s", __func__, JournalPath(dir).string());
+    return SyncDirectory(dir);
+}
+
+bool CCoinsViewMapped::ReadJournal(Journal& journal) const {
+    const boost::filesystem::path path = JournalPath(dir);
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    char buf[4096];
+    size_t nRead;
+    while ((nRead = fread(buf, 1, sizeof(buf), file)) > 0)
+        ss.write(buf, nRead);
+    fclose(file);
+
+    if (ss.size() < sizeof(uint256))
+        return error("%s: %s is truncated", __func__, path.string());
+    uint256 hashChecksum;
+    memcpy(hashChecksum.begin(), &ss[ss.size() - sizeof(uint256)], sizeof(uint256));
+    if (Hash(ss.begin(), ss.end() - sizeof(uint256)) != hashChecksum)
+        return error("%s: Checksum mismatch in %s", __func__, path.string());
+    try {
+        uint64_t nSlots;
+        ss >> journal.hashBlock >> journal.hashPrev >> journal.nCount >> journal.nUsed
+           >> journal.nLogSize >> journal.nLogGarbage >> nSlots;
+        if (nSlots > GetHeader().nCapacity)
+            return error("%s: Too many slots in %s", __func__, path.string());
+        journal.vSlots.resize(nSlots);
+        for (std::pair<uint64_t, Slot>& entry : journal.vSlots) {
+            ss >> entry.first;
+            ss.read(reinterpret_cast<char*>(&entry.second), sizeof(Slot));
+            if (entry.first >= GetHeader().nCapacity)
+                return error("%s: Slot out of range in %s", __func__, path.string());
+        }
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CCoinsViewMapped::ApplyJournal(const Journal& journal) {
+    Header& header = GetHeader();
+    Slot* slots = Slots();
+    for (const std::pair<uint64_t, Slot>& entry : journal.vSlots)
+        slots[entry.first] = entry.second;
+    header.nCount = journal.nCount;
+    header.nUsed = journal.nUsed;
+    header.nLogSize = journal.nLogSize;
+    header.nLogGarbage = journal.nLogGarbage;
+    if (!table.Sync(HEADER_SIZE, header.nCapacity * sizeof(Slot)))
+        return false;
+
+    // Mark the store as consistent with the block again. The header is
+    // smaller than a sector, so this write doesn't tear.
+    header.hashBest = journal.hashBlock;
+    header.hashHeads[0].SetNull();
+    header.hashHeads[1].SetNull();
+    if (!SyncHeader())
+        return false;
+    boost::filesystem::remove(JournalPath(dir));
+    return true;
+}
+
+bool CCoinsViewMapped::SyncHeader() {
+    return table.Sync(0, HEADER_SIZE);
+}
+
+uint64_t CCoinsViewMapped::Find(const COutPoint& outpoint) const {
+    const Header& header = GetHeader();
+    const uint64_t nMask = header.nCapacity - 1;
+    const Slot* slots = Slots();
+    for (uint64_t i = SipHashUint256Extra(header.k0, header.k1, outpoint.hash, outpoint.n) & nMask;; i = (i + 1) & nMask) {
+        const Slot& slot = slots[i];
+        if (slot.IsEmpty())
+            return NO_SLOT;
+        if (slot.IsLive() && slot.n == outpoint.n && slot.txid == outpoint.hash)
+            return i;
+    }
+}
+
+bool CCoinsViewMapped::ReadCoin(const Slot& slot, Coin& coin) const {
+    if (slot.nOffset + slot.nSize > GetHeader().nLogSize)
+        throw std::runtime_error("Coin store is corrupt, value out of range");
+    CMemoryReader reader(log.Data() + slot.nOffset, log.Data() + slot.nOffset + slot.nSize);
+    reader >> coin;
+    return true;
+}
+
+bool CCoinsViewMapped::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    const uint64_t i = Find(outpoint);
+    if (i == NO_SLOT)
+        return false;
+    return ReadCoin(Slots()[i], coin);
+}
+
+bool CCoinsViewMapped::HaveCoin(const COutPoint &outpoint) const {
+    return Find(outpoint) != NO_SLOT;
+}
+
+uint256 CCoinsViewMapped::GetBestBlock() const {
+    return GetHeader().hashBest;
+}
+
+std::vector<uint256> CCoinsViewMapped::GetHeadBlocks() const {
+    const Header& header = GetHeader();
+    if (header.hashHeads[0].IsNull())
+        return std::vector<uint256>();
+    return std::vector<uint256>{header.hashHeads[0], header.hashHeads[1]};
+}
+
+bool CCoinsViewMapped::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    assert(!hashBlock.IsNull());
+
+    uint256 old_tip = GetBestBlock();
+    if (old_tip.IsNull()) {
+        // We may be in the middle of replaying.
+        std::vector<uint256> old_heads = GetHeadBlocks();
+        if (old_heads.size() == 2) {
+            assert(old_heads[0] == hashBlock);
+            old_tip = old_heads[1];
+        }
+    }
+
+    // Make room in the table first, so the slots can be written in place.
+    size_t nDirty = 0;
+    for (const CCoinsMap::value_type& it : mapCoins)
+        nDirty += (it.second.flags & CCoinsCacheEntry::DIRTY) ? 1 : 0;
+    if ((GetHeader().nUsed + nDirty) * 4 > GetHeader().nCapacity * 3) {
+        uint64_t nCapacity = GetHeader().nCapacity;
+        while ((GetHeader().nCount + nDirty) * 2 > nCapacity)
+            nCapacity *= 2;
+        if (!Rebuild(nCapacity, false))
+            return false;
+    }
+
+    // Append the new values to the log.
+    std::vector<unsigned char> vchValues;
+    std::vector<uint32_t> vSizes;
+    for (const CCoinsMap::value_type& it : mapCoins) {
+        if ((it.second.flags & CCoinsCacheEntry::DIRTY) && !it.second.coin.IsSpent()) {
+            const size_t nBefore = vchValues.size();
+            CVectorWriter(SER_DISK, CLIENT_VERSION, vchValues, nBefore, it.second.coin);
+            vSizes.push_back(vchValues.size() - nBefore);
+        }
+    }
+    const uint64_t nLogStart = GetHeader().nLogSize;
+    if (nLogStart + vchValues.size() > log.Size())
+        log.Resize(std::max<size_t>(log.Size() * 2, nLogStart + vchValues.size()));
+    if (!vchValues.empty())
+        memcpy(log.Data() + nLogStart, vchValues.data(), vchValues.size());
+    if (!log.Sync(nLogStart, vchValues.size()))
+        return false;
+
+    // Work out the new slots and counters, without touching the table, so
+    // that they can be journaled before the first slot is written.
+    Header& header = GetHeader();
+    Journal journal;
+    journal.hashBlock = hashBlock;
+    journal.hashPrev = old_tip;
+    journal.nCount = header.nCount;
+    journal.nUsed = header.nUsed;
+    journal.nLogSize = nLogStart + vchValues.size();
+    journal.nLogGarbage = header.nLogGarbage;
+    std::map<uint64_t, size_t> mapPending; // slot index -> position in journal.vSlots
+    const Slot* slots = Slots();
+    auto slotAt = [&](uint64_t i) -> const Slot& {
+        std::map<uint64_t, size_t>::const_iterator it = mapPending.find(i);
+        return it == mapPending.end() ? slots[i] : journal.vSlots[it->second].second;
+    };
+    auto setSlot = [&](uint64_t i, const Slot& slot) {
+        std::pair<std::map<uint64_t, size_t>::iterator, bool> ins = mapPending.insert(std::make_pair(i, journal.vSlots.size()));
+        if (ins.second)
+            journal.vSlots.push_back(std::make_pair(i, slot));
+        else
+            journal.vSlots[ins.first->second].second = slot;
+    };
+
+    const uint64_t nMask = header.nCapacity - 1;
+    uint64_t nOffset = nLogStart;
+    size_t nValue = 0;
+    size_t count = 0, changed = 0;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+        ++count;
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        ++changed;
+        const COutPoint& outpoint = it->first;
+        const uint64_t nStart = SipHashUint256Extra(header.k0, header.k1, outpoint.hash, outpoint.n) & nMask;
+        uint64_t i = nStart;
+        for (; !slotAt(i).IsEmpty(); i = (i + 1) & nMask) {
+            if (slotAt(i).IsLive() && slotAt(i).n == outpoint.n && slotAt(i).txid == outpoint.hash)
+                break;
+        }
+        Slot slot = slotAt(i);
+        if (slot.IsLive()) {
+            journal.nLogGarbage += slot.nSize;
+            if (it->second.coin.IsSpent()) {
+                slot.nSize = 0;
+                slot.nOffset = TOMBSTONE;
+                --journal.nCount;
+                setSlot(i, slot);
+                continue;
+            }
+        } else {
+            if (it->second.coin.IsSpent())
+                continue;
+            // Reuse the first tombstone on the probe sequence, if any.
+            for (i = nStart; slotAt(i).IsLive(); i = (i + 1) & nMask) {}
+            slot = slotAt(i);
+            if (slot.IsEmpty())
+                ++journal.nUsed;
+            slot.txid = outpoint.hash;
+            slot.n = outpoint.n;
+            ++journal.nCount;
+        }
+        slot.nOffset = nOffset;
+        slot.nSize = vSizes[nValue];
+        nOffset += vSizes[nValue++];
+        setSlot(i, slot);
+    }
+    assert(nValue == vSizes.size());
+    if (!WriteJournal(journal))
+        return false;
+
+    // Mark the store as being in transition from old_tip to hashBlock.
+    header.hashBest.SetNull();
+    header.hashHeads[0] = hashBlock;
+    header.hashHeads[1] = old_tip;
+    if (!SyncHeader())
+        return false;
+    if (fInterruptWrite) {
+        fInterruptWrite = false;
+        return true;
+    }
+
+    if (!ApplyJournal(journal))
+        return false;
+    LogPrint(Log::COINDB, "Committed %u changed transaction outputs (out of %u) to coin store...\n", changed, count);
+
+    if (header.nLogGarbage > MIN_COMPACT_GARBAGE && header.nLogGarbage * 2 > header.nLogSize)
+        return Compact();
+    return true;
+}
+
+bool CCoinsViewMapped::Compact() {
+    return Rebuild(GetHeader().nCapacity, true);
+}
+
+bool CCoinsViewMapped::Rebuild(uint64_t nCapacity, bool fCompact) {
+    const Header& header = GetHeader();
+    assert(header.hashHeads[0].IsNull());
+    LogPrint(Log::COINDB, "Rebuilding coin store, %u slots%s\n", nCapacity, fCompact ? ", compacting values" : "");
+
+    const uint32_t nGeneration = header.nLogGeneration + (fCompact ? 1 : 0);
+    boost::filesystem::remove(dir / "table.new");
+    if (fCompact)
+        boost::filesystem::remove(LogPath(dir, nGeneration));
+    MappedFile newTable;
+    MappedFile newLog;
+    newTable.Open(dir / "table.new", HEADER_SIZE + nCapacity * sizeof(Slot));
+    Header& newHeader = *reinterpret_cast<Header*>(newTable.Data());
+    Slot* newSlots = reinterpret_cast<Slot*>(newTable.Data() + HEADER_SIZE);
+    newHeader = header;
+    newHeader.nCapacity = nCapacity;
+    newHeader.nUsed = header.nCount;
+    newHeader.nLogGeneration = nGeneration;
+    if (fCompact) {
+        newLog.Open(LogPath(dir, nGeneration), std::max<size_t>(MIN_LOG_SIZE, header.nLogSize - header.nLogGarbage));
+        newHeader.nLogSize = 0;
+        newHeader.nLogGarbage = 0;
+    }
+
+    const Slot* slots = Slots();
+    const uint64_t nMask = nCapacity - 1;
+    for (uint64_t j = 0; j < header.nCapacity; ++j) {
+        if (!slots[j].IsLive())
+            continue;
+        uint64_t i = SipHashUint256Extra(header.k0, header.k1, slots[j].txid, slots[j].n) & nMask;
+        while (!newSlots[i].IsEmpty())
+            i = (i + 1) & nMask;
+        newSlots[i] = slots[j];
+        if (fCompact) {
+            memcpy(newLog.Data() + newHeader.nLogSize, log.Data() + slots[j].nOffset, slots[j].nSize);
+            newSlots[i].nOffset = newHeader.nLogSize;
+            newHeader.nLogSize += slots[j].nSize;
+        }
+    }
+
+    if (fCompact && !newLog.Sync(0, newHeader.nLogSize))
+        return false;
+    if (!newTable.Sync(0, newTable.Size()))
+        return false;
+    newTable.Close();
+    newLog.Close();
+    if (!RenameOver(dir / "table.new", dir / "table.dat"))
+        return error("%s: Unable to replace coin store table", __func__);
+    // The old table could come back after a crash, so its log is only
+    // removed once the rename is durable.
+    if (!SyncDirectory(dir))
+        return error("%s: Unable to sync %s", __func__, dir.string());
+
+    const uint32_t nOldGeneration = header.nLogGeneration;
+    table.Open(dir / "table.dat", 0);
+    if (fCompact) {
+        OpenLog();
+        boost::filesystem::remove(LogPath(dir, nOldGeneration));
+    }
+    return true;
+}
+
+uint64_t CCoinsViewMapped::GetCount() const {
+    return GetHeader().nCount;
+}
+
+size_t CCoinsViewMapped::EstimateSize() const {
+    return HEADER_SIZE + GetHeader().nCapacity * sizeof(Slot) + GetHeader().nLogSize;
+}
+
+CCoinsViewCursor *CCoinsViewMapped::Cursor() const {
+    return new CCoinsViewMappedCursor(this, GetBestBlock());
+}
+
+CCoinsViewMappedCursor::CCoinsViewMappedCursor(const CCoinsViewMapped* viewIn, const uint256 &hashBlockIn) :
+    CCoinsViewCursor(hashBlockIn), view(viewIn), nPos(0) {
+    Skip();
+}
+
+void CCoinsViewMappedCursor::Skip() {
+    const uint64_t nCapacity = view->GetHeader().nCapacity;
+    while (nPos < nCapacity && !view->Slots()[nPos].IsLive())
+        ++nPos;
+}
+
+bool CCoinsViewMappedCursor::GetKey(COutPoint &key) const {
+    if (!Valid())
+        return false;
+    const CCoinsViewMapped::Slot& slot = view->Slots()[nPos];
+    key = COutPoint(slot.txid, slot.n);
+    return true;
+}
+
+bool CCoinsViewMappedCursor::GetValue(Coin &coin) const {
+    if (!Valid())
+        return false;
+    try {
+        return view->ReadCoin(view->Slots()[nPos], coin);
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+}
+
+unsigned int CCoinsViewMappedCursor::GetValueSize() const {
+    return Valid() ? view->Slots()[nPos].nSize : 0;
+}
+
+bool CCoinsViewMappedCursor::Valid() const {
+    return nPos < view->GetHeader().nCapacity;
+}
+
+void CCoinsViewMappedCursor::Next() {
+    ++nPos;
+    Skip();
+}
@@ -0,0 +1,139 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSMAPPED_H
+#define BITCOIN_COINSMAPPED_H
+
+#include "coins.h"
+
+#include <boost/filesystem/path.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+class CCoinsViewMappedCursor;
+
+/** A file mapped into memory, that can be grown. */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    //! Open (or create) the file and map at least nMinSize bytes of it. Throws on failure.
+    void Open(const boost::filesystem::path& path, size_t nMinSize);
+    void Close();
+    //! Grow the file and its mapping to nSize bytes. Throws on failure.
+    void Resize(size_t nSize);
+    //! Write the range to disk, returns false on failure.
+    bool Sync(size_t nOffset, size_t nLength);
+
+    char* Data() const { return pData; }
+    size_t Size() const { return nSize; }
+
+private:
+    boost::filesystem::path path;
+    int fd;
+    char* pData;
+    size_t nSize;
+
+    MappedFile(const MappedFile&);
+    void operator=(const MappedFile&);
+};
+
+/**
+ * CCoinsView backed by a memory mapped hash table (coinsmap/).
+ *
+ * The table is an open addressing hash table of fixed size slots, keyed by
+ * outpoint. Coins are serialized into an append-only value log that the
+ * slots point into, so a lookup is a hash probe and a read from the mapped
+ * log, without a block cache or decompression in between.
+ *
+ * A write appends the new values to the log and syncs it. The new contents
+ * of the slots it changes and the new counters go to a checksummed journal
+ * (journal.dat), which is synced before the table is marked as being in
+ * transition between two blocks and the slots are updated in place. Slots
+ * may straddle pages, so an interrupted update can leave torn slots behind;
+ * on opening, Recover() redoes the journaled writes, which completes the
+ * transition.
+ *
+ * Growing the table and compacting the log write new files, which replace
+ * the old ones atomically.
+ *
+ * The files are in native byte order. Not thread safe.
+ */
+class CCoinsViewMapped : public CCoinsView
+{
+public:
+    CCoinsViewMapped(const boost::filesystem::path& dir, bool fWipe = false);
+    ~CCoinsViewMapped();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool HaveCoin(const COutPoint &outpoint) const override;
+    uint256 GetBestBlock() const override;
+    std::vector<uint256> GetHeadBlocks() const override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    CCoinsViewCursor *Cursor() const override;
+    size_t EstimateSize() const override;
+
+    //! Number of unspent coins stored.
+    uint64_t GetCount() const;
+    //! Rewrite the value log without the values of spent or overwritten coins.
+    bool Compact();
+    //! For testing: stop the next write once the table is marked as being in
+    //! transition, before any slot is updated, as if it was interrupted.
+    void InterruptNextWrite() { fInterruptWrite = true; }
+
+private:
+    struct Header;
+    struct Slot;
+    struct Journal;
+
+    boost::filesystem::path dir;
+    MappedFile table;
+    MappedFile log;
+    bool fInterruptWrite;
+
+    Header& GetHeader() const;
+    Slot* Slots() const;
+    uint64_t Find(const COutPoint& outpoint) const;
+    bool ReadCoin(const Slot& slot, Coin& coin) const;
+
+    void CreateTable();
+    void OpenLog();
+    void Recover();
+    bool WriteJournal(const Journal& journal) const;
+    bool ReadJournal(Journal& journal) const;
+    bool ApplyJournal(const Journal& journal);
+    bool Rebuild(uint64_t nCapacity, bool fCompact);
+    bool SyncHeader();
+
+    friend class CCoinsViewMappedCursor;
+
+    CCoinsViewMapped(const CCoinsViewMapped&);
+    void operator=(const CCoinsViewMapped&);
+};
+
+/** Specialization of CCoinsViewCursor to iterate over a CCoinsViewMapped */
+class CCoinsViewMappedCursor : public CCoinsViewCursor
+{
+public:
+    bool GetKey(COutPoint &key) const override;
+    bool GetValue(Coin &coin) const override;
+    unsigned int GetValueSize() const override;
+
+    bool Valid() const override;
+    void Next() override;
+
+private:
+    CCoinsViewMappedCursor(const CCoinsViewMapped* viewIn, const uint256 &hashBlockIn);
+    void Skip();
+
+    const CCoinsViewMapped* view;
+    uint64_t nPos;
+
+    friend class CCoinsViewMapped;
+};
+
+#endif // BITCOIN_COINSMAPPED_H
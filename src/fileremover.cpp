@@ -0,0 +1,65 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "fileremover.h"
+
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+CFileRemover::CFileRemover() : fRemoving(false), fStop(false) {}
+
+CFileRemover::~CFileRemover()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fStop = true;
+    }
+    cvQueued.notify_one();
+    if (remover.joinable())
+        remover.join();
+}
+
+void CFileRemover::Remove(std::vector<boost::filesystem::path>&& paths)
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (!remover.joinable())
+            remover = std::thread(&CFileRemover::ThreadRemove, this);
+        for (boost::filesystem::path& path : paths)
+            queue.push_back(std::move(path));
+    }
+    cvQueued.notify_one();
+}
+
+void CFileRemover::Wait()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    cvDone.wait(lock, [this]() { return queue.empty() && !fRemoving; });
+}
+
+void CFileRemover::ThreadRemove()
+{
+    RenameThread("bitcoin-fileremove");
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        // Queued files are removed before stopping.
+        cvQueued.wait(lock, [this]() { return !queue.empty() || fStop; });
+        if (queue.empty())
+            return;
+        boost::filesystem::path path = std::move(queue.front());
+        queue.pop_front();
+        fRemoving = true;
+        lock.unlock();
+
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+        if (ec)
+            LogPrintf("%s: Unable to remove %s: %s\n", __func__, path.string(), ec.message());
+
+        lock.lock();
+        fRemoving = false;
+        cvDone.notify_all();
+    }
+}
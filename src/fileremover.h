@@ -0,0 +1,52 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FILEREMOVER_H
+#define BITCOIN_FILEREMOVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * Removes files on a thread of its own, so that pruning doesn't hold up
+ * validation while the file system frees hundreds of megabytes.
+ *
+ * Files are queued once nothing refers to them anymore: pruned block files
+ * after the block index that no longer points into them has been written.
+ */
+class CFileRemover
+{
+public:
+    CFileRemover();
+    ~CFileRemover();
+
+    //! Queue paths to be removed.
+    void Remove(std::vector<boost::filesystem::path>&& paths);
+
+    //! Block until the queued files are removed.
+    void Wait();
+
+private:
+    void ThreadRemove();
+
+    std::mutex cs;
+    std::condition_variable cvQueued;
+    std::condition_variable cvDone;
+    //! Guarded by cs.
+    std::deque<boost::filesystem::path> queue;
+    bool fRemoving;
+    bool fStop;
+
+    std::thread remover;
+
+    CFileRemover(const CFileRemover&);
+    void operator=(const CFileRemover&);
+};
+
+#endif // BITCOIN_FILEREMOVER_H
@@ -11,7 +11,9 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "bgvalidation.h"
 #include "checkpoints.h"
+#include "coinsmapped.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
 #include "httpserver.h"
@@ -29,6 +31,7 @@
 #include "scheduler.h"
 #include "timedata.h"
 #include "txdb.h"
+#include "txorphanpool.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utildebug.h"
@@ -42,6 +45,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <atomic>
 #include <memory>
 
 #ifndef WIN32
@@ -64,6 +68,9 @@ CWallet* pwalletMain = NULL;
 #endif
 std::unique_ptr<CConnman> g_connman;
 bool fFeeEstimatesInitialized = false;
+// Set once the mempool has been loaded from disk, so that we don't overwrite
+// mempool.dat with a partially loaded mempool.
+static std::atomic<bool> fDumpMempoolLater(false);
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -147,6 +154,7 @@ public:
 };
 
 static CCoinsViewDB *pcoinsdbview = NULL;
+static CCoinsViewMapped *pcoinsmapped = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -190,6 +198,7 @@ void Shutdown()
     GenerateBitcoins(false, 0, Params(), nullptr);
     MapPort(false);
     g_connman.reset();
+    StopBackgroundValidation();
 
     // After everything has been shut down, but before things get flushed, stop the
     // CScheduler/checkqueue threadGroup
@@ -198,6 +207,9 @@ void Shutdown()
 
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -213,13 +225,18 @@ void Shutdown()
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
+            WriteBlockIndexSnapshot();
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsWriteBehind;
+        pcoinsWriteBehind = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
+        delete pcoinsmapped;
+        pcoinsmapped = NULL;
         delete pblocktree;
         pblocktree = NULL;
     }
@@ -306,9 +323,12 @@ std::string HelpMessage(HelpMessageMode mode)
     string strUsage = HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockindexsnapshot", strprintf(_("Write a snapshot of the block index on shutdown, to load it faster on the next start (default: %u)"), DEFAULT_BLOCK_INDEX_SNAPSHOT));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+    strUsage += HelpMessageOpt("-compressblocks", strprintf(_("Store new blocks compressed. Block files written with it can't be read by older versions (default: %u)"), DEFAULT_COMPRESS_BLOCKS));
+    strUsage += HelpMessageOpt("-compressundo", strprintf(_("Store the undo data of new blocks LZ4 compressed. Undo files written with it can't be read by older versions (default: %u)"), DEFAULT_COMPRESS_UNDO));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "bitcoin.conf"));
     if (mode == HMM_BITCOIND)
     {
@@ -320,10 +340,14 @@ std::string HelpMessage(HelpMessageMode mode)
     if (showDebug) {
         strUsage += HelpMessageOpt("-dbbatchsize", strprintf("Maximum database write batch size in bytes (default: %u)", nDefaultDbBatchSize));
     }
+    strUsage += HelpMessageOpt("-coinsbackend=<type>", strprintf(_("Store the chain state in a LevelDB database (leveldb) or a memory mapped hash table (mmap). "
+            "Changing it requires -reindex-chainstate (default: %s)"), DEFAULT_COINS_BACKEND));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphanpool=<n>", strprintf(_("Keep unconnectable transactions in memory below <n> megabytes, a single peer may use at most a quarter of this (default: %u)"), DEFAULT_MAX_ORPHAN_POOL_SIZE));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
@@ -423,6 +447,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitclustercount=<n>", strprintf("Do not accept transactions that would connect more than <n> in-mempool transactions through their dependencies (default: %u)", DEFAULT_CLUSTER_LIMIT));
     }
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
         _("If <category> is not supplied or if <category> = 1, output all debugging information.") + " " + _("<category> can be:") + " " + ListLogCategories() + ".");
@@ -588,7 +613,7 @@ void CleanupBlockRevFiles()
     }
 }
 
-void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
+void ThreadImport(std::vector<boost::filesystem::path> vImportFiles, bool fReindexChainState)
 {
     RenameThread("bitcoin-loadblk");
     ScheduleBatchPriority();
@@ -596,18 +621,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -reindex
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
-        }
+        ReindexBlockFiles();
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -642,7 +656,17 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
     CValidationState state;
-    if (!ActivateBestChain(state)) {
+    bool fConnected;
+    if (fReindexChainState) {
+        if (pcoinsdbview)
+            pcoinsdbview->SetSortedWrites(true);
+        fConnected = ReindexChainState(state);
+        if (pcoinsdbview)
+            pcoinsdbview->SetSortedWrites(false);
+    } else {
+        fConnected = ActivateBestChain(state);
+    }
+    if (!fConnected) {
         LogPrintf("Failed to connect best block");
         StartShutdown();
     }
@@ -651,6 +675,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fDumpMempoolLater = !fRequestShutdown;
+    }
 }
 
 /** Sanity checks
@@ -912,6 +941,9 @@ bool AppInit2()
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fCompressUndo = GetBoolArg("-compressundo", DEFAULT_COMPRESS_UNDO);
+    fCompressBlocks = GetBoolArg("-compressblocks", DEFAULT_COMPRESS_BLOCKS);
+    fBlockIndexSnapshot = GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCK_INDEX_SNAPSHOT);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", true);
     if (fCheckpointsEnabled && !Opt().UAHFTime()) {
         InitWarning(_("Warning: checkpoints are not supported on the BTC chain."));
@@ -924,6 +956,10 @@ bool AppInit2()
     if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
         return InitError(strprintf(_("-maxmempool must be at least %d MB"), std::ceil(nMempoolSizeMin / 1000.0)));
 
+    // orphan pool limits
+    orphanpool.SetLimits(std::max(int64_t(0), GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)),
+                         std::max(int64_t(0), GetArg("-maxorphanpool", DEFAULT_MAX_ORPHAN_POOL_SIZE)) * 1000000);
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MB) to allot for block & undo files
@@ -1085,8 +1121,10 @@ bool AppInit2()
 
     LogPrintf("Using %u threads for script verification\n", Opt().ScriptCheckThreads());
     if (Opt().ScriptCheckThreads()) {
-        for (int i=0; i<Opt().ScriptCheckThreads()-1; i++)
+        for (int i=0; i<Opt().ScriptCheckThreads()-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadBlockCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1287,8 +1325,14 @@ bool AppInit2()
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", 0) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
     nTotalCache -= nBlockTreeDBCache;
+    const std::string strCoinsBackend = GetArg("-coinsbackend", DEFAULT_COINS_BACKEND);
+    if (strCoinsBackend != "leveldb" && strCoinsBackend != "mmap")
+        return InitError(strprintf(_("Unknown -coinsbackend '%s'"), strCoinsBackend));
+    const bool fCoinsMapped = strCoinsBackend == "mmap";
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
+    if (fCoinsMapped)
+        nCoinDBCache = 0; // the page cache serves the coin store
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
@@ -1308,8 +1352,13 @@ bool AppInit2()
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsWriteBehind;
+                delete pcoinsdbview;
+                delete pcoinsmapped;
+                pcoinsWriteBehind = NULL;
+                pcoinsdbview = NULL;
+                pcoinsmapped = NULL;
                 delete pblocktree;
 
                 // Detect database obfuscation by future versions of the DBWrapper
@@ -1317,8 +1366,33 @@ bool AppInit2()
                 bool blockDbScrambled;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, blockDbScrambled, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, chainstateScrambled, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+
+                // The chainstate can only be read by the backend that wrote it.
+                bool fStoredMapped = fCoinsMapped;
+                int nLastFile;
+                if (!pblocktree->ReadFlag("coinsmapped", fStoredMapped) && pblocktree->ReadLastBlockFile(nLastFile)) {
+                    // Written before the backend was recorded
+                    fStoredMapped = boost::filesystem::exists(GetDataDir() / "coinsmap" / "table.dat");
+                }
+                if (fStoredMapped != fCoinsMapped && !fReindex && !fReindexChainState) {
+                    strLoadError = strprintf(_("The chain state was written with -coinsbackend=%s. You need to rebuild the database using -reindex-chainstate to change it"),
+                                             fStoredMapped ? "mmap" : "leveldb");
+                    break;
+                }
+                pblocktree->WriteFlag("coinsmapped", fCoinsMapped);
+                // The view the in-memory cache is flushed to
+                CCoinsView* pcoinsbase;
+                if (fCoinsMapped) {
+                    chainstateScrambled = false;
+                    pcoinsmapped = new CCoinsViewMapped(GetDataDir() / "coinsmap", fReindex || fReindexChainState);
+                    pcoinsbase = pcoinsmapped;
+                    pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsmapped);
+                } else {
+                    pcoinsdbview = new CCoinsViewDB(nCoinDBCache, chainstateScrambled, false, fReindex || fReindexChainState);
+                    pcoinsbase = pcoinsdbview;
+                    pcoinsWriteBehind = new CCoinsViewWriteBehind(pcoinsdbview);
+                    pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsWriteBehind);
+                }
 
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
@@ -1327,7 +1401,7 @@ bool AppInit2()
                         CleanupBlockRevFiles();
                 } else {
                     // If necessary, upgrade from older database format.
-                    if (!pcoinsdbview->Upgrade()) {
+                    if (pcoinsdbview && !pcoinsdbview->Upgrade()) {
                         strLoadError = _("Error upgrading chainstate database");
                         break;
                     }
@@ -1357,6 +1431,16 @@ bool AppInit2()
                     break;
                 }
 
+                // Check for an interrupted loadtxoutset
+                bool fLoadingSnapshot = false;
+                pblocktree->ReadFlag("txoutsetloading", fLoadingSnapshot);
+                if (fLoadingSnapshot && !fReindex && !fReindexChainState) {
+                    strLoadError = _("Loading a UTXO snapshot was interrupted. You need to rebuild the database using -reindex-chainstate.");
+                    break;
+                }
+                if (fLoadingSnapshot)
+                    pblocktree->WriteFlag("txoutsetloading", false);
+
                 // Check for changed -txindex state
                 if (fTxIndex != GetBoolArg("-txindex", false)) {
                     strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -txindex");
@@ -1370,7 +1454,7 @@ bool AppInit2()
                     break;
                 }
 
-                if (!ReplayBlocks(chainparams, pcoinsdbview)) {
+                if (!ReplayBlocks(chainparams, pcoinsbase)) {
                     strLoadError = _("Unable to replay blocks. You will need to rebuild the database using -reindex-chainstate.");
                     break;
                 }
@@ -1382,7 +1466,7 @@ bool AppInit2()
                     LogPrintf("Prune: pruned datadir may not have more than %d blocks; -checkblocks=%d may fail\n",
                         MIN_BLOCKS_TO_KEEP, GetArg("-checkblocks", DEFAULT_CHECKBLOCKS));
                 }
-                if (!CVerifyDB().VerifyDB(pcoinsdbview, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
+                if (!CVerifyDB().VerifyDB(pcoinsbase, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
                               GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
@@ -1441,6 +1525,12 @@ bool AppInit2()
         }
     }
 
+    // Validate the blocks below the UTXO snapshot the chain state was loaded from, if any
+    {
+        LOCK(cs_main);
+        StartBackgroundValidation();
+    }
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (fDisableWallet) {
@@ -1608,7 +1698,7 @@ bool AppInit2()
             vImportFiles.push_back(strFile);
     }
 
-    threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles, fReindexChainState));
 
     // Wait for genesis block to be processed
     {
@@ -1667,6 +1757,14 @@ bool AppInit2()
     CBlockIndex *pdummy = NULL;
     scheduler.scheduleEvery(f, PartitionCheck(&IsInitialBlockDownload, boost::ref(cs_main), boost::cref(pdummy), nPowTargetSpacing));
 
+    // Dump the mempool periodically, so it survives an unclean shutdown
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        scheduler.scheduleEvery([]() {
+            if (fDumpMempoolLater)
+                DumpMempool();
+        }, MEMPOOL_DUMP_INTERVAL);
+    }
+
     // Generate coins in the background
     GenerateBitcoins(GetBoolArg("-gen", false), GetArg("-genproclimit", 1), Params(), g_connman.get());
 
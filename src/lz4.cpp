@@ -0,0 +1,168 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lz4.h"
+
+#include "crypto/common.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const size_t MIN_MATCH = 4;
+// The format requires the last 5 bytes to be literals, and the last match
+// to start at least 12 bytes before the end.
+const size_t LAST_LITERALS = 5;
+const size_t MF_LIMIT = 12;
+const size_t MAX_OFFSET = 65535;
+const int HASH_BITS = 12;
+// Skip ahead faster the longer no match is found, so incompressible data
+// (hashes, signatures) doesn't cost much.
+const int SKIP_TRIGGER = 6;
+
+uint32_t HashSequence(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void WriteLength(std::vector<unsigned char>& dst, size_t len)
+{
+    while (len >= 255) {
+        dst.push_back(255);
+        len -= 255;
+    }
+    dst.push_back(len);
+}
+
+void WriteSequence(std::vector<unsigned char>& dst, const unsigned char* literals, size_t nLiterals,
+                   size_t offset, size_t nMatch)
+{
+    const size_t nMatchCode = nMatch - MIN_MATCH;
+    dst.push_back((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatchCode, 15));
+    if (nLiterals >= 15)
+        WriteLength(dst, nLiterals - 15);
+    dst.insert(dst.end(), literals, literals + nLiterals);
+    dst.push_back(offset & 0xff);
+    dst.push_back(offset >> 8);
+    if (nMatchCode >= 15)
+        WriteLength(dst, nMatchCode - 15);
+}
+
+void WriteLastLiterals(std::vector<unsigned char>& dst, const unsigned char* literals, size_t nLiterals)
+{
+    dst.push_back(std::min<size_t>(nLiterals, 15) << 4);
+    if (nLiterals >= 15)
+        WriteLength(dst, nLiterals - 15);
+    dst.insert(dst.end(), literals, literals + nLiterals);
+}
+
+bool ReadLength(const unsigned char* src, size_t n, size_t& pos, size_t& len)
+{
+    unsigned char b;
+    do {
+        if (pos >= n)
+            return false;
+        b = src[pos++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+} // anon namespace
+
+void LZ4Compress(const unsigned char* src, size_t n, std::vector<unsigned char>& dst,
+                 const unsigned char* dict, size_t nDict)
+{
+    dst.clear();
+    dst.reserve(n + n / 255 + 16);
+
+    // With a dictionary, work on it and the data as one, positions counting
+    // from the start of the dictionary.
+    std::vector<unsigned char> combined;
+    if (nDict > MAX_OFFSET) {
+        dict += nDict - MAX_OFFSET;
+        nDict = MAX_OFFSET;
+    }
+    const size_t nStart = n >= MF_LIMIT + 1 ? nDict : 0;
+    if (nStart > 0) {
+        combined.reserve(nDict + n);
+        combined.insert(combined.end(), dict, dict + nDict);
+        combined.insert(combined.end(), src, src + n);
+        src = combined.data();
+        n = combined.size();
+    }
+
+    size_t anchor = nStart;
+    if (n - nStart >= MF_LIMIT + 1) {
+        std::vector<uint32_t> table(1 << HASH_BITS, 0);
+        for (size_t pos = 0; pos + MIN_MATCH <= nStart; ++pos)
+            table[HashSequence(ReadLE32(src + pos))] = pos;
+        const size_t matchLimit = n - LAST_LITERALS;
+        const size_t inputLimit = n - MF_LIMIT;
+        size_t pos = nStart;
+        while (pos < inputLimit) {
+            const uint32_t seq = ReadLE32(src + pos);
+            uint32_t& entry = table[HashSequence(seq)];
+            const size_t candidate = entry;
+            entry = pos;
+            if (candidate >= pos || pos - candidate > MAX_OFFSET || ReadLE32(src + candidate) != seq) {
+                pos += 1 + ((pos - anchor) >> SKIP_TRIGGER);
+                continue;
+            }
+            size_t nMatch = MIN_MATCH;
+            while (pos + nMatch < matchLimit && src[candidate + nMatch] == src[pos + nMatch])
+                ++nMatch;
+            WriteSequence(dst, src + anchor, pos - anchor, pos - candidate, nMatch);
+            pos += nMatch;
+            anchor = pos;
+        }
+    }
+    WriteLastLiterals(dst, src + anchor, n - anchor);
+}
+
+bool LZ4Decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t nDst,
+                   const unsigned char* dict, size_t nDict)
+{
+    if (nDict > MAX_OFFSET) {
+        dict += nDict - MAX_OFFSET;
+        nDict = MAX_OFFSET;
+    }
+    size_t pos = 0;
+    size_t out = 0;
+    while (true) {
+        if (pos >= n)
+            return false;
+        const unsigned char token = src[pos++];
+
+        size_t nLiterals = token >> 4;
+        if (nLiterals == 15 && !ReadLength(src, n, pos, nLiterals))
+            return false;
+        if (nLiterals > n - pos || nLiterals > nDst - out)
+            return false;
+        memcpy(dst + out, src + pos, nLiterals);
+        pos += nLiterals;
+        out += nLiterals;
+
+        // The last sequence has no match.
+        if (pos == n)
+            return out == nDst;
+
+        if (n - pos < 2)
+            return false;
+        const size_t offset = src[pos] | (src[pos + 1] << 8);
+        pos += 2;
+        if (offset == 0 || offset > out + nDict)
+            return false;
+        size_t nMatch = token & 15;
+        if (nMatch == 15 && !ReadLength(src, n, pos, nMatch))
+            return false;
+        nMatch += MIN_MATCH;
+        if (nMatch > nDst - out)
+            return false;
+        // Matches may overlap the bytes they produce, and start in the dictionary.
+        for (size_t i = 0; i < nMatch; ++i, ++out)
+            dst[out] = out >= offset ? dst[out - offset] : dict[nDict + out - offset];
+    }
+}
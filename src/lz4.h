@@ -0,0 +1,35 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LZ4_H
+#define BITCOIN_LZ4_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * A small implementation of the LZ4 block format
+ * (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md), for data
+ * we store on disk ourselves. It favours speed over ratio: greedy matching
+ * with a single hash table and no frame format. The size of the
+ * uncompressed data has to be stored along by the caller.
+ *
+ * Data can be compressed against a dictionary: bytes that are taken to
+ * precede it, for its first matches to refer to. The same dictionary has to
+ * be given to decompress it. Only its last 64 kB are used.
+ */
+
+/** Compress n bytes at src to dst, replacing its contents. */
+void LZ4Compress(const unsigned char* src, size_t n, std::vector<unsigned char>& dst,
+                 const unsigned char* dict = nullptr, size_t nDict = 0);
+
+/**
+ * Decompress n bytes at src to exactly nDst bytes at dst. Returns false
+ * if the data is corrupt or doesn't decompress to nDst bytes; never reads
+ * or writes out of bounds.
+ */
+bool LZ4Decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t nDst,
+                   const unsigned char* dict = nullptr, size_t nDict = 0);
+
+#endif // BITCOIN_LZ4_H
@@ -7,11 +7,16 @@
 
 #include "addrman.h"
 #include "arith_uint256.h"
+#include "bgvalidation.h"
 #include "bip135unknownsalerter.h"
 #include "bip64_getutxo.h"
 #include "blockannounce.h"
+#include "blockcompression.h"
+#include "blockdownloadscheduler.h"
 #include "blockencodings.h"
+#include "blockfilemap.h"
 #include "blockheaderprocessor.h"
+#include "blockindexsnapshot.h"
 #include "blocksender.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -22,8 +27,11 @@
 #include "consensus/merkle.h"
 #include "consensus/tx_verify.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
+#include "fileremover.h"
 #include "inflightindex.h"
 #include "init.h"
+#include "lz4.h"
 #include "maxblocksize.h"
 #include "merkleblock.h"
 #include "mempoolaccepter.h"
@@ -42,8 +50,10 @@
 #include "thinblockmanager.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "ui_interface.h"
 #include "undo.h"
+#include "undowriter.h"
 #include "util.h"
 #include "utilblock.h"
 #include "utilfork.h"
@@ -55,6 +65,13 @@
 
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <boost/dynamic_bitset.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -86,7 +103,11 @@ std::atomic_bool fImporting(false);
 bool fReindex = false;
 bool fTxIndex = false;
 bool fHavePruned = false;
+CBlockIndex *pindexSnapshotBase = NULL;
 bool fPruneMode = false;
+bool fCompressUndo = DEFAULT_COMPRESS_UNDO;
+bool fCompressBlocks = DEFAULT_COMPRESS_BLOCKS;
+bool fBlockIndexSnapshot = DEFAULT_BLOCK_INDEX_SNAPSHOT;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
@@ -98,15 +119,10 @@ CFeeRate minRelayTxFee = CFeeRate(1000);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
-void EraseOrphansFor(NodeId peer);
+TxOrphanPool orphanpool(DEFAULT_MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_POOL_SIZE * 1000000);
 
 static bool SanityCheckMessage(CNode* peer, const CNetMessage& msg);
+static void ProcessOrphans(std::vector<uint256> vWorkQueue, CConnman* connman);
 
 static void CheckBlockIndex();
 
@@ -155,10 +171,24 @@ namespace {
       * Pruned nodes may have entries where B is missing data.
       */
     multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+    /**
+     * Transaction count of the chain up to pindexSnapshotBase, from the
+     * snapshot. Blocks below it count their transactions once they are
+     * received, the others count as one, the base block's count is fixed.
+     */
+    uint64_t nSnapshotChainTx = 0;
 
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
+    /** Block files, and their undo files, written to since they were last synced. */
+    std::set<int> setUnsyncedBlockFiles;
+    /**
+     * The entries of mapBlockIndex with data in each block file, for pruning
+     * to find them. May hold entries that have been pruned since. Protected
+     * by cs_main.
+     */
+    std::vector<std::vector<CBlockIndex*> > vBlocksInFile;
     /** Global flag to indicate we should check to see if there are
      *  block/undo files that should be deleted.  Set on startup
      *  or if we allocate more file space when we're in prune mode
@@ -198,6 +228,9 @@ namespace {
 
     InFlightIndex blocksInFlight;
 
+    /** How many blocks to have in flight from each peer, by how fast they deliver. */
+    BlockDownloadScheduler blockDownloadScheduler(MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
@@ -209,6 +242,18 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Writes the undo data of connected blocks in the background. */
+    CUndoWriter undoWriter;
+
+    /** Holds the entries of mapBlockIndex. */
+    CBlockIndexArena blockIndexArena;
+
+    /** Removes pruned block files. */
+    CFileRemover prunedFileRemover;
+
+    /** Mappings of the block files blocks were last read from. Not used where address space is scarce. */
+    CBlockFileMaps blockFileMaps(sizeof(void*) >= 8 ? MAX_MAPPED_BLOCKFILES : 0);
 } // anon namespace
 
 // UAHF chain considers an OP_RETURN that commits to this string invalid
@@ -320,22 +365,26 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         blocksInFlight.erase(nodeid, entry.hash);
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    blockDownloadScheduler.remove(nodeid);
 
     state.erase();
 }
 
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+bool MarkBlockAsReceived(const uint256& hash, const std::set<NodeId>& from) {
     AssertLockHeld(cs_main);
     if (!blocksInFlight.isInFlight(hash))
         return false;
 
+    const int64_t nNow = GetTimeMicros();
     std::vector<QueuedBlockPtr> queued = blocksInFlight.queuedPtrsFor(hash);
     typedef std::vector<QueuedBlockPtr>::const_iterator auto_;
     for (auto_ q = queued.begin(); q != queued.end(); ++q) {
+        if (from.count((*q)->node))
+            blockDownloadScheduler.delivered((*q)->node, (*q)->nTime, nNow);
         InFlightEraserImpl erase;
         erase((*q)->node, hash);
     }
@@ -407,6 +456,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     std::set<NodeId> waitingfor;
+    const CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -437,6 +487,19 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                 // not being received as a thin block announcement.
                 if (pindex->nHeight > nWindowEnd) {
                     // We reached the end of the window.
+                    if (waitingfor.size() == 1 && !waitingfor.count(nodeid)) {
+                        // A single peer holds the window back. Ask this one
+                        // for the block as well, if it'd be faster.
+                        const NodeId staller = *waitingfor.begin();
+                        QueuedBlockPtr queued = blocksInFlight.queuedItem(staller, pindexWaitingFor->GetBlockHash());
+                        if (queued != QueuedBlockPtr() && blockDownloadScheduler.shouldRerequest(nodeid, staller, queued->nTime, GetTimeMicros())) {
+                            LogPrint(Log::NET, "Requesting block %s (%d) held back by peer=%d from peer=%d\n",
+                                    pindexWaitingFor->GetBlockHash().ToString(), pindexWaitingFor->nHeight, staller, nodeid);
+                            blockDownloadScheduler.rerequested(staller);
+                            vBlocks.push_back(pindexWaitingFor);
+                            return;
+                        }
+                    }
                     if (vBlocks.size() == 0 && !waitingfor.count(nodeid)) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
@@ -450,11 +513,39 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor.empty()) {
                 // This is the first already-in-flight block.
                 waitingfor = blocksInFlight.nodesWithQueued(pindex->GetBlockHash());
+                pindexWaitingFor = pindex;
             }
         }
     }
 }
 
+/** Add blocks below the UTXO snapshot base that the background validation
+ *  will need next and this peer has, until vBlocks has at most count entries. */
+void FindHistoricalBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks) {
+    AssertLockHeld(cs_main);
+    const int nValidatedHeight = BackgroundValidationHeight();
+    if (pindexSnapshotBase == NULL || nValidatedHeight < 0 || vBlocks.size() >= count)
+        return;
+
+    NodeStatePtr state(nodeid);
+    assert(!state.IsNull());
+    if (state->pindexBestKnownBlock == NULL || state->pindexBestKnownBlock->GetAncestor(pindexSnapshotBase->nHeight) != pindexSnapshotBase)
+        return;
+
+    std::vector<const CBlockIndex*> vToFetch;
+    const int nMaxHeight = std::min<int>(pindexSnapshotBase->nHeight, nValidatedHeight + BLOCK_DOWNLOAD_WINDOW);
+    for (const CBlockIndex* pindex = pindexSnapshotBase->GetAncestor(nMaxHeight); pindex->nHeight > nValidatedHeight; pindex = pindex->pprev)
+        vToFetch.push_back(pindex);
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vToFetch.rbegin(); it != vToFetch.rend(); ++it) {
+        const CBlockIndex* pindex = *it;
+        if (pindex->nStatus & BLOCK_HAVE_DATA || blocksInFlight.isInFlight(pindex->GetBlockHash()))
+            continue;
+        vBlocks.push_back(pindex);
+        if (vBlocks.size() == count)
+            return;
+    }
+}
+
 } // anon namespace
 
 /** Update tracking information about which blocks a peer is assumed to have. */
@@ -563,6 +654,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlockShare = blockDownloadScheduler.share(nodeid);
+    stats.blockDownload = blockDownloadScheduler.stats(nodeid);
     return true;
 }
 
@@ -602,93 +695,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewWriteBehind *pcoinsWriteBehind = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = GetSerializeSize(tx, SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
-    {
-        LogPrint(Log::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint(Log::MEMPOOL, "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint(Log::MEMPOOL, "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 bool ContextualCheckTransactionForNextBlock(const CTransaction &tx,
                                             CValidationState& state, int flags)
 {
@@ -833,8 +842,27 @@ bool IsCashHFEnabled(const CBlockIndex *pindexPrev) {
     return IsCashHFEnabled(pindexPrev->GetMedianTimePast());
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, CConnman* connman, bool fOverrideMempoolLimit, bool fRejectAbsurdFee)
+static unsigned int GetMempoolForkVerifyFlags(int64_t mtpChainTip)
+{
+    unsigned int forkVerifyFlags = 0;
+
+    if (IsUAHFActive(mtpChainTip)) {
+        forkVerifyFlags |= SCRIPT_ENABLE_SIGHASH_FORKID;
+    }
+
+    if (IsThirdHFActive(mtpChainTip)) {
+        forkVerifyFlags |= SCRIPT_ENABLE_MONOLITH_OPCODES;
+    }
+
+    if (IsFourthHFActive(mtpChainTip)) {
+        forkVerifyFlags |= SCRIPT_ENABLE_CHECKDATASIG;
+    }
+    return forkVerifyFlags;
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                     bool* pfMissingInputs, CConnman* connman, bool fOverrideMempoolLimit,
+                                     bool fRejectAbsurdFee, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -964,7 +992,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, lp, nSigOps);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, lp, nSigOps);
 
         FeeEvaluator feeEval(Opt().AllowFreeTx(), mempool.GetFeeModifier(),
                              ::minRelayTxFee);
@@ -995,21 +1023,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false);
         }
-
-        const int64_t mtpChainTip = chainActive.Tip()->GetMedianTimePast();
-        unsigned int forkVerifyFlags = 0;
-
-        if (IsUAHFActive(mtpChainTip)) {
-            forkVerifyFlags |= SCRIPT_ENABLE_SIGHASH_FORKID;
+        if (!pool.CheckClusterLimit(setAncestors, GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT), errString)) {
+            return state.DoS(0, false, REJECT_NONSTANDARD, "too-large-mempool-cluster", false);
         }
 
-        if (IsThirdHFActive(mtpChainTip)) {
-            forkVerifyFlags |= SCRIPT_ENABLE_MONOLITH_OPCODES;
-        }
-
-        if (IsFourthHFActive(mtpChainTip)) {
-            forkVerifyFlags |= SCRIPT_ENABLE_CHECKDATASIG;
-        }
+        const unsigned int forkVerifyFlags
+            = GetMempoolForkVerifyFlags(chainActive.Tip()->GetMedianTimePast());
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
@@ -1067,6 +1086,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, CConnman* connman, bool fOverrideMempoolLimit, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, connman,
+                                    fOverrideMempoolLimit, fRejectAbsurdFee, GetTime());
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1133,31 +1159,132 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+void SerializeBlockRecord(const CBlock& block, const CMessageHeader::MessageStartChars& messageStart, std::vector<unsigned char>& vRecord)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    vRecord.clear();
+    vRecord.reserve(BLOCK_RECORD_HEADER_SIZE + nSize);
+    CVectorWriter(SER_DISK, CLIENT_VERSION, vRecord, 0, FLATDATA(messageStart), nSize, block);
+    if (!fCompressBlocks)
+        return;
+
+    std::vector<unsigned char> vchCompressed;
+    CompressBlock(vRecord.data() + BLOCK_RECORD_HEADER_SIZE, nSize, vchCompressed);
+    if (vchCompressed.size() >= nSize)
+        return; // Stored as it is, it's smaller.
+    vRecord.resize(BLOCK_RECORD_HEADER_SIZE);
+    WriteLE32(vRecord.data() + MESSAGE_START_SIZE, vchCompressed.size() | BLOCK_COMPRESSED_FLAG);
+    vRecord.insert(vRecord.end(), vchCompressed.begin(), vchCompressed.end());
+}
+
+bool WriteBlockRecord(const std::vector<unsigned char>& vRecord, CDiskBlockPos& pos)
+{
+    // The index header and the block are written at pos in one go. The space
+    // was preallocated by FindBlockPos, and is synced with the next
+    // FlushBlockFile.
+    FILE* file = OpenBlockFile(CDiskBlockPos(pos.nFile, 0));
+    if (!file)
         return error("WriteBlockToDisk: OpenBlockFile failed");
+    const bool fWritten = WriteFileAt(file, pos.nPos, vRecord.data(), vRecord.size());
+    fclose(file);
+    if (!fWritten)
+        return error("WriteBlockToDisk: Failed to write %u bytes to blk%05u.dat at %u", vRecord.size(), pos.nFile, pos.nPos);
+    pos.nPos += BLOCK_RECORD_HEADER_SIZE;
 
-    // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, block);
-    fileout << FLATDATA(messageStart) << nSize;
+    return true;
+}
 
-    // Write block
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("WriteBlockToDisk: ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    std::vector<unsigned char> vRecord;
+    SerializeBlockRecord(block, messageStart, vRecord);
+    return WriteBlockRecord(vRecord, pos);
+}
 
+/**
+ * Read the size written ahead of the block at pos, through stdio. Blocks
+ * stored compressed have BLOCK_COMPRESSED_FLAG set in it.
+ */
+static bool ReadBlockRecordSize(const CDiskBlockPos& pos, uint32_t& nSize)
+{
+    if (pos.nPos < BLOCK_RECORD_HEADER_SIZE)
+        return false;
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        filein >> nSize;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
     return true;
 }
 
+/**
+ * Map the block file holding the block at pos, up to the end of the block,
+ * using the size written ahead of it. Returns nullptr if the file can't be
+ * mapped, for the caller to read it through stdio.
+ */
+static std::shared_ptr<const CBlockFileMaps::Mapping> MapBlockRecord(const CDiskBlockPos& pos, uint32_t& nSize, bool& fCompressed)
+{
+    if (pos.nPos < BLOCK_RECORD_HEADER_SIZE)
+        return nullptr;
+    const boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping = blockFileMaps.Get(path, pos.nPos);
+    if (!mapping)
+        return nullptr;
+    nSize = ReadLE32((const unsigned char*)mapping->pData + pos.nPos - 4);
+    fCompressed = nSize & BLOCK_COMPRESSED_FLAG;
+    nSize &= ~BLOCK_COMPRESSED_FLAG;
+    const uint64_t nEnd = pos.nPos + (uint64_t)nSize;
+    if (nEnd > mapping->nSize) {
+        // Written after the file was mapped.
+        mapping = blockFileMaps.Get(path, nEnd);
+    }
+    return mapping;
+}
+
+/**
+ * Deserialize the block at pos from a mapping of its block file. Returns
+ * false if the file can't be mapped or the record doesn't hold a block.
+ */
+static bool ReadBlockFromMapping(CBlock& block, const CDiskBlockPos& pos)
+{
+    uint32_t nSize;
+    bool fCompressed;
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping = MapBlockRecord(pos, nSize, fCompressed);
+    if (!mapping)
+        return false;
+    try {
+        if (fCompressed) {
+            std::vector<unsigned char> vchBlock;
+            if (!DecompressBlock((const unsigned char*)mapping->pData + pos.nPos, nSize, vchBlock))
+                return false;
+            CMemoryReader reader(SER_DISK, CLIENT_VERSION, (const char*)vchBlock.data(), vchBlock.size());
+            reader >> block;
+            return reader.size() == 0;
+        }
+        CMemoryReader reader(SER_DISK, CLIENT_VERSION, mapping->pData + pos.nPos, nSize);
+        reader >> block;
+        return reader.size() == 0;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
     block.SetNull();
 
+    if (ReadBlockFromMapping(block, pos)) {
+        if (!CheckProofOfWork(block.GetHash(), block.nBits, consensusParams))
+            return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
+        return true;
+    }
+    block.SetNull();
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1165,7 +1292,18 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 
     // Read block
     try {
-        filein >> block;
+        uint32_t nSize;
+        if (ReadBlockRecordSize(pos, nSize) && (nSize & BLOCK_COMPRESSED_FLAG)) {
+            std::vector<unsigned char> vchCompressed(nSize & ~BLOCK_COMPRESSED_FLAG), vchBlock;
+            filein.read((char*)vchCompressed.data(), vchCompressed.size());
+            if (!DecompressBlock(vchCompressed.data(), vchCompressed.size(), vchBlock))
+                return error("%s: Corrupt compressed block at %s", __func__, pos.ToString());
+            CMemoryReader reader(SER_DISK, CLIENT_VERSION, (const char*)vchBlock.data(), vchBlock.size());
+            reader >> block;
+        }
+        else {
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1188,6 +1326,57 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    const CDiskBlockPos pos = pindex->GetBlockPos();
+    block.clear();
+
+    uint32_t nSize;
+    bool fCompressed = false;
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping = MapBlockRecord(pos, nSize, fCompressed);
+    if (mapping) {
+        const char* pRecord = mapping->pData + pos.nPos - BLOCK_RECORD_HEADER_SIZE;
+        if (memcmp(pRecord, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        block.assign(pRecord + BLOCK_RECORD_HEADER_SIZE, pRecord + BLOCK_RECORD_HEADER_SIZE + nSize);
+    }
+    else {
+        if (pos.nPos < BLOCK_RECORD_HEADER_SIZE)
+            return error("%s: Invalid position %s", __func__, pos.ToString());
+        CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - BLOCK_RECORD_HEADER_SIZE), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+        try {
+            CMessageHeader::MessageStartChars blockStart;
+            filein >> FLATDATA(blockStart) >> nSize;
+            if (memcmp(blockStart, messageStart, MESSAGE_START_SIZE) != 0)
+                return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+            fCompressed = nSize & BLOCK_COMPRESSED_FLAG;
+            nSize &= ~BLOCK_COMPRESSED_FLAG;
+            boost::system::error_code ec;
+            const uintmax_t nFileSize = boost::filesystem::file_size(GetBlockPosFilename(pos, "blk"), ec);
+            if (ec || pos.nPos + (uint64_t)nSize > nFileSize)
+                return error("%s: Block size %u beyond the end of the file at %s", __func__, nSize, pos.ToString());
+            block.resize(nSize);
+            filein.read((char*)block.data(), nSize);
+        }
+        catch (const std::exception& e) {
+            return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    }
+    if (fCompressed) {
+        std::vector<unsigned char> vchCompressed;
+        vchCompressed.swap(block);
+        if (!DecompressBlock(vchCompressed.data(), vchCompressed.size(), block))
+            return error("%s: Corrupt compressed block at %s", __func__, pos.ToString());
+    }
+
+    // The header was checked when the block was stored.
+    if (block.size() < BLOCK_HEADER_SIZE || Hash(block.begin(), block.begin() + BLOCK_HEADER_SIZE) != pindex->GetBlockHash())
+        return error("%s: Block at %s doesn't match index for %s", __func__, pos.ToString(), pindex->ToString());
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1229,7 +1418,7 @@ bool fLargeWorkForkFound = false;
 bool fLargeWorkInvalidChainFound = false;
 CBlockIndex *pindexBestForkTip = NULL, *pindexBestForkBase = NULL;
 
-static void AlertNotify(const std::string& strMessage, bool fThread)
+void AlertNotify(const std::string& strMessage, bool fThread)
 {
     uiInterface.NotifyAlertChanged();
     std::string strCmd = GetArg("-alertnotify", "");
@@ -1510,9 +1699,21 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
-namespace {
+void CompressBlockUndo(const CBlockUndo& blockundo, std::vector<unsigned char>& vchCompressed)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockundo;
+    std::vector<unsigned char> vchLZ4;
+    LZ4Compress((const unsigned char*)ss.data(), ss.size(), vchLZ4);
+
+    // The size of the serialized data goes first.
+    vchCompressed.resize(4);
+    WriteLE32(vchCompressed.data(), ss.size());
+    vchCompressed.insert(vchCompressed.end(), vchLZ4.begin(), vchLZ4.end());
+}
 
-bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart,
+                     const std::vector<unsigned char>& vchCompressed)
 {
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1520,7 +1721,9 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
         return error("%s: OpenUndoFile failed", __func__);
 
     // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, blockundo);
+    unsigned int nSize = vchCompressed.empty()
+        ? GetSerializeSize(fileout, blockundo)
+        : vchCompressed.size() | UNDO_COMPRESSED_FLAG;
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write undo data
@@ -1528,9 +1731,12 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     if (fileOutPos < 0)
         return error("%s: ftell failed", __func__);
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
+    if (vchCompressed.empty())
+        fileout << blockundo;
+    else
+        fileout.write((const char*)vchCompressed.data(), vchCompressed.size());
 
-    // calculate & write checksum
+    // calculate & write checksum, over the uncompressed data
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
     hasher << blockundo;
@@ -1541,17 +1747,44 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // The data may still be on its way to disk.
+    if (!undoWriter.Wait())
+        return error("%s: writing undo data failed", __func__);
+
+    // Open history file to read, at the size ahead of the data that tells
+    // whether it is compressed.
+    if (pos.nPos < sizeof(unsigned int))
+        return error("%s: Invalid position", __func__);
+    CAutoFile filein(OpenUndoFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(unsigned int)), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("%s: OpenBlockFile failed", __func__);
 
     // Read block
     uint256 hashChecksum;
-    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
+    uint256 hashData;
     try {
-        verifier << hashBlock;
-        verifier >> blockundo;
+        unsigned int nSize;
+        filein >> nSize;
+        if (nSize & UNDO_COMPRESSED_FLAG) {
+            std::vector<unsigned char> vchCompressed(nSize & ~UNDO_COMPRESSED_FLAG);
+            filein.read((char*)vchCompressed.data(), vchCompressed.size());
+            // LZ4 can't do better than 255:1
+            if (vchCompressed.size() < 4 || ReadLE32(vchCompressed.data()) > (vchCompressed.size() - 4) * 255)
+                return error("%s: Invalid compressed size", __func__);
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ss.resize(ReadLE32(vchCompressed.data()));
+            if (!LZ4Decompress(vchCompressed.data() + 4, vchCompressed.size() - 4, (unsigned char*)ss.data(), ss.size()))
+                return error("%s: Decompression failed", __func__);
+            CHashVerifier<CDataStream> verifier(&ss);
+            verifier << hashBlock;
+            verifier >> blockundo;
+            hashData = verifier.GetHash();
+        } else {
+            CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
+            verifier << hashBlock;
+            verifier >> blockundo;
+            hashData = verifier.GetHash();
+        }
         filein >> hashChecksum;
     }
     catch (const std::exception& e) {
@@ -1559,12 +1792,14 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     }
 
     // Verify checksum
-    if (hashChecksum != verifier.GetHash())
+    if (hashChecksum != hashData)
         return error("%s: Checksum mismatch", __func__);
 
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1691,27 +1926,53 @@ static DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex*
     return fClean ? DisconnectResult::OK : DisconnectResult::UNCLEAN;
 }
 
+/**
+ * Sync the block and undo files written to since the last call, or, with
+ * fFinalize, truncate the last block file to what's used of it, before
+ * moving on to the next. Its sync is left to the next flush, along with
+ * the rest.
+ */
 void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
+    // Undo data is synced (and truncated) along, once written. Failures are reported by ConnectBlock and FlushStateToDisk.
+    undoWriter.Wait();
+
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
+    if (fFinalize) {
+        FILE *fileOld = OpenBlockFile(posOld);
+        if (fileOld) {
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
-    }
+            blockFileMaps.Invalidate(GetBlockPosFilename(posOld, "blk"));
+            fclose(fileOld);
+        }
 
-    fileOld = OpenUndoFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
+        fileOld = OpenUndoFile(posOld);
+        if (fileOld) {
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+            fclose(fileOld);
+        }
+        return;
+    }
+
+    // Opened for writing, committing a read-only file fails on Windows.
+    for (int nFile : setUnsyncedBlockFiles) {
+        CDiskBlockPos pos(nFile, 0);
+        FILE *file = OpenBlockFile(pos);
+        if (file) {
+            FileCommit(file);
+            fclose(file);
+        }
+
+        file = OpenUndoFile(pos);
+        if (file) {
+            FileCommit(file);
+            fclose(file);
+        }
     }
+    setUnsyncedBlockFiles.clear();
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
@@ -1723,6 +1984,121 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+typedef std::function<bool(const CTransaction&, CValidationState&)> TxCheck;
+/** A check of the item at a position, of a block's transactions or headers. */
+typedef std::function<bool(size_t, CValidationState&)> IndexCheck;
+
+/**
+ * Checks a range of positions, stopping at the first one that fails. Where
+ * it stopped and why is left in the result.
+ */
+class CRangeCheck
+{
+public:
+    struct Result {
+        bool fDone = false;
+        size_t nFailed = 0;
+        CValidationState state;
+    };
+
+private:
+    size_t nBegin;
+    size_t nEnd;
+    const IndexCheck* pcheck;
+    Result* presult;
+
+public:
+    CRangeCheck() : nBegin(0), nEnd(0), pcheck(nullptr), presult(nullptr) {}
+    CRangeCheck(size_t nBeginIn, size_t nEndIn, const IndexCheck& check, Result& result)
+        : nBegin(nBeginIn), nEnd(nEndIn), pcheck(&check), presult(&result) {}
+
+    bool operator()() {
+        presult->fDone = true;
+        for (presult->nFailed = nBegin; presult->nFailed < nEnd; ++presult->nFailed) {
+            if (!(*pcheck)(presult->nFailed, presult->state))
+                return false;
+        }
+        return true;
+    }
+
+    void swap(CRangeCheck& check) {
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(pcheck, check.pcheck);
+        std::swap(presult, check.presult);
+    }
+};
+
+static CCheckQueue<CRangeCheck> blockcheckqueue(1);
+// Blocks and headers are checked outside of cs_main, by more than one thread.
+static std::mutex csBlockCheckQueue;
+
+void ThreadBlockCheck() {
+    RenameThread("bitcoin-blockch");
+    blockcheckqueue.Thread();
+}
+
+/**
+ * Run check on positions 0 to nCount. Returns the first one that fails, with
+ * state set by it, or nCount if none does.
+ *
+ * Large counts are checked in ranges on the block check threads. The result
+ * is the same as when checking in order: once a range fails the queue skips
+ * those not started yet, the ones before the failure are checked here.
+ */
+static size_t CheckRanges(size_t nCount, CValidationState& state, const IndexCheck& check)
+{
+    static const size_t RANGE_SIZE = 256;
+
+    std::unique_lock<std::mutex> lock(csBlockCheckQueue, std::try_to_lock);
+    if (!lock.owns_lock() || Opt().ScriptCheckThreads() == 0 || nCount < 2 * RANGE_SIZE) {
+        for (size_t i = 0; i < nCount; ++i) {
+            if (!check(i, state))
+                return i;
+        }
+        return nCount;
+    }
+
+    const size_t nRanges = (nCount + RANGE_SIZE - 1) / RANGE_SIZE;
+    std::vector<CRangeCheck::Result> vResults(nRanges);
+    {
+        CCheckQueueControl<CRangeCheck> control(&blockcheckqueue);
+        std::vector<CRangeCheck> vChecks;
+        vChecks.reserve(nRanges);
+        for (size_t n = 0; n < nRanges; ++n) {
+            vChecks.emplace_back(n * RANGE_SIZE, std::min(nCount, (n + 1) * RANGE_SIZE), check, vResults[n]);
+        }
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    for (size_t n = 0; n < nRanges; ++n) {
+        const size_t nEnd = std::min(nCount, (n + 1) * RANGE_SIZE);
+        if (!vResults[n].fDone) {
+            for (size_t i = n * RANGE_SIZE; i < nEnd; ++i) {
+                if (!check(i, state))
+                    return i;
+            }
+        } else if (vResults[n].nFailed < nEnd) {
+            state = vResults[n].state;
+            return vResults[n].nFailed;
+        }
+    }
+    return nCount;
+}
+
+/**
+ * Run check on each of the transactions in vtx. Returns the index of the
+ * first one that fails, with state set by it, or vtx.size() if none does.
+ */
+static size_t CheckBlockTransactions(const std::vector<CTransaction>& vtx, CValidationState& state, const TxCheck& check)
+{
+    const IndexCheck checkIndex = [&vtx, &check](size_t i, CValidationState& stateTx) {
+        return check(vtx[i], stateTx);
+    };
+    return CheckRanges(vtx.size(), state, checkIndex);
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1826,7 +2202,8 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck,
+                  std::vector<CScriptCheck>* pvChecks)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -1948,7 +2325,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && Opt().ScriptCheckThreads() ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && !pvChecks && Opt().ScriptCheckThreads() ? &scriptcheckqueue : NULL);
 
     std::vector<int> prevheights;
 
@@ -2025,12 +2402,19 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
         static auto nScriptCheckThreads = Opt().ScriptCheckThreads();
         if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults,
-                         PrecomputedTransactionData(tx), nScriptCheckThreads ? &vChecks : NULL))
+                         PrecomputedTransactionData(tx), nScriptCheckThreads || pvChecks ? &vChecks : NULL))
         {
             return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
         }
-        control.Add(vChecks);
+        if (pvChecks) {
+            for (CScriptCheck& check : vChecks) {
+                pvChecks->emplace_back();
+                pvChecks->back().swap(check);
+            }
+        } else {
+            control.Add(vChecks);
+        }
 
         blockundo.vtxundo.push_back(CTxUndo());
         SpendCoins(view, tx, blockundo.vtxundo.back(), pindex->nHeight);
@@ -2062,14 +2446,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
     {
         if (pindex->GetUndoPos().IsNull()) {
+            // Compressing is done here, as the space is reserved for what's written.
+            std::vector<unsigned char> vchCompressed;
+            if (fCompressUndo)
+                CompressBlockUndo(blockundo, vchCompressed);
+            const unsigned int nUndoSize = vchCompressed.empty()
+                ? ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION)
+                : vchCompressed.size();
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            if (!FindUndoPos(state, pindex->nFile, pos, nUndoSize + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!UndoWriteToDisk(blockundo, pos, pindex->pprev->GetBlockHash(), chainparams.DBMagic()))
+            if (!undoWriter.Write(std::move(blockundo), std::move(vchCompressed), pos, pindex->pprev->GetBlockHash()))
                 return AbortNode(state, "Failed to write undo data");
 
-            // update nUndoPos in block index
-            pindex->nUndoPos = pos.nPos;
+            // update nUndoPos in block index, the data goes after the header
+            pindex->nUndoPos = pos.nPos + UNDO_HEADER_SIZE;
             pindex->nStatus |= BLOCK_HAVE_UNDO;
         }
 
@@ -2105,6 +2496,24 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/** Progress of the chain state rebuild ReindexChainState does. Guarded by cs_main. */
+static struct {
+    bool fActive = false;
+    int nStartHeight = 0;
+    int nTargetHeight = 0;
+    int64_t nStartTime = 0;
+    int64_t nLastLogTime = 0;
+    int nLastLogHeight = 0;
+} bulkLoad;
+
+/** Memory the coins cache may use. The mempool isn't used while bulk loading, its memory goes to the cache. */
+static size_t CoinCacheLimit()
+{
+    if (bulkLoad.fActive)
+        return nCoinCacheUsage + GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    return nCoinCacheUsage;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -2141,11 +2550,15 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // Coins still being written in the background count towards the limit.
+    // Free blocks of the cache's node pool don't, they are filled before the
+    // pool grows, so what it holds stays within a chunk of the limit.
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() - pcoinsTip->PoolFreeMemoryUsage() + (pcoinsWriteBehind ? pcoinsWriteBehind->DynamicMemoryUsage() : 0);
+    const size_t cacheLimit = CoinCacheLimit();
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > cacheLimit;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > cacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -2158,6 +2571,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(0))
             return state.Error("out of disk space");
         // First make sure all block and undo data is flushed to disk.
+        if (!undoWriter.Wait())
+            return AbortNode(state, "Failed to write undo data");
         FlushBlockFile();
         // Then update all block file information (which may refer to block and undo files).
         {
@@ -2180,6 +2595,9 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Finally remove any pruned files
         if (fFlushForPrune)
             UnlinkPrunedFiles(setFilesToPrune);
+        // They're removed in the background, except on the final flush.
+        if (mode == FLUSH_STATE_ALWAYS)
+            prunedFileRemover.Wait();
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2192,8 +2610,26 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Only modified coins are written, the rest of the cache stays warm.
+        if (!pcoinsTip->Sync())
             return AbortNode(state, "Failed to write to coin database");
+        // Validation can continue while the coins are written in the
+        // background, unless we're shutting down or about to delete
+        // block files the chainstate may still need.
+        if (pcoinsWriteBehind && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune)) {
+            if (!pcoinsWriteBehind->WaitForWrite())
+                return AbortNode(state, "Failed to write to coin database");
+        }
+        if (fCacheLarge || fCacheCritical) {
+            // Sync copied the modified coins to the write in flight, leave
+            // room for them until they are written. They remain readable
+            // through pcoinsWriteBehind once evicted from the cache.
+            const size_t nTrimTarget = cacheLimit / 100 * COINS_CACHE_TRIM_PERCENT;
+            const size_t nWriting = pcoinsWriteBehind ? pcoinsWriteBehind->DynamicMemoryUsage() : 0;
+            size_t nEvicted = pcoinsTip->Trim(nTrimTarget > nWriting ? nTrimTarget - nWriting : 0);
+            LogPrint(Log::COINDB, "Evicted %u unmodified coins from cache, %.1f MiB left, %.1f MiB being written\n",
+                     nEvicted, pcoinsTip->DynamicMemoryUsage() * (1.0 / 1048576.0), nWriting * (1.0 / 1048576.0));
+        }
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2218,6 +2654,22 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+/** Log the progress of a bulk load, every few seconds instead of every block. */
+static void LogBulkLoadProgress()
+{
+    const int64_t nNow = GetTimeMillis();
+    const int nHeight = chainActive.Height();
+    if (nNow < bulkLoad.nLastLogTime + 10 * 1000 && nHeight < bulkLoad.nTargetHeight)
+        return;
+    const double nBlocksPerSecond = (nHeight - bulkLoad.nLastLogHeight) * 1000.0 / std::max<int64_t>(nNow - bulkLoad.nLastLogTime, 1);
+    LogPrintf("Reindexing chain state: height=%d of %d (%.1f%%)  %.1f blocks/s  date=%s  cache=%.1fMiB(%utxo)\n",
+        nHeight, bulkLoad.nTargetHeight, bulkLoad.nTargetHeight ? nHeight * 100.0 / bulkLoad.nTargetHeight : 100.0,
+        nBlocksPerSecond, DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
+        pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+    bulkLoad.nLastLogTime = nNow;
+    bulkLoad.nLastLogHeight = nHeight;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
@@ -2227,10 +2679,14 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n", __func__,
-      chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
-      DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+    if (bulkLoad.fActive) {
+        LogBulkLoadProgress();
+    } else {
+        LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n", __func__,
+          chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
+          DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
+          Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+    }
 
     cvBlockChange.notify_all();
 
@@ -2248,8 +2704,85 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     }
 }
 
-/** Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and manually re-limit mempool size after this, with cs_main held. */
-bool static DisconnectTip(CValidationState &state) {
+DisconnectedTransactions::DisconnectedTransactions()
+    : nMaxSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000), nSize(0)
+{
+}
+
+void DisconnectedTransactions::AddBlock(const CBlock& block)
+{
+    blocks.push_back(block.vtx);
+    nSize += ::GetSerializeSize(block.vtx, SER_NETWORK, PROTOCOL_VERSION);
+    while (nSize > nMaxSize && blocks.size() > 1) {
+        // The transactions of the block nearest the old tip won't return,
+        // and neither can those in the mempool that spend them.
+        for (const CTransaction& tx : blocks.front()) {
+            list<CTransaction> removed;
+            mempool.removeRecursive(tx, removed);
+        }
+        nSize -= ::GetSerializeSize(blocks.front(), SER_NETWORK, PROTOCOL_VERSION);
+        blocks.pop_front();
+    }
+}
+
+void DisconnectedTransactions::RemoveForBlock(const std::vector<CTransaction>& vtx)
+{
+    if (blocks.empty())
+        return;
+    for (const CTransaction& tx : vtx)
+        setConfirmed.insert(tx.GetHash());
+}
+
+void DisconnectedTransactions::UpdateMempool()
+{
+    std::vector<uint256> vHashUpdate;
+    for (auto vtx = blocks.rbegin(); vtx != blocks.rend(); ++vtx) {
+        for (const CTransaction &tx : SortByParentsFirst(begin(*vtx), end(*vtx))) {
+            if (setConfirmed.count(tx.GetHash()))
+                continue;
+            // ignore validation errors in resurrected transactions
+            list<CTransaction> removed;
+            CValidationState stateDummy;
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, nullptr, true)) {
+                mempool.removeRecursive(tx, removed);
+            } else if (mempool.exists(tx.GetHash())) {
+                vHashUpdate.push_back(tx.GetHash());
+            }
+        }
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in
+    // these blocks that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate, GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT));
+    blocks.clear();
+    setConfirmed.clear();
+    nSize = 0;
+}
+
+/**
+ * Write the chain state changes in viewChain to disk, if necessary. During a
+ * reorg viewChain is a cache of its own on top of pcoinsTip, which is only
+ * flushed to it when done (fReorgDone) or when it grows large.
+ */
+static bool FlushChainView(CValidationState& state, CCoinsViewCache& viewChain, bool fReorgDone = false)
+{
+    if (&viewChain != pcoinsTip) {
+        if (!fReorgDone && viewChain.DynamicMemoryUsage() < CoinCacheLimit() / 4)
+            return true;
+        assert(viewChain.Flush());
+    }
+    return FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED);
+}
+
+/**
+ * Disconnect chainActive's tip, updating the chain state in viewChain. Its
+ * transactions are added to disconnected, to be returned to the mempool. You
+ * probably want to call mempool.removeForReorg and manually re-limit mempool
+ * size after that, with cs_main held.
+ */
+bool static DisconnectTip(CValidationState &state, CCoinsViewCache& viewChain, DisconnectedTransactions& disconnected) {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
     // Read block from disk.
@@ -2259,7 +2792,7 @@ bool static DisconnectTip(CValidationState &state) {
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
-        CCoinsViewCache view(pcoinsTip);
+        CCoinsViewCache view(&viewChain);
         assert(view.GetBestBlock() == pindexDelete->GetBlockHash());
         if (DisconnectBlock(block, pindexDelete, view) != DisconnectResult::OK)
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
@@ -2267,26 +2800,9 @@ bool static DisconnectTip(CValidationState &state) {
     }
     LogPrint(Log::BENCH, "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
+    if (!FlushChainView(state, viewChain))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    std::vector<uint256> vHashUpdate;
-    for (const CTransaction &tx : SortByParentsFirst(begin(block.vtx), end(block.vtx))) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, nullptr, true)) {
-            mempool.removeRecursive(tx, removed);
-        } else if (mempool.exists(tx.GetHash())) {
-            vHashUpdate.push_back(tx.GetHash());
-        }
-    }
-    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
-    // no in-mempool children, which is generally not true when adding
-    // previously-confirmed transactions back to the mempool.
-    // UpdateTransactionsFromBlock finds descendants of any transactions in this
-    // block that were added back and cleans up the mempool state.
-    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    disconnected.AddBlock(block);
 
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
@@ -2305,11 +2821,14 @@ static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
 /**
- * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
- * corresponding to pindexNew, to bypass loading it again from disk.
+ * Connect a new block to chainActive, updating the chain state in viewChain.
+ * Its transactions won't return to the mempool with disconnected ones.
+ * pblock is either NULL or a pointer to a CBlock corresponding to pindexNew,
+ * to bypass loading it again from disk.
  */
 bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew,
-        CBlock *pblock, const BlockSource& blockSource) {
+        CBlock *pblock, const BlockSource& blockSource, CCoinsViewCache& viewChain,
+        DisconnectedTransactions& disconnected) {
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
@@ -2324,7 +2843,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew,
     int64_t nTime3;
     LogPrint(Log::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
-        CCoinsViewCache view(pcoinsTip);
+        CCoinsViewCache view(&viewChain);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
         GetMainSignals().BlockChecked(*pblock, state);
@@ -2340,13 +2859,18 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew,
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint(Log::BENCH, "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
+    if (!FlushChainView(state, viewChain))
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint(Log::BENCH, "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
+    disconnected.RemoveForBlock(pblock->vtx);
+    // Orphans that were waiting for transactions in this block are re-admitted
+    // in a batch once we're done connecting blocks.
+    orphanpool.EraseForBlock(pblock->vtx);
+    orphanpool.QueueChildren(pblock->vtx);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
@@ -2444,12 +2968,30 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexOldTip = chainActive.Tip();
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
+    // A reorg disconnects and connects blocks on a cache of its own, which is
+    // flushed to pcoinsTip once done. The disconnected transactions return to
+    // the mempool after the new chain is connected.
+    std::unique_ptr<CCoinsViewCache> viewReorg;
+    if (chainActive.Tip() && chainActive.Tip() != pindexFork)
+        viewReorg.reset(new CCoinsViewCache(pcoinsTip));
+    CCoinsViewCache& viewChain = viewReorg ? *viewReorg : *pcoinsTip;
+    DisconnectedTransactions disconnected;
+    auto finishReorg = [&]() {
+        if (!viewReorg)
+            return true;
+        bool fOk = FlushChainView(state, viewChain, true);
+        disconnected.UpdateMempool();
+        mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+        mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        return fOk;
+    };
+
     // Disconnect active blocks which are no longer in the best chain.
-    bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
+        if (!DisconnectTip(state, viewChain, disconnected)) {
+            finishReorg();
             return false;
-        fBlocksDisconnected = true;
+        }
     }
 
     // Build list of new blocks to connect.
@@ -2472,7 +3014,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
             CBlock* mostWork = pindexConnect == pindexMostWork ? pblock : nullptr;
-            if (!ConnectTip(state, pindexConnect, mostWork, blockSource)) {
+            if (!ConnectTip(state, pindexConnect, mostWork, blockSource, viewChain, disconnected)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -2483,6 +3025,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    finishReorg();
                     return false;
                 }
             } else {
@@ -2496,10 +3039,8 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
         }
     }
 
-    if (fBlocksDisconnected) {
-        mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
-        mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
-    }
+    if (!finishReorg())
+        return false;
     mempool.check(pcoinsTip);
 
     // Callbacks/notifications for a new best chain.
@@ -2589,6 +3130,11 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock, const BlockSourc
     } while(pindexNewTip != pindexMostWork);
     CheckBlockIndex();
 
+    {
+        LOCK(cs_main);
+        ProcessOrphans(orphanpool.TakeQueued(), connman);
+    }
+
     // Write changes periodically to disk, after relay.
     if (!FlushStateToDisk(state, FLUSH_STATE_PERIODIC)) {
         return false;
@@ -2597,6 +3143,33 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock, const BlockSourc
     return true;
 }
 
+bool ReindexChainState(CValidationState &state)
+{
+    {
+        LOCK(cs_main);
+        CBlockIndex *pindexMostWork = FindMostWorkChain();
+        bulkLoad.fActive = true;
+        bulkLoad.nStartHeight = bulkLoad.nLastLogHeight = chainActive.Height();
+        bulkLoad.nTargetHeight = pindexMostWork ? pindexMostWork->nHeight : chainActive.Height();
+        bulkLoad.nStartTime = bulkLoad.nLastLogTime = GetTimeMillis();
+        LogPrintf("Reindexing chain state from height %d to %d, with up to %.1fMiB of coins cache\n",
+            bulkLoad.nStartHeight, bulkLoad.nTargetHeight, CoinCacheLimit() * (1.0 / (1<<20)));
+    }
+    bool fOk = ActivateBestChain(state);
+
+    LOCK(cs_main);
+    bulkLoad.fActive = false;
+    const double nSeconds = std::max<int64_t>(GetTimeMillis() - bulkLoad.nStartTime, 1) * 0.001;
+    const int nBlocks = chainActive.Height() - bulkLoad.nStartHeight;
+    LogPrintf("Reindexing chain state %s: %d blocks in %.1fs (%.1f blocks/s)\n", fOk ? "done" : "failed",
+        nBlocks, nSeconds, nBlocks / nSeconds);
+    // Write everything out, and shrink the cache back to its usual size.
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return false;
+    pcoinsTip->Trim(nCoinCacheUsage / 100 * COINS_CACHE_TRIM_PERCENT);
+    return fOk;
+}
+
 bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     AssertLockHeld(cs_main);
 
@@ -2605,6 +3178,7 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    DisconnectedTransactions disconnected;
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -2612,12 +3186,14 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTip(state, *pcoinsTip, disconnected)) {
+            disconnected.UpdateMempool();
             mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
             return false;
         }
     }
 
+    disconnected.UpdateMempool();
     mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
@@ -2668,16 +3244,15 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex) {
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+static CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256& hash)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
+    CBlockIndex* pindexNew = blockIndexArena.New(block);
     assert(pindexNew);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
@@ -2702,45 +3277,78 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     return pindexNew;
 }
 
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+{
+    return AddToBlockIndex(block, block.GetHash());
+}
+
+/**
+ * Set nChainTx of pindexNew, whose parents all have it set, and of the
+ * descendants in mapBlocksUnlinked that were only waiting for it.
+ */
+static void LinkBlockTransactions(CBlockIndex *pindexNew)
+{
+    deque<CBlockIndex*> queue;
+    queue.push_back(pindexNew);
+
+    // Recursively process any descendant blocks that now may be eligible to be connected.
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        if (pindex == pindexSnapshotBase)
+            pindex->nChainTx = nSnapshotChainTx;
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        pindex->nMaxBlockSize = GetNextMaxBlockSize(pindex->pprev, Params().GetConsensus());
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
+static void AddToBlockFileIndex(CBlockIndex* pindex)
+{
+    if (vBlocksInFile.size() <= (size_t)pindex->nFile)
+        vBlocksInFile.resize(pindex->nFile + 1);
+    vBlocksInFile[pindex->nFile].push_back(pindex);
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
+    // Blocks below a UTXO snapshot are linked already, with a placeholder
+    // transaction count. Replace it; the chain's count, that descendants'
+    // counts are based on, stays as it is until the block index is loaded
+    // again.
+    const bool fLinked = pindexNew->nChainTx != 0;
     pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainTx = 0;
+    if (!fLinked)
+        pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
+    AddToBlockFileIndex(pindexNew);
     pindexNew->nMaxBlockSizeVote = GetMaxBlockSizeVote(block.vtx[0].vin[0].scriptSig, pindexNew->nHeight);
     pindexNew->nStatus |= BLOCK_HAVE_DATA;
     pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
     setDirtyBlockIndex.insert(pindexNew);
 
+    if (fLinked)
+        return true;
+
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
-        deque<CBlockIndex*> queue;
-        queue.push_back(pindexNew);
-
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex *pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            {
-                LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            pindex->nMaxBlockSize = GetNextMaxBlockSize(pindex->pprev, Params().GetConsensus());
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
-            }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
-            while (range.first != range.second) {
-                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
-                range.first++;
-                mapBlocksUnlinked.erase(it);
-            }
-        }
+        LinkBlockTransactions(pindexNew);
     } else {
         if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
             mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
@@ -2750,6 +3358,51 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     return true;
 }
 
+bool ActivateUTXOSnapshot(CValidationState &state, CBlockIndex *pindexBase, uint64_t nChainTx, const uint256 &hashCommit)
+{
+    AssertLockHeld(cs_main);
+    assert(chainActive.Height() == 0);
+    assert(pcoinsTip->GetBestBlock() == pindexBase->GetBlockHash());
+
+    std::vector<CBlockIndex*> vPath;
+    for (CBlockIndex *pindex = pindexBase; pindex->pprev; pindex = pindex->pprev)
+        vPath.push_back(pindex);
+
+    // The snapshot stands in for validating the blocks up to its base. Blocks
+    // without data get a placeholder transaction count, and are queued in
+    // mapBlocksUnlinked as if they had it, so that they get linked along with
+    // the rest. The count for the chain up to the base is the snapshot's.
+    pindexSnapshotBase = pindexBase;
+    nSnapshotChainTx = std::max<uint64_t>(nChainTx, pindexBase->nHeight + 1);
+    CBlockIndex *pindexFirstUnlinked = NULL;
+    for (std::vector<CBlockIndex*>::reverse_iterator it = vPath.rbegin(); it != vPath.rend(); ++it) {
+        CBlockIndex *pindex = *it;
+        if (pindex->nTx == 0)
+            pindex->nTx = 1;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+        if (pindex->nChainTx)
+            continue;
+        if (pindexFirstUnlinked == NULL)
+            pindexFirstUnlinked = pindex;
+        else if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
+    }
+    if (pindexFirstUnlinked)
+        LinkBlockTransactions(pindexFirstUnlinked);
+    assert(pindexBase->nChainTx);
+
+    mempool.clear();
+    UpdateTip(pindexBase);
+    PruneBlockIndexCandidates();
+    LogPrintf("%s: chain state loaded from UTXO snapshot at height %d, commitment %s\n", __func__,
+        pindexBase->nHeight, hashCommit.GetHex());
+    if (!pblocktree->WriteSnapshotBase(pindexBase->GetBlockHash(), hashCommit, nSnapshotChainTx)
+            || !pblocktree->WriteFlag("snapshotvalidated", false) || !pblocktree->WriteFlag("snapshotinvalid", false))
+        return AbortNode(state, "Failed to write snapshot base");
+    return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
 bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
 {
     LOCK(cs_LastBlockFile);
@@ -2771,9 +3424,12 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         }
         pos.nFile = nFile;
         pos.nPos = vinfoBlockFile[nFile].nSize;
+        setUnsyncedBlockFiles.insert(nFile);
     }
 
-    nLastBlockFile = nFile;
+    // Blocks stored already (-reindex) come in any order of files, and
+    // there's nothing of theirs to sync.
+    nLastBlockFile = fKnown ? std::max<int>(nLastBlockFile, nFile) : nFile;
     vinfoBlockFile[nFile].AddBlock(nHeight, nTime);
     if (fKnown)
         vinfoBlockFile[nFile].nSize = std::max(pos.nPos + nAddSize, vinfoBlockFile[nFile].nSize);
@@ -2813,6 +3469,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     pos.nPos = vinfoBlockFile[nFile].nUndoSize;
     nNewSize = vinfoBlockFile[nFile].nUndoSize += nAddSize;
     setDirtyFileInfo.insert(nFile);
+    setUnsyncedBlockFiles.insert(nFile);
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -2834,10 +3491,10 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+static bool CheckBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus()))
+    if (fCheckPOW && !CheckProofOfWork(hash, block.nBits, Params().GetConsensus()))
         return state.DoS(50, error("CheckBlockHeader(): proof of work failed"),
                          REJECT_INVALID, "high-hash");
 
@@ -2849,6 +3506,36 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+{
+    return CheckBlockHeader(block, fCheckPOW ? block.GetHash() : uint256(), state, fCheckPOW);
+}
+
+size_t CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vHash, CValidationState& state)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    // Hash the headers and check their proof of work, in ranges on the block
+    // check threads for a full headers message.
+    vHash.resize(headers.size());
+    std::vector<char> vPowValid(headers.size());
+    const IndexCheck hashAndCheckPow = [&](size_t i, CValidationState&) {
+        vHash[i] = headers[i].GetHash();
+        vPowValid[i] = CheckProofOfWork(vHash[i], headers[i].nBits, consensusParams);
+        return true;
+    };
+    CValidationState stateHash;
+    CheckRanges(headers.size(), stateHash, hashAndCheckPow);
+
+    // The rest of the checks, in order, for the first failure to be reported.
+    // Failed proofs of work are checked again to set state.
+    for (size_t i = 0; i < headers.size(); ++i) {
+        if (!CheckBlockHeader(headers[i], vHash[i], state, !vPowValid[i]))
+            return i;
+    }
+    return headers.size();
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
@@ -2892,26 +3579,26 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                              REJECT_INVALID, "bad-cb-multiple");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock(): CheckTransaction failed");
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-    {
+    std::atomic<unsigned int> nSigOps(0);
+    const size_t nFailed = CheckBlockTransactions(block.vtx, state, [&nSigOps](const CTransaction& tx, CValidationState& stateCheck) {
+        if (!CheckTransaction(tx, stateCheck))
+            return false;
         nSigOps += GetLegacySigOpCount(tx, STANDARD_SCRIPT_VERIFY_FLAGS);
-    }
+        return true;
+    });
+    if (nFailed != block.vtx.size())
+        return error("CheckBlock(): CheckTransaction failed");
+
     if (nSigOps > MaxBlockSigops(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)))
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"), REJECT_INVALID, "bad-blk-sigops", true);
 
     return true;
 }
 
-bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex * const pindexPrev)
+static bool ContextualCheckBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, CBlockIndex * const pindexPrev)
 {
     const CChainParams& chainParams = Params();
     const Consensus::Params& consensusParams = chainParams.GetConsensus();
-    uint256 hash = block.GetHash();
     if (hash == consensusParams.hashGenesisBlock)
         return true;
 
@@ -2953,6 +3640,11 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     return true;
 }
 
+bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex * const pindexPrev)
+{
+    return ContextualCheckBlockHeader(block, block.GetHash(), state, pindexPrev);
+}
+
 bool ContextualCheckTransaction(const CTransaction &tx, CValidationState &state, int nHeight,
                                 int64_t nLockTimeCutoff, int64_t nMedianTimePastPrev) {
     if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
@@ -3013,10 +3705,24 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
     const bool isLTOREnabled = IsFourthHFActive(nMedianTimePastPrev);
 
-    // Check that all transactions are finalized
-    const CTransaction *prevTx = nullptr;
-    for (const auto& tx : block.vtx) {
-        if (isLTOREnabled) {
+    // Check that all transactions are finalized, and count the sigops of
+    // the block in the same pass.
+    std::atomic<uint32_t> nSigOps(0);
+    CValidationState stateTx;
+    const size_t nFailed = CheckBlockTransactions(block.vtx, stateTx, [&](const CTransaction& tx, CValidationState& stateCheck) {
+        if (!ContextualCheckTransaction(tx, stateCheck, nHeight, nLockTimeCutoff, nMedianTimePastPrev))
+            return false;
+        if (isLTOREnabled)
+            nSigOps += GetLegacySigOpCount(tx, STANDARD_CHECKDATASIG_VERIFY_FLAGS);
+        return true;
+    });
+
+    // Check the transaction order, up to the transaction that failed above:
+    // the first error in block order is reported.
+    if (isLTOREnabled) {
+        const CTransaction *prevTx = nullptr;
+        for (size_t i = 0; i < block.vtx.size() && i <= nFailed; ++i) {
+            const CTransaction& tx = block.vtx[i];
             if (prevTx && (tx.GetHash() < prevTx->GetHash())) {
                 return state.DoS(
                     100, false, REJECT_INVALID, "tx-ordering", false,
@@ -3029,11 +3735,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
                 prevTx = &tx;
             }
         }
-
-        if (!ContextualCheckTransaction(tx, state, nHeight, nLockTimeCutoff, nMedianTimePastPrev)) {
-            // state set by ContextualCheckTransaction.
-            return false;
-        }
+    }
+    if (nFailed != block.vtx.size()) {
+        // state set by ContextualCheckTransaction.
+        state = stateTx;
+        return false;
     }
 
     // Enforce rule that the coinbase starts with serialized block height
@@ -3048,11 +3754,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
     // Enforce CDSV sigop count after fork activation.  TODO: Remove either
     // this, or sigop counting in CheckBlock after fork is buried.
-    if (IsFourthHFActive(nMedianTimePastPrev)) {
-        uint32_t nSigOps = 0;
-        for (const CTransaction& tx : block.vtx) {
-            nSigOps += GetLegacySigOpCount(tx, STANDARD_CHECKDATASIG_VERIFY_FLAGS);
-        }
+    if (isLTOREnabled) {
         if (nSigOps > MaxBlockSigops(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)))
             return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"), REJECT_INVALID, "bad-blk-sigops", true);
     }
@@ -3060,12 +3762,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+static bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, CBlockIndex** ppindex, bool fCheckHeader)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (miSelf != mapBlockIndex.end()) {
@@ -3078,7 +3779,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (fCheckHeader && !CheckBlockHeader(block, hash, state, true))
         return false;
 
     // Get prev block index
@@ -3092,11 +3793,11 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
             return state.DoS(100, error("%s: prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
     }
 
-    if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+    if (!ContextualCheckBlockHeader(block, hash, state, pindexPrev))
         return false;
 
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3104,6 +3805,16 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
     return true;
 }
 
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+{
+    return AcceptBlockHeader(block, block.GetHash(), state, ppindex, true);
+}
+
+bool AcceptCheckedBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, CBlockIndex** ppindex)
+{
+    return AcceptBlockHeader(block, hash, state, ppindex, false);
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp)
 {
     const CChainParams& chainparams = Params();
@@ -3161,14 +3872,26 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        std::vector<unsigned char> vRecord;
+        unsigned int nRecordSize;
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
+            // Stored already, compressed or not.
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL))
+            uint32_t nSize;
+            if (ReadBlockRecordSize(blockPos, nSize))
+                nRecordSize = BLOCK_RECORD_HEADER_SIZE + (nSize & ~BLOCK_COMPRESSED_FLAG);
+            else
+                nRecordSize = BLOCK_RECORD_HEADER_SIZE + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        }
+        else {
+            SerializeBlockRecord(block, chainparams.DBMagic(), vRecord);
+            nRecordSize = vRecord.size();
+        }
+        if (!FindBlockPos(state, blockPos, nRecordSize, nHeight, block.GetBlockTime(), dbp != NULL))
             return error("AcceptBlock(): FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos, chainparams.DBMagic()))
+            if (!WriteBlockRecord(vRecord, blockPos))
                 AbortNode(state, "Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
@@ -3190,7 +3913,7 @@ bool ProcessNewBlock(CValidationState &state, const BlockSource& from,
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), from.nodes);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3252,9 +3975,10 @@ uint64_t CalculateCurrentUsage()
 /* Prune a block file (modify associated database entries)*/
 void PruneOneBlockFile(const int fileNumber)
 {
-    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
-        CBlockIndex* pindex = it->second;
-        if (pindex->nFile == fileNumber) {
+    if ((size_t)fileNumber >= vBlocksInFile.size())
+        vBlocksInFile.resize(fileNumber + 1);
+    for (CBlockIndex* pindex : vBlocksInFile[fileNumber]) {
+        if (pindex->nFile == fileNumber && (pindex->nStatus & BLOCK_HAVE_MASK)) {
             pindex->nStatus &= ~BLOCK_HAVE_DATA;
             pindex->nStatus &= ~BLOCK_HAVE_UNDO;
             pindex->nFile = 0;
@@ -3277,6 +4001,8 @@ void PruneOneBlockFile(const int fileNumber)
         }
     }
 
+    std::vector<CBlockIndex*>().swap(vBlocksInFile[fileNumber]);
+
     vinfoBlockFile[fileNumber].SetNull();
     setDirtyFileInfo.insert(fileNumber);
 }
@@ -3284,12 +4010,18 @@ void PruneOneBlockFile(const int fileNumber)
 
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
+    LOCK(cs_LastBlockFile);
+    std::vector<boost::filesystem::path> paths;
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
-        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
-        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
-        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
-    }
+        setUnsyncedBlockFiles.erase(*it);
+        blockFileMaps.Invalidate(GetBlockPosFilename(pos, "blk"));
+        paths.push_back(GetBlockPosFilename(pos, "blk"));
+        paths.push_back(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleting blk/rev (%05u)\n", __func__, *it);
+    }
+    // Nothing refers to the files anymore, removing them can be left to a thread of its own.
+    prunedFileRemover.Remove(std::move(paths));
 }
 
 /* Calculate the block/rev files that should be deleted to remain under target*/
@@ -3311,6 +4043,8 @@ void FindFilesToPrune(std::set<int>& setFilesToPrune)
     uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
     uint64_t nBytesToPrune;
     int count=0;
+    // Blocks below a UTXO snapshot are needed until the snapshot is known to be valid.
+    const bool fKeepSnapshotBlocks = pindexSnapshotBase && !IsSnapshotValidated();
 
     if (nCurrentUsage + nBuffer >= nPruneTarget) {
         for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
@@ -3326,6 +4060,10 @@ void FindFilesToPrune(std::set<int>& setFilesToPrune)
             if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
                 continue;
 
+            // nor files with blocks below a UTXO snapshot that is still to be validated
+            if (fKeepSnapshotBlocks && vinfoBlockFile[fileNumber].nHeightFirst <= (unsigned int)pindexSnapshotBase->nHeight)
+                continue;
+
             PruneOneBlockFile(fileNumber);
             // Queue up the files for removal
             setFilesToPrune.insert(fileNumber);
@@ -3397,33 +4135,128 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    // Create new
+    CBlockIndex* pindexNew = blockIndexArena.New();
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+
+    return pindexNew;
+}
+
+/**
+ * Identifies the block tree database state a block index snapshot was taken
+ * of. Every write of the index counts, the last block file's info is there
+ * for writes by versions that don't count them.
+ */
+static uint256 BlockIndexSnapshotState()
+{
+    LOCK(cs_LastBlockFile);
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << pblocktree->GetIndexGeneration() << nLastBlockFile << vinfoBlockFile[nLastBlockFile];
+    return ss.GetHash();
+}
+
+/**
+ * Load the block index from the snapshot written on the last shutdown, if
+ * it's still current. The snapshot is removed either way, as the index
+ * changes from here on.
+ */
+static bool LoadBlockIndexSnapshot(vector<pair<int, CBlockIndex*> >& vSortedByHeight)
+{
+    const boost::filesystem::path path = GetDataDir() / BLOCK_INDEX_SNAPSHOT_FILENAME;
+    if (!boost::filesystem::exists(path))
+        return false;
+    CBlockIndexSnapshot snapshot;
+    const bool fRead = fBlockIndexSnapshot && snapshot.Read(path, BlockIndexSnapshotState());
+    boost::filesystem::remove(path);
+    if (!fRead)
+        return false;
+
+    mapBlockIndex.reserve(snapshot.size());
+    blockIndexArena.Reserve(snapshot.size());
+    vector<CBlockIndex*> vEntries;
+    if (!snapshot.Load(InsertBlockIndex, vEntries)) {
+        mapBlockIndex.clear();
+        blockIndexArena.Clear();
+        return false;
+    }
+    // Stored parents first, in height order.
+    vSortedByHeight.reserve(vEntries.size());
+    for (CBlockIndex* pindex : vEntries)
+        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    LogPrintf("%s: loaded %u entries\n", __func__, vEntries.size());
+    return true;
+}
+
+void WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (!fBlockIndexSnapshot || fReindex || !setDirtyBlockIndex.empty() || !setDirtyFileInfo.empty())
+        return;
+
+    int64_t nStart = GetTimeMillis();
+    vector<pair<int, const CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    for (const BlockMap::value_type& entry : mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(entry.second->nHeight, entry.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    vector<const CBlockIndex*> vEntries;
+    vEntries.reserve(vSortedByHeight.size());
+    for (const pair<int, const CBlockIndex*>& item : vSortedByHeight)
+        vEntries.push_back(item.second);
+
+    if (CBlockIndexSnapshot::Write(GetDataDir() / BLOCK_INDEX_SNAPSHOT_FILENAME, BlockIndexSnapshotState(), vEntries))
+        LogPrintf("%s: wrote %u entries in %dms\n", __func__, vEntries.size(), GetTimeMillis() - nStart);
+}
+
+bool static LoadBlockIndexDB(bool* fRebuildRequired)
+{
+    const CChainParams& chainparams = Params();
+
+    // Load block file info
+    pblocktree->ReadLastBlockFile(nLastBlockFile);
+    vinfoBlockFile.resize(nLastBlockFile + 1);
+    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+    }
+    LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
+    for (int nFile = nLastBlockFile + 1; true; nFile++) {
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(nFile, info)) {
+            vinfoBlockFile.push_back(info);
+        } else {
+            break;
+        }
+    }
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    if (!LoadBlockIndexSnapshot(vSortedByHeight)) {
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
 
-    return pindexNew;
-}
+        boost::this_thread::interruption_point();
 
-bool static LoadBlockIndexDB(bool* fRebuildRequired)
-{
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    }
 
-    boost::this_thread::interruption_point();
+    // Check whether the chain state was loaded from a UTXO snapshot
+    uint256 hashSnapshotBase, hashSnapshotCommit;
+    if (pblocktree->ReadSnapshotBase(hashSnapshotBase, hashSnapshotCommit, nSnapshotChainTx)) {
+        BlockMap::iterator it = mapBlockIndex.find(hashSnapshotBase);
+        if (it == mapBlockIndex.end())
+            return error("LoadBlockIndexDB(): UTXO snapshot base block %s not found", hashSnapshotBase.ToString());
+        pindexSnapshotBase = it->second;
+        LogPrintf("LoadBlockIndexDB(): Chain state was loaded from a UTXO snapshot at height %d\n", pindexSnapshotBase->nHeight);
+    }
 
     // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
     vector<pair<int, CBlockIndex*>>::iterator firstBIP100Entry = vSortedByHeight.end();
     for (vector<pair<int, CBlockIndex*>>::iterator iter = vSortedByHeight.begin(); iter != vSortedByHeight.end(); iter++)
     {
@@ -3443,6 +4276,8 @@ bool static LoadBlockIndexDB(bool* fRebuildRequired)
             } else {
                 pindex->nChainTx = pindex->nTx;
             }
+            if (pindex == pindexSnapshotBase && pindex->nChainTx)
+                pindex->nChainTx = nSnapshotChainTx;
         }
         if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
@@ -3461,23 +4296,6 @@ bool static LoadBlockIndexDB(bool* fRebuildRequired)
         }
     }
 
-    // Load block file info
-    pblocktree->ReadLastBlockFile(nLastBlockFile);
-    vinfoBlockFile.resize(nLastBlockFile + 1);
-    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
-    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
-        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
-    }
-    LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
-    for (int nFile = nLastBlockFile + 1; true; nFile++) {
-        CBlockFileInfo info;
-        if (pblocktree->ReadBlockFileInfo(nFile, info)) {
-            vinfoBlockFile.push_back(info);
-        } else {
-            break;
-        }
-    }
-
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
@@ -3486,6 +4304,7 @@ bool static LoadBlockIndexDB(bool* fRebuildRequired)
         CBlockIndex* pindex = item.second;
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             setBlkDataFiles.insert(pindex->nFile);
+            AddToBlockFileIndex(pindex);
         }
     }
     for (std::set<int>::iterator it = setBlkDataFiles.begin(); it != setBlkDataFiles.end(); it++)
@@ -3594,6 +4413,16 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if ((fHavePruned || pindexSnapshotBase) && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // Only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (no data)\n", pindex->nHeight);
+            break;
+        }
+        if (pindex == pindexSnapshotBase) {
+            // Blocks up to the base of a UTXO snapshot have no undo data, they were never connected.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (UTXO snapshot)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
@@ -3749,11 +4578,11 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanpool.Clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
+    vBlocksInFile.clear();
     nLastBlockFile = 0;
     nBlockSequenceId = 1;
     blocksInFlight.clear();
@@ -3765,11 +4594,11 @@ void UnloadBlockIndex()
     recentRejects.reset(NULL);
     versionbitscache.Clear();
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
+    pindexSnapshotBase = NULL;
+    nSnapshotChainTx = 0;
 }
 
 bool LoadBlockIndex(bool* fRebuildRequired)
@@ -3803,12 +4632,13 @@ bool InitBlockIndex() {
         try {
             CBlock &block = const_cast<CBlock&>(Params().GenesisBlock());
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            std::vector<unsigned char> vRecord;
+            SerializeBlockRecord(block, chainparams.DBMagic(), vRecord);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
+            if (!FindBlockPos(state, blockPos, vRecord.size(), 0, block.GetBlockTime()))
                 return error("LoadBlockIndex(): FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos, chainparams.DBMagic()))
+            if (!WriteBlockRecord(vRecord, blockPos))
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
             CBlockIndex *pindex = AddToBlockIndex(block);
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
@@ -3823,6 +4653,227 @@ bool InitBlockIndex() {
 
 
 
+bool ScanBlockFile(int nFile, std::vector<std::pair<CBlockHeader, CDiskBlockPos> >& vBlocks)
+{
+    const CChainParams& chainparams = Params();
+    FILE* file = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+    if (!file)
+        return false; // This error is logged in OpenBlockFile
+    long nFileSize = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        nFileSize = ftell(file);
+    if (nFileSize < 0 || fseek(file, 0, SEEK_SET)) {
+        fclose(file);
+        return error("%s: unable to seek in blk%05u.dat", __func__, nFile);
+    }
+
+    try {
+        // Only the headers are read, the blocks themselves are skipped over.
+        CBufferedFile blkdat(file, REINDEX_SCAN_BUFFER_SIZE, BLOCK_RECORD_HEADER_SIZE + BLOCK_HEADER_SIZE, SER_DISK, CLIENT_VERSION);
+        uint64_t nPos = 0; // where the next block is expected
+        uint64_t nSeekPos = 0; // where the buffer was last filled from
+        uint64_t nPrevRecord = 0;
+        bool fAfterBlock = false;
+        while (!ShutdownRequested()) {
+            uint64_t nRecord;
+            unsigned int nSize = 0;
+            CBlockHeader header;
+            if (fAfterBlock && nPos == (uint64_t)nFileSize)
+                break; // The previous block was the last one.
+            try {
+                // The search goes on in the buffer after a false match of
+                // the magic, only skipping over blocks takes a seek.
+                if (nPos < nSeekPos || !blkdat.Rewind(nPos)) {
+                    if (!blkdat.Seek(nPos))
+                        break;
+                    nSeekPos = nPos;
+                }
+                blkdat.FindByte(chainparams.DBMagic()[0]);
+                nRecord = blkdat.GetPos();
+                if (fAfterBlock && nRecord != nPos) {
+                    // Garbage after the previous block, or it had the
+                    // wrong size: look for blocks in what was skipped.
+                    nPos = nPrevRecord + 1;
+                    fAfterBlock = false;
+                    continue;
+                }
+                fAfterBlock = false;
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, chainparams.DBMagic(), MESSAGE_START_SIZE)) {
+                    nPos = nRecord + 1;
+                    continue;
+                }
+                blkdat >> nSize;
+                // Compressed blocks start with the header as well.
+                nSize &= ~BLOCK_COMPRESSED_FLAG;
+                if (nSize < BLOCK_HEADER_SIZE) {
+                    nPos = nRecord + 1;
+                    continue;
+                }
+                blkdat >> header;
+            } catch (const std::exception&) {
+                if (fAfterBlock) {
+                    // The previous block may have had the wrong size.
+                    nPos = nPrevRecord + 1;
+                    fAfterBlock = false;
+                    continue;
+                }
+                // no further block header found; don't complain
+                break;
+            }
+            if (!CheckProofOfWork(header.GetHash(), header.nBits, chainparams.GetConsensus())) {
+                nPos = nRecord + 1;
+                continue;
+            }
+            vBlocks.push_back(std::make_pair(header, CDiskBlockPos(nFile, nRecord + BLOCK_RECORD_HEADER_SIZE)));
+            nPrevRecord = nRecord;
+            nPos = nRecord + BLOCK_RECORD_HEADER_SIZE + nSize;
+            fAfterBlock = true;
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+        return false;
+    }
+    return true;
+}
+
+bool ReindexBlockFiles()
+{
+    const CChainParams& chainparams = Params();
+    int64_t nStart = GetTimeMillis();
+
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    // Locate the blocks of all files in parallel.
+    std::vector<std::vector<std::pair<CBlockHeader, CDiskBlockPos> > > vFileBlocks(nFiles);
+    std::atomic<int> nNextFile(0);
+    auto scan = [&]() {
+        for (int nFile = nNextFile++; nFile < nFiles && !ShutdownRequested(); nFile = nNextFile++) {
+            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+            ScanBlockFile(nFile, vFileBlocks[nFile]);
+        }
+    };
+    std::vector<std::thread> scanners;
+    const int nThreads = std::max(1, std::min(GetNumCores(), MAX_REINDEX_SCAN_THREADS));
+    for (int i = 1; i < nThreads && i < nFiles; ++i)
+        scanners.emplace_back([&scan]() { RenameThread("bitcoin-reindex"); scan(); });
+    scan();
+    for (std::thread& scanner : scanners)
+        scanner.join();
+    boost::this_thread::interruption_point();
+
+    // Blocks stored more than once are loaded from where they were found first.
+    std::vector<std::pair<CBlockHeader, CDiskBlockPos> > vBlocks;
+    std::vector<uint256> vHash;
+    boost::unordered_map<uint256, size_t, BlockHasher> mapLocated;
+    for (std::vector<std::pair<CBlockHeader, CDiskBlockPos> >& vFile : vFileBlocks) {
+        for (std::pair<CBlockHeader, CDiskBlockPos>& located : vFile) {
+            const uint256 hash = located.first.GetHash();
+            if (mapLocated.emplace(hash, vBlocks.size()).second) {
+                vBlocks.push_back(located);
+                vHash.push_back(hash);
+            }
+        }
+        std::vector<std::pair<CBlockHeader, CDiskBlockPos> >().swap(vFile);
+    }
+    LogPrintf("Located %u blocks in %d block files in %dms\n", vBlocks.size(), nFiles, GetTimeMillis() - nStart);
+
+    // Order them by height, no matter what order they were stored in, so
+    // that parents are processed first.
+    static const int HEIGHT_UNRESOLVED = -3;
+    static const int HEIGHT_UNKNOWN_PARENT = -2;
+    std::vector<int> vHeight(vBlocks.size(), HEIGHT_UNRESOLVED);
+    {
+        LOCK(cs_main);
+        std::vector<size_t> vPath;
+        for (size_t i = 0; i < vBlocks.size(); ++i) {
+            int nHeight;
+            vPath.clear();
+            for (size_t j = i; ; ) {
+                if (vHeight[j] != HEIGHT_UNRESOLVED) {
+                    nHeight = vHeight[j];
+                    break;
+                }
+                vPath.push_back(j);
+                if (vHash[j] == chainparams.GetConsensus().hashGenesisBlock) {
+                    nHeight = -1;
+                    break;
+                }
+                BlockMap::iterator mi = mapBlockIndex.find(vBlocks[j].first.hashPrevBlock);
+                if (mi != mapBlockIndex.end()) {
+                    nHeight = mi->second->nHeight;
+                    break;
+                }
+                auto it = mapLocated.find(vBlocks[j].first.hashPrevBlock);
+                if (it == mapLocated.end()) {
+                    nHeight = HEIGHT_UNKNOWN_PARENT;
+                    break;
+                }
+                j = it->second;
+            }
+            for (auto j = vPath.rbegin(); j != vPath.rend(); ++j) {
+                if (nHeight != HEIGHT_UNKNOWN_PARENT)
+                    nHeight++;
+                vHeight[*j] = nHeight;
+            }
+        }
+    }
+    std::vector<size_t> vOrder;
+    for (size_t i = 0; i < vBlocks.size(); ++i) {
+        if (vHeight[i] == HEIGHT_UNKNOWN_PARENT)
+            LogPrint(Log::REINDEX, "%s: Block %s with unknown parent %s\n", __func__, vHash[i].ToString(),
+                    vBlocks[i].first.hashPrevBlock.ToString());
+        else
+            vOrder.push_back(i);
+    }
+    std::stable_sort(vOrder.begin(), vOrder.end(), [&vHeight](size_t a, size_t b) {
+        return vHeight[a] < vHeight[b];
+    });
+
+    // Build the block index from the headers first, ...
+    for (size_t i : vOrder) {
+        LOCK(cs_main);
+        CValidationState state;
+        if (!AcceptBlockHeader(vBlocks[i].first, state))
+            LogPrint(Log::REINDEX, "%s: Invalid header %s: %s\n", __func__, vHash[i].ToString(), FormatStateMessage(state));
+    }
+
+    // ... then load the blocks themselves.
+    int nLoaded = 0;
+    for (size_t i : vOrder) {
+        boost::this_thread::interruption_point();
+
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(vHash[i]);
+            if (mi == mapBlockIndex.end() || (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+                continue;
+        }
+        CBlock block;
+        if (!ReadBlockFromDisk(block, vBlocks[i].second, chainparams.GetConsensus()) || block.GetHash() != vHash[i])
+            continue;
+
+        LOCK(cs_main);
+        CValidationState state;
+        if (AcceptBlock(block, state, NULL, true, &vBlocks[i].second))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    }
+
+    {
+        // Continue writing to the last file, not the one the highest block happened to be in.
+        LOCK(cs_LastBlockFile);
+        nLastBlockFile = std::max(nLastBlockFile, (int)vinfoBlockFile.size() - 1);
+    }
+
+    LogPrintf("Loaded %i blocks from %d block files in %dms\n", nLoaded, nFiles, GetTimeMillis() - nStart);
+    return true;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     const CChainParams& chainparams = Params();
@@ -3842,6 +4893,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
@@ -3852,6 +4904,8 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     continue;
                 // read size
                 blkdat >> nSize;
+                fCompressed = nSize & BLOCK_COMPRESSED_FLAG;
+                nSize &= ~BLOCK_COMPRESSED_FLAG;
                 if (nSize < 80)
                     continue;
             } catch (const std::exception&) {
@@ -3866,7 +4920,17 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 CBlock block;
-                blkdat >> block;
+                if (fCompressed) {
+                    std::vector<unsigned char> vchCompressed(nSize), vchBlock;
+                    blkdat.read((char*)vchCompressed.data(), nSize);
+                    if (!DecompressBlock(vchCompressed.data(), nSize, vchBlock))
+                        throw std::ios_base::failure("corrupt compressed block");
+                    CMemoryReader reader(SER_DISK, CLIENT_VERSION, (const char*)vchBlock.data(), vchBlock.size());
+                    reader >> block;
+                }
+                else {
+                    blkdat >> block;
+                }
                 nRewind = blkdat.GetPos();
 
                 // detect out of order blocks, and store them for later
@@ -3989,7 +5053,7 @@ void static CheckBlockIndex()
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);  // nSequenceId can't be set for blocks that aren't linked
         // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
         // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
-        if (!fHavePruned) {
+        if (!fHavePruned && !pindexSnapshotBase) {
             // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
             assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
             assert(pindexFirstMissing == pindexFirstNeverProcessed);
@@ -4048,7 +5112,7 @@ void static CheckBlockIndex()
         if (pindexFirstMissing == NULL) assert(!foundInUnlinked); // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
         if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
             // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
-            assert(fHavePruned); // We must have pruned.
+            assert(fHavePruned || pindexSnapshotBase); // We must have pruned (or started from a snapshot).
             // This block may have entered mapBlocksUnlinked if:
             //  - it has a descendant that at some point had more work than the
             //    tip, and
@@ -4189,6 +5253,64 @@ bool static SanityCheckMessage(CNode* peer, const CNetMessage& msg)
     return true;
 }
 
+/**
+ * Try to accept the orphans in vWorkQueue into the mempool, and recursively
+ * any orphans depending on those that get accepted.
+ */
+static void ProcessOrphans(std::vector<uint256> vWorkQueue, CConnman* connman)
+{
+    AssertLockHeld(cs_main);
+
+    set<NodeId> setMisbehaving;
+    for (size_t i = 0; i < vWorkQueue.size(); i++)
+    {
+        const uint256 orphanHash = vWorkQueue[i];
+        CTransaction orphanTx;
+        NodeId fromPeer;
+        if (!orphanpool.GetTx(orphanHash, orphanTx, fromPeer))
+            continue; // already processed
+        if (setMisbehaving.count(fromPeer))
+            continue;
+
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2, connman))
+        {
+            LogPrint(Log::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
+            if (connman) {
+                std::vector<uint256> vAncestors;
+                mempool.queryAncestors(orphanHash, vAncestors, connman->GetLocalServices());
+                connman->RelayTransaction(orphanTx, vAncestors);
+            }
+            orphanpool.EraseTx(orphanHash);
+            std::vector<uint256> children = orphanpool.GetChildren(orphanTx);
+            vWorkQueue.insert(vWorkQueue.end(), children.begin(), children.end());
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos, "invalid orphan tx");
+                setMisbehaving.insert(fromPeer);
+                LogPrint(Log::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint(Log::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
+            orphanpool.EraseTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+    }
+    if (!vWorkQueue.empty())
+        mempool.check(pcoinsTip);
+}
 
 bool static AlreadyHave(const CInv& inv)
 {
@@ -4209,7 +5331,7 @@ bool static AlreadyHave(const CInv& inv)
 
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
+                   orphanpool.Exists(inv.hash) ||
                    pcoinsTip->HaveCoin(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
                    pcoinsTip->HaveCoin(COutPoint(inv.hash, 1));
         }
@@ -4386,8 +5508,9 @@ struct TxFinderImpl : public TxFinder {
         if (mempool.lookup(h, tx))
             return tx;
 
-        if (mapOrphanTransactions.count(h))
-            return mapOrphanTransactions[h].tx;
+        NodeId fromPeer;
+        if (orphanpool.GetTx(h, tx, fromPeer))
+            return tx;
 
         // if not found, tx is left alone.
         try {
@@ -4423,12 +5546,10 @@ struct TxFinderImpl : public TxFinder {
         if (!match.IsNull())
             return match;
 
-        for (auto t : mapOrphanTransactions)
-            if (hash.equals(t.second.tx.GetHash()))
-                return t.second.tx;
-
         // Skip relay map.
-        return CTransaction();
+        return orphanpool.FindTx([&hash](const uint256& h) {
+            return hash.equals(h);
+        });
     }
 
     CTransaction operator()(const ThinTx& hash) const {
@@ -4989,8 +6110,6 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
     else if (strCommand == NetMsgType::TX)
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
@@ -5012,7 +6131,6 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             std::vector<uint256> vAncestors;
             mempool.queryAncestors(tx.GetHash(), vAncestors, connman->GetLocalServices());
             connman->RelayTransaction(tx, vAncestors);
-            vWorkQueue.push_back(inv.hash);
 
             LogPrint(Log::MEMPOOL, "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
@@ -5020,69 +6138,16 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 mempool.size());
 
             // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2, connman))
-                    {
-                        LogPrint(Log::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
-                        std::vector<uint256> vAncestors;
-                        mempool.queryAncestors(orphanTx.GetHash(), vAncestors, connman->GetLocalServices());
-                        connman->RelayTransaction(orphanTx, vAncestors);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos, "invalid orphan tx");
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint(Log::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint(Log::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            ProcessOrphans(orphanpool.GetChildren(tx), connman);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx, pfrom->GetId());
+            orphanpool.AddTx(tx, pfrom->GetId());
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            // DoS prevention: do not allow the orphan pool to grow unbounded
+            unsigned int nEvicted = orphanpool.LimitSize();
             if (nEvicted > 0)
-                LogPrint(Log::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
+                LogPrint(Log::MEMPOOL, "orphan pool overflow, removed %u tx\n", nEvicted);
         } else {
             assert(recentRejects);
             recentRejects->insert(tx.GetHash());
@@ -5138,6 +6203,10 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        // Hash and check the headers before taking cs_main, for it to be
+        // held only to add them to the block index.
+        const CheckedHeaders checked(headers);
+
         LOCK(cs_main);
         MarkBlockAsInFlight inFlight;
         DefaultHeaderProcessor p(*connman, pfrom, blocksInFlight, thinblockmg, inFlight, CheckBlockIndex);
@@ -5149,7 +6218,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         try {
-            p(headers, nCount == MAX_HEADERS_RESULTS, true);
+            p(checked, nCount == MAX_HEADERS_RESULTS, true);
         }
         catch (const BlockHeaderError& e) {
             return error(e.what());
@@ -5820,10 +6889,13 @@ bool SendMessages(CNode* pto, CConnman* connman, std::atomic<bool>& interruptMsg
         ThinBlockWorker& worker = *(statePtr->thinblock);
         bool fetchData = WillDownloadFromNode(pto, worker);
         vector<CInv> vGetData;
-        if (fetchData && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && statePtr->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        // Peers that deliver slower than others get fewer blocks to download.
+        const int nMaxInFlight = blockDownloadScheduler.share(pto->GetId());
+        if (fetchData && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && statePtr->nBlocksInFlight < nMaxInFlight) {
             vector<const CBlockIndex*> vToDownload;
             std::set<NodeId> stallers;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - statePtr->nBlocksInFlight, vToDownload, stallers);
+            FindNextBlocksToDownload(pto->GetId(), nMaxInFlight - statePtr->nBlocksInFlight, vToDownload, stallers);
+            FindHistoricalBlocksToDownload(pto->GetId(), nMaxInFlight - statePtr->nBlocksInFlight, vToDownload);
             for (const CBlockIndex *pindex : vToDownload) {
 
                 if (ThinBlocksActive(pto)) {
@@ -5888,19 +6960,239 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
 }
 
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+// Verify scripts for this many transactions per script check queue run when
+// loading the mempool, so an invalid transaction only stops the warm-up of
+// its own batch.
+static const size_t MEMPOOL_LOAD_CHECK_BATCH = 1000;
+// Accept this many transactions per hold of cs_main when loading the mempool,
+// so that blocks and peers are served in between.
+static const size_t MEMPOOL_LOAD_ACCEPT_BATCH = 100;
+// Trim the mempool to its limit each time this many bytes of loaded
+// transactions were accepted, rather than letting it grow by the whole file.
+static const size_t MEMPOOL_LOAD_TRIM_INTERVAL = 4 * 1000000;
+
+// Runs script checks for txs on the script check threads, to populate
+// the signature cache before the transactions are accepted one by one.
+// cs_main is only held to look up the coins of each batch.
+static void WarmSigCacheForMempoolLoad(const std::vector<CTransaction>& txs)
+{
+    if (!Opt().ScriptCheckThreads())
+        return;
+
+    unsigned int flags;
+    {
+        LOCK(cs_main);
+        flags = STANDARD_SCRIPT_VERIFY_FLAGS
+            | GetMempoolForkVerifyFlags(chainActive.Tip()->GetMedianTimePast());
+    }
+
+    // Outputs of the transactions checked so far, which children later in
+    // the file spend.
+    CCoinsView viewDummy;
+    CCoinsViewCache viewLoaded(&viewDummy);
+
+    for (size_t start = 0; start < txs.size(); start += MEMPOOL_LOAD_CHECK_BATCH) {
+        boost::this_thread::interruption_point();
+        const size_t end = std::min(txs.size(), start + MEMPOOL_LOAD_CHECK_BATCH);
+
+        std::vector<CScriptCheck> vChecks;
+        {
+            LOCK(cs_main);
+            CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+            CCoinsViewCache view(&viewMemPool);
+            for (size_t i = start; i < end; ++i) {
+                const CTransaction& tx = txs[i];
+                if (tx.IsCoinBase())
+                    continue;
+
+                std::vector<const Coin*> coins;
+                coins.reserve(tx.vin.size());
+                for (const CTxIn& txin : tx.vin) {
+                    const Coin& coin = viewLoaded.HaveCoin(txin.prevout)
+                        ? viewLoaded.AccessCoin(txin.prevout)
+                        : view.AccessCoin(txin.prevout);
+                    if (coin.IsSpent())
+                        break;
+                    coins.push_back(&coin);
+                }
+                if (coins.size() != tx.vin.size())
+                    continue;
+
+                PrecomputedTransactionData txdata(tx);
+                for (size_t n = 0; n < tx.vin.size(); ++n) {
+                    vChecks.push_back(CScriptCheck(coins[n]->out.scriptPubKey, coins[n]->out.nValue,
+                                                   tx, n, flags, true, txdata));
+                }
+                AddCoins(viewLoaded, tx, MEMPOOL_HEIGHT, true);
+            }
+        }
+
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        // Failures are reported by AcceptToMemoryPool.
+        if (!control.Wait())
+            LogPrint(Log::MEMPOOL, "Script check failed while warming signature cache for mempool load\n");
+    }
+}
+
+bool LoadMempool()
+{
+    const int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<CTransaction> txs;
+    std::vector<std::pair<int64_t, CAmount> > txinfo;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return false;
+        }
+        // The count isn't trusted for allocating; a file that claims more
+        // entries than it has fails to deserialize.
+        uint64_t num;
+        file >> num;
+        for (uint64_t i = 0; i < num; ++i) {
+            CTransaction tx;
+            int64_t nTime;
+            CAmount nFeeDelta;
+            file >> tx;
+            file >> nTime;
+            file >> nFeeDelta;
+            txs.push_back(std::move(tx));
+            txinfo.push_back(std::make_pair(nTime, nFeeDelta));
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    int64_t nRead = GetTimeMillis();
+
+    WarmSigCacheForMempoolLoad(txs);
+
+    int count = 0;
+    int skipped = 0;
+    int failed = 0;
+    int64_t nNow = GetTime();
+    const size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    size_t nUntrimmed = 0;
+    for (size_t start = 0; start < txs.size(); start += MEMPOOL_LOAD_ACCEPT_BATCH) {
+        const size_t end = std::min(txs.size(), start + MEMPOOL_LOAD_ACCEPT_BATCH);
+
+        LOCK(cs_main);
+        for (size_t i = start; i < end; ++i) {
+            const CTransaction& tx = txs[i];
+            const int64_t nTime = txinfo[i].first;
+            const CAmount nFeeDelta = txinfo[i].second;
+
+            if (nFeeDelta != 0)
+                mempool.GetFeeModifier().AddDelta(tx.GetHash(), nFeeDelta);
+
+            if (nTime + nExpiryTimeout <= nNow) {
+                ++skipped;
+                continue;
+            }
+            // Limits are applied per MEMPOOL_LOAD_TRIM_INTERVAL, below.
+            CValidationState state;
+            if (AcceptToMemoryPoolWorker(mempool, state, tx, true, nullptr, nullptr,
+                                         true, false, nTime)) {
+                ++count;
+                nUntrimmed += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            } else {
+                ++failed;
+            }
+        }
+        if (ShutdownRequested())
+            return false;
+        if (nUntrimmed >= MEMPOOL_LOAD_TRIM_INTERVAL || end == txs.size()) {
+            mempool.Expire(nNow - nExpiryTimeout);
+            mempool.TrimToSize(nMaxMempool);
+            nUntrimmed = 0;
+        }
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired (read %dms, total %dms)\n",
+              count, failed, skipped, nRead - nStart, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<const CTxMemPoolEntry*> entries;
+    std::vector<CAmount> deltas;
+    std::vector<CTransactionRef> txs;
+    std::vector<int64_t> times;
+    {
+        LOCK(mempool.cs);
+        entries.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& e : mempool.mapTx)
+            entries.push_back(&e);
+
+        // Parents before children, so the file can be loaded front to back.
+        std::sort(begin(entries), end(entries), [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+
+        txs.reserve(entries.size());
+        times.reserve(entries.size());
+        deltas.reserve(entries.size());
+        for (const CTxMemPoolEntry* e : entries) {
+            txs.push_back(e->GetSharedTx());
+            times.push_back(e->GetTime());
+            deltas.push_back(mempool.GetFeeModifier().GetDelta(e->GetTx().GetHash()));
+        }
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr) {
+            return false;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+
+        file << (uint64_t)txs.size();
+        for (size_t i = 0; i < txs.size(); ++i) {
+            file << *txs[i];
+            file << times[i];
+            file << deltas[i];
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid-nStart)*0.000001, (nLast-nMid)*0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+
 class CMainCleanup
 {
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers, their entries go with blockIndexArena
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.Clear();
     }
 } instance_of_cmaincleanup;
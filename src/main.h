@@ -11,6 +11,7 @@
 #endif
 
 #include "amount.h"
+#include "blockdownloadscheduler.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -27,6 +28,7 @@
 #include "versionbits.h"
 
 #include <algorithm>
+#include <deque>
 #include <exception>
 #include <map>
 #include <set>
@@ -39,18 +41,27 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
+class CCoinsViewWriteBehind;
 class CInv;
 class CConnman;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
+class TxOrphanPool;
 
 struct CNodeStateStats;
 struct LockPoints;
 
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanpool, maximum megabytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_POOL_SIZE = 10;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between periodic dumps of the mempool to disk */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
 /** Default for -limitancestorcount, max number of in-mempool ancestors */
 static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
 /** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
@@ -59,6 +70,8 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions connected through in-mempool dependencies */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
 /** Default for -maxmempool, maximum megabytes of mempool memory usage */
 static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
@@ -67,6 +80,16 @@ static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Size of the magic and length written ahead of every block in the block files */
+static const unsigned int BLOCK_RECORD_HEADER_SIZE = MESSAGE_START_SIZE + sizeof(unsigned int);
+/** Size of a serialized block header */
+static const unsigned int BLOCK_HEADER_SIZE = 80;
+/** Maximum number of threads locating the blocks of block files on -reindex */
+static const int MAX_REINDEX_SCAN_THREADS = 8;
+/** Read buffer for locating blocks on -reindex, which only reads their headers */
+static const unsigned int REINDEX_SCAN_BUFFER_SIZE = 16 * 1024;
+/** The maximum number of block files kept memory mapped for reading blocks */
+static const size_t MAX_MAPPED_BLOCKFILES = 16;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -83,6 +106,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** When the coins cache is flushed for being full, unmodified coins are evicted until it is this percentage of its limit. */
+static const unsigned int COINS_CACHE_TRIM_PERCENT = 70;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -101,6 +126,7 @@ struct BlockHasher
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern TxOrphanPool orphanpool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -131,8 +157,19 @@ std::vector<unsigned char>& GetAntiReplayCommitment();
 /** Pruning-related variables and constants */
 /** True if any block files have ever been pruned. */
 extern bool fHavePruned;
+/** Base block of the UTXO snapshot the chain state was loaded from, if any. Blocks below it may have no data. */
+extern CBlockIndex *pindexSnapshotBase;
 /** True if we're running in -prune mode. */
 extern bool fPruneMode;
+/** Write undo data LZ4 compressed (-compressundo). Undo files can hold both formats. */
+extern bool fCompressUndo;
+static const bool DEFAULT_COMPRESS_UNDO = false;
+/** Write new blocks compressed (-compressblocks). Block files can hold both formats. */
+extern bool fCompressBlocks;
+static const bool DEFAULT_COMPRESS_BLOCKS = false;
+/** Write a snapshot of the block index on shutdown, to load it faster on the next start (-blockindexsnapshot). */
+extern bool fBlockIndexSnapshot;
+static const bool DEFAULT_BLOCK_INDEX_SNAPSHOT = true;
 /** Number of MiB of block files that we're trying to stay below. */
 extern uint64_t nPruneTarget;
 /** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
@@ -203,6 +240,10 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
+/** Locate the blocks stored in block file nFile, and check the proof of work of their headers */
+bool ScanBlockFile(int nFile, std::vector<std::pair<CBlockHeader, CDiskBlockPos> >& vBlocks);
+/** Rebuild the block index from all block files, scanning them in parallel (-reindex) */
+bool ReindexBlockFiles();
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
@@ -212,6 +253,8 @@ bool LoadBlockIndex(bool* fRebuildRequired);
 void LoadChainTip(const CChainParams& chainparams);
 /** Unload database information */
 void UnloadBlockIndex();
+/** Write a snapshot of the block index, once it's flushed, for the next start to load */
+void WriteBlockIndexSnapshot();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom, CConnman* connman, std::atomic<bool>& interrupt);
 /** Process a single message from a given node */
@@ -229,6 +272,8 @@ bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv,
 bool SendMessages(CNode* pto, CConnman* connman, std::atomic<bool>& interrupt);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking the transactions of large blocks in CheckBlock */
+void ThreadBlockCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 int PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -241,6 +286,18 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, b
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState &state, CBlock *pblock = nullptr,
                        const BlockSource& = BlockSource(), CConnman* connman = nullptr);
+/**
+ * ActivateBestChain for -reindex-chainstate: connects the blocks on disk with
+ * the mempool's memory added to the coins cache, flushes only when that is
+ * full, and logs progress every few seconds instead of every block.
+ */
+bool ReindexChainState(CValidationState &state);
+/**
+ * Make pindexBase the tip after its UTXO set was loaded into pcoinsTip (see
+ * loadtxoutset). Its ancestors count as validated, with or without their
+ * data, blocks we have no data for get a placeholder transaction count.
+ */
+bool ActivateUTXOSnapshot(CValidationState &state, CBlockIndex *pindexBase, uint64_t nChainTx, const uint256 &hashCommit);
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams);
 
 /**
@@ -261,7 +318,7 @@ CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams);
 void FindFilesToPrune(std::set<int>& setFilesToPrune);
 
 /**
- *  Actually unlink the specified files
+ *  Actually unlink the specified files, on a thread of their own
  */
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 
@@ -285,9 +342,18 @@ bool IsCashHFEnabled(const CBlockIndex *pindexPrev);
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, CConnman*, bool fOverrideMempoolLimit=false, bool fRejectAbsurdFee=false);
 
+/** Load the mempool from disk, skipping relay and verifying scripts in parallel */
+bool LoadMempool();
+
+/** Dump the mempool to disk */
+bool DumpMempool();
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
+/** Notify the UI and run -alertnotify with a warning (in a thread of its own if fThread) */
+void AlertNotify(const std::string& strMessage, bool fThread);
+
 /** Get the BIP135 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params &params, Consensus::DeploymentPos pos);
 
@@ -296,6 +362,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlockShare;
+    BlockDownloadStats blockDownload;
 };
 
 
@@ -387,9 +455,23 @@ public:
 
 
 /** Functions for disk access for blocks */
+/** Serialize block as it's stored in the block files, into vRecord, compressed if fCompressBlocks. */
+void SerializeBlockRecord(const CBlock& block, const CMessageHeader::MessageStartChars& messageStart, std::vector<unsigned char>& vRecord);
+/** Write a record from SerializeBlockRecord at pos, and move pos to the block in it. */
+bool WriteBlockRecord(const std::vector<unsigned char>& vRecord, CDiskBlockPos& pos);
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params&);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params&);
+/** Read the serialized block of pindex as stored, to send it on without deserializing it. */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+
+/** Functions for disk access for undo data, pos is set to where the data goes after the header */
+/** Serialize and LZ4 compress blockundo, as UndoWriteToDisk stores it when compressing undo data */
+void CompressBlockUndo(const CBlockUndo& blockundo, std::vector<unsigned char>& vchCompressed);
+/** Write undo data at pos; compressed as vchCompressed from CompressBlockUndo, if not empty */
+bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart,
+                     const std::vector<unsigned char>& vchCompressed = std::vector<unsigned char>());
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -400,11 +482,48 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
  *  of problems. Note that in any case, coins may be modified. */
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  If pvChecks is given, the script checks are appended to it for the caller to run, instead of being run. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false,
+                  std::vector<CScriptCheck>* pvChecks = NULL);
+
+/**
+ * Transactions of the blocks disconnected in a reorg. They are returned to
+ * the mempool in one go once the new chain is connected, so that those the
+ * new chain confirms aren't added and removed again.
+ */
+class DisconnectedTransactions
+{
+public:
+    //! Holds up to -maxmempool.
+    DisconnectedTransactions();
+    explicit DisconnectedTransactions(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), nSize(0) {}
+
+    //! Blocks are added tip first. More than the mempool can hold is of no
+    //! use: those added first, nearest the old tip, are dropped, and the
+    //! mempool transactions that spend from them removed.
+    void AddBlock(const CBlock& block);
+    //! Transactions the new chain confirms are left out.
+    void RemoveForBlock(const std::vector<CTransaction>& vtx);
+    //! Resurrect the transactions in the mempool, the oldest block's first.
+    void UpdateMempool();
+
+private:
+    std::deque<std::vector<CTransaction>> blocks;
+    std::set<uint256> setConfirmed;
+    const size_t nMaxSize;
+    size_t nSize;
+};
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+/**
+ * Hash headers into vHash and run CheckBlockHeader on them, spreading the
+ * proof of work checks of a full headers message over the block check
+ * threads. Needs no lock. Returns the number of headers before the first
+ * that fails, with state set by it.
+ */
+size_t CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vHash, CValidationState& state);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 /** Context-dependent validity checks */
@@ -417,6 +536,8 @@ bool ContextualCheckTransaction(const CTransaction &tx, CValidationState &state,
 bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+/** AcceptBlockHeader for a header of the given hash, that passed CheckBlockHeaders. */
+bool AcceptCheckedBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, CBlockIndex **ppindex = NULL);
 
 
 /** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
@@ -445,6 +566,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Writes the coins flushed from pcoinsTip to the coin database in the background, if set (protected by cs_main) */
+extern CCoinsViewWriteBehind *pcoinsWriteBehind;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -173,8 +173,9 @@ void CreateNewBlock(miner::BlockBuilder& block, const CScript& scriptPubKeyIn, b
             bool fPushedAParent = false;
             bool fFirstTime = !gotParents.count(iter);
             gotParents.insert(iter);
-            BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+            BOOST_FOREACH(const CTxMemPoolEntry* parentEntry, mempool.GetMemPoolParents(iter))
             {
+                CTxMemPool::txiter parent = mempool.mapTx.iterator_to(*parentEntry);
                 if (!inBlock.count(parent)) {
                     fAllParentsInBlock = false;
                     if (fFirstTime) {
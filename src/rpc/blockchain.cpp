@@ -3,21 +3,26 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "bgvalidation.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
+#include "init.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
 #include "sync.h"
 #include "util.h"
 #include "utilblock.h" // BlockStatusToStr
+#include "utxosnapshot.h"
 #include "hash.h"
+#include "txdb.h"
 #include "versionbits.h"
 
 #include <stdint.h>
 
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
 using namespace std;
@@ -546,6 +551,198 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
     return ret;
 }
 
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set to a file, which other nodes can bootstrap from with loadtxoutset.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) The file to write, relative to the data directory. It must not exist.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",        (string) the absolute path of the file\n"
+            "  \"base_hash\": \"hash\",   (string) the best block of the written set\n"
+            "  \"base_height\": n,       (numeric) its height\n"
+            "  \"coins_written\": n,     (numeric) the number of coins written\n"
+            "  \"commitment\": \"hash\"   (string) the UTXO commitment of the set\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    const boost::filesystem::path path = boost::filesystem::absolute(request.params[0].get_str(), GetDataDir());
+    const boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    // The LevelDB cursor reads a snapshot of the chain state, so blocks are
+    // connected while the set is written. The memory mapped store's cursor
+    // reads the live table, which has to stay at the base block throughout.
+    const bool fCoinsMapped = GetArg("-coinsbackend", DEFAULT_COINS_BACKEND) == "mmap";
+    CCriticalBlock lockMapped(fCoinsMapped ? &cs_main : NULL, "cs_main", __FILE__, __LINE__);
+
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
+    int nBaseHeight;
+    UTXOSnapshotMetadata metadata;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        BlockMap::iterator itBase = mapBlockIndex.find(pcursor->GetBestBlock());
+        if (itBase == mapBlockIndex.end())
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Best block " + pcursor->GetBestBlock().GetHex() + " of the chain state is not known");
+        nBaseHeight = itBase->second->nHeight;
+        metadata.nChainTx = itBase->second->nChainTx;
+    }
+
+    CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to create " + pathTmp.string());
+    try {
+        WriteUTXOSnapshot(file, *pcursor, metadata);
+        FileCommit(file.Get());
+        file.fclose();
+    } catch (const std::exception& e) {
+        file.fclose();
+        boost::filesystem::remove(pathTmp);
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Unable to write %s: %s", pathTmp.string(), e.what()));
+    }
+    if (!RenameOver(pathTmp, path))
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to rename " + pathTmp.string());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("base_hash", metadata.hashBase.GetHex()));
+    ret.push_back(Pair("base_height", nBaseHeight));
+    ret.push_back(Pair("coins_written", metadata.nCoins));
+    ret.push_back(Pair("commitment", metadata.hashCommit.GetHex()));
+    return ret;
+}
+
+//! The block to make the tip with a snapshot, throws if the chain state can't take one.
+static CBlockIndex* SnapshotBaseBlock(const UTXOSnapshotMetadata& metadata)
+{
+    AssertLockHeld(cs_main);
+    if (chainActive.Height() != 0)
+        throw JSONRPCError(RPC_MISC_ERROR, "A UTXO snapshot can only be loaded before any blocks are connected");
+    BlockMap::iterator it = mapBlockIndex.find(metadata.hashBase);
+    if (it == mapBlockIndex.end())
+        throw JSONRPCError(RPC_MISC_ERROR, "Base block " + metadata.hashBase.GetHex() + " of the snapshot is not known, wait for the headers to sync");
+    if (it->second->nStatus & BLOCK_FAILED_MASK)
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Base block " + metadata.hashBase.GetHex() + " of the snapshot is invalid");
+    return it->second;
+}
+
+UniValue loadtxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" \"commitment\"\n"
+            "\nLoads an unspent transaction output set written by dumptxoutset, and makes its best block the tip.\n"
+            "Blocks up to it count as validated, they are downloaded and checked against the snapshot in the background.\n"
+            "Only possible before any blocks are connected.\n"
+            "The commitment in the file only protects against corruption. The set is only loaded if it has the\n"
+            "commitment given, which must come from a trusted source.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"         (string, required) The file to read, relative to the data directory\n"
+            "2. \"commitment\"   (string, required) The UTXO commitment the set must have\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"base_hash\": \"hash\",   (string) the new tip\n"
+            "  \"base_height\": n,       (numeric) its height\n"
+            "  \"coins_loaded\": n       (numeric) the number of coins loaded\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"commitment\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"commitment\"")
+        );
+
+    const boost::filesystem::path path = boost::filesystem::absolute(request.params[0].get_str(), GetDataDir());
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unable to open " + path.string());
+
+    UTXOSnapshotMetadata metadata;
+    long nCoinsPos;
+    try {
+        file >> metadata;
+        nCoinsPos = ftell(file.Get());
+    } catch (const std::exception& e) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("Unable to read %s: %s", path.string(), e.what()));
+    }
+    if (ParseHashV(request.params[1], "commitment") != metadata.hashCommit)
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Snapshot commitment " + metadata.hashCommit.GetHex() + " is not the expected one");
+    {
+        LOCK(cs_main);
+        SnapshotBaseBlock(metadata);
+    }
+
+    // Check the whole file before touching the chain state.
+    LogPrintf("Verifying UTXO snapshot %s\n", path.string());
+    bool fValid;
+    try {
+        fValid = ReadUTXOSnapshot(file, metadata, nullptr);
+    } catch (const std::exception& e) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("Unable to read %s: %s", path.string(), e.what()));
+    }
+    if (!fValid)
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Snapshot is corrupt, its coins do not match its commitment");
+    if (nCoinsPos < 0 || fseek(file.Get(), nCoinsPos, SEEK_SET) != 0)
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to seek in " + path.string());
+    // Coins are added as new ones, which a second coin for an outpoint
+    // would silently overwrite once the first has been flushed.
+    COutPoint dup;
+    bool fDuplicate;
+    try {
+        fDuplicate = FindDuplicateOutpoint(file, metadata, nCoinCacheUsage, dup);
+    } catch (const std::exception& e) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("Unable to read %s: %s", path.string(), e.what()));
+    }
+    if (fDuplicate)
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Snapshot has more than one coin for " + dup.ToString());
+
+    CValidationState state;
+    CBlockIndex* pindexBase;
+    {
+        LOCK(cs_main);
+        pindexBase = SnapshotBaseBlock(metadata);
+        LogPrintf("Loading UTXO snapshot at height %d\n", pindexBase->nHeight);
+        pblocktree->WriteFlag("txoutsetloading", true);
+        bool fLoaded = false;
+        try {
+            pcoinsTip->SetBestBlock(metadata.hashBase);
+            fLoaded = ReadUTXOSnapshot(file, metadata, [](const COutPoint& out, Coin&& coin) {
+                pcoinsTip->AddCoin(out, std::move(coin), false);
+                if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage && !pcoinsTip->Flush())
+                    throw std::runtime_error("Failed to write coins");
+            }) && ActivateUTXOSnapshot(state, pindexBase, metadata.nChainTx, metadata.hashCommit);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        if (!fLoaded) {
+            // The chain state is neither the old nor the new one.
+            StartShutdown();
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Loading the snapshot failed, shutting down. Restart with -reindex-chainstate.");
+        }
+        pblocktree->WriteFlag("txoutsetloading", false);
+        StartBackgroundValidation();
+    }
+
+    // Connect the blocks after the base that we already have.
+    if (!ActivateBestChain(state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("base_hash", metadata.hashBase.GetHex()));
+    ret.push_back(Pair("base_height", pindexBase->nHeight));
+    ret.push_back(Pair("coins_loaded", metadata.nCoins));
+    return ret;
+}
+
 UniValue gettxout(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 2 || request.params.size() > 3)
@@ -754,6 +951,11 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"sizelimit\" : n,          (numeric) The block size limit as of the last block\n"
+            "  \"snapshot\": {             (object, only if the chain state was loaded with loadtxoutset)\n"
+            "     \"height\": xx,            (numeric) the height of the base block of the UTXO snapshot\n"
+            "     \"status\": \"xxxx\",       (string) one of \"validating\", \"valid\", \"invalid\"\n"
+            "     \"validatedheight\": xx,   (numeric) the height up to which the blocks below it are validated, while validating\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -839,6 +1041,19 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    if (pindexSnapshotBase)
+    {
+        bool fValidated = false, fInvalid = false;
+        pblocktree->ReadFlag("snapshotvalidated", fValidated);
+        pblocktree->ReadFlag("snapshotinvalid", fInvalid);
+        UniValue snapshot(UniValue::VOBJ);
+        snapshot.push_back(Pair("height", pindexSnapshotBase->nHeight));
+        snapshot.push_back(Pair("status", fInvalid ? "invalid" : fValidated ? "valid" : "validating"));
+        if (BackgroundValidationHeight() >= 0)
+            snapshot.push_back(Pair("validatedheight", BackgroundValidationHeight()));
+        obj.push_back(Pair("snapshot", snapshot));
+    }
     return obj;
 }
 
@@ -1088,6 +1303,8 @@ static const CRPCCommand commands[] =
     { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {} },
     { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true,  {"path"} },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           false, {"path","commitment"} },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        true,  {"blockhash"} },
@@ -94,7 +94,14 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blockdownload\": {         (json object) How fast the peer delivers the blocks we ask for\n"
+            "      \"share\": n,              (numeric) The number of blocks we ask from it at a time\n"
+            "      \"delivered\": n,          (numeric) The number of blocks it delivered\n"
+            "      \"latency\": n,            (numeric) Average seconds from requesting a block to its delivery\n"
+            "      \"interval\": n,           (numeric) Average seconds between deliveries, while it has blocks in flight\n"
+            "      \"rerequested\": n         (numeric) The number of blocks it held back that were asked from a faster peer\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -145,6 +152,13 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            UniValue download(UniValue::VOBJ);
+            download.push_back(Pair("share", statestats.nBlockShare));
+            download.push_back(Pair("delivered", statestats.blockDownload.delivered));
+            download.push_back(Pair("latency", statestats.blockDownload.latency / 1000000.0));
+            download.push_back(Pair("interval", statestats.blockDownload.interval / 1000000.0));
+            download.push_back(Pair("rerequested", statestats.blockDownload.rerequested));
+            obj.push_back(Pair("blockdownload", download));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -592,6 +592,15 @@ public:
         }
     }
 
+    // go back to a position at most nRewind bytes before the current one,
+    // that was read since the last Seek
+    bool Rewind(uint64_t nPos) {
+        if (nPos > nReadPos || nPos + nRewind < nReadPos)
+            return false;
+        nReadPos = nPos;
+        return true;
+    }
+
     bool Seek(uint64_t nPos) {
         long nLongPos = nPos;
         if (nPos != (uint64_t)nLongPos)
@@ -0,0 +1,216 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Hands out blocks of a single size, carved from larger chunks. This avoids
+ * the per allocation overhead of malloc for containers with many small nodes.
+ *
+ * Freed blocks are kept for reuse. All chunks are released once the last
+ * block is freed, ReleaseUnused() frees the chunks that are empty before that.
+ *
+ * Not thread safe, a pool belongs to a single container.
+ */
+class FixedSizePool
+{
+public:
+    FixedSizePool(size_t nSize, size_t nAlign) : nBlockSize(BlockSize(nSize, nAlign)), nUsed(0),
+        nAllocated(0), nNextChunk(MIN_CHUNK_BLOCKS), pFree(nullptr), pCurrent(nullptr), pEnd(nullptr) {}
+    ~FixedSizePool() { Release(); }
+
+    //! Whether objects of this size and alignment are served from this pool.
+    bool Accepts(size_t nSize, size_t nAlign) const { return BlockSize(nSize, nAlign) == nBlockSize; }
+
+    void* Allocate() {
+        ++nUsed;
+        if (pFree) {
+            void* p = pFree;
+            pFree = *static_cast<void**>(pFree);
+            return p;
+        }
+        if (pCurrent == pEnd) {
+            char* chunk = static_cast<char*>(::operator new(nNextChunk * nBlockSize));
+            vChunks.push_back(std::make_pair(chunk, nNextChunk));
+            nAllocated += nNextChunk * nBlockSize;
+            pCurrent = chunk;
+            pEnd = chunk + nNextChunk * nBlockSize;
+            nNextChunk = std::min(nNextChunk * 2, MAX_CHUNK_BLOCKS);
+        }
+        void* p = pCurrent;
+        pCurrent += nBlockSize;
+        return p;
+    }
+
+    void Deallocate(void* p) {
+        *static_cast<void**>(p) = pFree;
+        pFree = p;
+        if (--nUsed == 0)
+            Release();
+    }
+
+    /** Free the chunks none of whose blocks are in use. Walks the free list. */
+    void ReleaseUnused() {
+        if (vChunks.empty())
+            return;
+        std::vector<std::pair<char*, size_t> > vSorted(vChunks);
+        std::sort(vSorted.begin(), vSorted.end());
+        // Blocks of a chunk that are free, the uncarved rest of the current one included.
+        std::vector<size_t> vFree(vSorted.size(), 0);
+        for (void* p = pFree; p; p = *static_cast<void**>(p))
+            ++vFree[ChunkOf(vSorted, p)];
+        if (pCurrent != pEnd)
+            vFree[ChunkOf(vSorted, pCurrent)] += (pEnd - pCurrent) / nBlockSize;
+
+        std::vector<bool> vEmpty(vSorted.size());
+        bool fAny = false;
+        for (size_t i = 0; i < vSorted.size(); ++i) {
+            vEmpty[i] = vFree[i] == vSorted[i].second;
+            fAny |= vEmpty[i];
+        }
+        if (!fAny)
+            return;
+
+        // Unlink the blocks of empty chunks from the free list, keeping the order of the rest.
+        void** ppNext = &pFree;
+        while (*ppNext) {
+            if (vEmpty[ChunkOf(vSorted, *ppNext)])
+                *ppNext = *static_cast<void**>(*ppNext);
+            else
+                ppNext = static_cast<void**>(*ppNext);
+        }
+        if (pCurrent != pEnd && vEmpty[ChunkOf(vSorted, pCurrent)])
+            pCurrent = pEnd = nullptr;
+        vChunks.clear();
+        for (size_t i = 0; i < vSorted.size(); ++i) {
+            if (vEmpty[i]) {
+                ::operator delete(vSorted[i].first);
+                nAllocated -= vSorted[i].second * nBlockSize;
+            } else {
+                vChunks.push_back(vSorted[i]);
+            }
+        }
+    }
+
+    size_t BlockSize() const { return nBlockSize; }
+    size_t BlocksUsed() const { return nUsed; }
+    //! Bytes held in chunks, used or not.
+    size_t Allocated() const { return nAllocated; }
+
+private:
+    static const size_t MIN_CHUNK_BLOCKS = 16;
+    static const size_t MAX_CHUNK_BLOCKS = 4096;
+
+    //! Blocks are packed, each is aligned for its object and can hold the free list pointer.
+    static size_t BlockSize(size_t nSize, size_t nAlign) {
+        nAlign = std::max(nAlign, alignof(void*));
+        return (std::max(nSize, sizeof(void*)) + nAlign - 1) / nAlign * nAlign;
+    }
+
+    //! Index of the chunk holding p, in chunks sorted by address.
+    static size_t ChunkOf(const std::vector<std::pair<char*, size_t> >& vSorted, const void* p) {
+        std::vector<std::pair<char*, size_t> >::const_iterator it = std::upper_bound(vSorted.begin(), vSorted.end(),
+            std::make_pair(static_cast<char*>(const_cast<void*>(p)), std::numeric_limits<size_t>::max()));
+        return it - vSorted.begin() - 1;
+    }
+
+    void Release() {
+        for (const std::pair<char*, size_t>& chunk : vChunks)
+            ::operator delete(chunk.first);
+        vChunks.clear();
+        nAllocated = 0;
+        pFree = pCurrent = pEnd = nullptr;
+        nNextChunk = MIN_CHUNK_BLOCKS;
+    }
+
+    const size_t nBlockSize;
+    size_t nUsed;
+    size_t nAllocated;
+    size_t nNextChunk;
+    void* pFree;
+    char* pCurrent;
+    char* pEnd;
+    //! Start and number of blocks of each chunk.
+    std::vector<std::pair<char*, size_t> > vChunks;
+
+    FixedSizePool(const FixedSizePool&);
+    void operator=(const FixedSizePool&);
+};
+
+/**
+ * Allocator for node based containers of Value. Single object allocations of
+ * the container's nodes come from a FixedSizePool shared by all copies of the
+ * allocator, anything else (e.g. bucket arrays) from operator new.
+ *
+ * Containers rebind the allocator to their node type, which holds a Value
+ * and is at least as large. The pool is sized for that type when the first
+ * node is allocated, so that empty containers are cheap. A moved from
+ * allocator gets a new pool when it is used again.
+ */
+template <typename T, typename Value = T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U, typename V> friend class PoolAllocator;
+
+    PoolAllocator() noexcept {}
+    PoolAllocator(const PoolAllocator& o) noexcept : pool(o.pool) {}
+    PoolAllocator(PoolAllocator&& o) noexcept : pool(std::move(o.pool)) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, Value>& o) noexcept : pool(o.pool) {}
+
+    template <typename U>
+    struct rebind { typedef PoolAllocator<U, Value> other; };
+
+    PoolAllocator select_on_container_copy_construction() const { return PoolAllocator(); }
+
+    T* allocate(size_t n) {
+        if (n == 1 && IsNode()) {
+            if (!pool)
+                pool = std::make_shared<FixedSizePool>(sizeof(T), alignof(T));
+            if (pool->Accepts(sizeof(T), alignof(T)))
+                return static_cast<T*>(pool->Allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n == 1 && IsNode() && pool && pool->Accepts(sizeof(T), alignof(T)))
+            pool->Deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    //! Memory held by the pool, see memusage::DynamicUsage.
+    size_t PoolUsage() const { return pool ? pool->Allocated() : 0; }
+    //! Memory held by the pool in blocks that are not in use.
+    size_t PoolFree() const { return pool ? pool->Allocated() - pool->BlocksUsed() * pool->BlockSize() : 0; }
+    //! Return the chunks that are no longer used to the system.
+    void ReleaseUnused() const { if (pool) pool->ReleaseUnused(); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U, Value>& o) const { return pool == o.pool; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U, Value>& o) const { return pool != o.pool; }
+
+private:
+    //! Bucket arrays hold pointers, a node holds a Value.
+    static bool IsNode() { return !std::is_pointer<T>::value && sizeof(T) >= sizeof(Value); }
+
+    std::shared_ptr<FixedSizePool> pool;
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -15,6 +15,7 @@
 #include "script/sighashtype.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanpool.h"
 #include "util.h"
 
 #include "test/test_bitcoin.h"
@@ -26,17 +27,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -129,17 +119,20 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!connman->IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+CTransaction RandomOrphan(const TxOrphanPool& orphans, const std::vector<uint256>& added)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    CTransaction tx;
+    NodeId peer;
+    while (!orphans.GetTx(added.at(GetRand(added.size())), tx, peer))
+        ;
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
+    TxOrphanPool orphans(1000, 10 * 1000000);
+    std::vector<uint256> added;
+
     CKey key;
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
@@ -157,13 +150,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(orphans.AddTx(tx, i));
+        added.push_back(tx.GetHash());
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(orphans, added);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -174,13 +168,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0, SigHashType::ALL | SigHashType::FORKID);
 
-        AddOrphanTx(tx, i);
+        if (orphans.AddTx(tx, i))
+            added.push_back(tx.GetHash());
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(orphans, added);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -198,25 +193,28 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!orphans.AddTx(tx, i));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphans.Size();
+        orphans.EraseForPeer(i);
+        BOOST_CHECK(orphans.Size() < sizeBefore);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    // Test LimitSize() function:
+    orphans.SetLimits(40, 10 * 1000000);
+    orphans.LimitSize();
+    BOOST_CHECK(orphans.Size() <= 40);
+    orphans.SetLimits(10, 10 * 1000000);
+    orphans.LimitSize();
+    BOOST_CHECK(orphans.Size() <= 10);
+    orphans.SetLimits(0, 10 * 1000000);
+    orphans.LimitSize();
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Size());
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Bytes());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
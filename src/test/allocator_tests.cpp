@@ -4,6 +4,8 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
@@ -117,4 +119,69 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_allocator)
+{
+    typedef std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+        PoolAllocator<std::pair<const uint64_t, uint64_t> > > PoolMap;
+
+    PoolMap m;
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolUsage(), 0U);
+    for (uint64_t i = 0; i < 1000; ++i)
+        m[i] = i;
+    // The pool holds whole chunks, their unused part is reported separately.
+    const size_t nHeld = m.get_allocator().PoolUsage();
+    const size_t nNodeUsage = (nHeld - m.get_allocator().PoolFree()) / m.size();
+    BOOST_CHECK_EQUAL(nHeld - m.get_allocator().PoolFree(), nNodeUsage * 1000);
+    BOOST_CHECK(nNodeUsage >= sizeof(PoolMap::value_type));
+    BOOST_CHECK(nNodeUsage <= sizeof(PoolMap::value_type) + 2 * sizeof(void*));
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(m),
+        nHeld + memusage::MallocUsage(sizeof(void*) * m.bucket_count()));
+
+    // Freed nodes are kept for reuse.
+    for (uint64_t i = 0; i < 500; ++i)
+        m.erase(i);
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolUsage(), nHeld);
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolFree(), nHeld - nNodeUsage * 500);
+    for (uint64_t i = 0; i < 500; ++i)
+        m[i] = i;
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolUsage(), nHeld);
+    for (uint64_t i = 0; i < 1000; ++i)
+        BOOST_CHECK_EQUAL(m.at(i), i);
+
+    // Chunks that only hold free blocks can be released. The last nodes
+    // were carved from the last chunk, the earlier chunks become empty.
+    for (uint64_t i = 0; i < 900; ++i)
+        m.erase(i);
+    m.get_allocator().ReleaseUnused();
+    const size_t nReleased = nHeld - m.get_allocator().PoolUsage();
+    BOOST_CHECK(nReleased > 0);
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolFree(), m.get_allocator().PoolUsage() - nNodeUsage * 100);
+    for (uint64_t i = 900; i < 1000; ++i)
+        BOOST_CHECK_EQUAL(m.at(i), i);
+    // Nothing is left to release.
+    m.get_allocator().ReleaseUnused();
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolUsage(), nHeld - nReleased);
+    for (uint64_t i = 0; i < 900; ++i)
+        m[i] = i;
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolFree(), m.get_allocator().PoolUsage() - nNodeUsage * 1000);
+    for (uint64_t i = 0; i < 1000; ++i)
+        BOOST_CHECK_EQUAL(m.at(i), i);
+
+    // Copies get their own pool.
+    PoolMap copy(m);
+    BOOST_CHECK(copy.get_allocator() != m.get_allocator());
+    m.clear();
+    BOOST_CHECK_EQUAL(m.get_allocator().PoolUsage(), 0U);
+    BOOST_CHECK_EQUAL(copy.size(), 1000U);
+    BOOST_CHECK_EQUAL(copy.at(999), 999U);
+
+    // A moved from map can be used again.
+    PoolMap moved(std::move(copy));
+    BOOST_CHECK_EQUAL(moved.size(), 1000U);
+    copy.clear();
+    copy[1] = 1;
+    BOOST_CHECK(copy.get_allocator() != moved.get_allocator());
+    BOOST_CHECK_EQUAL(moved.get_allocator().PoolUsage() - moved.get_allocator().PoolFree(), nNodeUsage * 1000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockcompression.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcompression_tests, TestingSetup)
+
+namespace {
+
+std::vector<unsigned char> RandomBytes(FastRandomContext& rng, size_t n)
+{
+    std::vector<unsigned char> bytes(n);
+    for (unsigned char& c : bytes)
+        c = rng.rand32() & 0xff;
+    return bytes;
+}
+
+// The genesis header, with pay to pubkey hash transactions of random
+// signatures, keys and hashes after the coinbase.
+CBlock MakeBlock()
+{
+    FastRandomContext rng(true);
+    CBlock block = Params().GenesisBlock();
+    for (int i = 0; i < 200; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1 + i % 2);
+        for (CTxIn& in : tx.vin) {
+            in.prevout = COutPoint(ArithToUint256(arith_uint256(rng.rand64())), i % 3);
+            in.scriptSig << RandomBytes(rng, 72) << RandomBytes(rng, 33);
+        }
+        tx.vout.resize(2);
+        for (CTxOut& out : tx.vout) {
+            out.nValue = rng.rand32();
+            out.scriptPubKey << OP_DUP << OP_HASH160 << RandomBytes(rng, 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+std::vector<unsigned char> Serialize(const CBlock& block)
+{
+    CDataStream stream(SER_DISK, CLIENT_VERSION);
+    stream << block;
+    return std::vector<unsigned char>(stream.begin(), stream.end());
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(compress_roundtrip)
+{
+    const std::vector<unsigned char> block = Serialize(MakeBlock());
+    std::vector<unsigned char> compressed, decompressed;
+    CompressBlock(block.data(), block.size(), compressed);
+    BOOST_CHECK(compressed.size() < block.size());
+    // The header is kept as it is.
+    BOOST_CHECK(std::equal(block.begin(), block.begin() + BLOCK_HEADER_SIZE, compressed.begin()));
+    BOOST_CHECK(DecompressBlock(compressed.data(), compressed.size(), decompressed));
+    BOOST_CHECK(decompressed == block);
+
+    // Just the header
+    CompressBlock(block.data(), BLOCK_HEADER_SIZE, compressed);
+    BOOST_CHECK(DecompressBlock(compressed.data(), compressed.size(), decompressed));
+    BOOST_CHECK(decompressed == std::vector<unsigned char>(block.begin(), block.begin() + BLOCK_HEADER_SIZE));
+}
+
+BOOST_AUTO_TEST_CASE(decompress_corrupt)
+{
+    const std::vector<unsigned char> block = Serialize(MakeBlock());
+    std::vector<unsigned char> compressed, decompressed;
+    CompressBlock(block.data(), block.size(), compressed);
+
+    BOOST_CHECK(!DecompressBlock(compressed.data(), BLOCK_HEADER_SIZE + 3, decompressed));
+    BOOST_CHECK(!DecompressBlock(compressed.data(), compressed.size() - 1, decompressed));
+    // More than LZ4 can expand to
+    std::vector<unsigned char> oversized(compressed);
+    WriteLE32(oversized.data() + BLOCK_HEADER_SIZE, (oversized.size() - BLOCK_HEADER_SIZE - 4) * 255 + 1);
+    BOOST_CHECK(!DecompressBlock(oversized.data(), oversized.size(), decompressed));
+}
+
+BOOST_AUTO_TEST_CASE(store_compressed)
+{
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+    const CBlock block = MakeBlock();
+    const std::vector<unsigned char> serialized = Serialize(block);
+
+    fCompressBlocks = true;
+    std::vector<unsigned char> vRecord;
+    SerializeBlockRecord(block, Params().DBMagic(), vRecord);
+    BOOST_CHECK(vRecord.size() < BLOCK_RECORD_HEADER_SIZE + serialized.size());
+    BOOST_CHECK(ReadLE32(vRecord.data() + MESSAGE_START_SIZE) & BLOCK_COMPRESSED_FLAG);
+
+    // Next to a block stored as it is.
+    CDiskBlockPos pos1(0, 0);
+    BOOST_REQUIRE(WriteBlockRecord(vRecord, pos1));
+    fCompressBlocks = false;
+    CDiskBlockPos pos2(0, pos1.nPos + vRecord.size() - BLOCK_RECORD_HEADER_SIZE);
+    BOOST_REQUIRE(WriteBlockToDisk(const_cast<CBlock&>(block), pos2, Params().DBMagic()));
+
+    for (const CDiskBlockPos& pos : {pos1, pos2}) {
+        CBlock read;
+        BOOST_CHECK(ReadBlockFromDisk(read, pos, Params().GetConsensus()));
+        BOOST_CHECK(Serialize(read) == serialized);
+
+        const uint256 hash = block.GetHash();
+        CBlockIndex index;
+        index.phashBlock = &hash;
+        index.nFile = pos.nFile;
+        index.nDataPos = pos.nPos;
+        index.nStatus = BLOCK_HAVE_DATA;
+        std::vector<unsigned char> raw;
+        BOOST_CHECK(ReadRawBlockFromDisk(raw, &index, Params().DBMagic()));
+        BOOST_CHECK(raw == serialized);
+    }
+
+    // Found by a reindex
+    std::vector<std::pair<CBlockHeader, CDiskBlockPos> > vBlocks;
+    BOOST_CHECK(ScanBlockFile(0, vBlocks));
+    BOOST_REQUIRE_EQUAL(vBlocks.size(), 2);
+    BOOST_CHECK(vBlocks[0].second == pos1);
+    BOOST_CHECK(vBlocks[1].second == pos2);
+    BOOST_CHECK(vBlocks[0].first.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
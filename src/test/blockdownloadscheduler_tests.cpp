@@ -0,0 +1,98 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockdownloadscheduler.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockdownloadscheduler_tests, BasicTestingSetup)
+
+namespace {
+
+const int MAX_IN_FLIGHT = 16;
+
+// node delivers count blocks after start, one every interval, each
+// requested latency before it's delivered. Returns the last delivery time.
+int64_t Deliver(BlockDownloadScheduler& s, NodeId node, int count,
+                int64_t start, int64_t interval, int64_t latency)
+{
+    int64_t now = start;
+    for (int i = 0; i < count; ++i) {
+        now += interval;
+        s.delivered(node, now - latency, now);
+    }
+    return now;
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(share_by_rate)
+{
+    BlockDownloadScheduler s(MAX_IN_FLIGHT);
+
+    // Not measured yet
+    BOOST_CHECK_EQUAL(s.share(1), MAX_IN_FLIGHT);
+    int64_t now = Deliver(s, 1, 3, 0, 100000, 400000);
+    BOOST_CHECK_EQUAL(s.share(1), MAX_IN_FLIGHT);
+
+    Deliver(s, 1, 7, now, 100000, 400000);
+    Deliver(s, 2, 10, 0, 400000, 1600000);
+    Deliver(s, 3, 10, 0, 100000000, 100000000);
+    BOOST_CHECK_EQUAL(s.share(1), MAX_IN_FLIGHT);
+    BOOST_CHECK_EQUAL(s.share(2), MAX_IN_FLIGHT / 4);
+    // Never less than one
+    BOOST_CHECK_EQUAL(s.share(3), 1);
+    BOOST_CHECK_EQUAL(s.share(4), MAX_IN_FLIGHT);
+
+    BlockDownloadStats stats = s.stats(2);
+    BOOST_CHECK_EQUAL(stats.delivered, 10u);
+    BOOST_CHECK_EQUAL(stats.interval, 400000);
+    BOOST_CHECK_EQUAL(stats.latency, 1600000);
+
+    // The fastest one is gone.
+    s.remove(1);
+    BOOST_CHECK_EQUAL(s.share(2), MAX_IN_FLIGHT);
+    BOOST_CHECK_EQUAL(s.stats(1).delivered, 0u);
+
+    s.clear();
+    BOOST_CHECK_EQUAL(s.share(3), MAX_IN_FLIGHT);
+}
+
+BOOST_AUTO_TEST_CASE(interval_after_idle)
+{
+    BlockDownloadScheduler s(MAX_IN_FLIGHT);
+
+    // The time it had nothing in flight doesn't count against it.
+    int64_t now = Deliver(s, 1, 5, 0, 100000, 100000);
+    s.delivered(1, now + 10000000, now + 10100000);
+    BOOST_CHECK_EQUAL(s.stats(1).interval, 100000);
+    BOOST_CHECK_EQUAL(s.stats(1).latency, 100000);
+}
+
+BOOST_AUTO_TEST_CASE(rerequest)
+{
+    BlockDownloadScheduler s(MAX_IN_FLIGHT);
+    Deliver(s, 1, 10, 0, 100000, 500000);
+    Deliver(s, 2, 10, 0, 1000000, 5000000);
+    Deliver(s, 3, 10, 0, 1000000, 1000000);
+
+    // Not late yet for what the faster one would take
+    BOOST_CHECK(!s.shouldRerequest(1, 2, 0, 900000));
+    BOOST_CHECK(s.shouldRerequest(1, 2, 0, 1100000));
+
+    // As fast, and not late by its own measure
+    BOOST_CHECK(!s.shouldRerequest(3, 2, 0, 3000000));
+    BOOST_CHECK(s.shouldRerequest(3, 2, 0, 11000000));
+
+    // Not measured
+    BOOST_CHECK(!s.shouldRerequest(4, 2, 0, 20000000));
+    BOOST_CHECK(s.shouldRerequest(1, 4, 0, 1100000));
+    BOOST_CHECK(!s.shouldRerequest(1, 1, 0, 20000000));
+
+    s.rerequested(2);
+    BOOST_CHECK_EQUAL(s.stats(2).rerequested, 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
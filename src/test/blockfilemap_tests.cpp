@@ -0,0 +1,137 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <cstdio>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+namespace {
+
+void Append(const boost::filesystem::path& path, const std::string& data)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(data.data(), 1, data.size(), file), data.size());
+    fclose(file);
+}
+
+std::string Read(const std::shared_ptr<const CBlockFileMaps::Mapping>& mapping)
+{
+    return std::string(mapping->pData, mapping->nSize);
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(map_and_remap)
+{
+    CBlockFileMaps maps(2);
+    const boost::filesystem::path path = pathTemp / "blk00000.dat";
+
+    // Missing file
+    BOOST_CHECK(!maps.Get(path, 0));
+
+    Append(path, "abcd");
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping = maps.Get(path, 4);
+    BOOST_REQUIRE(mapping);
+    BOOST_CHECK_EQUAL(Read(mapping), "abcd");
+    BOOST_CHECK(maps.Get(path, 2) == mapping);
+
+    // Past the end of the file
+    BOOST_CHECK(!maps.Get(path, 5));
+
+    // Grown since mapped, the old mapping stays valid while held.
+    Append(path, "efgh");
+    BOOST_CHECK(maps.Get(path, 4) == mapping);
+    std::shared_ptr<const CBlockFileMaps::Mapping> grown = maps.Get(path, 8);
+    BOOST_REQUIRE(grown);
+    BOOST_CHECK_EQUAL(Read(grown), "abcdefgh");
+    BOOST_CHECK_EQUAL(Read(mapping), "abcd");
+
+    // Truncated
+    boost::filesystem::resize_file(path, 2);
+    maps.Invalidate(path);
+    BOOST_CHECK(!maps.Get(path, 4));
+    BOOST_REQUIRE(maps.Get(path, 2));
+    BOOST_CHECK_EQUAL(Read(maps.Get(path, 2)), "ab");
+}
+
+BOOST_AUTO_TEST_CASE(least_recently_used)
+{
+    CBlockFileMaps maps(2);
+    const boost::filesystem::path path1 = pathTemp / "blk00001.dat";
+    const boost::filesystem::path path2 = pathTemp / "blk00002.dat";
+    const boost::filesystem::path path3 = pathTemp / "blk00003.dat";
+    Append(path1, "1");
+    Append(path2, "2");
+    Append(path3, "3");
+
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping1 = maps.Get(path1, 1);
+    std::shared_ptr<const CBlockFileMaps::Mapping> mapping2 = maps.Get(path2, 1);
+    BOOST_CHECK(maps.Get(path1, 1) == mapping1);
+    maps.Get(path3, 1);
+
+    // path2 was dropped, path1 was used since.
+    BOOST_CHECK(maps.Get(path1, 1) == mapping1);
+    BOOST_CHECK(maps.Get(path2, 1) != mapping2);
+    BOOST_CHECK_EQUAL(Read(mapping2), "2");
+
+    CBlockFileMaps none(0);
+    BOOST_CHECK(!none.Get(path1, 1));
+}
+
+BOOST_AUTO_TEST_CASE(read_block_from_disk)
+{
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+    CBlock genesis = Params().GenesisBlock();
+
+    // Blocks written after the file was first read from.
+    CDiskBlockPos pos1(0, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos1, Params().DBMagic()));
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pos1, Params().GetConsensus()));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+
+    CDiskBlockPos pos2(0, pos1.nPos + ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos2, Params().DBMagic()));
+    BOOST_CHECK(pos2.nPos > pos1.nPos);
+    BOOST_CHECK(ReadBlockFromDisk(block, pos2, Params().GetConsensus()));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+
+    // Not the start of a block
+    BOOST_CHECK(!ReadBlockFromDisk(block, CDiskBlockPos(0, pos2.nPos + 1), Params().GetConsensus()));
+    BOOST_CHECK(!ReadBlockFromDisk(block, CDiskBlockPos(1, 8), Params().GetConsensus()));
+
+    // As stored
+    const uint256 hash = genesis.GetHash();
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    index.nFile = pos2.nFile;
+    index.nDataPos = pos2.nPos;
+    index.nStatus = BLOCK_HAVE_DATA;
+    std::vector<unsigned char> raw;
+    BOOST_CHECK(ReadRawBlockFromDisk(raw, &index, Params().DBMagic()));
+    CDataStream expected(SER_DISK, CLIENT_VERSION);
+    expected << genesis;
+    BOOST_CHECK(raw == std::vector<unsigned char>(expected.begin(), expected.end()));
+
+    const uint256 otherHash = uint256S("0xbeef");
+    index.phashBlock = &otherHash;
+    BOOST_CHECK(!ReadRawBlockFromDisk(raw, &index, Params().DBMagic()));
+    index.phashBlock = &hash;
+    index.nDataPos = pos2.nPos + 1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(raw, &index, Params().DBMagic()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/test/unit_test.hpp>
 #include "blockheaderprocessor.h"
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
 #include "test/dummyconnman.h"
+#include "test/test_bitcoin.h"
 #include "test/testutil.h"
 #include "test/thinblockutil.h"
 
@@ -146,4 +150,75 @@ BOOST_AUTO_TEST_CASE(test_find_missing_blocks_toofarbehind) {
     BOOST_CHECK_EQUAL(size_t(0), missing.size());
 }
 
+namespace {
+    struct RegtestSetup : public TestingSetup {
+        RegtestSetup() : TestingSetup(CBaseChainParams::REGTEST) { }
+    };
+
+    std::vector<CBlockHeader> MineHeaders(const CBlockIndex* prev, size_t count) {
+        std::vector<CBlockHeader> headers(count);
+        uint256 hashPrev = prev->GetBlockHash();
+        for (size_t i = 0; i < count; ++i) {
+            CBlockHeader& h = headers[i];
+            h.nVersion = 4;
+            h.hashPrevBlock = hashPrev;
+            h.nTime = prev->nTime + 600 * (i + 1);
+            h.nBits = prev->nBits;
+            while (!CheckProofOfWork(h.GetHash(), h.nBits, Params().GetConsensus()))
+                ++h.nNonce;
+            hashPrev = h.GetHash();
+        }
+        return headers;
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_accept_checked_headers, RegtestSetup) {
+    const std::vector<CBlockHeader> headers = MineHeaders(chainActive.Tip(), MAX_HEADERS_RESULTS);
+    CheckedHeaders checked(headers);
+    BOOST_CHECK_EQUAL(headers.size(), checked.valid);
+    BOOST_REQUIRE_EQUAL(headers.size(), checked.hashes.size());
+    for (size_t i = 0; i < headers.size(); ++i)
+        BOOST_CHECK(headers[i].GetHash() == checked.hashes[i]);
+
+    DummyHeaderProcessor p(GetDummyThinBlockMg());
+    LOCK(cs_main);
+    CBlockIndex* last = p(checked, false, false);
+    BOOST_REQUIRE(last != nullptr);
+    BOOST_CHECK_EQUAL(static_cast<int>(MAX_HEADERS_RESULTS), last->nHeight);
+    BOOST_CHECK(last->GetBlockHash() == checked.hashes.back());
+    BOOST_CHECK(pindexBestHeader == last);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_accept_checked_headers_invalid, RegtestSetup) {
+    std::vector<CBlockHeader> headers = MineHeaders(chainActive.Tip(), 1000);
+
+    // The first failure is reported, no matter which thread checked it.
+    headers[900].nTime = GetAdjustedTime() + 3 * 60 * 60;
+    while (CheckProofOfWork(headers[600].GetHash(), headers[600].nBits, Params().GetConsensus()))
+        ++headers[600].nNonce;
+    CheckedHeaders checked(headers);
+    BOOST_CHECK_EQUAL(size_t(600), checked.valid);
+    BOOST_CHECK_EQUAL("high-hash", checked.state.GetRejectReason());
+
+    headers.resize(601);
+    headers[600].hashPrevBlock = headers[599].GetHash();
+    headers[600].nTime = GetAdjustedTime() + 3 * 60 * 60;
+    while (!CheckProofOfWork(headers[600].GetHash(), headers[600].nBits, Params().GetConsensus()))
+        ++headers[600].nNonce;
+    CheckedHeaders future(headers);
+    BOOST_CHECK_EQUAL(size_t(600), future.valid);
+    BOOST_CHECK_EQUAL("time-too-new", future.state.GetRejectReason());
+
+    // The headers before it are accepted.
+    DummyHeaderProcessor p(GetDummyThinBlockMg());
+    LOCK(cs_main);
+    BOOST_CHECK_THROW(p(future, false, false), BlockHeaderError);
+    BOOST_CHECK(mapBlockIndex.count(future.hashes[599]));
+    BOOST_CHECK(!mapBlockIndex.count(future.hashes[600]));
+
+    // Not a sequence
+    std::swap(headers[10], headers[11]);
+    BOOST_CHECK_THROW(p(headers, false, false), BlockHeaderError);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
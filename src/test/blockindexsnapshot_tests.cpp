@@ -0,0 +1,191 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockindexsnapshot.h"
+#include "chain.h"
+#include "test/test_bitcoin.h"
+#include "txdb.h"
+
+#include <cstdio>
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindexsnapshot_tests, TestingSetup)
+
+namespace {
+
+struct BlockIndexMap {
+    CBlockIndexArena arena;
+    std::map<uint256, CBlockIndex*> entries;
+
+    CBlockIndex* Insert(const uint256& hash)
+    {
+        auto it = entries.find(hash);
+        if (it == entries.end()) {
+            it = entries.emplace(hash, arena.New()).first;
+            it->second->phashBlock = &it->first;
+        }
+        return it->second;
+    }
+};
+
+// A chain of 10 blocks, with a fork of 2 off height 5.
+std::vector<const CBlockIndex*> MakeTree(BlockIndexMap& map)
+{
+    std::vector<const CBlockIndex*> vEntries;
+    for (int i = 0; i < 12; ++i) {
+        CBlockIndex* pindex = map.Insert(ArithToUint256(arith_uint256(i + 1)));
+        pindex->pprev = i == 0 ? NULL : i == 10 ? map.Insert(ArithToUint256(arith_uint256(6))) : const_cast<CBlockIndex*>(vEntries.back());
+        pindex->nHeight = pindex->pprev ? pindex->pprev->nHeight + 1 : 0;
+        pindex->nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+        pindex->nTx = 10 + i;
+        pindex->nFile = i / 4;
+        pindex->nDataPos = 1000 * i;
+        pindex->nUndoPos = 100 * i;
+        pindex->nVersion = 4;
+        pindex->hashMerkleRoot = ArithToUint256(arith_uint256(100 + i));
+        pindex->nTime = 1500000000 + i;
+        pindex->nBits = 0x207fffff;
+        pindex->nNonce = i * 3;
+        pindex->nSerialVersion = 1;
+        pindex->nMaxBlockSize = 8000000 + i;
+        pindex->nMaxBlockSizeVote = 16000000 + i;
+        vEntries.push_back(pindex);
+    }
+    return vEntries;
+}
+
+void CheckEqual(const CBlockIndex& a, const CBlockIndex& b)
+{
+    BOOST_CHECK(a.GetBlockHash() == b.GetBlockHash());
+    BOOST_CHECK((a.pprev == NULL) == (b.pprev == NULL));
+    if (a.pprev && b.pprev)
+        BOOST_CHECK(a.pprev->GetBlockHash() == b.pprev->GetBlockHash());
+    BOOST_CHECK_EQUAL(a.nHeight, b.nHeight);
+    BOOST_CHECK_EQUAL(a.nStatus, b.nStatus);
+    BOOST_CHECK_EQUAL(a.nTx, b.nTx);
+    BOOST_CHECK_EQUAL(a.nFile, b.nFile);
+    BOOST_CHECK_EQUAL(a.nDataPos, b.nDataPos);
+    BOOST_CHECK_EQUAL(a.nUndoPos, b.nUndoPos);
+    BOOST_CHECK(a.GetBlockHeader().GetHash() == b.GetBlockHeader().GetHash());
+    BOOST_CHECK_EQUAL(a.nSerialVersion, b.nSerialVersion);
+    BOOST_CHECK_EQUAL(a.nMaxBlockSize, b.nMaxBlockSize);
+    BOOST_CHECK_EQUAL(a.nMaxBlockSizeVote, b.nMaxBlockSizeVote);
+}
+
+void FlipByte(const boost::filesystem::path& path, long nPos)
+{
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, nPos, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, nPos, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(write_and_load)
+{
+    const boost::filesystem::path path = pathTemp / BLOCK_INDEX_SNAPSHOT_FILENAME;
+    const uint256 hashState = uint256S("0xabcd");
+    BlockIndexMap written;
+    const std::vector<const CBlockIndex*> vWritten = MakeTree(written);
+    BOOST_REQUIRE(CBlockIndexSnapshot::Write(path, hashState, vWritten));
+    BOOST_CHECK(!boost::filesystem::exists(path.string() + ".new"));
+
+    CBlockIndexSnapshot snapshot;
+    BOOST_REQUIRE(snapshot.Read(path, hashState));
+    BOOST_CHECK_EQUAL(snapshot.size(), vWritten.size());
+
+    BlockIndexMap loaded;
+    std::vector<CBlockIndex*> vLoaded;
+    BOOST_REQUIRE(snapshot.Load([&loaded](const uint256& hash) { return loaded.Insert(hash); }, vLoaded));
+    BOOST_REQUIRE_EQUAL(vLoaded.size(), vWritten.size());
+    BOOST_CHECK_EQUAL(loaded.entries.size(), vWritten.size());
+    for (size_t i = 0; i < vWritten.size(); ++i)
+        CheckEqual(*vWritten[i], *vLoaded[i]);
+    // The fork links to the main chain entry.
+    BOOST_CHECK(vLoaded[10]->pprev == vLoaded[5]);
+
+    // Taken of another state
+    BOOST_CHECK(!snapshot.Read(path, uint256S("0xabce")));
+}
+
+BOOST_AUTO_TEST_CASE(parents_first)
+{
+    BlockIndexMap map;
+    std::vector<const CBlockIndex*> vEntries = MakeTree(map);
+    std::swap(vEntries[3], vEntries[4]);
+    BOOST_CHECK(!CBlockIndexSnapshot::Write(pathTemp / BLOCK_INDEX_SNAPSHOT_FILENAME, uint256(), vEntries));
+    BOOST_CHECK(!boost::filesystem::exists(pathTemp / BLOCK_INDEX_SNAPSHOT_FILENAME));
+}
+
+BOOST_AUTO_TEST_CASE(corrupted)
+{
+    const boost::filesystem::path path = pathTemp / BLOCK_INDEX_SNAPSHOT_FILENAME;
+    BlockIndexMap map;
+    BOOST_REQUIRE(CBlockIndexSnapshot::Write(path, uint256(), MakeTree(map)));
+    const uintmax_t nSize = boost::filesystem::file_size(path);
+
+    CBlockIndexSnapshot snapshot;
+    FlipByte(path, nSize / 2);
+    BOOST_CHECK(!snapshot.Read(path, uint256()));
+    BOOST_CHECK_EQUAL(snapshot.size(), 0);
+    FlipByte(path, nSize / 2);
+    BOOST_CHECK(snapshot.Read(path, uint256()));
+
+    boost::filesystem::resize_file(path, nSize - 1);
+    BOOST_CHECK(!snapshot.Read(path, uint256()));
+    boost::filesystem::resize_file(path, 10);
+    BOOST_CHECK(!snapshot.Read(path, uint256()));
+    boost::filesystem::remove(path);
+    BOOST_CHECK(!snapshot.Read(path, uint256()));
+}
+
+BOOST_AUTO_TEST_CASE(index_generation)
+{
+    // Every write of the index counts, across restarts, whether the last
+    // block file changes or not.
+    BlockIndexMap map;
+    const std::vector<const CBlockIndex*> vEntries = MakeTree(map);
+    const CBlockFileInfo info;
+    bool fObfuscated;
+    {
+        CBlockTreeDB db(1 << 20, fObfuscated, false, true);
+        BOOST_CHECK_EQUAL(db.GetIndexGeneration(), 0U);
+        BOOST_CHECK(db.WriteBatchSync({ std::make_pair(0, &info) }, 0, vEntries));
+        BOOST_CHECK(db.WriteBatchSync({}, 0, { vEntries[3] }));
+        BOOST_CHECK_EQUAL(db.GetIndexGeneration(), 2U);
+    }
+    CBlockTreeDB db(1 << 20, fObfuscated);
+    BOOST_CHECK_EQUAL(db.GetIndexGeneration(), 2U);
+    BOOST_CHECK(db.WriteBatchSync({}, 0, {}));
+    BOOST_CHECK_EQUAL(db.GetIndexGeneration(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(arena)
+{
+    CBlockIndexArena arena;
+    arena.Reserve(5000);
+    std::vector<CBlockIndex*> vEntries;
+    for (int i = 0; i < 10000; ++i) {
+        CBlockIndex* pindex = arena.New();
+        pindex->nHeight = i;
+        vEntries.push_back(pindex);
+    }
+    for (int i = 0; i < 10000; ++i)
+        BOOST_CHECK_EQUAL(vEntries[i]->nHeight, i);
+    CBlockHeader header;
+    header.nTime = 1234;
+    BOOST_CHECK_EQUAL(arena.New(header)->nTime, 1234);
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.New()->nHeight, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
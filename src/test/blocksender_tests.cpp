@@ -9,6 +9,7 @@
 #include "net.h"
 #include "uint256.h"
 #include "protocol.h"
+#include "streams.h"
 #include "chain.h"
 #include "xthin.h"
 #include <string>
@@ -94,15 +95,24 @@ BOOST_AUTO_TEST_CASE(can_send) {
 }
 
 struct BlockSenderDummy : public BlockSender {
-    BlockSenderDummy() : BlockSender(), readBlock(TestBlock1())
+    BlockSenderDummy() : BlockSender(), readBlock(TestBlock1()),
+        blocksRead(0), rawBlocksRead(0)
     {
     }
 
     virtual bool readBlockFromDisk(CBlock& block, const CBlockIndex* pindex) {
         block = readBlock;
+        ++blocksRead;
+        return true;
+    }
+    virtual bool readRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex) {
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, block, 0, readBlock);
+        ++rawBlocksRead;
         return true;
     }
     CBlock readBlock;
+    int blocksRead;
+    int rawBlocksRead;
 };
 
 BOOST_AUTO_TEST_CASE(send_msg_block) {
@@ -113,6 +123,10 @@ BOOST_AUTO_TEST_CASE(send_msg_block) {
 
     bs.sendBlock(connman, node, index, MSG_BLOCK, index.nHeight);
     BOOST_CHECK(connman.MsgWasSent(node, "block", 0));
+
+    // Full blocks are sent as stored.
+    BOOST_CHECK_EQUAL(0, bs.blocksRead);
+    BOOST_CHECK_EQUAL(1, bs.rawBlocksRead);
 }
 
 // We don't support this message, so we fallback to sending
@@ -209,6 +223,8 @@ BOOST_AUTO_TEST_CASE(send_cmpctblock_depth) {
     // outside depth
     bs.sendBlock(connman, node, index, MSG_CMPCT_BLOCK, index.nHeight + 6);
     BOOST_CHECK(connman.MsgWasSent(node, "block", 1));
+    BOOST_CHECK_EQUAL(1, bs.blocksRead);
+    BOOST_CHECK_EQUAL(1, bs.rawBlocksRead);
 }
 
 BOOST_AUTO_TEST_CASE(send_xthinblock_depth) {
@@ -5,6 +5,7 @@
 #include "clientversion.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "random.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 
@@ -62,4 +63,64 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+static CBlock LargeBlock(size_t nTx)
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(coinbase);
+    for (size_t i = 1; i < nTx; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_CHECKSIG;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_FIXTURE_TEST_CASE(parallel_first_error, TestingSetup)
+{
+    CBlock block = LargeBlock(5000);
+    CValidationState state;
+    BOOST_CHECK(CheckBlock(block, state, false, false));
+
+    // Two invalid transactions, the first in block order is reported no
+    // matter which range is checked first.
+    CMutableTransaction negative(block.vtx[3000]);
+    negative.vout[0].nValue = -1;
+    CMutableTransaction duplicate(block.vtx[4000]);
+    duplicate.vin.push_back(duplicate.vin[0]);
+    block.vtx[3000] = negative;
+    block.vtx[4000] = duplicate;
+    for (int i = 0; i < 20; ++i) {
+        CValidationState state;
+        BOOST_CHECK(!CheckBlock(block, state, false, false));
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-vout-negative");
+    }
+
+    block.vtx[1] = duplicate;
+    state = CValidationState();
+    BOOST_CHECK(!CheckBlock(block, state, false, false));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-inputs-duplicate");
+
+    // The sigops of all ranges are counted: 5 * 4999 of them go over the
+    // limit of a block below 1MB.
+    block = LargeBlock(5000);
+    for (size_t i = 1; i < block.vtx.size(); ++i) {
+        CMutableTransaction tx(block.vtx[i]);
+        tx.vout[0].scriptPubKey = CScript() << OP_CHECKSIG << OP_CHECKSIG << OP_CHECKSIG << OP_CHECKSIG << OP_CHECKSIG;
+        block.vtx[i] = tx;
+    }
+    BOOST_CHECK(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) < MAX_BLOCK_SIZE);
+    state = CValidationState();
+    BOOST_CHECK(!CheckBlock(block, state, false, false));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-blk-sigops");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
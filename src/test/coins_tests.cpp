@@ -4,6 +4,7 @@
 
 #include "coins.h"
 #include "script/standard.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "undo.h"
 #include "utilstrencodings.h"
@@ -14,6 +15,7 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 
 #include <boost/test/unit_test.hpp>
 
@@ -857,4 +859,185 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+static Coin MakeCoin(CAmount nValue)
+{
+    Coin coin;
+    coin.out.nValue = nValue;
+    coin.out.scriptPubKey.assign(uint32_t(56), 1);
+    coin.nHeight = 1;
+    return coin;
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_sync)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    const COutPoint added(GetRandHash(), 0);
+    const COutPoint spent(GetRandHash(), 0);
+    const COutPoint clean(GetRandHash(), 0);
+
+    {
+        CCoinsViewCacheTest setup(&base);
+        setup.AddCoin(spent, MakeCoin(1), false);
+        setup.AddCoin(clean, MakeCoin(2), false);
+        setup.SetBestBlock(GetRandHash());
+        BOOST_CHECK(setup.Flush());
+    }
+
+    cache.AddCoin(added, MakeCoin(3), false);
+    BOOST_CHECK(cache.SpendCoin(spent));
+    BOOST_CHECK(cache.HaveCoin(clean));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+
+    // Written entries stay, now unmodified. Spent ones are gone.
+    BOOST_CHECK_EQUAL(cache.map().size(), 2U);
+    BOOST_CHECK_EQUAL(cache.map().at(added).flags, 0);
+    BOOST_CHECK_EQUAL(cache.map().at(clean).flags, 0);
+    BOOST_CHECK(!cache.map().count(spent));
+    BOOST_CHECK(base.GetBestBlock() == cache.GetBestBlock());
+
+    Coin coin;
+    BOOST_CHECK(base.GetCoin(added, coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 3);
+    BOOST_CHECK(!base.GetCoin(spent, coin) || coin.IsSpent());
+
+    // Nothing left to write.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.map().size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // One coin per block, each block is a tick of the access clock.
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 10; ++i) {
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), MakeCoin(i + 1), false);
+        cache.SetBestBlock(GetRandHash());
+    }
+    BOOST_CHECK(cache.Sync());
+
+    // Use the oldest coin again, then add a modified one.
+    BOOST_CHECK(cache.HaveCoin(outpoints[0]));
+    const COutPoint dirty(GetRandHash(), 0);
+    cache.AddCoin(dirty, MakeCoin(11), false);
+
+    // Free blocks of the node pool don't count.
+    BOOST_CHECK_EQUAL(cache.Trim(cache.DynamicMemoryUsage()), 0U);
+    const size_t nUsage = cache.DynamicMemoryUsage() - cache.PoolFreeMemoryUsage();
+    const size_t nEvicted = cache.Trim(nUsage * 6 / 10);
+    cache.SelfTest();
+    BOOST_CHECK(nEvicted > 0 && nEvicted < 10);
+    BOOST_CHECK(cache.DynamicMemoryUsage() - cache.PoolFreeMemoryUsage() <= nUsage * 6 / 10);
+
+    // Least recently used are evicted first, modified ones never.
+    BOOST_CHECK(cache.map().count(dirty));
+    BOOST_CHECK(cache.map().count(outpoints[0]));
+    for (size_t i = 1; i < outpoints.size(); ++i)
+        BOOST_CHECK_EQUAL(cache.map().count(outpoints[i]), i > nEvicted ? 1U : 0U);
+
+    // Evicted coins are still found in the base.
+    BOOST_CHECK(cache.HaveCoin(outpoints[1]));
+
+    // Evicts all unmodified coins if needed.
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.map().size(), 1U);
+    BOOST_CHECK(cache.map().count(dirty));
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_write_behind, TestingSetup)
+{
+    bool fObfuscated;
+    CCoinsViewDB db(1 << 20, fObfuscated, true);
+    CCoinsViewWriteBehind writer(&db);
+    CCoinsViewCacheTest cache(&writer);
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; ++i) {
+        outpoints.push_back(COutPoint(GetRandHash(), i));
+        cache.AddCoin(outpoints.back(), MakeCoin(i + 1), false);
+    }
+    const uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Sync());
+
+    // Reads are consistent while the write may still be in flight.
+    CCoinsViewCache reader(&writer);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    for (const COutPoint& out : outpoints)
+        BOOST_CHECK(reader.HaveCoin(out));
+
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(outpoints[5], coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 6);
+
+    // Spends are served from the snapshot as well.
+    BOOST_CHECK(cache.SpendCoin(outpoints[5]));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(!writer.HaveCoin(outpoints[5]));
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK(!db.HaveCoin(outpoints[5]));
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_sorted_write, TestingSetup)
+{
+    bool fObfuscated;
+    CCoinsViewDB db(1 << 20, fObfuscated, true);
+    db.SetSortedWrites(true);
+    // Small enough to write in several partial batches.
+    mapArgs["-dbbatchsize"] = "1000";
+
+    std::map<COutPoint, Coin> coins;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 200; ++i) {
+            const COutPoint out(GetRandHash(), i % 3);
+            coins[out] = MakeCoin(i + 1);
+            cache.AddCoin(out, MakeCoin(i + 1), false);
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Spend some, keep the rest cached and unmodified.
+    CCoinsViewCacheTest cache(&db);
+    int n = 0;
+    for (auto it = coins.begin(); it != coins.end(); ++n) {
+        if (n % 4 == 0) {
+            BOOST_CHECK(cache.SpendCoin(it->first));
+            it = coins.erase(it);
+        } else {
+            BOOST_CHECK(cache.HaveCoin(it->first));
+            ++it;
+        }
+    }
+    const uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.map().size(), coins.size());
+    mapArgs.erase("-dbbatchsize");
+
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    std::unique_ptr<CCoinsViewCursor> cursor(db.Cursor());
+    size_t nFound = 0;
+    for (; cursor->Valid(); cursor->Next(), ++nFound) {
+        COutPoint key;
+        Coin coin;
+        BOOST_CHECK(cursor->GetKey(key) && cursor->GetValue(coin));
+        auto expected = coins.find(key);
+        BOOST_REQUIRE(expected != coins.end());
+        BOOST_CHECK(coin.out == expected->second.out);
+    }
+    BOOST_CHECK_EQUAL(nFound, coins.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,262 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsmapped.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+#include "util.h"
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(coinsmapped_tests, BasicTestingSetup)
+
+namespace {
+
+Coin RandomCoin()
+{
+    Coin coin;
+    coin.out.nValue = GetRand(21000000 * COIN);
+    coin.out.scriptPubKey.assign(GetRand(100) + 1, 0x51);
+    coin.nHeight = GetRand(500000);
+    coin.fCoinBase = GetRand(2);
+    return coin;
+}
+
+bool CoinsEqual(const Coin& a, const Coin& b)
+{
+    return a.out == b.out && a.nHeight == b.nHeight && a.fCoinBase == b.fCoinBase;
+}
+
+class TempDir
+{
+public:
+    TempDir() : path(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("coinsmapped_%%%%%%%%")) {}
+    ~TempDir() { boost::filesystem::remove_all(path); }
+    const boost::filesystem::path path;
+};
+
+// Apply random changes to both the store and a reference map.
+void RandomChanges(CCoinsViewMapped& store, std::map<COutPoint, Coin>& expected, int nAdd, int nSpend)
+{
+    CCoinsViewCache cache(&store);
+    for (int i = 0; i < nAdd; ++i) {
+        COutPoint out(GetRandHash(), GetRand(4));
+        Coin coin = RandomCoin();
+        expected[out] = coin;
+        cache.AddCoin(out, std::move(coin), false);
+    }
+    for (int i = 0; i < nSpend && !expected.empty(); ++i) {
+        auto it = expected.begin();
+        std::advance(it, GetRand(expected.size()));
+        BOOST_CHECK(cache.SpendCoin(it->first));
+        expected.erase(it);
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+}
+
+void CheckStore(const CCoinsViewMapped& store, const std::map<COutPoint, Coin>& expected)
+{
+    BOOST_CHECK_EQUAL(store.GetCount(), expected.size());
+    for (const auto& e : expected) {
+        Coin coin;
+        BOOST_CHECK(store.GetCoin(e.first, coin));
+        BOOST_CHECK(CoinsEqual(coin, e.second));
+    }
+
+    size_t nCursor = 0;
+    std::unique_ptr<CCoinsViewCursor> cursor(store.Cursor());
+    BOOST_CHECK(cursor->GetBestBlock() == store.GetBestBlock());
+    for (; cursor->Valid(); cursor->Next()) {
+        COutPoint key;
+        Coin coin;
+        BOOST_CHECK(cursor->GetKey(key));
+        BOOST_CHECK(cursor->GetValue(coin));
+        auto it = expected.find(key);
+        BOOST_CHECK(it != expected.end() && CoinsEqual(coin, it->second));
+        ++nCursor;
+    }
+    BOOST_CHECK_EQUAL(nCursor, expected.size());
+}
+
+std::vector<char> ReadFile(const boost::filesystem::path& path)
+{
+    std::ifstream file(path.string().c_str(), std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void WriteFile(const boost::filesystem::path& path, const std::vector<char>& data)
+{
+    std::ofstream file(path.string().c_str(), std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(write_read_spend)
+{
+    TempDir dir;
+    CCoinsViewMapped store(dir.path);
+    BOOST_CHECK(store.GetBestBlock().IsNull());
+    BOOST_CHECK(store.GetHeadBlocks().empty());
+
+    std::map<COutPoint, Coin> expected;
+    RandomChanges(store, expected, 1000, 0);
+    CheckStore(store, expected);
+    for (int i = 0; i < 10; ++i)
+        RandomChanges(store, expected, 200, 300);
+    CheckStore(store, expected);
+
+    BOOST_CHECK(!store.HaveCoin(COutPoint(GetRandHash(), 0)));
+    Coin coin;
+    BOOST_CHECK(!store.GetCoin(COutPoint(GetRandHash(), 0), coin));
+    BOOST_CHECK(store.GetHeadBlocks().empty());
+}
+
+BOOST_AUTO_TEST_CASE(reopen_grow_compact)
+{
+    TempDir dir;
+    std::map<COutPoint, Coin> expected;
+    uint256 hashBest;
+    {
+        CCoinsViewMapped store(dir.path);
+        // More coins than fit in the initial table.
+        for (int i = 0; i < 10; ++i)
+            RandomChanges(store, expected, 10000, 2000);
+        hashBest = store.GetBestBlock();
+    }
+    {
+        CCoinsViewMapped store(dir.path);
+        BOOST_CHECK(store.GetBestBlock() == hashBest);
+        CheckStore(store, expected);
+
+        const size_t nSize = store.EstimateSize();
+        BOOST_CHECK(store.Compact());
+        BOOST_CHECK(store.EstimateSize() < nSize);
+        CheckStore(store, expected);
+        RandomChanges(store, expected, 100, 100);
+        hashBest = store.GetBestBlock();
+    }
+    {
+        CCoinsViewMapped store(dir.path);
+        BOOST_CHECK(store.GetBestBlock() == hashBest);
+        CheckStore(store, expected);
+    }
+    {
+        CCoinsViewMapped store(dir.path, true);
+        BOOST_CHECK(store.GetBestBlock().IsNull());
+        BOOST_CHECK_EQUAL(store.GetCount(), 0U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(reopen_after_compaction)
+{
+    TempDir dir;
+    const boost::filesystem::path tablePath = dir.path / "table.dat";
+    const boost::filesystem::path oldLogPath = dir.path / "values00000.dat";
+    const boost::filesystem::path newLogPath = dir.path / "values00001.dat";
+    std::map<COutPoint, Coin> expected;
+    std::vector<char> vOldTable, vOldLog;
+    {
+        CCoinsViewMapped store(dir.path);
+        RandomChanges(store, expected, 1000, 500);
+        vOldTable = ReadFile(tablePath);
+        vOldLog = ReadFile(oldLogPath);
+        BOOST_CHECK(store.Compact());
+    }
+    BOOST_CHECK(!boost::filesystem::exists(oldLogPath));
+    BOOST_REQUIRE(boost::filesystem::exists(newLogPath));
+
+    // Interrupted after the new table was in place, before the old log was
+    // removed.
+    WriteFile(oldLogPath, vOldLog);
+    {
+        CCoinsViewMapped store(dir.path);
+        CheckStore(store, expected);
+    }
+    BOOST_CHECK(!boost::filesystem::exists(oldLogPath));
+    BOOST_CHECK(boost::filesystem::exists(newLogPath));
+
+    // The rename didn't make it to disk, the old table is back.
+    const std::vector<char> vNewTable = ReadFile(tablePath);
+    WriteFile(tablePath, vOldTable);
+    WriteFile(oldLogPath, vOldLog);
+    {
+        CCoinsViewMapped store(dir.path);
+        CheckStore(store, expected);
+    }
+    BOOST_CHECK(boost::filesystem::exists(oldLogPath));
+    BOOST_CHECK(!boost::filesystem::exists(newLogPath));
+
+    // A table whose log is gone isn't opened, and the other logs are kept.
+    WriteFile(tablePath, vNewTable);
+    BOOST_CHECK_THROW(CCoinsViewMapped store(dir.path), std::runtime_error);
+    BOOST_CHECK(boost::filesystem::exists(oldLogPath));
+}
+
+BOOST_AUTO_TEST_CASE(recover_interrupted_write)
+{
+    TempDir dir;
+    const boost::filesystem::path tablePath = dir.path / "table.dat";
+    const boost::filesystem::path journalPath = dir.path / "journal.dat";
+    std::map<COutPoint, Coin> expected;
+    uint256 hashBest;
+    {
+        CCoinsViewMapped store(dir.path);
+        RandomChanges(store, expected, 1000, 0);
+        store.InterruptNextWrite();
+        RandomChanges(store, expected, 200, 300);
+        BOOST_CHECK(store.GetBestBlock().IsNull());
+        BOOST_REQUIRE_EQUAL(store.GetHeadBlocks().size(), 2U);
+        hashBest = store.GetHeadBlocks()[0];
+    }
+    // None of the slots were written.
+    const std::vector<char> vBefore = ReadFile(tablePath);
+    const std::vector<char> vJournal = ReadFile(journalPath);
+    BOOST_CHECK(!vJournal.empty());
+    {
+        CCoinsViewMapped store(dir.path);
+        BOOST_CHECK(store.GetBestBlock() == hashBest);
+        BOOST_CHECK(store.GetHeadBlocks().empty());
+        CheckStore(store, expected);
+    }
+    BOOST_CHECK(!boost::filesystem::exists(journalPath));
+
+    // Some pages of the slots were written, which tears the slots that
+    // straddle their boundaries.
+    const std::vector<char> vAfter = ReadFile(tablePath);
+    BOOST_REQUIRE_EQUAL(vBefore.size(), vAfter.size());
+    const size_t nPage = 4096;
+    std::vector<char> vTorn(vBefore);
+    for (size_t nOffset = nPage; nOffset < vTorn.size(); nOffset += nPage) {
+        if (GetRand(2))
+            std::copy(vAfter.begin() + nOffset, vAfter.begin() + nOffset + nPage, vTorn.begin() + nOffset);
+    }
+    WriteFile(tablePath, vTorn);
+    WriteFile(journalPath, vJournal);
+    {
+        CCoinsViewMapped store(dir.path);
+        BOOST_CHECK(store.GetBestBlock() == hashBest);
+        CheckStore(store, expected);
+        RandomChanges(store, expected, 100, 100);
+        CheckStore(store, expected);
+    }
+
+    // A store left in transition can't be opened without a valid journal.
+    WriteFile(tablePath, vTorn);
+    std::vector<char> vCorrupt(vJournal);
+    vCorrupt[vCorrupt.size() / 2] ^= 1;
+    WriteFile(journalPath, vCorrupt);
+    BOOST_CHECK_THROW(CCoinsViewMapped store(dir.path), std::runtime_error);
+    boost::filesystem::remove(journalPath);
+    BOOST_CHECK_THROW(CCoinsViewMapped store(dir.path), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,57 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "fileremover.h"
+#include "test/test_bitcoin.h"
+
+#include <cstdio>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(fileremover_tests, TestingSetup)
+
+namespace {
+
+boost::filesystem::path Create(const boost::filesystem::path& path)
+{
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    fclose(file);
+    return path;
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(remove_and_wait)
+{
+    CFileRemover remover;
+    // Nothing queued
+    remover.Wait();
+
+    std::vector<boost::filesystem::path> paths;
+    for (int i = 0; i < 10; ++i)
+        paths.push_back(Create(pathTemp / strprintf("blk%05u.dat", i)));
+    // Missing files are skipped.
+    paths.push_back(pathTemp / "missing.dat");
+    const boost::filesystem::path keep = Create(pathTemp / "blk00010.dat");
+
+    remover.Remove(std::vector<boost::filesystem::path>(paths));
+    remover.Wait();
+    for (const boost::filesystem::path& path : paths)
+        BOOST_CHECK(!boost::filesystem::exists(path));
+    BOOST_CHECK(boost::filesystem::exists(keep));
+}
+
+BOOST_AUTO_TEST_CASE(remove_on_destruction)
+{
+    const boost::filesystem::path path = Create(pathTemp / "rev00000.dat");
+    {
+        CFileRemover remover;
+        remover.Remove({path});
+    }
+    BOOST_CHECK(!boost::filesystem::exists(path));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
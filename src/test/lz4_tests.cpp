@@ -0,0 +1,150 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lz4.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(lz4_tests, BasicTestingSetup)
+
+namespace {
+
+bool RoundTrip(const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> compressed;
+    LZ4Compress(data.data(), data.size(), compressed);
+    std::vector<unsigned char> decompressed(data.size());
+    return LZ4Decompress(compressed.data(), compressed.size(), decompressed.data(), decompressed.size())
+        && decompressed == data;
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(lz4_roundtrip)
+{
+    FastRandomContext rng(true);
+
+    // Too short to hold a match.
+    for (size_t n = 0; n < 20; ++n)
+        BOOST_CHECK(RoundTrip(std::vector<unsigned char>(n, 'a')));
+
+    // Incompressible, with literal runs longer than 255 bytes.
+    std::vector<unsigned char> random(100000);
+    for (unsigned char& c : random)
+        c = rng.rand32() & 0xff;
+    BOOST_CHECK(RoundTrip(random));
+
+    // Long and overlapping matches.
+    BOOST_CHECK(RoundTrip(std::vector<unsigned char>(100000, 0)));
+
+    // Repeats further apart than the 64k an offset can reach.
+    std::vector<unsigned char> repeated(random.begin(), random.begin() + 1000);
+    repeated.insert(repeated.end(), random.begin(), random.end());
+    repeated.insert(repeated.end(), random.begin(), random.begin() + 1000);
+    BOOST_CHECK(RoundTrip(repeated));
+
+    // Short repeats mixed with noise, like scripts and heights in undo data.
+    std::vector<unsigned char> mixed;
+    for (int i = 0; i < 5000; ++i) {
+        mixed.push_back(rng.rand32() & 3);
+        mixed.insert(mixed.end(), {0x76, 0xa9, 0x14});
+        for (int j = 0; j < 20; ++j)
+            mixed.push_back(rng.rand32() & 0xff);
+    }
+    BOOST_CHECK(RoundTrip(mixed));
+
+    std::vector<unsigned char> compressed;
+    LZ4Compress(mixed.data(), mixed.size(), compressed);
+    BOOST_CHECK(compressed.size() < mixed.size());
+}
+
+BOOST_AUTO_TEST_CASE(lz4_corrupt)
+{
+    std::vector<unsigned char> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = i % 7;
+    std::vector<unsigned char> compressed;
+    LZ4Compress(data.data(), data.size(), compressed);
+
+    std::vector<unsigned char> out(data.size());
+    BOOST_CHECK(LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+
+    // Wrong size
+    BOOST_CHECK(!LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size() - 1));
+    std::vector<unsigned char> larger(data.size() + 1);
+    BOOST_CHECK(!LZ4Decompress(compressed.data(), compressed.size(), larger.data(), larger.size()));
+
+    // Truncated
+    for (size_t n = 0; n < compressed.size(); ++n)
+        BOOST_CHECK(!LZ4Decompress(compressed.data(), n, out.data(), out.size()));
+
+    // Offset ahead of the output
+    std::vector<unsigned char> bad = {0x10, 'a', 0x02, 0x00, 0x00};
+    BOOST_CHECK(!LZ4Decompress(bad.data(), bad.size(), out.data(), 5));
+    bad[2] = 0x00;
+    BOOST_CHECK(!LZ4Decompress(bad.data(), bad.size(), out.data(), 5));
+    std::vector<unsigned char> good = {0x10, 'a', 0x01, 0x00, 0x00};
+    BOOST_CHECK(LZ4Decompress(good.data(), good.size(), out.data(), 5));
+    BOOST_CHECK(std::vector<unsigned char>(out.begin(), out.begin() + 5) == std::vector<unsigned char>(5, 'a'));
+
+    // Random garbage must not crash
+    FastRandomContext rng(true);
+    for (int i = 0; i < 1000; ++i) {
+        std::vector<unsigned char> garbage(1 + rng.randrange(63));
+        for (unsigned char& c : garbage)
+            c = rng.rand32() & 0xff;
+        LZ4Decompress(garbage.data(), garbage.size(), out.data(), out.size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lz4_dictionary)
+{
+    FastRandomContext rng(true);
+    std::vector<unsigned char> dict(100000);
+    for (unsigned char& c : dict)
+        c = rng.rand32() & 0xff;
+
+    // Pieces of the end of the dictionary, the first one running into the
+    // data. Close enough to its end for them to be in the hash table.
+    std::vector<unsigned char> data(dict.end() - 50, dict.end());
+    data.insert(data.end(), data.begin(), data.end());
+    for (int i = 0; i < 100; ++i) {
+        const size_t nPos = dict.size() - 1 - rng.randrange(2000);
+        const size_t nLen = std::min<size_t>(4 + rng.randrange(40), dict.size() - nPos);
+        data.insert(data.end(), dict.begin() + nPos, dict.begin() + nPos + nLen);
+        data.push_back(rng.rand32() & 0xff);
+    }
+
+    std::vector<unsigned char> plain, compressed;
+    LZ4Compress(data.data(), data.size(), plain);
+    LZ4Compress(data.data(), data.size(), compressed, dict.data(), dict.size());
+    BOOST_CHECK(compressed.size() < plain.size() / 2);
+
+    std::vector<unsigned char> out(data.size());
+    BOOST_CHECK(LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size(), dict.data(), dict.size()));
+    BOOST_CHECK(out == data);
+
+    // Only the last 64 kB of the dictionary count.
+    std::vector<unsigned char> tail(dict.end() - 65535, dict.end());
+    BOOST_CHECK(LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size(), tail.data(), tail.size()));
+    BOOST_CHECK(out == data);
+
+    // Without the dictionary
+    BOOST_CHECK(!LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size()));
+    std::vector<unsigned char> shorter(dict.end() - 1000, dict.end());
+    BOOST_CHECK(!LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size(), shorter.data(), shorter.size()) || out != data);
+
+    // Too short to compress against it
+    std::vector<unsigned char> small(dict.end() - 10, dict.end());
+    LZ4Compress(small.data(), small.size(), compressed, dict.data(), dict.size());
+    out.resize(small.size());
+    BOOST_CHECK(LZ4Decompress(compressed.data(), compressed.size(), out.data(), out.size(), dict.data(), dict.size()));
+    BOOST_CHECK(out == small);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,10 +3,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "clientversion.h"
 #include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -72,4 +77,91 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(disconnected_transactions_overflow)
+{
+    auto spend = [](const COutPoint& prevout) {
+        CMutableTransaction tx;
+        tx.vin.push_back(CTxIn(prevout));
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+        return CTransaction(tx);
+    };
+    // Transactions of the old tip and of the block before it, each with a
+    // child in the mempool.
+    CBlock tip, prev;
+    tip.vtx.push_back(spend(COutPoint(GetRandHash(), 0)));
+    prev.vtx.push_back(spend(COutPoint(GetRandHash(), 0)));
+    CTransaction tipChild = spend(COutPoint(tip.vtx[0].GetHash(), 0));
+    CTransaction prevChild = spend(COutPoint(prev.vtx[0].GetHash(), 0));
+    CTransaction grandChild = spend(COutPoint(tipChild.GetHash(), 0));
+    TestMemPoolEntryHelper entry;
+    mempool.addUnchecked(tipChild.GetHash(), entry.FromTx(tipChild));
+    mempool.addUnchecked(prevChild.GetHash(), entry.FromTx(prevChild));
+    mempool.addUnchecked(grandChild.GetHash(), entry.FromTx(grandChild));
+
+    // Room for less than a block, one is kept all the same.
+    DisconnectedTransactions disconnected(1);
+    disconnected.AddBlock(tip);
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    // The old tip's transactions are dropped, with their descendants.
+    disconnected.AddBlock(prev);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+    BOOST_CHECK(mempool.exists(prevChild.GetHash()));
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(scan_block_file)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CDataStream block(SER_DISK, CLIENT_VERSION);
+    block << genesis;
+    const unsigned int nSize = block.size();
+
+    // Blocks, with garbage, false starts of the magic, a truncated record and
+    // a record with the wrong size in between.
+    CDataStream file(SER_DISK, CLIENT_VERSION);
+    std::vector<unsigned int> expected;
+    auto record = [&](unsigned int nRecordSize) {
+        file << FLATDATA(Params().DBMagic()) << nRecordSize;
+        expected.push_back(file.size());
+        file.write(&block[0], block.size());
+    };
+    record(nSize);
+    record(nSize);
+    file << std::string("garbage");
+    for (int i = 0; i < 3; ++i)
+        file.write((const char*)Params().DBMagic(), i + 1);
+    file << FLATDATA(Params().DBMagic()) << nSize << std::string("truncated");
+    record(nSize);
+    record(nSize + 100);
+    record(nSize);
+
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+    const CDiskBlockPos pos(7, 0);
+    auto scan = [&](const CDataStream& data) {
+        FILE* out = OpenBlockFile(pos);
+        BOOST_REQUIRE(out);
+        BOOST_REQUIRE_EQUAL(fwrite(&data[0], 1, data.size(), out), data.size());
+        BOOST_REQUIRE(TruncateFile(out, data.size()));
+        fclose(out);
+
+        std::vector<std::pair<CBlockHeader, CDiskBlockPos> > vBlocks;
+        BOOST_CHECK(ScanBlockFile(pos.nFile, vBlocks));
+        BOOST_REQUIRE_EQUAL(vBlocks.size(), expected.size());
+        for (size_t i = 0; i < vBlocks.size(); ++i) {
+            BOOST_CHECK(vBlocks[i].first.GetHash() == genesis.GetHash());
+            BOOST_CHECK_EQUAL(vBlocks[i].second.nFile, pos.nFile);
+            BOOST_CHECK_EQUAL(vBlocks[i].second.nPos, expected[i]);
+        }
+    };
+    // Ending with the last block, and with unused preallocated space.
+    scan(file);
+    file.write(std::vector<char>(1000, 0).data(), 1000);
+    scan(file);
+
+    // Missing file
+    std::vector<std::pair<CBlockHeader, CDiskBlockPos> > vBlocks;
+    BOOST_CHECK(!ScanBlockFile(pos.nFile + 1, vBlocks));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "chainparamsbase.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+struct RegtestingSetup : public TestingSetup {
+    RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) { }
+    ~RegtestingSetup() { SetMockTime(0); }
+};
+
+CTransaction Spend(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0] = CTxOut(nValue, CScript() << OP_TRUE);
+    return tx;
+}
+
+CTransaction Accept(const CTransaction& tx)
+{
+    CValidationState state;
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, true, nullptr, nullptr));
+    return tx;
+}
+
+int64_t EntryTime(const uint256& hash)
+{
+    LOCK(mempool.cs);
+    auto it = mempool.mapTx.find(hash);
+    BOOST_REQUIRE(it != mempool.mapTx.end());
+    return it->GetTime();
+}
+
+} // anon namespace
+
+BOOST_FIXTURE_TEST_SUITE(mempool_persist_tests, RegtestingSetup)
+
+BOOST_AUTO_TEST_CASE(dump_and_load)
+{
+    LOCK(cs_main);
+    const int64_t nTime = GetTime();
+    SetMockTime(nTime);
+
+    std::vector<CTransaction> txs;
+    for (int i = 0; i < 3; ++i) {
+        const COutPoint prevout(ArithToUint256(arith_uint256(i + 1)), 0);
+        pcoinsTip->AddCoin(prevout, Coin(CTxOut(COIN, CScript() << OP_TRUE), 0, false), false);
+        txs.push_back(Accept(Spend(prevout, COIN - 10000)));
+    }
+    // A child, which has to be loaded after its parent.
+    SetMockTime(nTime + 10);
+    txs.push_back(Accept(Spend(COutPoint(txs[0].GetHash(), 0), COIN - 20000)));
+    BOOST_REQUIRE_EQUAL(mempool.size(), 4u);
+    mempool.GetFeeModifier().AddDelta(txs[1].GetHash(), 500);
+
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(GetDataDir() / "mempool.dat"));
+    mempool.clear();
+    mempool.GetFeeModifier().RemoveDelta(txs[1].GetHash());
+
+    SetMockTime(nTime + 100);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 4u);
+    for (const CTransaction& tx : txs)
+        BOOST_CHECK(mempool.exists(tx.GetHash()));
+    BOOST_CHECK_EQUAL(EntryTime(txs[0].GetHash()), nTime);
+    BOOST_CHECK_EQUAL(EntryTime(txs[3].GetHash()), nTime + 10);
+    BOOST_CHECK_EQUAL(mempool.GetFeeModifier().GetDelta(txs[1].GetHash()), 500);
+
+    // The parents expired while the node was down, which the child can't
+    // do without.
+    mempool.clear();
+    SetMockTime(nTime + DEFAULT_MEMPOOL_EXPIRY * 60 * 60 + 5);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(load_bad_count)
+{
+    // Claims far more entries than the file holds.
+    CAutoFile file(fopen((GetDataDir() / "mempool.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    file << uint64_t(1);
+    file << (uint64_t(1) << 62);
+    file << Spend(COutPoint(uint256S("0x01"), 0), COIN);
+    file << GetTime();
+    file << CAmount(0);
+    file.fclose();
+
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0u);
+
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+    BOOST_CHECK(!LoadMempool());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -378,4 +379,163 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<3>(pool, sortedOrder);
 }
 
+static CMutableTransaction SpendOutputs(const std::vector<COutPoint>& prevouts)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(prevouts.size());
+    for (size_t i = 0; i < prevouts.size(); ++i) {
+        tx.vin[i].prevout = prevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 1 * COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.Fee(1000LL);
+
+    // A chain of 5 and an unrelated transaction.
+    std::vector<CMutableTransaction> chain;
+    chain.push_back(SpendOutputs({ COutPoint(GetRandHash(), 0) }));
+    for (int i = 1; i < 5; ++i) {
+        chain.push_back(SpendOutputs({ COutPoint(chain.back().GetHash(), 0) }));
+    }
+    CMutableTransaction unrelated = SpendOutputs({ COutPoint(GetRandHash(), 0) });
+    for (auto& tx : chain) {
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+    }
+    pool.addUnchecked(unrelated.GetHash(), entry.FromTx(unrelated));
+    BOOST_CHECK_EQUAL(size_t(2), pool.GetClusterCount());
+
+    auto it4 = pool.mapTx.find(chain[4].GetHash());
+    const auto& linearization = pool.GetClusterLinearization(it4);
+    BOOST_CHECK_EQUAL(size_t(5), linearization.size());
+    for (size_t i = 0; i < chain.size(); ++i) {
+        BOOST_CHECK(linearization[i]->GetTx().GetHash() == chain[i].GetHash());
+    }
+    BOOST_CHECK_EQUAL(5, it4->GetCountWithAncestors());
+
+    // Confirming the start of the chain updates the ancestor state of the rest.
+    std::vector<CTransaction> vtx = { chain[1], chain[0] };
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vtx, 1, dummy, false);
+    BOOST_CHECK_EQUAL(size_t(4), pool.size());
+    BOOST_CHECK_EQUAL(size_t(2), pool.GetClusterCount());
+    auto it2 = pool.mapTx.find(chain[2].GetHash());
+    const uint64_t txSize = it2->GetTxSize();
+    BOOST_CHECK_EQUAL(1, it2->GetCountWithAncestors());
+    BOOST_CHECK_EQUAL(txSize, it2->GetSizeWithAncestors());
+    BOOST_CHECK_EQUAL(1000, it2->GetFeesWithAncestors());
+    BOOST_CHECK_EQUAL(3, it2->GetCountWithDescendants());
+    BOOST_CHECK_EQUAL(3, it4->GetCountWithAncestors());
+    BOOST_CHECK_EQUAL(3000, it4->GetFeesWithAncestors());
+    BOOST_CHECK_EQUAL(size_t(3), pool.GetClusterLinearization(it4).size());
+
+    // Spending from both clusters joins them.
+    CMutableTransaction joined = SpendOutputs({
+        COutPoint(chain[4].GetHash(), 0), COutPoint(unrelated.GetHash(), 0) });
+    pool.addUnchecked(joined.GetHash(), entry.FromTx(joined));
+    BOOST_CHECK_EQUAL(size_t(1), pool.GetClusterCount());
+    auto itJoined = pool.mapTx.find(joined.GetHash());
+    BOOST_CHECK_EQUAL(size_t(5), pool.GetClusterLinearization(itJoined).size());
+    BOOST_CHECK(pool.GetClusterLinearization(itJoined).back() == itJoined);
+    BOOST_CHECK_EQUAL(5, itJoined->GetCountWithAncestors());
+
+    // Removing the link splits them again.
+    pool.removeRecursive(chain[3], dummy);
+    BOOST_CHECK_EQUAL(size_t(2), pool.size());
+    BOOST_CHECK_EQUAL(size_t(2), pool.GetClusterCount());
+    BOOST_CHECK_EQUAL(1, it2->GetCountWithDescendants());
+    BOOST_CHECK_EQUAL(txSize, it2->GetSizeWithDescendants());
+    BOOST_CHECK_EQUAL(size_t(1), pool.GetClusterLinearization(it2).size());
+
+    // A disconnected block puts parents back after their children.
+    pool.clear();
+    for (size_t i = 2; i < chain.size(); ++i) {
+        pool.addUnchecked(chain[i].GetHash(), entry.FromTx(chain[i]));
+    }
+    pool.addUnchecked(chain[0].GetHash(), entry.FromTx(chain[0]));
+    pool.addUnchecked(chain[1].GetHash(), entry.FromTx(chain[1]));
+    BOOST_CHECK_EQUAL(size_t(2), pool.GetClusterCount());
+    pool.UpdateTransactionsFromBlock({ chain[0].GetHash(), chain[1].GetHash() }, DEFAULT_CLUSTER_LIMIT);
+    BOOST_CHECK_EQUAL(size_t(1), pool.GetClusterCount());
+
+    it4 = pool.mapTx.find(chain[4].GetHash());
+    const auto& relinearized = pool.GetClusterLinearization(it4);
+    BOOST_CHECK_EQUAL(size_t(5), relinearized.size());
+    for (size_t i = 0; i < chain.size(); ++i) {
+        BOOST_CHECK(relinearized[i]->GetTx().GetHash() == chain[i].GetHash());
+        BOOST_CHECK_EQUAL(i + 1, relinearized[i]->GetCountWithAncestors());
+        BOOST_CHECK_EQUAL(chain.size() - i, relinearized[i]->GetCountWithDescendants());
+    }
+    BOOST_CHECK_EQUAL(5000, pool.mapTx.find(chain[0].GetHash())->GetFeesWithDescendants());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.Fee(1000LL);
+    const uint64_t nLimit = 100;
+
+    // A parent with many outputs, each spent by a child of its own. Every
+    // child has a single ancestor, only the cluster grows.
+    CMutableTransaction parent = SpendOutputs({ COutPoint(GetRandHash(), 0) });
+    parent.vout.resize(1000, parent.vout[0]);
+    std::vector<CMutableTransaction> children;
+    for (uint32_t n = 0; n < parent.vout.size(); ++n) {
+        children.push_back(SpendOutputs({ COutPoint(parent.GetHash(), n) }));
+    }
+
+    pool.addUnchecked(parent.GetHash(), entry.FromTx(parent));
+    for (size_t i = 0; i + 1 < nLimit; ++i) {
+        pool.addUnchecked(children[i].GetHash(), entry.FromTx(children[i]));
+    }
+    auto itParent = pool.mapTx.find(parent.GetHash());
+    BOOST_CHECK_EQUAL(nLimit, pool.GetClusterLinearization(itParent).size());
+
+    CTxMemPool::setEntries setAncestors;
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string errString;
+    CTxMemPoolEntry next = entry.FromTx(children[nLimit - 1]);
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(next, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(size_t(1), setAncestors.size());
+    BOOST_CHECK(!pool.CheckClusterLimit(setAncestors, nLimit, errString));
+    BOOST_CHECK(pool.CheckClusterLimit(setAncestors, nLimit + 1, errString));
+    BOOST_CHECK(pool.CheckClusterLimit(CTxMemPool::setEntries(), 1, errString));
+
+    // A disconnected parent links all children that are already in the
+    // mempool into one cluster, which is cut back to the limit.
+    pool.clear();
+    for (CMutableTransaction& child : children) {
+        pool.addUnchecked(child.GetHash(), entry.FromTx(child));
+    }
+    pool.addUnchecked(parent.GetHash(), entry.FromTx(parent));
+    BOOST_CHECK_EQUAL(children.size() + 1, pool.GetClusterCount());
+    pool.UpdateTransactionsFromBlock({ parent.GetHash() }, nLimit);
+    BOOST_CHECK_EQUAL(nLimit, pool.size());
+    BOOST_CHECK_EQUAL(size_t(1), pool.GetClusterCount());
+    itParent = pool.mapTx.find(parent.GetHash());
+    BOOST_CHECK(pool.GetClusterLinearization(itParent).front() == itParent);
+    BOOST_CHECK_EQUAL(nLimit, pool.GetClusterLinearization(itParent).size());
+    BOOST_CHECK_EQUAL(nLimit, itParent->GetCountWithDescendants());
+    BOOST_CHECK_EQUAL(1000 * int64_t(nLimit), itParent->GetFeesWithDescendants());
+    BOOST_CHECK_EQUAL(nLimit - 1, pool.GetMemPoolChildren(itParent).size());
+    for (auto it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+        BOOST_CHECK_EQUAL(it == itParent ? 1U : 2U, it->GetCountWithAncestors());
+    }
+
+    // Confirming the parent leaves the children on their own.
+    std::vector<CTransaction> vtx = { parent };
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vtx, 1, dummy, false);
+    BOOST_CHECK_EQUAL(nLimit - 1, pool.size());
+    BOOST_CHECK_EQUAL(nLimit - 1, pool.GetClusterCount());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
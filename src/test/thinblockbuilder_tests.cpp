@@ -59,5 +59,29 @@ BOOST_AUTO_TEST_CASE(finish_block) {
     BOOST_CHECK_EQUAL(block.GetHash().ToString(), res.GetHash().ToString());
 }
 
+BOOST_AUTO_TEST_CASE(add_dup_and_unwanted) {
+    CBlock block = TestBlock1();
+    std::vector<ThinTx> wanted;
+    for (auto& t : block.vtx)
+        wanted.push_back(ThinTx(t.GetHash()));
+
+    ThinBlockBuilder bb(block, wanted, NullFinder());
+    BOOST_CHECK_EQUAL(int(block.vtx.size()), bb.numTxsMissing());
+
+    // Fill in reverse order.
+    for (auto t = block.vtx.rbegin(); t != block.vtx.rend(); ++t)
+        BOOST_CHECK(bb.addTransaction(*t) == ThinBlockBuilder::TX_ADDED);
+    BOOST_CHECK_EQUAL(0, bb.numTxsMissing());
+
+    BOOST_CHECK(bb.addTransaction(block.vtx[3]) == ThinBlockBuilder::TX_DUP);
+
+    CMutableTransaction unwanted(block.vtx[3]);
+    unwanted.nLockTime++;
+    BOOST_CHECK(bb.addTransaction(unwanted) == ThinBlockBuilder::TX_UNWANTED);
+
+    CBlock res = bb.finishBlock();
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), res.GetHash().ToString());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
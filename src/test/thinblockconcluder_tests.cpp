@@ -118,4 +118,38 @@ BOOST_AUTO_TEST_CASE(compact_concluder) {
     BOOST_CHECK(worker.addTxCalled);
 };
 
+BOOST_AUTO_TEST_CASE(non_worker_contributes) {
+
+    XThinReReqResponse resp;
+    resp.block = block.GetHash();
+    resp.txRequested.push_back(block.vtx[1]);
+
+    struct DummyWorker : public XThinWorker {
+        DummyWorker(ThinBlockManager& mg, NodeId id) :
+            XThinWorker(mg, id), addTxCalled(false) { }
+
+        bool addTx(const uint256& block, const CTransaction& tx) override {
+            addTxCalled = true;
+            return true;
+        }
+
+        bool addTxCalled;
+    };
+
+    // Another peer is building the block.
+    XThinWorker other(tmgr, 43);
+    other.addWork(resp.block);
+    XThinStub stub(XThinBlock(block, CBloomFilter()));
+    other.buildStub(stub, NullFinder(), connman, pfrom);
+    BOOST_CHECK(other.isWorkingOn(resp.block));
+
+    // Not working on the block, but the transactions
+    // are still useful to the other worker.
+    DummyWorker worker(tmgr, 42);
+    XThinBlockConcluder conclude;
+    conclude(resp, connman, pfrom, worker, markInFlight);
+    BOOST_CHECK(worker.addTxCalled);
+    BOOST_CHECK(!worker.isWorkingOn(resp.block));
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,122 @@
+#include "test/test_bitcoin.h"
+#include "random.h"
+#include "txorphanpool.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txorphanpool_tests, BasicTestingSetup)
+
+static CMutableTransaction SpendTx(const uint256& prev, uint32_t n, int nOut = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev, n);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(nOut);
+    for (auto& o : tx.vout) {
+        o.nValue = 1 * CENT;
+        o.scriptPubKey = CScript() << OP_TRUE;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(children_by_outpoint)
+{
+    TxOrphanPool orphans(100, 10 * 1000000);
+
+    CTransaction parent = SpendTx(GetRandHash(), 0, 3);
+    CTransaction child0 = SpendTx(parent.GetHash(), 0);
+    CTransaction child2 = SpendTx(parent.GetHash(), 2);
+    CTransaction unrelated = SpendTx(GetRandHash(), 0);
+
+    BOOST_CHECK(orphans.AddTx(child0, 1));
+    BOOST_CHECK(orphans.AddTx(child2, 2));
+    BOOST_CHECK(orphans.AddTx(unrelated, 1));
+    BOOST_CHECK(!orphans.AddTx(child0, 1)); // dup
+    BOOST_CHECK_EQUAL(size_t(3), orphans.Size());
+
+    std::vector<uint256> children = orphans.GetChildren(parent);
+    BOOST_CHECK_EQUAL(size_t(2), children.size());
+    BOOST_CHECK(std::count(begin(children), end(children), child0.GetHash()));
+    BOOST_CHECK(std::count(begin(children), end(children), child2.GetHash()));
+    BOOST_CHECK(orphans.GetChildren(child0).empty());
+
+    BOOST_CHECK(orphans.EraseTx(child0.GetHash()));
+    BOOST_CHECK(!orphans.EraseTx(child0.GetHash()));
+    BOOST_CHECK_EQUAL(size_t(1), orphans.GetChildren(parent).size());
+
+    orphans.Clear();
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Size());
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Bytes());
+    BOOST_CHECK_EQUAL(size_t(0), orphans.PeerBytes(1));
+}
+
+BOOST_AUTO_TEST_CASE(byte_budget)
+{
+    CTransaction tx = SpendTx(GetRandHash(), 0);
+    TxOrphanPool orphans(1000, 10 * 1000000);
+    BOOST_CHECK(orphans.AddTx(tx, 1));
+    const size_t txBytes = orphans.Bytes();
+    BOOST_CHECK(txBytes > 0);
+    BOOST_CHECK_EQUAL(txBytes, orphans.PeerBytes(1));
+    orphans.Clear();
+
+    // Room for ~10 orphans in total, so ~2 per peer
+    orphans.SetLimits(1000, txBytes * ORPHAN_POOL_PEER_SHARE * 2 + txBytes / 2);
+    BOOST_CHECK(orphans.AddTx(SpendTx(GetRandHash(), 0), 1));
+    BOOST_CHECK(orphans.AddTx(SpendTx(GetRandHash(), 0), 1));
+    BOOST_CHECK(!orphans.AddTx(SpendTx(GetRandHash(), 0), 1));
+
+    // Other peers have their own quota
+    for (NodeId peer = 2; peer < 10; ++peer) {
+        BOOST_CHECK(orphans.AddTx(SpendTx(GetRandHash(), 0), peer));
+        BOOST_CHECK(orphans.AddTx(SpendTx(GetRandHash(), 0), peer));
+    }
+    BOOST_CHECK(orphans.Bytes() > txBytes * ORPHAN_POOL_PEER_SHARE * 2);
+    BOOST_CHECK(orphans.LimitSize() > 0);
+    BOOST_CHECK(orphans.Bytes() <= txBytes * ORPHAN_POOL_PEER_SHARE * 2 + txBytes / 2);
+
+    size_t sum = 0;
+    for (NodeId peer = 1; peer < 10; ++peer)
+        sum += orphans.PeerBytes(peer);
+    BOOST_CHECK_EQUAL(orphans.Bytes(), sum);
+
+    for (NodeId peer = 1; peer < 10; ++peer)
+        orphans.EraseForPeer(peer);
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Size());
+    BOOST_CHECK_EQUAL(size_t(0), orphans.Bytes());
+}
+
+BOOST_AUTO_TEST_CASE(erase_and_queue_for_block)
+{
+    TxOrphanPool orphans(100, 10 * 1000000);
+
+    CTransaction parent = SpendTx(GetRandHash(), 0, 2);
+    CTransaction included = SpendTx(GetRandHash(), 0);
+    CTransaction conflict = SpendTx(parent.vin[0].prevout.hash, 0, 2);
+    CTransaction child = SpendTx(parent.GetHash(), 1);
+    CTransaction grandchild = SpendTx(child.GetHash(), 0);
+
+    BOOST_CHECK(orphans.AddTx(included, 1));
+    BOOST_CHECK(orphans.AddTx(conflict, 1));
+    BOOST_CHECK(orphans.AddTx(child, 1));
+    BOOST_CHECK(orphans.AddTx(grandchild, 1));
+
+    std::vector<CTransaction> vtx = { parent, included };
+    BOOST_CHECK_EQUAL(2, orphans.EraseForBlock(vtx));
+    BOOST_CHECK(!orphans.Exists(included.GetHash()));
+    BOOST_CHECK(!orphans.Exists(conflict.GetHash()));
+    BOOST_CHECK(orphans.Exists(child.GetHash()));
+
+    // Only direct children are queued, the rest is found when
+    // the children are accepted.
+    orphans.QueueChildren(vtx);
+    std::vector<uint256> queued = orphans.TakeQueued();
+    BOOST_CHECK_EQUAL(size_t(1), queued.size());
+    BOOST_CHECK(queued.at(0) == child.GetHash());
+    BOOST_CHECK(orphans.TakeQueued().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "hash.h"
+#include "main.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+#include "undowriter.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(undowriter_tests, TestingSetup)
+
+namespace {
+
+CBlockUndo RandomUndo(int nTx)
+{
+    CBlockUndo blockundo;
+    for (int i = 0; i < nTx; ++i) {
+        CTxUndo txundo;
+        for (int j = 0; j < 1 + i % 3; ++j) {
+            Coin coin;
+            coin.out.nValue = GetRand(21000000 * COIN);
+            coin.out.scriptPubKey.assign(1 + GetRand(50), 0x51);
+            coin.nHeight = 1 + GetRand(500000);
+            txundo.vprevout.push_back(coin);
+        }
+        blockundo.vtxundo.push_back(txundo);
+    }
+    return blockundo;
+}
+
+} // anon namespace
+
+namespace {
+
+// Writes 50 blocks worth of undo data back to back, every other one
+// compressed if fCompress, and reads them back.
+void WriteAndRead(int nFile, bool fCompress)
+{
+    CUndoWriter writer;
+    std::vector<CBlockUndo> written;
+    std::vector<CDiskBlockPos> positions;
+    std::vector<uint256> hashes;
+
+    // Reserve the space like FindUndoPos, back to back in a file of its own.
+    CDiskBlockPos pos(nFile, 0);
+    for (int i = 0; i < 50; ++i) {
+        CBlockUndo blockundo = RandomUndo(i);
+        std::vector<unsigned char> vchCompressed;
+        if (fCompress && i % 2)
+            CompressBlockUndo(blockundo, vchCompressed);
+        const unsigned int nSize = vchCompressed.empty()
+            ? ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION)
+            : vchCompressed.size();
+        written.push_back(blockundo);
+        hashes.push_back(GetRandHash());
+        positions.push_back(CDiskBlockPos(pos.nFile, pos.nPos + UNDO_HEADER_SIZE));
+        BOOST_CHECK(writer.Write(std::move(blockundo), std::move(vchCompressed), pos, hashes.back()));
+        pos.nPos += nSize + 40;
+    }
+    BOOST_CHECK(writer.Wait());
+
+    for (size_t i = 0; i < written.size(); ++i) {
+        CBlockUndo read;
+        BOOST_CHECK(UndoReadFromDisk(read, positions[i], hashes[i]));
+        BOOST_CHECK(::SerializeHash(read) == ::SerializeHash(written[i]));
+    }
+
+    // The checksum covers the block hash.
+    for (int i = 1; i < 3; ++i) {
+        CBlockUndo read;
+        BOOST_CHECK(!UndoReadFromDisk(read, positions[i], hashes[0]));
+    }
+}
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(write_in_order)
+{
+    WriteAndRead(1000, false);
+}
+
+BOOST_AUTO_TEST_CASE(write_compressed)
+{
+    WriteAndRead(1001, true);
+
+    // Undo data with repetitive scripts gets smaller.
+    CBlockUndo blockundo = RandomUndo(1000);
+    std::vector<unsigned char> vchCompressed;
+    CompressBlockUndo(blockundo, vchCompressed);
+    BOOST_CHECK(vchCompressed.size() < ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
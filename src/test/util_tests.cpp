@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -547,4 +548,26 @@ BOOST_AUTO_TEST_CASE(test_ConvertBits) {
                             0x15, 0x0f, 0x06, 0x1e, 0x1e});
 }
 
+BOOST_AUTO_TEST_CASE(test_WriteFileAt)
+{
+    const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_bitcoin_%%%%%%%%");
+    FILE* file = fopen(path.string().c_str(), "wb+");
+    BOOST_REQUIRE(file);
+    AllocateFileRange(file, 0, 16);
+
+    BOOST_CHECK(WriteFileAt(file, 4, "abcd", 4));
+    BOOST_CHECK(WriteFileAt(file, 0, "0123", 4));
+    // Past the end
+    BOOST_CHECK(WriteFileAt(file, 20, "xy", 2));
+    BOOST_CHECK(WriteFileAt(file, 6, "EF", 2));
+
+    char buf[22];
+    BOOST_CHECK_EQUAL(fseek(file, 0, SEEK_SET), 0);
+    BOOST_REQUIRE_EQUAL(fread(buf, 1, sizeof(buf), file), sizeof(buf));
+    fclose(file);
+    boost::filesystem::remove(path);
+    BOOST_CHECK_EQUAL(std::string(buf, 8), "0123abEF");
+    BOOST_CHECK_EQUAL(std::string(buf + 20, 2), "xy");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
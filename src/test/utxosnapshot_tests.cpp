@@ -0,0 +1,275 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bgvalidation.h"
+#include "chainparams.h"
+#include "chainparamsbase.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+#include "txdb.h"
+#include "util.h"
+#include "utxocommit.h"
+#include "utxosnapshot.h"
+
+#include <map>
+#include <memory>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxosnapshot_tests, TestingSetup)
+
+namespace {
+
+Coin RandomCoin()
+{
+    Coin coin;
+    coin.out.nValue = GetRand(21000000 * COIN);
+    coin.out.scriptPubKey.assign(GetRand(100) + 1, 0x51);
+    coin.nHeight = GetRand(500000);
+    coin.fCoinBase = GetRand(2);
+    return coin;
+}
+
+struct RegtestingSetup : public TestingSetup {
+    RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) { }
+};
+
+CBlock MakeBlock(const CBlockIndex* pindexPrev, const std::vector<CTransaction>& vtx)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    coinbase.vout.push_back(CTxOut(50 * COIN, CScript() << OP_TRUE));
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->GetBlockTime() + 1;
+    block.nBits = GetNextWorkRequired(pindexPrev, block.nTime, Params().GetConsensus());
+    block.vtx.push_back(coinbase);
+    block.vtx.insert(block.vtx.end(), vtx.begin(), vtx.end());
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    while (!CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus()))
+        ++block.nNonce;
+    return block;
+}
+
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    BlockMap::iterator it = mapBlockIndex.find(hash);
+    return it == mapBlockIndex.end() ? NULL : it->second;
+}
+
+void ReloadBlockIndex()
+{
+    FlushStateToDisk();
+    UnloadBlockIndex();
+    bool fRebuildRequired = false;
+    BOOST_REQUIRE(LoadBlockIndex(&fRebuildRequired));
+    LoadChainTip(Params());
+}
+
+struct SnapshotSetup
+{
+    SnapshotSetup() : db(1 << 20, fObfuscated, true), path(GetDataDir() / "snapshot.dat")
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 500; ++i) {
+            const uint256 txid = GetRandHash();
+            for (uint32_t n = 0, nOutputs = GetRand(5) + 1; n < nOutputs; ++n) {
+                Coin coin = RandomCoin();
+                coins[COutPoint(txid, n)] = coin;
+                cache.AddCoin(COutPoint(txid, n), std::move(coin), false);
+            }
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    void Write(UTXOSnapshotMetadata& metadata)
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        std::unique_ptr<CCoinsViewCursor> cursor(db.Cursor());
+        WriteUTXOSnapshot(file, *cursor, metadata);
+    }
+
+    bool Read(UTXOSnapshotMetadata& metadata, std::map<COutPoint, Coin>& read)
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        file >> metadata;
+        return ReadUTXOSnapshot(file, metadata, [&read](const COutPoint& out, Coin&& coin) {
+            BOOST_CHECK(read.emplace(out, std::move(coin)).second);
+        });
+    }
+
+    bool fObfuscated;
+    CCoinsViewDB db;
+    boost::filesystem::path path;
+    std::map<COutPoint, Coin> coins;
+};
+
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(write_read)
+{
+    SnapshotSetup setup;
+    UTXOSnapshotMetadata metadata;
+    metadata.nChainTx = 1234;
+    setup.Write(metadata);
+    BOOST_CHECK(metadata.hashBase == setup.db.GetBestBlock());
+    BOOST_CHECK_EQUAL(metadata.nCoins, setup.coins.size());
+
+    CUtxoCommit commit;
+    std::unique_ptr<CCoinsViewCursor> cursor(setup.db.Cursor());
+    BOOST_CHECK(commit.AddCoinView(cursor.get()));
+    BOOST_CHECK(metadata.hashCommit == commit.GetHash());
+
+    UTXOSnapshotMetadata metadataRead;
+    std::map<COutPoint, Coin> read;
+    BOOST_CHECK(setup.Read(metadataRead, read));
+    BOOST_CHECK(metadataRead.hashBase == metadata.hashBase);
+    BOOST_CHECK_EQUAL(metadataRead.nChainTx, 1234U);
+    BOOST_CHECK(metadataRead.hashCommit == metadata.hashCommit);
+    BOOST_CHECK_EQUAL(read.size(), setup.coins.size());
+    for (const auto& e : setup.coins) {
+        auto it = read.find(e.first);
+        BOOST_CHECK(it != read.end() && it->second.out == e.second.out &&
+                    it->second.nHeight == e.second.nHeight && it->second.fCoinBase == e.second.fCoinBase);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(corrupt)
+{
+    SnapshotSetup setup;
+    UTXOSnapshotMetadata metadata;
+    setup.Write(metadata);
+    const size_t nSize = boost::filesystem::file_size(setup.path);
+
+    // Flip a bit in the value of the last coin.
+    {
+        FILE* file = fopen(setup.path.string().c_str(), "rb+");
+        BOOST_CHECK_EQUAL(fseek(file, nSize - 2, SEEK_SET), 0);
+        int ch = fgetc(file);
+        BOOST_CHECK_EQUAL(fseek(file, nSize - 2, SEEK_SET), 0);
+        fputc(ch ^ 1, file);
+        fclose(file);
+    }
+    UTXOSnapshotMetadata metadataRead;
+    std::map<COutPoint, Coin> read;
+    bool fValid = false;
+    try {
+        fValid = setup.Read(metadataRead, read);
+    } catch (const std::ios_base::failure&) {
+    }
+    BOOST_CHECK(!fValid);
+
+    // A truncated file can't be read.
+    boost::filesystem::resize_file(setup.path, nSize / 2);
+    read.clear();
+    BOOST_CHECK_THROW(setup.Read(metadataRead, read), std::ios_base::failure);
+
+    // Neither can something that isn't a snapshot.
+    {
+        CAutoFile file(fopen(setup.path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        file << std::string("not a snapshot, but long enough to be read as one");
+    }
+    BOOST_CHECK_THROW(setup.Read(metadataRead, read), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(duplicate_outpoint)
+{
+    SnapshotSetup setup;
+    UTXOSnapshotMetadata metadata;
+    setup.Write(metadata);
+    COutPoint dup;
+    // However many passes it takes.
+    for (size_t nMaxMemory : { size_t(1) << 20, size_t(64), size_t(1) }) {
+        CAutoFile file(fopen(setup.path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        file >> metadata;
+        const long nCoinsPos = ftell(file.Get());
+        BOOST_CHECK(!FindDuplicateOutpoint(file, metadata, nMaxMemory, dup));
+        BOOST_CHECK_EQUAL(ftell(file.Get()), nCoinsPos);
+    }
+
+    // A coin that appears again in a later run of its transaction.
+    const COutPoint out = setup.coins.begin()->first;
+    const Coin& coin = setup.coins.begin()->second;
+    {
+        CAutoFile file(fopen(setup.path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        metadata.nCoins = 3;
+        file << metadata;
+        uint64_t nOutputs = 1;
+        for (const uint256& txid : { out.hash, GetRandHash(), out.hash }) {
+            file << txid << VARINT(nOutputs) << VARINT(out.n) << coin;
+        }
+    }
+    for (size_t nMaxMemory : { size_t(1) << 20, size_t(1) }) {
+        CAutoFile file(fopen(setup.path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        file >> metadata;
+        BOOST_CHECK(FindDuplicateOutpoint(file, metadata, nMaxMemory, dup));
+        BOOST_CHECK(dup == out);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(activate_transaction_counts, RegtestingSetup)
+{
+    LOCK(cs_main);
+
+    // Headers of blocks the node has no data for, the fifth has a
+    // transaction besides its coinbase.
+    std::vector<CBlock> blocks;
+    CBlockIndex* pindex = chainActive.Tip();
+    for (int i = 1; i <= 10; ++i) {
+        std::vector<CTransaction> vtx;
+        if (i == 5) {
+            CMutableTransaction tx;
+            tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+            tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+            vtx.push_back(tx);
+        }
+        blocks.push_back(MakeBlock(pindex, vtx));
+        CValidationState state;
+        BOOST_REQUIRE(AcceptBlockHeader(blocks.back(), state, &pindex));
+    }
+    const uint256 hashBase = pindex->GetBlockHash();
+    const uint256 hashFifth = blocks[4].GetHash();
+    // The genesis block, 10 coinbases and the one transaction.
+    const uint64_t nChainTx = 12;
+
+    pcoinsTip->SetBestBlock(hashBase);
+    CValidationState state;
+    BOOST_REQUIRE(ActivateUTXOSnapshot(state, pindex, nChainTx, uint256()));
+    BOOST_CHECK(chainActive.Tip() == pindex);
+    BOOST_CHECK(pindexSnapshotBase == pindex);
+    BOOST_CHECK_EQUAL(pindex->nChainTx, nChainTx);
+    BOOST_CHECK_EQUAL(LookupBlockIndex(hashFifth)->nTx, 1U);
+    BOOST_CHECK(!IsSnapshotValidated());
+
+    // The count for the chain is the snapshot's, not that of the placeholders.
+    ReloadBlockIndex();
+    BOOST_REQUIRE(LookupBlockIndex(hashBase));
+    BOOST_CHECK(pindexSnapshotBase == LookupBlockIndex(hashBase));
+    BOOST_CHECK(chainActive.Tip() == pindexSnapshotBase);
+    BOOST_CHECK_EQUAL(pindexSnapshotBase->nChainTx, nChainTx);
+
+    // The placeholder goes once the block is received.
+    BOOST_CHECK(ProcessNewBlock(state, BlockSource{}, &blocks[4], true, NULL, connman));
+    CBlockIndex* pindexFifth = LookupBlockIndex(hashFifth);
+    BOOST_CHECK(pindexFifth->nStatus & BLOCK_HAVE_DATA);
+    BOOST_CHECK_EQUAL(pindexFifth->nTx, 2U);
+    BOOST_CHECK_EQUAL(pindexSnapshotBase->nChainTx, nChainTx);
+    BOOST_CHECK(chainActive.Tip() == pindexSnapshotBase);
+
+    ReloadBlockIndex();
+    BOOST_CHECK_EQUAL(LookupBlockIndex(hashFifth)->nTx, 2U);
+    BOOST_CHECK_EQUAL(LookupBlockIndex(hashFifth)->nChainTx, 7U);
+    BOOST_CHECK_EQUAL(pindexSnapshotBase->nChainTx, nChainTx);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -37,58 +37,64 @@ ThinBlockBuilder::ThinBlockBuilder(const CBlockHeader& header,
 
 void ThinBlockBuilder::updateWantedIndex()
 {
-    for (auto w = begin(wanted); w != end(wanted); ++w) {
-        if (!w->hasShortid())
+    wantedIdks.clear();
+    shortidIndex.clear();
+    fullIndex.clear();
+    cheapIndex.clear();
+
+    for (size_t i = 0; i < wanted.size(); ++i) {
+        const ThinTx& w = wanted[i];
+
+        // emplace keeps the first slot on (unlikely) hash collisions,
+        // same as a front-to-back scan would.
+        if (w.hasShortid()) {
+            wantedIdks.insert(w.shortidIdk());
+            shortidIndex.emplace(w.shortid(), i);
             continue;
-
-        wantedIdks.insert(w->shortidIdk());
-        wantedIndex.insert({w->shortid(), w});
+        }
+        if (w.hasFull()) {
+            fullIndex.emplace(w.full(), i);
+            continue;
+        }
+        if (w.hasCheap())
+            cheapIndex.emplace(w.cheap(), i);
     }
 }
 
-ThinBlockBuilder::TXAddRes ThinBlockBuilder::addTransaction(const CTransaction& tx) {
-    assert(!tx.IsNull());
+// Returns offset of the slot tx belongs in, or wanted.size() if
+// tx does not belong to block.
+size_t ThinBlockBuilder::findSlot(const CTransaction& tx) const {
+    const uint256& hash = tx.GetHash();
 
-    auto loc = end(wanted);
-
-    // Look it up in the shortid index
+    // Look it up in the shortid index. There is one idk per stub
+    // provider, so this is normally a single lookup.
     for (auto& w : wantedIdks) {
-
-        uint64_t shortid = GetShortID(w, tx.GetHash());
-        auto i = wantedIndex.find(shortid);
-        if (i == end(wantedIndex))
-            continue;
-
-        loc = i->second;
-        break;
+        auto i = shortidIndex.find(GetShortID(w, hash));
+        if (i != end(shortidIndex))
+            return i->second;
     }
 
-    if (loc == end(wanted)) {
-
-        // Didn't match any by shortid, try full and cheap matches.
-        loc = std::find_if(begin(wanted), end(wanted), [&](const ThinTx& b) {
+    auto f = fullIndex.find(hash);
+    if (f != end(fullIndex))
+        return f->second;
 
-                // we already checked shortid
-                if (b.hasShortid())
-                    return false;
+    auto c = cheapIndex.find(hash.GetCheapHash());
+    if (c != end(cheapIndex))
+        return c->second;
 
-                if (b.hasFull())
-                    return b.full() == tx.GetHash();
+    return wanted.size();
+}
 
-                if (b.hasCheap())
-                    return b.cheap() == tx.GetHash().GetCheapHash();
+ThinBlockBuilder::TXAddRes ThinBlockBuilder::addTransaction(const CTransaction& tx) {
+    assert(!tx.IsNull());
 
-                return false;
-        });
-    }
+    size_t offset = findSlot(tx);
 
-    if (loc == end(wanted)) {
+    if (offset == wanted.size()) {
         // TX does not belong to block
         return TX_UNWANTED;
     }
 
-    size_t offset = std::distance(begin(wanted), loc);
-
     if (!thinBlock.vtx[offset].IsNull()) {
         // We already have this one.
         return TX_DUP;
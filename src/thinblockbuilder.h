@@ -3,6 +3,7 @@
 
 #include "thinblock.h"
 #include "primitives/block.h"
+#include "hash.h"
 #include "random.h"
 
 #include <unordered_set>
@@ -24,6 +25,20 @@ class IdkHasher {
         uint64_t nonce;
 };
 
+// Salted like SaltedTxIDHasher, but assignable.
+class TxHashHasher {
+    public:
+        TxHashHasher() :
+            k0(GetRand(std::numeric_limits<uint64_t>::max())),
+            k1(GetRand(std::numeric_limits<uint64_t>::max())) { }
+        size_t operator()(const uint256& h) const {
+            return SipHashUint256(k0, k1, h);
+        }
+
+    private:
+        uint64_t k0, k1;
+};
+
 // Assembles a block from it's merkle block and the individual transactions.
 class ThinBlockBuilder {
     public:
@@ -56,10 +71,19 @@ class ThinBlockBuilder {
         CBlock thinBlock;
         std::vector<ThinTx> wanted;
         std::unordered_set<std::pair<uint64_t, uint64_t>, IdkHasher> wantedIdks;
-        std::unordered_map<uint64_t, std::vector<ThinTx>::iterator> wantedIndex;
+
+        // Offset into wanted/thinBlock.vtx, indexed by the most specific
+        // hash we have for each transaction. Lets us place a transaction in
+        // its slot without scanning the wanted list, regardless of the order
+        // transactions arrive in.
+        std::unordered_map<uint64_t, size_t> shortidIndex;
+        std::unordered_map<uint256, size_t, TxHashHasher> fullIndex;
+        std::unordered_map<uint64_t, size_t> cheapIndex;
+
         size_t missing;
 
         void updateWantedIndex();
+        size_t findSlot(const CTransaction& tx) const;
 };
 
 #endif
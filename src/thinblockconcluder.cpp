@@ -42,14 +42,31 @@ static void handleReRequestFailed(ThinBlockWorker& worker,
         Misbehaving(worker.nodeID(), 10, "unfulfilled-rerequest");
 }
 
+// Several peers may be racing to provide the same block. If this peer
+// gave up on it (or was never assigned it), the transactions are still
+// useful to the peers that are working on it.
+template <typename TxList>
+static void contributeToOthers(ThinBlockWorker& worker, const uint256& block,
+                               const TxList& txs, NodeId from)
+{
+    if (!worker.isStubBuilt(block)) {
+        LogPrint(Log::BLOCK, "got re-req response for %s, but not "
+                "working on block peer=%d\n", block.ToString(), from);
+        return;
+    }
+    LogPrint(Log::BLOCK, "got re-req response for %s from non-worker, "
+            "adding to block being built peer=%d\n", block.ToString(), from);
+    for (auto& t : txs)
+        worker.addTx(block, t);
+}
+
 void XThinBlockConcluder::operator()(const XThinReReqResponse& resp,
                                      CConnman& connman, CNode& pfrom,
                                      ThinBlockWorker& worker, BlockInFlightMarker& markInFlight) {
 
     if (!worker.isWorkingOn(resp.block))
     {
-        LogPrint(Log::BLOCK, "got xthin re-req response for %s, but not "
-                "working on block peer=%d\n", resp.block.ToString(), pfrom.id);
+        contributeToOthers(worker, resp.block, resp.txRequested, pfrom.id);
         return;
     }
 
@@ -67,8 +84,7 @@ void CompactBlockConcluder::operator()(const CompactReReqResponse& resp,
 
     if (!worker.isWorkingOn(resp.blockhash))
     {
-        LogPrint(Log::BLOCK, "got compact re-req response for %s, but not "
-                "working on block peer=%d\n", resp.blockhash.ToString(), pfrom.id);
+        contributeToOthers(worker, resp.blockhash, resp.txn, pfrom.id);
         return;
     }
 
@@ -12,6 +12,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -29,6 +30,8 @@ static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SNAPSHOT_BASE = 'S';
+static const char DB_INDEX_GENERATION = 'g';
 
 namespace {
 
@@ -54,7 +57,10 @@ struct CoinEntry {
 
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool &isObfuscated, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, isObfuscated, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool &isObfuscated, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, isObfuscated, fMemory, fWipe), fSortedWrites(false) {
+}
+
+CCoinsViewDB::CCoinsViewDB(const boost::filesystem::path &path, size_t nCacheSize, bool &isObfuscated, bool fMemory, bool fWipe) : db(path, nCacheSize, isObfuscated, fMemory, fWipe), fSortedWrites(false) {
 }
 
 bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
@@ -81,6 +87,10 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    return WriteCoins(mapCoins, hashBlock, true);
+}
+
+bool CCoinsViewDB::WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
     CDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
@@ -105,18 +115,13 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     batch.Erase(DB_BEST_BLOCK);
     batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, old_tip});
 
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            CoinEntry entry(&it->first);
-            if (it->second.coin.IsSpent())
-                batch.Erase(entry);
-            else
-                batch.Write(entry, it->second.coin);
-            changed++;
-        }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+    auto writeEntry = [&](const COutPoint& outpoint, const CCoinsCacheEntry& cacheEntry) {
+        CoinEntry entry(&outpoint);
+        if (cacheEntry.coin.IsSpent())
+            batch.Erase(entry);
+        else
+            batch.Write(entry, cacheEntry.coin);
+        changed++;
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(Log::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -129,6 +134,38 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
                 }
             }
         }
+    };
+
+    if (fSortedWrites) {
+        // Each partial batch then covers a key range of its own, and the
+        // tables LevelDB makes of them don't overlap. Into an empty database
+        // they can go straight to a deeper level instead of being compacted.
+        std::vector<const CCoinsMap::value_type*> vDirty;
+        vDirty.reserve(mapCoins.size());
+        for (const CCoinsMap::value_type& entry : mapCoins) {
+            if (entry.second.flags & CCoinsCacheEntry::DIRTY)
+                vDirty.push_back(&entry);
+        }
+        std::sort(vDirty.begin(), vDirty.end(), [](const CCoinsMap::value_type* a, const CCoinsMap::value_type* b) {
+            // Key order: the txid bytes as serialized, unlike uint256's operator<.
+            const int cmp = memcmp(a->first.hash.begin(), b->first.hash.begin(), a->first.hash.size());
+            return cmp < 0 || (cmp == 0 && a->first.n < b->first.n);
+        });
+        for (const CCoinsMap::value_type* entry : vDirty)
+            writeEntry(entry->first, entry->second);
+        count = mapCoins.size();
+        if (fErase)
+            mapCoins.clear();
+    } else {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY)
+                writeEntry(it->first, it->second);
+            count++;
+            if (fErase)
+                it = mapCoins.erase(it);
+            else
+                ++it;
+        }
     }
 
     // In the last batch, mark the database as consistent with hashBlock again.
@@ -141,12 +178,104 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return ret;
 }
 
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB *dbIn) : CCoinsViewBacked(dbIn), db(dbIn), nWritingUsage(0), fWriteOk(true) {}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind() {
+    WaitForWrite();
+}
+
+bool CCoinsViewWriteBehind::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        CCoinsMap::const_iterator it;
+        if (mapWriting && (it = mapWriting->find(outpoint)) != mapWriting->end()) {
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return db->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewWriteBehind::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const {
+    {
+        // While writing, the database is marked as being in transition.
+        std::lock_guard<std::mutex> lock(cs);
+        if (!hashWriting.IsNull())
+            return hashWriting;
+    }
+    return db->GetBestBlock();
+}
+
+std::vector<uint256> CCoinsViewWriteBehind::GetHeadBlocks() const {
+    WaitForWrite();
+    return db->GetHeadBlocks();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    if (!WaitForWrite())
+        return false;
+
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (const CCoinsMap::value_type& entry : mapCoins)
+        nUsage += entry.second.coin.DynamicMemoryUsage();
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        mapWriting.reset(new CCoinsMap(std::move(mapCoins)));
+        hashWriting = hashBlock;
+        nWritingUsage = nUsage;
+    }
+    mapCoins.clear();
+
+    // mapWriting is not modified while the thread runs, so lookups from
+    // GetCoin only need cs to not race with the cleanup at the end.
+    writer = std::thread([this]() {
+        RenameThread("bitcoin-coinswrite");
+        bool fOk = false;
+        try {
+            fOk = db->WriteCoins(*mapWriting, hashWriting, false);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        std::lock_guard<std::mutex> lock(cs);
+        fWriteOk = fOk;
+        mapWriting.reset();
+        hashWriting.SetNull();
+        nWritingUsage = 0;
+    });
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewWriteBehind::Cursor() const {
+    WaitForWrite();
+    return db->Cursor();
+}
+
+bool CCoinsViewWriteBehind::WaitForWrite() const {
+    if (writer.joinable())
+        writer.join();
+    std::lock_guard<std::mutex> lock(cs);
+    return fWriteOk;
+}
+
+size_t CCoinsViewWriteBehind::DynamicMemoryUsage() const {
+    std::lock_guard<std::mutex> lock(cs);
+    return nWritingUsage;
+}
+
 size_t CCoinsViewDB::EstimateSize() const
 {
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool &isObfuscated, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, isObfuscated, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool &isObfuscated, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, isObfuscated, fMemory, fWipe), nIndexGeneration(0) {
+    Read(DB_INDEX_GENERATION, nIndexGeneration);
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -232,7 +361,11 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
-    return WriteBatch(batch, true);
+    batch.Write(DB_INDEX_GENERATION, nIndexGeneration + 1);
+    if (!WriteBatch(batch, true))
+        return false;
+    nIndexGeneration++;
+    return true;
 }
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
@@ -258,6 +391,20 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotBase(const uint256 &hashBase, const uint256 &hashCommit, uint64_t nChainTx) {
+    return Write(DB_SNAPSHOT_BASE, std::make_pair(std::make_pair(hashBase, hashCommit), nChainTx), true);
+}
+
+bool CBlockTreeDB::ReadSnapshotBase(uint256 &hashBase, uint256 &hashCommit, uint64_t &nChainTx) {
+    std::pair<std::pair<uint256, uint256>, uint64_t> snapshot;
+    if (!Read(DB_SNAPSHOT_BASE, snapshot))
+        return false;
+    hashBase = snapshot.first.first;
+    hashCommit = snapshot.first.second;
+    nChainTx = snapshot.second;
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
@@ -10,8 +10,12 @@
 #include "dbwrapper.h"
 #include "chain.h"
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -25,6 +29,8 @@ class uint256;
 static const int64_t nDefaultDbCache = 300;
 //! -dbbatchsize default (bytes)
 static const int64_t nDefaultDbBatchSize = 16 << 20;
+//! -coinsbackend default
+static const char* const DEFAULT_COINS_BACKEND = "leveldb";
 //! max. -dbcache (MiB)
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
@@ -68,8 +74,11 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    std::atomic<bool> fSortedWrites;
 public:
     CCoinsViewDB(size_t nCacheSize, bool &isObfuscated, bool fMemory = false, bool fWipe = false);
+    //! A coin database in another directory than chainstate/
+    CCoinsViewDB(const boost::filesystem::path &path, size_t nCacheSize, bool &isObfuscated, bool fMemory = false, bool fWipe = false);
 
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
@@ -78,11 +87,59 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
 
+    //! Write the dirty entries of mapCoins. Written entries are removed from mapCoins if fErase is set.
+    bool WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
+    //! Write coins in key order. Worth it for large writes to a mostly empty database.
+    void SetSortedWrites(bool fSorted) { fSortedWrites = fSorted; }
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
 };
 
+/**
+ * Writes to the coin database on a background thread.
+ *
+ * BatchWrite takes over the modified coins and returns before they are
+ * written. Until the write is done, reads are served from the coins being
+ * written and fall through to the database for anything else. Only one
+ * write is in flight at a time; the next BatchWrite waits for the previous
+ * one and fails if it did.
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+public:
+    CCoinsViewWriteBehind(CCoinsViewDB *dbIn);
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool HaveCoin(const COutPoint &outpoint) const override;
+    uint256 GetBestBlock() const override;
+    std::vector<uint256> GetHeadBlocks() const override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    CCoinsViewCursor *Cursor() const override;
+
+    //! Block until the write in flight (if any) is done. Returns false if it failed.
+    bool WaitForWrite() const;
+    //! Memory held by the coins being written, which is freed once the write is done.
+    size_t DynamicMemoryUsage() const;
+
+private:
+    CCoinsViewDB *db;
+
+    mutable std::mutex cs;
+    //! Coins being written and the block they are for, guarded by cs.
+    mutable std::unique_ptr<CCoinsMap> mapWriting;
+    mutable uint256 hashWriting;
+    mutable size_t nWritingUsage;
+    mutable bool fWriteOk;
+
+    mutable std::thread writer;
+
+    CCoinsViewWriteBehind(const CCoinsViewWriteBehind&);
+    void operator=(const CCoinsViewWriteBehind&);
+};
+
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
 class CCoinsViewDBCursor: public CCoinsViewCursor
 {
@@ -123,7 +180,15 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! The UTXO snapshot the chain state was loaded from, see loadtxoutset.
+    bool WriteSnapshotBase(const uint256 &hashBase, const uint256 &hashCommit, uint64_t nChainTx);
+    bool ReadSnapshotBase(uint256 &hashBase, uint256 &hashCommit, uint64_t &nChainTx);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! Number of times the block index and block file info were written, for a snapshot of them to tell if it's current.
+    uint64_t GetIndexGeneration() const { return nIndexGeneration; }
+
+private:
+    uint64_t nIndexGeneration;
 };
 
 #endif // BITCOIN_TXDB_H
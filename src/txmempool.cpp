@@ -15,24 +15,27 @@
 #include "streams.h"
 #include "timedata.h"
 #include "util.h"
-#include "utilblock.h"
 #include "utilmoneystr.h"
 #include "version.h"
 #include "respend/respenddetector.h"
 #include "respend/respendlogger.h"
 #include "respend/mempoolremover.h"
 
+#include <algorithm>
+#include <functional>
+#include <queue>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _nHeight,
                                  bool poolHasNoInputsOf, bool _spendsCoinbase,
                                  LockPoints lp, unsigned int _sigOps):
-        tx(_tx), nFee(_nFee), nTime(_nTime), nHeight(_nHeight),
+        tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), nHeight(_nHeight),
         hadNoDependencies(poolHasNoInputsOf), spendsCoinbase(_spendsCoinbase),
-        lockPoints(lp), sigOpCount(_sigOps)
+        lockPoints(lp), sigOpCount(_sigOps), nClusterId(0), nClusterPos(0)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
     nUsageSize = RecursiveDynamicUsage(tx);
 
     nCountWithDescendants = 1;
@@ -61,97 +64,95 @@ void CTxMemPoolEntry::UpdateLockPoints(const LockPoints& lp)
     lockPoints = lp;
 }
 
-// Update the given tx for any in-mempool descendants.
-// Assumes that setMemPoolChildren is correct for the given tx and all
-// descendants.
-void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
-{
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
-
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
-            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
-            if (cacheIt != cachedDescendants.end()) {
-                // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
-                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
-                }
-            } else if (!setAllDescendants.count(childEntry)) {
-                // Schedule for later processing
-                stageEntries.insert(childEntry);
-            }
-        }
-    }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
-    // Update and add to cached descendant map
-    int64_t modifySize = 0;
-    CAmount modifyFee = 0;
-    int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
-        if (!setExclude.count(cit->GetTx().GetHash())) {
-            modifySize += cit->GetTxSize();
-            modifyFee += cit->GetFee();
-            modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
-            // Update ancestor state for each descendant
-            mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetFee(), 1));
-        }
-    }
-    mapTx.modify(updateIt, update_descendant_state(modifySize, modifyFee, modifyCount));
-}
-
 // vHashesToUpdate is the set of transaction hashes from a disconnected block
 // which has been re-added to the mempool.
-// for each entry, look for descendants that are outside hashesToUpdate, and
-// add fee/size information for such descendants to the parent.
-// for each such descendant, also update the ancestor state to include the parent.
-void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
+// for each entry, link it to its in-mempool children, which joins their
+// clusters. The affected clusters are then relinearized and their state
+// recalculated in one pass each. Linking can join clusters beyond the limit
+// enforced at accept time; those lose the transactions at the end of their
+// linearization, which takes their descendants along.
+void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate, uint64_t limitClusterCount)
 {
     LOCK(cs);
-    // For each entry in vHashesToUpdate, store the set of in-mempool, but not
-    // in-vHashesToUpdate transactions, so that we don't have to recalculate
-    // descendants when we come across a previously seen entry.
-    cacheMap mapMemPoolDescendantsToUpdate;
-
-    // Use a set for lookups into vHashesToUpdate (these entries are already
-    // accounted for in the state of their ancestors)
-    std::set<uint256> setAlreadyIncluded(vHashesToUpdate.begin(), vHashesToUpdate.end());
-
-    // Iterate in reverse, so that whenever we are looking at at a transaction
-    // we are sure that all in-mempool descendants have already been processed.
-    // This maximizes the benefit of the descendant cache and guarantees that
-    // setMemPoolChildren will be updated, an assumption made in
-    // UpdateForDescendants.
-    BOOST_REVERSE_FOREACH(const uint256 &hash, vHashesToUpdate) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
-        // calculate children from mapNextTx
+    std::vector<txiter> updated;
+    BOOST_FOREACH(const uint256 &hash, vHashesToUpdate) {
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
-        std::map<COutPoint, CInPoint>::iterator iter = mapNextTx.lower_bound(COutPoint(hash, 0));
-        // First calculate the children, and update setMemPoolChildren to
-        // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first.hash == hash; ++iter) {
-            const uint256 &childHash = iter->second.ptx->GetHash();
-            txiter childIter = mapTx.find(childHash);
+        bool fLinked = false;
+        for (uint32_t n = 0; n < it->GetTx().vout.size(); ++n) {
+            auto iter = mapNextTx.find(COutPoint(hash, n));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
+            txiter childIter = mapTx.find(iter->second.ptx->GetHash());
             assert(childIter != mapTx.end());
-            // We can skip updating entries we've encountered before or that
-            // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
-                UpdateChild(it, childIter, true);
-                UpdateParent(childIter, it, true);
+            // Children from the same block were linked in addUnchecked.
+            const CTxMemPoolEntry::Relatives& children = GetMemPoolChildren(it);
+            if (std::find(children.begin(), children.end(), &*childIter) != children.end()) {
+                continue;
             }
+            UpdateChild(it, childIter, true);
+            UpdateParent(childIter, it, true);
+
+            const uint64_t parentCluster = it->nClusterId;
+            const uint64_t childCluster = childIter->nClusterId;
+            if (mapClusters[parentCluster].txs.size() >= mapClusters[childCluster].txs.size()) {
+                MergeClusters(parentCluster, childCluster);
+            } else {
+                MergeClusters(childCluster, parentCluster);
+            }
+            fLinked = true;
+        }
+        if (fLinked) {
+            updated.push_back(it);
+        }
+    }
+
+    // Merging may have moved the transactions to other clusters, look them
+    // up once all links are in place.
+    std::set<uint64_t> clusterIds;
+    for (txiter it : updated) {
+        clusterIds.insert(it->nClusterId);
+    }
+    setEntries stage;
+    std::set<uint64_t> trimmedIds;
+    for (uint64_t id : clusterIds) {
+        TxCluster& cluster = mapClusters[id];
+        RelinearizeCluster(cluster);
+        if (cluster.txs.size() > limitClusterCount) {
+            // Everything after a position in a linearization is closed under
+            // descendants, so no link to a remaining transaction is left.
+            stage.insert(cluster.txs.begin() + limitClusterCount, cluster.txs.end());
+            trimmedIds.insert(id);
+        } else {
+            UpdateClusterState(cluster);
         }
-        UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+    if (!stage.empty()) {
+        LogPrint(Log::MEMPOOL, "Removing %u transactions from %u mempool clusters over the limit of %u\n",
+                 stage.size(), trimmedIds.size(), limitClusterCount);
+        // Recalculates the state of what is left of the trimmed clusters.
+        RemoveStaged(stage, true);
+    }
+}
+
+bool CTxMemPool::CheckClusterLimit(const setEntries &setAncestors, uint64_t limitClusterCount, std::string &errString) const
+{
+    LOCK(cs);
+    std::set<uint64_t> clusterIds;
+    uint64_t nClusterCount = 1;
+    BOOST_FOREACH(txiter ancestor, setAncestors) {
+        if (clusterIds.insert(ancestor->nClusterId).second) {
+            nClusterCount += GetClusterLinearization(ancestor).size();
+        }
+    }
+    if (nClusterCount > limitClusterCount) {
+        errString = strprintf("too many transactions in cluster [limit: %u]", limitClusterCount);
+        return false;
+    }
+    return true;
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */)
@@ -177,7 +178,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+            parentHashes.insert(ToIter(parent));
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -200,8 +203,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(stageit)) {
+            const txiter phash = ToIter(parent);
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
                 parentHashes.insert(phash);
@@ -238,10 +241,9 @@ void CTxMemPool::queryAncestors(const uint256 txHash,
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
-    BOOST_FOREACH(txiter piter, parentIters) {
-        UpdateChild(piter, it, add);
+    BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+        UpdateChild(ToIter(parent), it, add);
     }
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
@@ -265,60 +267,56 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
-        UpdateParent(updateIt, it, false);
+    BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+        UpdateParent(ToIter(child), it, false);
     }
 }
 
 void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants)
 {
-    // For each entry, walk back all ancestors and decrement size associated with this
-    // transaction
     const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     if (updateDescendants) {
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
-        // we need to preserve until we're finished with all operations that
-        // need to traverse the mempool).
+        // Walking the descendants of every removed transaction is quadratic
+        // for long chains, so the state of the transactions left behind is
+        // recalculated per cluster once the entries are gone (see
+        // RemoveStaged). Here we only sever the links to the parents.
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
-            int64_t modifySize = -((int64_t)removeIt->GetTxSize());
-            CAmount modifyFee = -removeIt->GetFee();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1));
+            BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(removeIt)) {
+                UpdateChild(ToIter(parent), removeIt, false);
             }
         }
-    }
-    BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
-        const CTxMemPoolEntry &entry = *removeIt;
-        std::string dummy;
-        // Since this is a tx that is already in the mempool, we can call CMPA
-        // with fSearchForParents = false.  If the mempool is in a consistent
-        // state, then using true or false should both be correct, though false
-        // should be a bit faster.
-        // However, if we happen to be in the middle of processing a reorg, then
-        // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of
-        // ancestors whose packages include this transaction, because when we
-        // add a new transaction to the mempool in addUnchecked(), we assume it
-        // has no children, and in the case of a reorg where that assumption is
-        // false, the in-mempool children aren't linked to the in-block tx's
-        // until UpdateTransactionsFromBlock() is called.
-        // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
-        // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
-        // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-        // Note that UpdateAncestorsOf severs the child links that point to
-        // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+    } else {
+        // For each entry, walk back all ancestors and decrement size associated with this
+        // transaction
+        BOOST_FOREACH(txiter removeIt, entriesToRemove) {
+            setEntries setAncestors;
+            const CTxMemPoolEntry &entry = *removeIt;
+            std::string dummy;
+            // Since this is a tx that is already in the mempool, we can call CMPA
+            // with fSearchForParents = false.  If the mempool is in a consistent
+            // state, then using true or false should both be correct, though false
+            // should be a bit faster.
+            // However, if we happen to be in the middle of processing a reorg, then
+            // the mempool can be in an inconsistent state.  In this case, the set
+            // of ancestors reachable via memPoolParents will be the same as the set of
+            // ancestors whose packages include this transaction, because when we
+            // add a new transaction to the mempool in addUnchecked(), we assume it
+            // has no children, and in the case of a reorg where that assumption is
+            // false, the in-mempool children aren't linked to the in-block tx's
+            // until UpdateTransactionsFromBlock() is called.
+            // So if we're being called during a reorg, ie before
+            // UpdateTransactionsFromBlock() has been called, then memPoolParents will
+            // differ from the set of mempool parents we'd calculate by searching,
+            // and it's important that we use the memPoolParents notion of ancestor
+            // transactions as the set of things to update for removal.
+            CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            // Note that UpdateAncestorsOf severs the child links that point to
+            // removeIt in the entries for the parents of removeIt.
+            UpdateAncestorsOf(false, removeIt, setAncestors);
+        }
     }
     // After updating all the ancestor sizes, we can now sever the link between each
     // transaction being removed and any mempool children (ie, update setMemPoolParents
@@ -391,7 +389,6 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
 
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
@@ -418,6 +415,31 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             UpdateParent(newit, pit, true);
         }
     }
+
+    // Join the clusters of all in-mempool parents, the largest one absorbs
+    // the others. As the new tx has no in-mempool children, appending it
+    // keeps the linearization valid.
+    uint64_t clusterId = 0;
+    bool fHasCluster = false;
+    BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(newit)) {
+        const uint64_t parentCluster = parent->nClusterId;
+        if (!fHasCluster) {
+            clusterId = parentCluster;
+            fHasCluster = true;
+        } else if (mapClusters[parentCluster].txs.size() > mapClusters[clusterId].txs.size()) {
+            clusterId = MergeClusters(parentCluster, clusterId);
+        } else {
+            MergeClusters(clusterId, parentCluster);
+        }
+    }
+    if (!fHasCluster) {
+        clusterId = nNextClusterId++;
+    }
+    TxCluster& cluster = mapClusters[clusterId];
+    newit->nClusterId = clusterId;
+    newit->nClusterPos = cluster.txs.size();
+    cluster.txs.push_back(newit);
+
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
 
@@ -442,8 +464,7 @@ void CTxMemPool::removeUnchecked(txiter it)
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    cachedInnerUsage -= memusage::DynamicUsage(it->memPoolParents) + memusage::DynamicUsage(it->memPoolChildren);
     mapTx.erase(it);
     nTransactionsUpdated++;
     minerPolicyEstimator->removeTx(hash);
@@ -469,8 +490,8 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH(const txiter &childiter, setChildren) {
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+            const txiter childiter = ToIter(child);
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
             }
@@ -493,7 +514,7 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, std::list<CTransact
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                auto it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txiter nextit = mapTx.find(it->second.ptx->GetHash());
@@ -567,26 +588,26 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtxIn, unsigned int nBlockHeight,
                                 std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
-    std::vector<CTransaction> vtx(SortByParentsFirst(begin(vtxIn), end(vtxIn)));
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    setEntries stage;
+    BOOST_FOREACH(const CTransaction& tx, vtxIn)
     {
         uint256 hash = tx.GetHash();
 
         indexed_transaction_set::iterator i = mapTx.find(hash);
-        if (i != mapTx.end())
+        if (i != mapTx.end()) {
             entries.push_back(*i);
+            stage.insert(i);
+        }
     }
+    // Remove all of them in one go, so that the clusters they leave behind
+    // are only updated once.
+    RemoveStaged(stage, true);
+
     MempoolFeeModifier& modifier = GetFeeModifier();
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    BOOST_FOREACH(const CTransaction& tx, vtxIn)
     {
-        txiter it = mapTx.find(tx.GetHash());
-        if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true);
-        }
         removeConflicts(tx, conflicts);
         modifier.RemoveDelta(tx.GetHash());
     }
@@ -596,7 +617,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtxIn, unsigned
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
+    mapClusters.clear();
+    nNextClusterId = 0;
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -622,6 +644,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     uint64_t checkTotal = 0;
     uint64_t innerUsage = 0;
+    // Every transaction adds the size of its cluster, so this adds up to the
+    // sum of squared cluster sizes if all members are accounted for.
+    uint64_t clusteredTotal = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
     const int64_t nSpendHeight = GetSpendHeight(mempoolDuplicate);
@@ -633,10 +658,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        innerUsage += memusage::DynamicUsage(it->memPoolParents) + memusage::DynamicUsage(it->memPoolChildren);
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -656,13 +678,24 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            auto it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == GetMemPoolParents(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(it)) {
+            assert(setParentCheck.count(ToIter(parent)));
+        }
+        // Parents are in the same cluster, and come first in its linearization.
+        const std::vector<txiter>& cluster = GetClusterLinearization(it);
+        assert(it->nClusterPos < cluster.size() && cluster[it->nClusterPos] == it);
+        BOOST_FOREACH(txiter parentIt, setParentCheck) {
+            assert(parentIt->nClusterId == it->nClusterId);
+            assert(parentIt->nClusterPos < it->nClusterPos);
+        }
+        clusteredTotal += cluster.size();
         // Also check to make sure ancestor size/fees are >= sum with immediate
         // parents.
         assert(it->GetSizeWithAncestors() >= parentSizes + it->GetTxSize());
@@ -670,10 +703,12 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(it->GetFeesWithAncestors() >= 0);
         // Check children against mapNextTx
         CTxMemPool::setEntries setChildrenCheck;
-        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
         int64_t childSizes = 0;
         CAmount childFees = 0;
-        for (; iter != mapNextTx.end() && iter->first.hash == it->GetTx().GetHash(); ++iter) {
+        for (uint32_t n = 0; n < tx.vout.size(); ++n) {
+            auto iter = mapNextTx.find(COutPoint(tx.GetHash(), n));
+            if (iter == mapNextTx.end())
+                continue;
             txiter childit = mapTx.find(iter->second.ptx->GetHash());
             assert(childit != mapTx.end()); // mapNextTx points to in-mempool transactions
             if (setChildrenCheck.insert(childit).second) {
@@ -681,7 +716,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childFees += childit->GetFee();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == GetMemPoolChildren(it).size());
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(it)) {
+            assert(setChildrenCheck.count(ToIter(child)));
+        }
         // Also check to make sure size/fees is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -715,7 +753,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (auto it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->GetTx();
@@ -725,6 +763,13 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
+    uint64_t clusterSizes = 0;
+    for (std::map<uint64_t, TxCluster>::const_iterator it = mapClusters.begin(); it != mapClusters.end(); it++) {
+        assert(!it->second.txs.empty());
+        clusterSizes += it->second.txs.size() * it->second.txs.size();
+    }
+    assert(clusterSizes == clusteredTotal);
+
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
 }
@@ -820,15 +865,24 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + GetFeeModifier().DynamicMemoryUsage() + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+    // Cluster linearizations hold one iterator per transaction.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + GetFeeModifier().DynamicMemoryUsage() + memusage::DynamicUsage(mapClusters) + sizeof(txiter) * mapTx.size() + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
     AssertLockHeld(cs);
+    std::set<uint64_t> clusterIds;
+    BOOST_FOREACH(const txiter& it, stage) {
+        mapClusters[it->nClusterId].txs[it->nClusterPos] = mapTx.end();
+        clusterIds.insert(it->nClusterId);
+    }
     UpdateForRemoveFromMempool(stage, updateDescendants);
     BOOST_FOREACH(const txiter& it, stage) {
         removeUnchecked(it);
     }
+    // Without updateDescendants, all descendants were removed and the
+    // ancestors were updated in UpdateForRemoveFromMempool.
+    SplitClusters(clusterIds, updateDescendants);
 }
 
 int CTxMemPool::Expire(int64_t time) {
@@ -857,40 +911,247 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+// Adds or removes entry from relatives, keeping cachedInnerUsage in line
+// with the memory used by the vector.
+static void UpdateRelatives(CTxMemPoolEntry::Relatives& relatives, const CTxMemPoolEntry* entry,
+                            bool add, uint64_t& cachedInnerUsage)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    CTxMemPoolEntry::Relatives::iterator it = std::find(relatives.begin(), relatives.end(), entry);
+    if (add == (it != relatives.end())) {
+        return;
     }
+    const size_t usageBefore = memusage::DynamicUsage(relatives);
+    if (add) {
+        relatives.push_back(entry);
+    } else {
+        *it = relatives.back();
+        relatives.pop_back();
+        if (relatives.empty()) {
+            CTxMemPoolEntry::Relatives().swap(relatives);
+        }
+    }
+    cachedInnerUsage += memusage::DynamicUsage(relatives);
+    cachedInnerUsage -= usageBefore;
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateRelatives(entry->memPoolChildren, &*child, add, cachedInnerUsage);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateRelatives(entry->memPoolParents, &*parent, add, cachedInnerUsage);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPoolEntry::Relatives& CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    return entry->memPoolParents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPoolEntry::Relatives& CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    return entry->memPoolChildren;
+}
+
+const std::vector<CTxMemPool::txiter>& CTxMemPool::GetClusterLinearization(txiter entry) const
+{
+    std::map<uint64_t, TxCluster>::const_iterator it = mapClusters.find(entry->nClusterId);
+    assert(it != mapClusters.end());
+    return it->second.txs;
+}
+
+size_t CTxMemPool::GetClusterCount() const
+{
+    LOCK(cs);
+    return mapClusters.size();
+}
+
+uint64_t CTxMemPool::MergeClusters(uint64_t to, uint64_t from)
+{
+    if (to == from) {
+        return to;
+    }
+    std::map<uint64_t, TxCluster>::iterator itFrom = mapClusters.find(from);
+    assert(itFrom != mapClusters.end());
+    std::vector<txiter>& txs = mapClusters[to].txs;
+    txs.reserve(txs.size() + itFrom->second.txs.size());
+    BOOST_FOREACH(txiter it, itFrom->second.txs) {
+        it->nClusterId = to;
+        it->nClusterPos = txs.size();
+        txs.push_back(it);
+    }
+    mapClusters.erase(itFrom);
+    return to;
+}
+
+void CTxMemPool::SplitClusters(const std::set<uint64_t>& clusterIds, bool updateState)
+{
+    BOOST_FOREACH(uint64_t id, clusterIds) {
+        std::map<uint64_t, TxCluster>::iterator itCluster = mapClusters.find(id);
+        assert(itCluster != mapClusters.end());
+
+        std::vector<txiter> remaining;
+        remaining.reserve(itCluster->second.txs.size());
+        BOOST_FOREACH(txiter it, itCluster->second.txs) {
+            if (it != mapTx.end()) {
+                it->nClusterPos = remaining.size();
+                remaining.push_back(it);
+            }
+        }
+        if (remaining.empty()) {
+            mapClusters.erase(itCluster);
+            continue;
+        }
+
+        // Label the connected components of what is left.
+        const int unlabeled = -1;
+        std::vector<int> component(remaining.size(), unlabeled);
+        int nComponents = 0;
+        std::vector<size_t> stack;
+        for (size_t i = 0; i < remaining.size(); ++i) {
+            if (component[i] != unlabeled) {
+                continue;
+            }
+            component[i] = nComponents;
+            stack.push_back(i);
+            while (!stack.empty()) {
+                const txiter it = remaining[stack.back()];
+                stack.pop_back();
+                for (const CTxMemPoolEntry::Relatives* neighbours : { &it->memPoolParents, &it->memPoolChildren }) {
+                    BOOST_FOREACH(const CTxMemPoolEntry* n, *neighbours) {
+                        const size_t pos = n->nClusterPos;
+                        if (component[pos] == unlabeled) {
+                            component[pos] = nComponents;
+                            stack.push_back(pos);
+                        }
+                    }
+                }
+            }
+            ++nComponents;
+        }
+
+        // The first component keeps the id. A subsequence of a
+        // linearization is still a valid linearization.
+        std::vector<uint64_t> ids(nComponents, id);
+        for (int c = 1; c < nComponents; ++c) {
+            ids[c] = nNextClusterId++;
+        }
+        mapClusters[id].txs.clear();
+        for (size_t i = 0; i < remaining.size(); ++i) {
+            std::vector<txiter>& txs = mapClusters[ids[component[i]]].txs;
+            remaining[i]->nClusterId = ids[component[i]];
+            remaining[i]->nClusterPos = txs.size();
+            txs.push_back(remaining[i]);
+        }
+        if (updateState) {
+            for (int c = 0; c < nComponents; ++c) {
+                UpdateClusterState(mapClusters[ids[c]]);
+            }
+        }
+    }
+}
+
+void CTxMemPool::RelinearizeCluster(TxCluster& cluster)
+{
+    std::vector<txiter>& txs = cluster.txs;
+    std::vector<size_t> missingParents(txs.size());
+    // Ready transactions in their current order.
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t> > ready;
+    for (size_t i = 0; i < txs.size(); ++i) {
+        missingParents[i] = GetMemPoolParents(txs[i]).size();
+        if (missingParents[i] == 0) {
+            ready.push(i);
+        }
+    }
+
+    std::vector<txiter> linearization;
+    linearization.reserve(txs.size());
+    while (!ready.empty()) {
+        const size_t i = ready.top();
+        ready.pop();
+        linearization.push_back(txs[i]);
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(txs[i])) {
+            const size_t pos = child->nClusterPos;
+            if (--missingParents[pos] == 0) {
+                ready.push(pos);
+            }
+        }
+    }
+    assert(linearization.size() == txs.size());
+    txs.swap(linearization);
+    for (size_t i = 0; i < txs.size(); ++i) {
+        txs[i]->nClusterPos = i;
+    }
+}
+
+void CTxMemPool::UpdateClusterState(const TxCluster& cluster)
+{
+    const std::vector<txiter>& txs = cluster.txs;
+    const size_t n = txs.size();
+    const size_t words = (n + 63) / 64;
+
+    // Row i holds the ancestors (or descendants) of txs[i], including itself.
+    // As parents come first in the linearization, a single pass in each
+    // direction is enough.
+    std::vector<uint64_t> ancestors(n * words, 0);
+    std::vector<uint64_t> descendants(n * words, 0);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t* row = &ancestors[i * words];
+        row[i / 64] |= uint64_t(1) << (i % 64);
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, GetMemPoolParents(txs[i])) {
+            const size_t pos = parent->nClusterPos;
+            assert(pos < i);
+            const uint64_t* prow = &ancestors[pos * words];
+            for (size_t w = 0; w < words; ++w) {
+                row[w] |= prow[w];
+            }
+        }
+    }
+    for (size_t i = n; i-- > 0; ) {
+        uint64_t* row = &descendants[i * words];
+        row[i / 64] |= uint64_t(1) << (i % 64);
+        BOOST_FOREACH(const CTxMemPoolEntry* child, GetMemPoolChildren(txs[i])) {
+            const size_t pos = child->nClusterPos;
+            assert(pos > i);
+            const uint64_t* crow = &descendants[pos * words];
+            for (size_t w = 0; w < words; ++w) {
+                row[w] |= crow[w];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        int64_t ancSize = 0, descSize = 0, ancCount = 0, descCount = 0;
+        CAmount ancFee = 0, descFee = 0;
+        for (size_t w = 0; w < words; ++w) {
+            for (uint64_t bits = ancestors[i * words + w]; bits; bits &= bits - 1) {
+                const txiter& a = txs[w * 64 + __builtin_ctzll(bits)];
+                ancSize += a->GetTxSize();
+                ancFee += a->GetFee();
+                ++ancCount;
+            }
+            for (uint64_t bits = descendants[i * words + w]; bits; bits &= bits - 1) {
+                const txiter& d = txs[w * 64 + __builtin_ctzll(bits)];
+                descSize += d->GetTxSize();
+                descFee += d->GetFee();
+                ++descCount;
+            }
+        }
+        const txiter& it = txs[i];
+        if (ancCount != int64_t(it->GetCountWithAncestors()) || ancSize != int64_t(it->GetSizeWithAncestors())
+                || ancFee != it->GetFeesWithAncestors()) {
+            mapTx.modify(it, update_ancestor_state(ancSize - it->GetSizeWithAncestors(),
+                        ancFee - it->GetFeesWithAncestors(), ancCount - it->GetCountWithAncestors()));
+        }
+        if (descCount != int64_t(it->GetCountWithDescendants()) || descSize != int64_t(it->GetSizeWithDescendants())
+                || descFee != it->GetFeesWithDescendants()) {
+            mapTx.modify(it, update_descendant_state(descSize - it->GetSizeWithDescendants(),
+                        descFee - it->GetFeesWithDescendants(), descCount - it->GetCountWithDescendants()));
+        }
+    }
 }
 
 void CTxMemPool::TrimToSize(size_t sizelimit) {
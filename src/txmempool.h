@@ -8,6 +8,8 @@
 
 #include <list>
 #include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "amount.h"
 #include "coins.h"
@@ -63,8 +65,13 @@ class CTxMemPool;
 
 class CTxMemPoolEntry
 {
+public:
+    typedef std::vector<const CTxMemPoolEntry*> Relatives;
+
 private:
-    CTransaction tx;
+    friend class CTxMemPool;
+
+    CTransactionRef tx;
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nUsageSize; //! ... and total memory usage
@@ -90,6 +97,14 @@ private:
     uint64_t nSizeWithAncestors;
     CAmount nFeesWithAncestors;
 
+    // In-mempool parents and children, and the cluster this entry belongs
+    // to. Maintained by CTxMemPool. None of the indexes depend on them, so
+    // they're updated in place rather than through mapTx.modify.
+    mutable Relatives memPoolParents;
+    mutable Relatives memPoolChildren;
+    mutable uint64_t nClusterId;
+    mutable size_t nClusterPos; //! position in the cluster linearization
+
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, unsigned int _nHeight,
@@ -97,7 +112,8 @@ public:
                     unsigned int nSigOps);
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    CTransactionRef GetSharedTx() const { return this->tx; }
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
@@ -306,18 +322,18 @@ public:
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
+ * the in-mempool direct parents and direct children in each entry.  Within
  * each CTxMemPoolEntry, we track the size and fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
  * children (because any such children would be an orphan).  So in
  * addUnchecked(), we:
- * - update a new entry's setMemPoolParents to include all in-mempool parents
+ * - update a new entry's memPoolParents to include all in-mempool parents
  * - update the new entry's direct parents to include the new tx as a child
  * - update all ancestors of the transaction to include the new tx's size/fee
  *
  * When a transaction is removed from the mempool, we must:
- * - update all in-mempool parents to not track the tx in setMemPoolChildren
+ * - update all in-mempool parents to not track the tx in memPoolChildren
  * - update all ancestors to not include the tx's size/fees in descendant state
  * - update all in-mempool children to not include it as a parent
  *
@@ -339,7 +355,7 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * the parent/child links may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -352,11 +368,21 @@ public:
  *
  * Adding transactions from a disconnected block can be very time consuming,
  * because we don't have a way to limit the number of in-mempool descendants.
- * To bound CPU processing, we limit the amount of work we're willing to do
- * to properly update the descendant information for a tx being added from
- * a disconnected block.  If we would exceed the limit, then we instead mark
- * the entry as "dirty", and set the feerate for sorting purposes to be equal
- * the feerate of the transaction without any descendants.
+ *
+ * Clusters:
+ *
+ * Transactions connected through in-mempool dependencies (in any direction)
+ * form a cluster. Each cluster keeps a linearization of its transactions,
+ * an ordering where parents always come before their children. When
+ * transactions are added from a disconnected block, or confirmed in a block,
+ * the ancestor and descendant state of the remaining transactions is
+ * recalculated in a single pass over the linearization of each affected
+ * cluster, instead of walking the descendants of every transaction involved.
+ * This keeps removeForBlock() and UpdateTransactionsFromBlock() linear in the
+ * size of the affected clusters, even for long chains. Recalculating the
+ * state of a cluster is quadratic in its size, so clusters are limited in
+ * size both when accepting transactions (CheckClusterLimit()) and when
+ * linking transactions from a disconnected block to their children.
  *
  */
 class CTxMemPool
@@ -404,25 +430,29 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
-private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    const CTxMemPoolEntry::Relatives& GetMemPoolParents(txiter entry) const;
+    const CTxMemPoolEntry::Relatives& GetMemPoolChildren(txiter entry) const;
 
-    struct TxLinks {
-        setEntries parents;
-        setEntries children;
+    /** All transactions connected to entry, parents before children. */
+    const std::vector<txiter>& GetClusterLinearization(txiter entry) const;
+    size_t GetClusterCount() const;
+private:
+    struct TxCluster {
+        // Linearization, parents before children. Slots of entries that are
+        // being removed are set to mapTx.end() until the cluster is split.
+        std::vector<txiter> txs;
     };
+    std::map<uint64_t, TxCluster> mapClusters;
+    uint64_t nNextClusterId;
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
     MempoolFeeModifier feemodifier;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
+    txiter ToIter(const CTxMemPoolEntry* entry) const { return mapTx.iterator_to(*entry); }
 
 public:
-    std::map<COutPoint, CInPoint> mapNextTx;
+    std::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> mapNextTx;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
@@ -478,8 +508,15 @@ public:
      *  child transactions present in hashesToUpdate, which are already accounted
      *  for).  Note: hashesToUpdate should be the set of transactions from the
      *  disconnected block that have been accepted back into the mempool.
+     *  Clusters that grow beyond limitClusterCount transactions are cut back
+     *  by removing the transactions at the end of their linearization.
      */
-    void UpdateTransactionsFromBlock(const std::vector<uint256> &hashesToUpdate);
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &hashesToUpdate, uint64_t limitClusterCount);
+
+    /** Check that adding a transaction with the given in-mempool ancestors
+     *  (as returned by CalculateMemPoolAncestors) keeps its cluster at or
+     *  below limitClusterCount transactions. */
+    bool CheckClusterLimit(const setEntries &setAncestors, uint64_t limitClusterCount, std::string &errString) const;
 
     /** Try to calculate all in-mempool ancestors of entry.
      *  (these are all calculated including the tx itself)
@@ -489,7 +526,7 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from memPoolParents. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true);
 
@@ -556,22 +593,18 @@ public:
     const MempoolFeeModifier& GetFeeModifier() const { return feemodifier; }
 
 private:
-    /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
-     *  the descendants for a single transaction that has been added to the
-     *  mempool but may have child transactions in the mempool, eg during a
-     *  chain reorg.  setExclude is the set of descendant transactions in the
-     *  mempool that must not be accounted for (because any descendants in
-     *  setExclude were added to the mempool after the transaction being
-     *  updated and hence their state is already reflected in the parent
-     *  state).
-     *
-     *  cachedDescendants will be updated with the descendants of the transaction
-     *  being updated, so that future invocations don't need to walk the
-     *  same transaction again, if encountered in another transaction chain.
-     */
-    void UpdateForDescendants(txiter updateIt,
-            cacheMap &cachedDescendants,
-            const std::set<uint256> &setExclude);
+    /** Move all transactions of cluster from into cluster to. Returns to. */
+    uint64_t MergeClusters(uint64_t to, uint64_t from);
+    /** Drop the removed slots from the given clusters and split them into
+     *  their connected components. If updateState is set, the ancestor and
+     *  descendant state of every remaining transaction is recalculated. */
+    void SplitClusters(const std::set<uint64_t>& clusterIds, bool updateState);
+    /** Reorder a cluster so that parents come before children, keeping the
+     *  existing order where possible. */
+    void RelinearizeCluster(TxCluster& cluster);
+    /** Recalculate ancestor and descendant state of all transactions in
+     *  cluster from its linearization. */
+    void UpdateClusterState(const TxCluster& cluster);
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
     void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
     /** Set ancestor state for an entry */
@@ -588,7 +621,7 @@ private:
     /** Before calling removeUnchecked for a given transaction,
      *  UpdateForRemoveFromMempool must be called on the entire (dependent) set
      *  of transactions being removed at the same time.  We use each
-     *  CTxMemPoolEntry's setMemPoolParents in order to walk ancestors of a
+     *  CTxMemPoolEntry's memPoolParents in order to walk ancestors of a
      *  given transaction that is removed, so we can't remove intermediate
      *  transactions in a chain before we've updated all the state for the
      *  removal.
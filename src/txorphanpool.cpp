@@ -0,0 +1,223 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "txorphanpool.h"
+#include "core_memusage.h"
+#include "random.h"
+#include "serialize.h"
+#include "util.h"
+
+TxOrphanPool::TxOrphanPool(size_t maxTxs, size_t maxBytes) :
+    totalBytes(0), maxTxs(maxTxs), maxBytes(maxBytes)
+{
+}
+
+void TxOrphanPool::SetLimits(size_t maxTxs, size_t maxBytes) {
+    this->maxTxs = maxTxs;
+    this->maxBytes = maxBytes;
+}
+
+bool TxOrphanPool::AddTx(const CTransaction& tx, NodeId peer)
+{
+    const uint256& hash = tx.GetHash();
+    if (orphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = GetSerializeSize(tx, SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz > MAX_ORPHAN_TX_SIZE)
+    {
+        LogPrint(Log::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    const size_t bytes = RecursiveDynamicUsage(tx) + sizeof(Entry)
+        + tx.vin.size() * sizeof(COutPoint);
+
+    // A single peer may not crowd out orphans from everyone else.
+    if (PeerBytes(peer) + bytes > MaxPeerBytes())
+    {
+        LogPrint(Log::MEMPOOL, "ignoring orphan tx %s, peer=%d exceeds its orphan pool quota\n",
+                 hash.ToString(), peer);
+        return false;
+    }
+
+    orphans.insert({hash, Entry{tx, peer, bytes, randomOrder.size()}});
+    randomOrder.push_back(hash);
+    for (const CTxIn& txin : tx.vin)
+        byPrevOut[txin.prevout].insert(hash);
+
+    totalBytes += bytes;
+    peerBytes[peer] += bytes;
+
+    LogPrint(Log::MEMPOOL, "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+             orphans.size(), byPrevOut.size(), totalBytes);
+    return true;
+}
+
+bool TxOrphanPool::EraseTx(const uint256& hash)
+{
+    auto it = orphans.find(hash);
+    if (it == orphans.end())
+        return false;
+
+    const Entry& e = it->second;
+    for (const CTxIn& txin : e.tx.vin)
+    {
+        auto itPrev = byPrevOut.find(txin.prevout);
+        if (itPrev == byPrevOut.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            byPrevOut.erase(itPrev);
+    }
+
+    // Swap-remove from the random eviction order
+    const uint256& last = randomOrder.back();
+    orphans.at(last).pos = e.pos;
+    randomOrder[e.pos] = last;
+    randomOrder.pop_back();
+
+    totalBytes -= e.bytes;
+    auto p = peerBytes.find(e.fromPeer);
+    assert(p != peerBytes.end() && p->second >= e.bytes);
+    p->second -= e.bytes;
+    if (p->second == 0)
+        peerBytes.erase(p);
+
+    orphans.erase(it);
+    return true;
+}
+
+int TxOrphanPool::EraseForPeer(NodeId peer)
+{
+    if (!peerBytes.count(peer))
+        return 0;
+
+    std::vector<uint256> toErase;
+    for (auto& o : orphans)
+        if (o.second.fromPeer == peer)
+            toErase.push_back(o.first);
+
+    for (const uint256& h : toErase)
+        EraseTx(h);
+
+    if (!toErase.empty())
+        LogPrint(Log::MEMPOOL, "Erased %d orphan tx from peer %d\n", toErase.size(), peer);
+    return toErase.size();
+}
+
+int TxOrphanPool::EraseForBlock(const std::vector<CTransaction>& vtx)
+{
+    std::vector<uint256> toErase;
+    for (const CTransaction& tx : vtx)
+    {
+        if (orphans.count(tx.GetHash()))
+            toErase.push_back(tx.GetHash());
+
+        // Orphans double spending the block are never going to be valid.
+        for (const CTxIn& txin : tx.vin)
+        {
+            auto itPrev = byPrevOut.find(txin.prevout);
+            if (itPrev == byPrevOut.end())
+                continue;
+            toErase.insert(toErase.end(), itPrev->second.begin(), itPrev->second.end());
+        }
+    }
+    int nErased = 0;
+    for (const uint256& h : toErase)
+        nErased += EraseTx(h);
+
+    if (nErased > 0)
+        LogPrint(Log::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    return nErased;
+}
+
+unsigned int TxOrphanPool::LimitSize()
+{
+    unsigned int nEvicted = 0;
+    while (!orphans.empty() && (orphans.size() > maxTxs || totalBytes > maxBytes))
+    {
+        // Evict a random orphan:
+        size_t pos = GetRand(randomOrder.size());
+        EraseTx(randomOrder[pos]);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+bool TxOrphanPool::Exists(const uint256& hash) const {
+    return orphans.count(hash);
+}
+
+bool TxOrphanPool::GetTx(const uint256& hash, CTransaction& tx, NodeId& fromPeer) const
+{
+    auto it = orphans.find(hash);
+    if (it == orphans.end())
+        return false;
+    tx = it->second.tx;
+    fromPeer = it->second.fromPeer;
+    return true;
+}
+
+CTransaction TxOrphanPool::FindTx(const std::function<bool(const uint256&)>& pred) const
+{
+    for (auto& o : orphans)
+        if (pred(o.first))
+            return o.second.tx;
+    return CTransaction();
+}
+
+std::vector<uint256> TxOrphanPool::GetChildren(const CTransaction& parent) const
+{
+    std::vector<uint256> children;
+    if (orphans.empty())
+        return children;
+
+    const uint256& hash = parent.GetHash();
+    for (uint32_t i = 0; i < parent.vout.size(); ++i)
+    {
+        auto itPrev = byPrevOut.find(COutPoint(hash, i));
+        if (itPrev == byPrevOut.end())
+            continue;
+        children.insert(children.end(), itPrev->second.begin(), itPrev->second.end());
+    }
+    return children;
+}
+
+void TxOrphanPool::QueueChildren(const std::vector<CTransaction>& txs)
+{
+    for (const CTransaction& tx : txs)
+    {
+        std::vector<uint256> children = GetChildren(tx);
+        queued.insert(queued.end(), children.begin(), children.end());
+    }
+}
+
+std::vector<uint256> TxOrphanPool::TakeQueued()
+{
+    std::vector<uint256> q;
+    q.swap(queued);
+    return q;
+}
+
+size_t TxOrphanPool::PeerBytes(NodeId peer) const {
+    auto p = peerBytes.find(peer);
+    return p == peerBytes.end() ? 0 : p->second;
+}
+
+void TxOrphanPool::Clear()
+{
+    orphans.clear();
+    byPrevOut.clear();
+    peerBytes.clear();
+    randomOrder.clear();
+    queued.clear();
+    totalBytes = 0;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include "coins.h" // SaltedOutpointHasher
+#include "primitives/transaction.h"
+#include "utilhash.h" // SaltedTxIDHasher
+
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+typedef int NodeId;
+
+/** Orphans larger than this (serialized) are not stored */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer may use at most 1/n of the orphan pool memory budget */
+static const unsigned int ORPHAN_POOL_PEER_SHARE = 4;
+
+/**
+ * Transactions we've received, but can't validate yet because one or more of
+ * their inputs are missing.
+ *
+ * Orphans are indexed by the outpoints they spend, so the orphans that may be
+ * unblocked by a new transaction are found in O(outputs + children).
+ *
+ * Not thread safe. In main, access is protected by cs_main.
+ */
+class TxOrphanPool {
+public:
+    TxOrphanPool(size_t maxTxs, size_t maxBytes);
+
+    /**
+     * Set the limits of the pool. Evicting down to the limits is done by
+     * LimitSize, while the per peer share of maxBytes is enforced in AddTx.
+     */
+    void SetLimits(size_t maxTxs, size_t maxBytes);
+
+    /** Returns false if tx was not stored. */
+    bool AddTx(const CTransaction& tx, NodeId peer);
+    bool EraseTx(const uint256& hash);
+    int EraseForPeer(NodeId peer);
+
+    /**
+     * Removes orphans that were included in a block, or that
+     * conflict with it. Returns number of orphans removed.
+     */
+    int EraseForBlock(const std::vector<CTransaction>& vtx);
+
+    /** Evicts random orphans until the pool is within its limits. */
+    unsigned int LimitSize();
+
+    bool Exists(const uint256& hash) const;
+    bool GetTx(const uint256& hash, CTransaction& tx, NodeId& fromPeer) const;
+
+    /** Returns first orphan matching pred, or a null transaction. */
+    CTransaction FindTx(const std::function<bool(const uint256&)>& pred) const;
+
+    /** Orphans that spend one or more outputs of parent. */
+    std::vector<uint256> GetChildren(const CTransaction& parent) const;
+
+    /**
+     * Queue orphans spending outputs of txs for re-admission. Used when
+     * a block is connected, so that the orphans it unblocks can be
+     * processed in a single batch afterwards.
+     */
+    void QueueChildren(const std::vector<CTransaction>& txs);
+    std::vector<uint256> TakeQueued();
+
+    size_t Size() const { return orphans.size(); }
+    /** Estimated memory used by orphans, this is what the byte budget applies to. */
+    size_t Bytes() const { return totalBytes; }
+    size_t PeerBytes(NodeId peer) const;
+    size_t MaxPeerBytes() const { return maxBytes / ORPHAN_POOL_PEER_SHARE; }
+
+    void Clear();
+
+private:
+    struct Entry {
+        CTransaction tx;
+        NodeId fromPeer;
+        size_t bytes;
+        // position in randomOrder
+        size_t pos;
+    };
+    std::unordered_map<uint256, Entry, SaltedTxIDHasher> orphans;
+    std::unordered_map<COutPoint, std::unordered_set<uint256, SaltedTxIDHasher>,
+        SaltedOutpointHasher> byPrevOut;
+    std::unordered_map<NodeId, size_t> peerBytes;
+
+    // For picking a random orphan to evict in constant time.
+    std::vector<uint256> randomOrder;
+
+    std::vector<uint256> queued;
+
+    size_t totalBytes;
+    size_t maxTxs;
+    size_t maxBytes;
+};
+
+#endif // BITCOIN_TXORPHANPOOL_H
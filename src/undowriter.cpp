@@ -0,0 +1,84 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "undowriter.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+namespace {
+
+// Enough to ride out a slow disk for a while, without holding on to the
+// undo data of more than a handful of blocks.
+const size_t MAX_QUEUED = 16;
+
+} // anon namespace
+
+CUndoWriter::CUndoWriter() : fWriting(false), fFailed(false), fStop(false) {}
+
+CUndoWriter::~CUndoWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fStop = true;
+    }
+    cvQueued.notify_one();
+    if (writer.joinable())
+        writer.join();
+}
+
+bool CUndoWriter::Write(CBlockUndo&& blockundo, std::vector<unsigned char>&& vchCompressed,
+                        const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    std::unique_lock<std::mutex> lock(cs);
+    if (!writer.joinable())
+        writer = std::thread(&CUndoWriter::ThreadWrite, this);
+    cvDone.wait(lock, [this]() { return queue.size() < MAX_QUEUED || fFailed; });
+    if (fFailed)
+        return false;
+    queue.push_back(Job{std::move(blockundo), std::move(vchCompressed), pos, hashBlock});
+    lock.unlock();
+    cvQueued.notify_one();
+    return true;
+}
+
+bool CUndoWriter::Wait()
+{
+    std::unique_lock<std::mutex> lock(cs);
+    cvDone.wait(lock, [this]() { return (queue.empty() && !fWriting) || fFailed; });
+    return !fFailed;
+}
+
+void CUndoWriter::ThreadWrite()
+{
+    RenameThread("bitcoin-undowrite");
+    std::unique_lock<std::mutex> lock(cs);
+    while (true) {
+        // Queued writes are done before stopping.
+        cvQueued.wait(lock, [this]() { return !queue.empty() || fStop; });
+        if (queue.empty())
+            return;
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        fWriting = true;
+        lock.unlock();
+
+        CDiskBlockPos pos = job.pos;
+        bool fOk = false;
+        try {
+            fOk = UndoWriteToDisk(job.blockundo, pos, job.hashBlock, Params().DBMagic(), job.vchCompressed)
+                && pos.nPos == job.pos.nPos + UNDO_HEADER_SIZE;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        if (!fOk)
+            LogPrintf("*** Failed to write undo data to rev%05u.dat at %u\n", job.pos.nFile, job.pos.nPos);
+
+        lock.lock();
+        fWriting = false;
+        fFailed |= !fOk;
+        cvDone.notify_all();
+    }
+}
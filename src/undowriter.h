@@ -0,0 +1,80 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UNDOWRITER_H
+#define BITCOIN_UNDOWRITER_H
+
+#include "chain.h"
+#include "coins.h"
+#include "protocol.h"
+#include "undo.h"
+#include "uint256.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Undo data on disk is preceded by the network magic and its size. */
+static const unsigned int UNDO_HEADER_SIZE = MESSAGE_START_SIZE + sizeof(unsigned int);
+/** Set in the size of compressed undo data. */
+static const unsigned int UNDO_COMPRESSED_FLAG = 0x80000000;
+
+/**
+ * Writes block undo data on a thread of its own, so that connecting a block
+ * doesn't wait for it to be serialized and written.
+ *
+ * The space for the data is reserved (FindUndoPos) before it is queued, so
+ * the block index can point at it right away. Anything that reads undo data,
+ * syncs the undo files or writes the block index and chain state must Wait()
+ * first: the undo data of a block has to be on disk before a chain state
+ * that includes the block is.
+ */
+class CUndoWriter
+{
+public:
+    CUndoWriter();
+    ~CUndoWriter();
+
+    /**
+     * Queue blockundo to be written at pos, as reserved by FindUndoPos. The
+     * data itself goes UNDO_HEADER_SIZE after it. Waits if too many writes
+     * are queued. Returns false if an earlier write failed.
+     *
+     * vchCompressed is what CompressBlockUndo made of blockundo, if it is
+     * to be stored compressed, or empty.
+     */
+    bool Write(CBlockUndo&& blockundo, std::vector<unsigned char>&& vchCompressed,
+               const CDiskBlockPos& pos, const uint256& hashBlock);
+
+    //! Block until the queued writes are done. Returns false if any failed.
+    bool Wait();
+
+private:
+    struct Job {
+        CBlockUndo blockundo;
+        std::vector<unsigned char> vchCompressed;
+        CDiskBlockPos pos;
+        uint256 hashBlock;
+    };
+
+    void ThreadWrite();
+
+    std::mutex cs;
+    std::condition_variable cvQueued;
+    std::condition_variable cvDone;
+    //! Guarded by cs.
+    std::deque<Job> queue;
+    bool fWriting;
+    bool fFailed;
+    bool fStop;
+
+    std::thread writer;
+
+    CUndoWriter(const CUndoWriter&);
+    void operator=(const CUndoWriter&);
+};
+
+#endif // BITCOIN_UNDOWRITER_H
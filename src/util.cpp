@@ -673,6 +673,33 @@ bool TruncateFile(FILE *file, unsigned int length) {
 #endif
 }
 
+/**
+ * Write all of data at offset, in as few writes as the system takes. Leaves
+ * the position of file as it was, where that's supported.
+ */
+bool WriteFileAt(FILE *file, unsigned int offset, const void *data, size_t length) {
+#if defined(WIN32)
+    if (fseek(file, offset, SEEK_SET) != 0)
+        return false;
+    return fwrite(data, 1, length, file) == length && fflush(file) == 0;
+#else
+    const char* p = static_cast<const char*>(data);
+    off_t nPos = offset;
+    while (length > 0) {
+        ssize_t nWritten = pwrite(fileno(file), p, length, nPos);
+        if (nWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += nWritten;
+        nPos += nWritten;
+        length -= nWritten;
+    }
+    return true;
+#endif
+}
+
 /**
  * this function tries to raise the file descriptor limit to the requested number.
  * It returns the actual file descriptor limit (which may be more or less than nMinFD)
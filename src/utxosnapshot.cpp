@@ -0,0 +1,177 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+#include "utxocommit.h"
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/thread.hpp> // boost::this_thread::interruption_point
+
+namespace {
+
+void WriteRun(CAutoFile& file, const uint256& txid, const std::vector<std::pair<uint32_t, Coin>>& run)
+{
+    uint64_t nOutputs = run.size();
+    file << txid;
+    file << VARINT(nOutputs);
+    for (const auto& output : run) {
+        file << VARINT(output.first);
+        file << output.second;
+    }
+}
+
+//! Read the coins following the metadata, passing each to fn. Returns false on a bad run.
+bool ReadCoins(CAutoFile& file, const UTXOSnapshotMetadata& metadata,
+               const std::function<bool(const COutPoint&, Coin&&)>& fn)
+{
+    uint64_t nCoins = 0;
+    while (nCoins < metadata.nCoins) {
+        boost::this_thread::interruption_point();
+        COutPoint out;
+        uint64_t nOutputs;
+        file >> out.hash;
+        file >> VARINT(nOutputs);
+        if (nOutputs == 0 || nOutputs > metadata.nCoins - nCoins)
+            return error("%s: bad output count %u after %u coins", __func__, nOutputs, nCoins);
+        for (uint64_t i = 0; i < nOutputs; ++i) {
+            Coin coin;
+            file >> VARINT(out.n);
+            file >> coin;
+            if (!fn(out, std::move(coin)))
+                return false;
+        }
+        nCoins += nOutputs;
+    }
+    return true;
+}
+
+void SeekTo(CAutoFile& file, long nPos)
+{
+    if (fseek(file.Get(), nPos, SEEK_SET) != 0)
+        throw std::ios_base::failure("UTXO snapshot: fseek failed");
+}
+
+} // anon namespace
+
+void WriteUTXOSnapshot(CAutoFile& file, CCoinsViewCursor& cursor, UTXOSnapshotMetadata& metadata)
+{
+    const long nStart = ftell(file.Get());
+    if (nStart < 0)
+        throw std::ios_base::failure("WriteUTXOSnapshot: ftell failed");
+    metadata.hashBase = cursor.GetBestBlock();
+    metadata.nCoins = 0;
+    file << metadata;
+
+    // Coins come in outpoint order from most views, so the outputs of a
+    // transaction are together and the txid is written once. Otherwise a
+    // transaction just takes more than one run.
+    CUtxoCommit commit;
+    uint256 txid;
+    std::vector<std::pair<uint32_t, Coin>> run;
+    for (; cursor.Valid(); cursor.Next()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (!cursor.GetKey(key) || !cursor.GetValue(coin))
+            throw std::runtime_error("WriteUTXOSnapshot: unable to read coin");
+        if (!run.empty() && key.hash != txid) {
+            WriteRun(file, txid, run);
+            run.clear();
+        }
+        txid = key.hash;
+        commit.Add(key, coin);
+        run.push_back(std::make_pair(key.n, std::move(coin)));
+        ++metadata.nCoins;
+    }
+    if (!run.empty())
+        WriteRun(file, txid, run);
+    metadata.hashCommit = commit.GetHash();
+
+    // Now that the coins are counted, write the final metadata.
+    if (fseek(file.Get(), nStart, SEEK_SET) != 0)
+        throw std::ios_base::failure("WriteUTXOSnapshot: fseek failed");
+    file << metadata;
+    if (fseek(file.Get(), 0, SEEK_END) != 0)
+        throw std::ios_base::failure("WriteUTXOSnapshot: fseek failed");
+}
+
+bool ReadUTXOSnapshot(CAutoFile& file, const UTXOSnapshotMetadata& metadata,
+                      const std::function<void(const COutPoint&, Coin&&)>& fn)
+{
+    CUtxoCommit commit;
+    bool fRead = ReadCoins(file, metadata, [&commit, &fn](const COutPoint& out, Coin&& coin) {
+        if (coin.IsSpent())
+            return error("%s: spent coin %s", "ReadUTXOSnapshot", out.ToString());
+        commit.Add(out, coin);
+        if (fn)
+            fn(out, std::move(coin));
+        return true;
+    });
+    if (!fRead)
+        return false;
+    if (commit.GetHash() != metadata.hashCommit)
+        return error("%s: coins do not match the commitment %s", __func__, metadata.hashCommit.GetHex());
+    return true;
+}
+
+bool FindDuplicateOutpoint(CAutoFile& file, const UTXOSnapshotMetadata& metadata, size_t nMaxMemory, COutPoint& dup)
+{
+    const long nStart = ftell(file.Get());
+    if (nStart < 0)
+        throw std::ios_base::failure("FindDuplicateOutpoint: ftell failed");
+
+    // Look for equal salted hashes of the outpoints, a share of them per
+    // pass over the file, so that their number stays within nMaxMemory.
+    const uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    const uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    const uint64_t nPerPass = std::max<uint64_t>(nMaxMemory / sizeof(uint64_t), 1);
+    const uint64_t nPasses = std::max<uint64_t>((metadata.nCoins + nPerPass - 1) / nPerPass, 1);
+    std::set<uint64_t> setSuspects;
+    for (uint64_t nPass = 0; nPass < nPasses; ++nPass) {
+        SeekTo(file, nStart);
+        std::vector<uint64_t> vHashes;
+        vHashes.reserve(std::min(nPerPass, metadata.nCoins));
+        bool fRead = ReadCoins(file, metadata, [&](const COutPoint& out, Coin&&) {
+            const uint64_t nHash = SipHashUint256Extra(k0, k1, out.hash, out.n);
+            if (nHash % nPasses == nPass)
+                vHashes.push_back(nHash);
+            return true;
+        });
+        if (!fRead)
+            throw std::ios_base::failure("FindDuplicateOutpoint: bad snapshot");
+        std::sort(vHashes.begin(), vHashes.end());
+        for (size_t i = 1; i < vHashes.size(); ++i) {
+            if (vHashes[i] == vHashes[i - 1])
+                setSuspects.insert(vHashes[i]);
+        }
+    }
+
+    // Tell duplicates from (unlikely) collisions of their hashes.
+    bool fFound = false;
+    if (!setSuspects.empty()) {
+        SeekTo(file, nStart);
+        std::set<COutPoint> setSeen;
+        ReadCoins(file, metadata, [&](const COutPoint& out, Coin&&) {
+            if (setSuspects.count(SipHashUint256Extra(k0, k1, out.hash, out.n)) && !setSeen.insert(out).second) {
+                dup = out;
+                fFound = true;
+                return false;
+            }
+            return true;
+        });
+    }
+    SeekTo(file, nStart);
+    return fFound;
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2018 The Bitcoin XT developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <cstring>
+#include <functional>
+#include <ios>
+#include <stdint.h>
+
+class CAutoFile;
+class CCoinsViewCursor;
+class COutPoint;
+class Coin;
+
+static const char UTXO_SNAPSHOT_MAGIC[8] = {'x', 't', 'u', 't', 'x', 'o', 's', '\0'};
+static const uint32_t UTXO_SNAPSHOT_VERSION = 1;
+
+/**
+ * Header of a UTXO snapshot file, as written by dumptxoutset.
+ *
+ * It is followed by the coins, in runs of outputs of the same transaction:
+ * the txid, the number of outputs in the run, and for each output its index
+ * and the coin.
+ */
+class UTXOSnapshotMetadata
+{
+public:
+    //! Block the chain state was at.
+    uint256 hashBase;
+    //! Number of transactions in the chain up to and including the base block.
+    uint64_t nChainTx;
+    //! Number of coins in the snapshot.
+    uint64_t nCoins;
+    //! CUtxoCommit hash of the coins.
+    uint256 hashCommit;
+
+    UTXOSnapshotMetadata() : nChainTx(0), nCoins(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        char magic[sizeof(UTXO_SNAPSHOT_MAGIC)];
+        uint32_t nVersion = UTXO_SNAPSHOT_VERSION;
+        memcpy(magic, UTXO_SNAPSHOT_MAGIC, sizeof(magic));
+        READWRITE(FLATDATA(magic));
+        READWRITE(nVersion);
+        if (ser_action.ForRead() && memcmp(magic, UTXO_SNAPSHOT_MAGIC, sizeof(magic)) != 0)
+            throw std::ios_base::failure("Not a UTXO snapshot");
+        if (ser_action.ForRead() && nVersion != UTXO_SNAPSHOT_VERSION)
+            throw std::ios_base::failure("Unsupported UTXO snapshot version");
+        READWRITE(hashBase);
+        READWRITE(nChainTx);
+        READWRITE(nCoins);
+        READWRITE(hashCommit);
+    }
+};
+
+/**
+ * Write the metadata and the coins of the cursor to file. The coin count and
+ * commitment of the metadata are filled in. Throws on I/O errors.
+ */
+void WriteUTXOSnapshot(CAutoFile& file, CCoinsViewCursor& cursor, UTXOSnapshotMetadata& metadata);
+
+/**
+ * Read the coins following the metadata from file, passing each to fn (if
+ * set). Returns false if they don't match the coin count and commitment of
+ * the metadata, throws on I/O and format errors.
+ *
+ * The commitment in the file only detects corruption. That the snapshot is
+ * of the right chain state has to be established by comparing the
+ * commitment with one from a trusted source.
+ */
+bool ReadUTXOSnapshot(CAutoFile& file, const UTXOSnapshotMetadata& metadata,
+                      const std::function<void(const COutPoint&, Coin&&)>& fn);
+
+/**
+ * Look for an outpoint that has more than one coin among those following the
+ * metadata in file. The coins are read as many times as needed to use no
+ * more than about nMaxMemory bytes. Returns true and sets dup if there is
+ * one. The file is left at the first coin, throws on I/O and format errors.
+ */
+bool FindDuplicateOutpoint(CAutoFile& file, const UTXOSnapshotMetadata& metadata, size_t nMaxMemory, COutPoint& dup);
+
+#endif // BITCOIN_UTXOSNAPSHOT_H